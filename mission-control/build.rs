@@ -2,6 +2,8 @@ use std::env;
 use std::path::PathBuf;
 use std::process::Command;
 
+mod schema_codegen;
+
 fn main() {
     let project_dir = env::var("CARGO_MANIFEST_DIR").unwrap();
     Command::new("sh")
@@ -35,4 +37,10 @@ fn main() {
     bindings
         .write_to_file(out_path.join("bindings.rs"))
         .expect("Couldn't write bindings!");
+
+    // Compile the module schemas into static tables
+    schema_codegen::generate(
+        &PathBuf::from(&project_dir).join("schema"),
+        &out_path.join("schema_tables.rs"),
+    );
 }
@@ -0,0 +1,172 @@
+//! Compiles the module schema YAML files into static tables.
+//!
+//! Used by the build script. The generated file is included by `src/analog3/schema.rs`,
+//! which holds the types the tables are made of.
+
+use std::{
+    collections::{BTreeMap, BTreeSet},
+    fmt::Write,
+    fs,
+    path::Path,
+};
+
+use serde::Deserialize;
+
+/// Marks an empty slot of a name table
+const EMPTY_SLOT: u8 = 0xff;
+
+/// Seeds tried before giving up on a name table
+const MAX_SEED: u32 = 1 << 20;
+
+#[derive(Deserialize)]
+struct ModuleDesc {
+    module_type: u16,
+    module_type_name: String,
+    properties: Vec<Option<PropertyDesc>>,
+}
+
+#[derive(Deserialize)]
+struct PropertyDesc {
+    id: u8,
+    name: String,
+    value_type: String,
+    #[serde(rename = "enum")]
+    enum_names: Option<Vec<String>>,
+    read_only: Option<bool>,
+}
+
+/// FNV-1a seeded by the initial state, with a finalizer.
+/// Must stay in sync with `schema::name_hash`.
+fn name_hash(name: &str, seed: u32) -> u32 {
+    let mut hash = 0x811c9dc5 ^ seed;
+    for byte in name.bytes() {
+        hash ^= byte as u32;
+        hash = hash.wrapping_mul(0x01000193);
+    }
+    // FNV leaves the low bits depending on the low bits only; fold the high bits in
+    hash ^= hash >> 16;
+    hash = hash.wrapping_mul(0x7feb352d);
+    hash ^= hash >> 15;
+    hash
+}
+
+/// Finds a seed that maps every name to its own slot. Returns the seed and the slots,
+/// which hold indexes into `names`.
+fn build_name_table(names: &[&str]) -> (u32, Vec<u8>) {
+    let num_slots = (names.len() * 2).next_power_of_two().max(1);
+    for seed in 0..MAX_SEED {
+        let mut slots = vec![EMPTY_SLOT; num_slots];
+        let is_perfect = names.iter().enumerate().all(|(index, name)| {
+            let slot = (name_hash(name, seed) as usize) & (num_slots - 1);
+            let is_free = slots[slot] == EMPTY_SLOT;
+            slots[slot] = index as u8;
+            is_free
+        });
+        if is_perfect {
+            return (seed, slots);
+        }
+    }
+    panic!("no perfect hash found for {:?}", names);
+}
+
+fn value_type_variant(value_type: &str) -> &'static str {
+    match value_type {
+        "u8" => "U8",
+        "u16" => "U16",
+        "u32" => "U32",
+        "text" => "Text",
+        "boolean" => "Boolean",
+        "vector_u8" => "VectorU8",
+        "vector_u16" => "VectorU16",
+        _ => panic!("unknown value type: {}", value_type),
+    }
+}
+
+fn load(dir: &Path) -> BTreeMap<u16, ModuleDesc> {
+    let mut modules = BTreeMap::new();
+    let mut paths: Vec<_> = fs::read_dir(dir)
+        .unwrap_or_else(|e| panic!("cannot read {:?}: {}", dir, e))
+        .map(|entry| entry.unwrap().path())
+        .filter(|path| {
+            path.extension()
+                .is_some_and(|ext| ext == "yaml" || ext == "yml")
+        })
+        .collect();
+    paths.sort();
+    for path in paths {
+        println!("cargo:rerun-if-changed={}", path.display());
+        let content = fs::read_to_string(&path).unwrap();
+        let desc: ModuleDesc = serde_yaml::from_str(&content)
+            .unwrap_or_else(|e| panic!("YAML parse error in {:?}: {}", path, e));
+        if let Some(existing) = modules.insert(desc.module_type, desc) {
+            panic!(
+                "{:?}: module type {} is taken by {}",
+                path, existing.module_type, existing.module_type_name
+            );
+        }
+    }
+    modules
+}
+
+/// Generates the tables of the schema files in `schema_dir` into `out_file`.
+pub fn generate(schema_dir: &Path, out_file: &Path) {
+    println!("cargo:rerun-if-changed={}", schema_dir.display());
+    let modules = load(schema_dir);
+
+    let mut code = String::new();
+    writeln!(
+        code,
+        "// Generated from the schema directory by the build script."
+    )
+    .unwrap();
+    writeln!(code, "pub static BUILTIN_MODULES: &[StaticModuleDef] = &[").unwrap();
+    for desc in modules.values() {
+        let mut properties: Vec<&PropertyDesc> = desc.properties.iter().flatten().collect();
+        properties.sort_by_key(|property| property.id);
+        let names: Vec<&str> = properties.iter().map(|p| p.name.as_str()).collect();
+        let ids: BTreeSet<u8> = properties.iter().map(|p| p.id).collect();
+        let unique_names: BTreeSet<&str> = names.iter().copied().collect();
+        if ids.len() != properties.len() || unique_names.len() != names.len() {
+            panic!("{}: duplicate property ID or name", desc.module_type_name);
+        }
+        let (seed, slots) = build_name_table(&names);
+
+        writeln!(code, "    StaticModuleDef {{").unwrap();
+        writeln!(code, "        module_type: {:#06x},", desc.module_type).unwrap();
+        writeln!(
+            code,
+            "        module_type_name: {:?},",
+            desc.module_type_name
+        )
+        .unwrap();
+        writeln!(code, "        properties: &[").unwrap();
+        for property in &properties {
+            let enum_names = match &property.enum_names {
+                Some(names) => format!("Some(&{:?})", names),
+                None => "None".to_string(),
+            };
+            writeln!(
+                code,
+                "            StaticPropertyDef {{ id: {}, name: {:?}, value_type: ValueType::{}, \
+                 enum_names: {}, read_only: {} }},",
+                property.id,
+                property.name,
+                value_type_variant(&property.value_type),
+                enum_names,
+                property.read_only.unwrap_or(false)
+            )
+            .unwrap();
+        }
+        writeln!(code, "        ],").unwrap();
+        writeln!(
+            code,
+            "        name_table: NameTable {{ seed: {}, slots: &{:?} }},",
+            seed, slots
+        )
+        .unwrap();
+        writeln!(code, "    }},").unwrap();
+    }
+    writeln!(code, "];").unwrap();
+
+    fs::write(out_file, code).unwrap();
+}
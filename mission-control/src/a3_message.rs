@@ -1,6 +1,14 @@
+use std::time::Instant;
+
 use tokio::sync::mpsc::Sender;
 
-use crate::{analog3 as a3, can_controller::CanMessage};
+use crate::{
+    analog3::{
+        self as a3,
+        config::{Property, PropertyEncoder},
+    },
+    can_controller::{CanMessage, MAX_PAYLOAD_LENGTH, TxFrame},
+};
 
 pub async fn sign_in(can_tx: Sender<CanMessage>) {
     let mut out_message = CanMessage::new();
@@ -23,8 +31,14 @@ pub async fn assign_module_id(can_tx: Sender<CanMessage>, remote_uid: u32, remot
     can_tx.send(out_message).await.unwrap();
 }
 
-pub async fn ping(can_tx: Sender<CanMessage>, remote_id: u8, enable_visual: bool) {
+pub async fn ping(
+    can_tx: Sender<CanMessage>,
+    remote_id: u8,
+    enable_visual: bool,
+    deadline: Option<Instant>,
+) {
     let mut out_message = CanMessage::new();
+    out_message.set_deadline(deadline);
     out_message.set_id(a3::A3_ID_MISSION_CONTROL as u32);
     let length = if enable_visual { 3 } else { 2 };
     out_message.set_data_length(length);
@@ -36,15 +50,32 @@ pub async fn ping(can_tx: Sender<CanMessage>, remote_id: u8, enable_visual: bool
     can_tx.send(out_message).await.unwrap();
 }
 
-pub async fn request_command(can_tx: Sender<CanMessage>, opcode: u8, id: u8, wire_addr: u8) {
+/// Requests the module to start a stream command on the wire.
+/// Opcode specific arguments follow the wire address; up to 5 bytes fit in the frame.
+/// The request is not sent once the deadline has passed.
+pub async fn request_command(
+    can_tx: Sender<CanMessage>,
+    opcode: u8,
+    id: u8,
+    wire_addr: u8,
+    args: &[u8],
+    deadline: Option<Instant>,
+) {
     let mut out_message = make_mission_control_message(opcode, id);
+    out_message.set_deadline(deadline);
     out_message.set_data(2, wire_addr);
-    out_message.set_data_length(3);
+    out_message.mut_data()[3..3 + args.len()].copy_from_slice(args);
+    out_message.set_data_length(3 + args.len() as u8);
     can_tx.send(out_message).await.unwrap();
 }
 
-pub async fn request_to_continue(can_tx: Sender<CanMessage>, wire_id: u16) {
+pub async fn request_to_continue(
+    can_tx: Sender<CanMessage>,
+    wire_id: u16,
+    deadline: Option<Instant>,
+) {
     let mut out_message = CanMessage::new();
+    out_message.set_deadline(deadline);
     out_message.set_std_id(wire_id);
     out_message.set_data_length(0);
     can_tx.send(out_message).await.unwrap();
@@ -57,6 +88,34 @@ pub async fn modify_config(can_tx: Sender<CanMessage>, id: u8, wire_id: u8) {
     can_tx.send(out_message).await.unwrap();
 }
 
+/// Sets a scalar property of the module by a single frame; the module does not reply.
+pub async fn set_property_realtime(can_tx: Sender<CanMessage>, id: u8, property: &Property) {
+    let mut out_message = make_mission_control_message(a3::A3_MC_SET_PROPERTY_REALTIME, id);
+    let length = property.data.len();
+    out_message.set_data(2, property.id);
+    out_message.mut_data()[3..3 + length].copy_from_slice(&property.data);
+    out_message.set_data_length(3 + length as u8);
+    can_tx.send(out_message).await.unwrap();
+}
+
+/// Tells all modules to apply the property set staged with the tag.
+pub async fn commit_staged(can_tx: Sender<CanMessage>, tag: u8) {
+    let mut out_message =
+        make_mission_control_message(a3::A3_MC_COMMIT_STAGED, a3::A3_MODULE_ID_BROADCAST);
+    out_message.set_data(2, tag);
+    out_message.set_data_length(3);
+    can_tx.send(out_message).await.unwrap();
+}
+
+/// Tells all modules to drop the property set staged with the tag.
+pub async fn discard_staged(can_tx: Sender<CanMessage>, tag: u8) {
+    let mut out_message =
+        make_mission_control_message(a3::A3_MC_DISCARD_STAGED, a3::A3_MODULE_ID_BROADCAST);
+    out_message.set_data(2, tag);
+    out_message.set_data_length(3);
+    can_tx.send(out_message).await.unwrap();
+}
+
 pub async fn request_uid_cancel(can_tx: Sender<CanMessage>, uid: u32) {
     let out_message = make_message_by_uid(uid, a3::A3_ADMIN_REQ_UID_CANCEL);
     can_tx.send(out_message).await.unwrap();
@@ -74,6 +133,25 @@ pub async fn im_notify_id(can_tx: Sender<CanMessage>, uid: u32, id: u8) {
     can_tx.send(out_message).await.unwrap();
 }
 
+/// Encodes the properties into the data frames of a config writing stream.
+/// The frames are built in one pass into a vector sized for the whole stream.
+/// Values are packed if the stream has negotiated packing.
+pub fn encode_config_frames(wire_id: u16, props: &Vec<Property>, packing: bool) -> Vec<TxFrame> {
+    let mut encoder = match packing {
+        true => PropertyEncoder::with_packing(props),
+        false => PropertyEncoder::new(props),
+    };
+    let num_frames = encoder.encoded_length().div_ceil(MAX_PAYLOAD_LENGTH);
+    let mut frames = Vec::with_capacity(num_frames);
+    while !encoder.is_done() {
+        let mut frame = TxFrame::new(wire_id);
+        let length = encoder.flush(&mut frame.data);
+        frame.set_payload_length(length);
+        frames.push(frame);
+    }
+    return frames;
+}
+
 fn make_mission_control_message(opcode: u8, remote_id: u8) -> CanMessage {
     let mut out_message = CanMessage::new();
     out_message.set_std_id(a3::A3_ID_MISSION_CONTROL);
@@ -90,3 +168,107 @@ fn make_message_by_uid(uid: u32, opcode: u8) -> CanMessage {
     out_message.set_data(0, opcode);
     return out_message;
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::analog3::{
+        config::ChunkParser,
+        schema::{ModuleDef, ValueType, builtin_schema},
+    };
+
+    #[test]
+    fn test_encode_config_frames() {
+        let props = vec![
+            Property::u8(3, 1),
+            Property::text(a3::A3_PROP_ID_NAME, &"Analog3 mission control".to_string()),
+            Property::u16(6, 0x1234),
+        ];
+        let frames = encode_config_frames(0x123, &props, false);
+        // 1 + (2 + 1) + (2 + 23) + (2 + 2) = 33 bytes
+        assert_eq!(frames.len(), 5);
+        assert_eq!(frames.capacity(), 5);
+        assert!(frames.iter().all(|frame| frame.id == 0x123));
+        assert_eq!(frames[0].payload(), b"\x03\x03\x01\x01\x02\x17An");
+        assert_eq!(frames[4].payload(), b"\x34");
+
+        // same bytes as flushing the encoder frame by frame
+        let mut encoder = PropertyEncoder::new(&props);
+        for frame in &frames {
+            let mut data = [0u8; 8];
+            let length = encoder.flush(&mut data);
+            assert_eq!(frame.payload(), &data[..length]);
+        }
+        assert!(encoder.is_done());
+    }
+
+    /// A config of the module as it typically is; vector properties have a value per voice,
+    /// mostly the same for every voice.
+    fn typical_config(module_def: &ModuleDef, num_voices: usize) -> Vec<Property> {
+        module_def
+            .properties
+            .iter()
+            .map(|def| match def.value_type {
+                ValueType::U8 => Property::u8(def.id, 1),
+                ValueType::U16 => Property::u16(def.id, 0x0800),
+                ValueType::U32 => Property::u32(def.id, 0x1acebeef),
+                ValueType::Text => Property::text(def.id, &module_def.module_type_name.to_string()),
+                ValueType::Boolean => Property::boolean(def.id, true),
+                ValueType::VectorU8 => Property::vector_u8(def.id, &vec![1; num_voices]),
+                ValueType::VectorU16 if def.name == "voice_id" => Property::vector_u16(
+                    def.id,
+                    &(0..num_voices as u16).map(|voice| 0x100 + voice).collect(),
+                ),
+                ValueType::VectorU16 => Property::vector_u16(def.id, &vec![0x0800; num_voices]),
+            })
+            .collect()
+    }
+
+    #[test]
+    fn test_packed_frame_counts() {
+        for module_def in builtin_schema().values() {
+            let has_vectors = module_def
+                .properties
+                .iter()
+                .any(|def| matches!(def.value_type, ValueType::VectorU8 | ValueType::VectorU16));
+            for num_voices in [4, 16] {
+                let props = typical_config(module_def, num_voices);
+                let plain = encode_config_frames(0x123, &props, false);
+                let packed = encode_config_frames(0x123, &props, true);
+                assert!(packed.len() <= plain.len());
+                if has_vectors && num_voices == 16 {
+                    assert!(packed.len() < plain.len());
+                }
+
+                let mut parser = ChunkParser::new();
+                parser.enable_packing();
+                for frame in &packed {
+                    parser.data(frame.payload(), frame.payload().len()).unwrap();
+                }
+                let parsed = parser.commit().unwrap();
+                for (parsed, prop) in parsed.iter().zip(&props) {
+                    assert_eq!(parsed.id, prop.id);
+                    assert_eq!(parsed.data, prop.data);
+                }
+            }
+        }
+    }
+
+    #[test]
+    #[ignore]
+    fn bench_packed_frame_counts() {
+        println!("module type       voices  plain frames  packed frames");
+        for module_def in builtin_schema().values() {
+            for num_voices in [4, 16] {
+                let props = typical_config(module_def, num_voices);
+                println!(
+                    "{:16}  {:6}  {:12}  {:13}",
+                    module_def.module_type_name,
+                    num_voices,
+                    encode_config_frames(0x123, &props, false).len(),
+                    encode_config_frames(0x123, &props, true).len()
+                );
+            }
+        }
+    }
+}
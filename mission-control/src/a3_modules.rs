@@ -1,4 +1,11 @@
-use std::collections::HashMap;
+mod events;
+mod store;
+
+use std::{
+    collections::{HashMap, HashSet},
+    path::Path,
+    sync::{Arc, RwLock},
+};
 
 use tokio::{
     sync::{
@@ -10,15 +17,21 @@ use tokio::{
 
 use crate::error::{AppError, ErrorType};
 
+pub use events::{EventBatch, ModuleEvent, Subscription};
+
 #[derive(Debug, Clone)]
 pub struct A3Module {
     pub uid: u32,
     pub id: u8,
     pub name: Option<String>,
-    pub module_type: Option<String>,
+    /// Interned; shares the string with the `ModuleDef` of the type
+    pub module_type: Option<Arc<str>>,
     pub module_type_id: Option<u16>,
 }
 
+/// One slot per module ID
+const NUM_SLOTS: usize = 256;
+
 pub enum Operation {
     GetOrCreateIdByUid {
         uid: u32,
@@ -31,90 +44,171 @@ pub enum Operation {
     Deregister {
         uid: u32,
     },
-    List {
-        resp: oneshot::Sender<Result<Vec<A3Module>, AppError>>,
-    },
-    GetById {
-        id: u8,
-        resp: oneshot::Sender<Result<A3Module, AppError>>,
-    },
     SetProperties {
         id: u8,
         name: Option<String>,
-        module_type: Option<String>,
+        module_type: Option<Arc<str>>,
         module_type_id: Option<u16>,
         // TODO: Return error when the module is not found
         // resp: oneshot::Sender<Result<(), AppError>>,
     },
+    /// Result of a round trip to the module, e.g., a ping
+    ReportLiveness {
+        id: u8,
+        alive: bool,
+    },
+}
+
+/// Immutable snapshot of the module registry
+pub struct RegistryView {
+    slots: Vec<Option<Arc<A3Module>>>,
+}
+
+impl RegistryView {
+    /// Returns the modules in the order of their IDs.
+    pub fn list(&self) -> Vec<Arc<A3Module>> {
+        self.slots.iter().flatten().cloned().collect()
+    }
+
+    pub fn get_by_id(&self, id: u8) -> Result<Arc<A3Module>, AppError> {
+        match &self.slots[id as usize] {
+            Some(entry) => Ok(entry.clone()),
+            None => Err(AppError::new(
+                ErrorType::A3ModuleNotFound,
+                format!("No such module ID: {}", id),
+            )),
+        }
+    }
+}
+
+/// Read handle of the module registry.
+///
+/// The registry actor is the single writer. It publishes a new view after every change,
+/// and readers load the current one without going through the actor (read-copy-update).
+/// The lock is held only to swap or clone the pointer, never while a view is built or
+/// read, so readers do not wait on registration traffic.
+#[derive(Clone)]
+pub struct RegistryReader {
+    published: Arc<RwLock<Arc<RegistryView>>>,
+    events: Arc<events::EventHub>,
+}
+
+impl RegistryReader {
+    pub fn load(&self) -> Arc<RegistryView> {
+        self.published.read().unwrap().clone()
+    }
+
+    /// Subscribes to the registry changes. Dropping the subscription unsubscribes.
+    pub fn subscribe(&self) -> Arc<Subscription> {
+        self.events.subscribe()
+    }
 }
 
-// TODO: Consider using sqlite
+/// Module registry
+///
+/// Modules live in a slab of 256 slots indexed by module ID, with a UID to ID index on the
+/// side. Entries are reference counted so that views share them instead of deep copies.
 pub struct A3Modules {
-    modules_by_id: HashMap<u8, A3Module>,
-    modules_by_uid: HashMap<u32, A3Module>,
+    slots: Vec<Option<Arc<A3Module>>>,
+    id_by_uid: HashMap<u32, u8>,
+    store: Option<store::StoreWriter>,
+    reader: RegistryReader,
+    /// UIDs of the modules that failed the last round trip
+    unresponsive: HashSet<u32>,
 }
 
 impl A3Modules {
     pub fn new() -> Self {
         Self {
-            modules_by_uid: HashMap::new(),
-            modules_by_id: HashMap::new(),
+            slots: vec![None; NUM_SLOTS],
+            id_by_uid: HashMap::new(),
+            store: None,
+            reader: RegistryReader {
+                published: Arc::new(RwLock::new(Arc::new(RegistryView {
+                    slots: vec![None; NUM_SLOTS],
+                }))),
+                events: Arc::new(events::EventHub::new()),
+            },
+            unresponsive: HashSet::new(),
         }
     }
 
-    pub fn get_or_create_id_by_uid(&mut self, uid: u32) -> u8 {
-        let id = match self.modules_by_uid.get(&uid) {
-            Some(module) => module.id,
-            None => {
-                let new_id = self.find_available_id();
-                let module = A3Module {
-                    id: new_id,
-                    uid,
-                    name: Option::None,
-                    module_type: Option::None,
-                    module_type_id: Option::None,
-                };
-                self.modules_by_id.insert(new_id, module.clone());
-                self.modules_by_uid.insert(uid, module);
-                new_id
+    pub fn reader(&self) -> RegistryReader {
+        self.reader.clone()
+    }
+
+    /// Makes a registry that persists in the directory, restoring the modules saved there.
+    /// Falls back to an in-memory registry if the store cannot be opened.
+    pub fn with_store(dir: &Path) -> Self {
+        let mut modules = Self::new();
+        match store::RegistryStore::open(dir) {
+            Ok((store, restored)) => {
+                modules.store = Some(store::StoreWriter::start(store, &restored));
+                for module in restored {
+                    modules.insert(module);
+                }
+                modules.publish();
+                log::info!(
+                    "Restored {} modules from {:?}",
+                    modules.id_by_uid.len(),
+                    dir
+                );
             }
-        };
-        return id;
+            Err(e) => log::error!("Failed to open the module registry in {:?}: {}", dir, e),
+        }
+        return modules;
     }
 
-    pub fn register(&mut self, uid: u32, id: u8) {
+    pub fn get_or_create_id_by_uid(&mut self, uid: u32) -> u8 {
+        if let Some(id) = self.id_by_uid.get(&uid) {
+            return *id;
+        }
+        let new_id = self.find_available_id();
         let module = A3Module {
-            id,
+            id: new_id,
             uid,
             name: Option::None,
             module_type: Option::None,
             module_type_id: Option::None,
         };
-        self.modules_by_id.insert(module.id, module.clone());
-        self.modules_by_uid.insert(module.uid, module);
+        self.insert(module);
+        self.persist(new_id);
+        self.publish();
+        self.emit(ModuleEvent::Registered { id: new_id, uid });
+        return new_id;
     }
 
-    pub fn deregister(&mut self, uid: u32) {
-        if let Some(module) = self.modules_by_uid.remove(&uid) {
-            self.modules_by_id.remove(&module.id);
+    pub fn register(&mut self, uid: u32, id: u8) {
+        if self.id_by_uid.get(&uid) == Some(&id) {
+            // already known, e.g., restored from the store; keep the name and the type
+            return;
         }
-    }
-
-    pub fn list(&self) -> Vec<A3Module> {
-        let mut modules_list = Vec::new();
-        for (_, module) in &self.modules_by_id {
-            modules_list.push(module.clone());
+        self.deregister(uid);
+        if let Some(module) = &self.slots[id as usize] {
+            self.deregister(module.uid);
         }
-        modules_list
+        let module = A3Module {
+            id,
+            uid,
+            name: Option::None,
+            module_type: Option::None,
+            module_type_id: Option::None,
+        };
+        self.insert(module);
+        self.persist(id);
+        self.publish();
+        self.emit(ModuleEvent::Registered { id, uid });
     }
 
-    pub fn get_by_id(&self, id: u8) -> Result<A3Module, AppError> {
-        match self.modules_by_id.get(&id) {
-            Some(entry) => Ok(entry.clone()),
-            None => Err(AppError::new(
-                ErrorType::A3ModuleNotFound,
-                format!("No such module ID: {}", id),
-            )),
+    pub fn deregister(&mut self, uid: u32) {
+        if let Some(id) = self.id_by_uid.remove(&uid) {
+            self.slots[id as usize] = None;
+            self.unresponsive.remove(&uid);
+            self.publish();
+            self.emit(ModuleEvent::Deregistered { id, uid });
+            if let Some(store) = &self.store {
+                store.remove(uid);
+            }
         }
     }
 
@@ -122,26 +216,97 @@ impl A3Modules {
         &mut self,
         id: u8,
         name: &Option<String>,
-        module_type: &Option<String>,
+        module_type: &Option<Arc<str>>,
         module_type_id: &Option<u16>,
     ) {
-        if let Some(module) = self.modules_by_id.get_mut(&id) {
-            module.name = name.clone().or(module.name.clone());
-            module.module_type = module_type.clone().or(module.module_type.clone());
-            module.module_type_id = module_type_id.clone().or(module.module_type_id.clone());
-            if let Some(module2) = self.modules_by_uid.get_mut(&module.uid) {
-                module2.name = name.clone().or(module2.name.clone());
-                module2.module_type = module_type.clone().or(module2.module_type.clone());
-                module2.module_type_id = module_type_id.clone().or(module2.module_type_id.clone());
-            }
+        let mut events = Vec::new();
+        let Some(entry) = &mut self.slots[id as usize] else {
+            return;
+        };
+        let renamed = name.is_some() && *name != entry.name;
+        let retyped = module_type
+            .as_ref()
+            .is_some_and(|new_type| entry.module_type.as_ref() != Some(new_type));
+        let type_id_changed = module_type_id.is_some() && *module_type_id != entry.module_type_id;
+        // most config reads report what is known already; leave the store alone then
+        if !renamed && !retyped && !type_id_changed {
+            return;
+        }
+        let module = Arc::make_mut(entry);
+        if renamed {
+            module.name = name.clone();
+            events.push(ModuleEvent::Renamed {
+                id,
+                uid: module.uid,
+                name: name.clone().unwrap(),
+            });
+        }
+        if retyped {
+            let new_type = module_type.clone().unwrap();
+            module.module_type = Some(new_type.clone());
+            events.push(ModuleEvent::TypeResolved {
+                id,
+                uid: module.uid,
+                module_type: new_type,
+            });
+        }
+        if type_id_changed {
+            module.module_type_id = *module_type_id;
+        }
+        self.persist(id);
+        self.publish();
+        for event in events {
+            self.emit(event);
+        }
+    }
+
+    /// Records the result of a round trip. Only transitions are reported to subscribers.
+    pub fn report_liveness(&mut self, id: u8, alive: bool) {
+        let Some(module) = &self.slots[id as usize] else {
+            return;
+        };
+        let uid = module.uid;
+        let changed = match alive {
+            true => self.unresponsive.remove(&uid),
+            false => self.unresponsive.insert(uid),
+        };
+        if changed {
+            self.emit(ModuleEvent::LivenessChanged { id, uid, alive });
         }
     }
 
     //////////////////////////////////////////////////////////////////
 
+    fn insert(&mut self, module: A3Module) {
+        self.id_by_uid.insert(module.uid, module.id);
+        let id = module.id as usize;
+        self.slots[id] = Some(Arc::new(module));
+    }
+
+    /// Makes the current state visible to readers. Entries are shared with the slab, so
+    /// this costs one pointer copy per slot.
+    fn publish(&mut self) {
+        let view = Arc::new(RegistryView {
+            slots: self.slots.clone(),
+        });
+        *self.reader.published.write().unwrap() = view;
+    }
+
+    fn emit(&self, event: ModuleEvent) {
+        self.reader.events.publish(event);
+    }
+
+    /// Queues the module in the slot for the store; does not wait for the disk.
+    fn persist(&self, id: u8) {
+        let (Some(store), Some(module)) = (&self.store, &self.slots[id as usize]) else {
+            return;
+        };
+        store.put(module);
+    }
+
     fn find_available_id(&self) -> u8 {
         for id in 1..=255 {
-            if !self.modules_by_id.contains_key(&id) {
+            if self.slots[id as usize].is_none() {
                 return id;
             }
         }
@@ -149,16 +314,21 @@ impl A3Modules {
     }
 }
 
-pub fn start() -> (Sender<Operation>, JoinHandle<()>) {
+/// Starts the registry. The modules are persisted in `state_dir` if it is given.
+pub fn start(state_dir: Option<&Path>) -> (Sender<Operation>, RegistryReader, JoinHandle<()>) {
     let (operation_tx, operation_rx) = channel(8);
+    let modules = match state_dir {
+        Some(dir) => A3Modules::with_store(dir),
+        None => A3Modules::new(),
+    };
+    let reader = modules.reader();
     let handle = tokio::spawn(async move {
-        handle_requests(operation_rx).await;
+        handle_requests(operation_rx, modules).await;
     });
-    return (operation_tx, handle);
+    return (operation_tx, reader, handle);
 }
 
-async fn handle_requests(mut operation_rx: Receiver<Operation>) {
-    let mut modules = A3Modules::new();
+async fn handle_requests(mut operation_rx: Receiver<Operation>, mut modules: A3Modules) {
     loop {
         if let Some(request) = operation_rx.recv().await {
             match request {
@@ -172,13 +342,6 @@ async fn handle_requests(mut operation_rx: Receiver<Operation>) {
                 Operation::Deregister { uid } => {
                     modules.deregister(uid);
                 }
-                Operation::List { resp } => {
-                    let modules_list = modules.list();
-                    resp.send(Ok(modules_list)).unwrap();
-                }
-                Operation::GetById { id, resp } => {
-                    resp.send(modules.get_by_id(id)).unwrap();
-                }
                 Operation::SetProperties {
                     id,
                     name,
@@ -188,7 +351,169 @@ async fn handle_requests(mut operation_rx: Receiver<Operation>) {
                 } => {
                     modules.set_properties(id, &name, &module_type, &module_type_id);
                 }
+                Operation::ReportLiveness { id, alive } => {
+                    modules.report_liveness(id, alive);
+                }
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::analog3::schema::modules_schema;
+
+    #[test]
+    fn test_registry() {
+        let mut modules = A3Modules::new();
+        assert_eq!(modules.get_or_create_id_by_uid(0x1acebeef), 1);
+        assert_eq!(modules.get_or_create_id_by_uid(0xba5eba11), 2);
+        assert_eq!(modules.get_or_create_id_by_uid(0x1acebeef), 1);
+
+        // a module claims ID 1 that belonged to another one
+        modules.register(0xfeedface, 1);
+        assert!(modules.id_by_uid.get(&0x1acebeef).is_none());
+        let list = modules.reader().load().list();
+        assert_eq!(list.len(), 2);
+        assert_eq!(list[0].uid, 0xfeedface);
+        assert_eq!(list[1].uid, 0xba5eba11);
+        assert_eq!(modules.get_or_create_id_by_uid(0x1acebeef), 3);
+    }
+
+    #[test]
+    fn test_set_properties_shares_type_name() {
+        let mut modules = A3Modules::new();
+        let id = modules.get_or_create_id_by_uid(0x1acebeef);
+        let reader = modules.reader();
+        let before = reader.load().get_by_id(id).unwrap();
+        let type_name = modules_schema()[&2].module_type_name.clone();
+        modules.set_properties(
+            id,
+            &Some("vca".to_string()),
+            &Some(type_name.clone()),
+            &Some(2),
+        );
+
+        // the view taken earlier is left intact
+        assert!(before.name.is_none());
+        let after = reader.load().get_by_id(id).unwrap();
+        assert_eq!(after.name.as_deref(), Some("vca"));
+        assert!(Arc::ptr_eq(after.module_type.as_ref().unwrap(), &type_name));
+
+        modules.set_properties(id, &None, &None, &None);
+        assert_eq!(
+            reader.load().get_by_id(id).unwrap().name.as_deref(),
+            Some("vca")
+        );
+    }
+
+    #[test]
+    fn test_store_keeps_registration_that_compacts() {
+        let dir = std::env::temp_dir().join(format!("a3-registry-{}", std::process::id()));
+        let _ = std::fs::remove_dir_all(&dir);
+        let log_length = |modules: &A3Modules| {
+            modules.store.as_ref().unwrap().flush();
+            return std::fs::metadata(dir.join("modules.log")).unwrap().len();
+        };
+        {
+            let mut modules = A3Modules::with_store(&dir);
+            let id = modules.get_or_create_id_by_uid(0x1acebeef);
+            // a config read that reports nothing new is not written
+            let name = Some("vca".to_string());
+            modules.set_properties(id, &name, &None, &None);
+            let length = log_length(&modules);
+            modules.set_properties(id, &name, &None, &None);
+            assert_eq!(log_length(&modules), length);
+
+            // fill the log up to one record short of compaction
+            for n in 2..store::COMPACTION_THRESHOLD - 1 {
+                modules.set_properties(id, &Some(format!("vca {}", n)), &None, &None);
             }
+            // this registration triggers the compaction
+            modules.get_or_create_id_by_uid(0xba5eba11);
+            assert_eq!(log_length(&modules), 0);
+        }
+        let modules = A3Modules::with_store(&dir);
+        let list = modules.reader().load().list();
+        assert_eq!(
+            list.iter().map(|module| module.uid).collect::<Vec<_>>(),
+            vec![0x1acebeef, 0xba5eba11]
+        );
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    /// Read latency of the registry view vs. an actor round trip while sign-ins keep the
+    /// actor busy. Run with `cargo test --release -- --ignored --nocapture bench_`.
+    #[tokio::test(flavor = "multi_thread", worker_threads = 4)]
+    #[ignore]
+    async fn bench_read_latency_under_sign_ins() {
+        use crate::mission_control::LatencySummary;
+        use std::{
+            sync::atomic::{AtomicBool, Ordering},
+            time::{Duration, Instant},
+        };
+
+        const NUM_READS: usize = 20000;
+        let (modules_tx, reader, _) = start(None);
+        let stop = Arc::new(AtomicBool::new(false));
+        let mut sign_ins = Vec::new();
+        for worker in 0..2u32 {
+            let modules_tx = modules_tx.clone();
+            let stop = stop.clone();
+            sign_ins.push(tokio::spawn(async move {
+                let mut uid = worker << 24;
+                while !stop.load(Ordering::Relaxed) {
+                    uid += 1;
+                    let (resp_tx, resp_rx) = oneshot::channel();
+                    let op = Operation::GetOrCreateIdByUid { uid, resp: resp_tx };
+                    modules_tx.send(op).await.unwrap();
+                    if resp_rx.await.unwrap().unwrap() > 200 {
+                        modules_tx
+                            .send(Operation::Deregister { uid: uid - 100 })
+                            .await
+                            .unwrap();
+                    }
+                }
+            }));
+        }
+
+        let mut view_samples = Vec::<Duration>::with_capacity(NUM_READS);
+        for _ in 0..NUM_READS {
+            let started_at = Instant::now();
+            let modules = reader.load().list();
+            std::hint::black_box(modules);
+            view_samples.push(started_at.elapsed());
+        }
+        let mut actor_samples = Vec::<Duration>::with_capacity(NUM_READS);
+        for _ in 0..NUM_READS {
+            let started_at = Instant::now();
+            let (resp_tx, resp_rx) = oneshot::channel();
+            let op = Operation::GetOrCreateIdByUid {
+                uid: 0xffffffff,
+                resp: resp_tx,
+            };
+            modules_tx.send(op).await.unwrap();
+            std::hint::black_box(resp_rx.await.unwrap().unwrap());
+            actor_samples.push(started_at.elapsed());
+        }
+        stop.store(true, Ordering::Relaxed);
+        for sign_in in sign_ins {
+            sign_in.await.unwrap();
+        }
+
+        for (name, samples) in [("view", view_samples), ("actor", actor_samples)] {
+            let summary = LatencySummary::from_samples(&samples).unwrap();
+            println!(
+                "{:5} reads={} min/avg/p50/p99/max = {:?}/{:?}/{:?}/{:?}/{:?}",
+                name,
+                summary.count,
+                summary.min,
+                summary.avg,
+                summary.p50,
+                summary.p99,
+                summary.max
+            );
         }
     }
 }
@@ -0,0 +1,216 @@
+use std::{
+    collections::VecDeque,
+    sync::{Arc, Mutex, Weak},
+};
+
+use tokio::sync::Notify;
+
+/// Number of events a subscriber may have pending before older ones are dropped
+const QUEUE_CAPACITY: usize = 64;
+
+/// Incremental change of the module registry
+#[derive(Debug, Clone, PartialEq)]
+pub enum ModuleEvent {
+    Registered {
+        id: u8,
+        uid: u32,
+    },
+    Deregistered {
+        id: u8,
+        uid: u32,
+    },
+    Renamed {
+        id: u8,
+        uid: u32,
+        name: String,
+    },
+    TypeResolved {
+        id: u8,
+        uid: u32,
+        module_type: Arc<str>,
+    },
+    LivenessChanged {
+        id: u8,
+        uid: u32,
+        alive: bool,
+    },
+}
+
+impl ModuleEvent {
+    pub fn uid(&self) -> u32 {
+        match self {
+            ModuleEvent::Registered { uid, .. }
+            | ModuleEvent::Deregistered { uid, .. }
+            | ModuleEvent::Renamed { uid, .. }
+            | ModuleEvent::TypeResolved { uid, .. }
+            | ModuleEvent::LivenessChanged { uid, .. } => *uid,
+        }
+    }
+
+    /// Events of the same module and the same kind supersede each other; only the latest
+    /// one matters to a subscriber that has not caught up yet.
+    fn supersedes(&self, other: &ModuleEvent) -> bool {
+        std::mem::discriminant(self) == std::mem::discriminant(other) && self.uid() == other.uid()
+    }
+}
+
+/// Fans registry events out to the subscribers.
+pub struct EventHub {
+    subscribers: Mutex<Vec<Weak<Subscription>>>,
+}
+
+impl EventHub {
+    pub fn new() -> Self {
+        Self {
+            subscribers: Mutex::new(Vec::new()),
+        }
+    }
+
+    pub fn subscribe(&self) -> Arc<Subscription> {
+        let subscription = Arc::new(Subscription {
+            state: Mutex::new(QueueState {
+                events: VecDeque::new(),
+                num_lost: 0,
+            }),
+            notify: Notify::new(),
+        });
+        self.subscribers
+            .lock()
+            .unwrap()
+            .push(Arc::downgrade(&subscription));
+        return subscription;
+    }
+
+    /// Queues the event to every live subscriber. Never blocks on a slow one.
+    pub fn publish(&self, event: ModuleEvent) {
+        let mut subscribers = self.subscribers.lock().unwrap();
+        subscribers.retain(|subscriber| match subscriber.upgrade() {
+            Some(subscription) => {
+                subscription.push(event.clone());
+                true
+            }
+            None => false,
+        });
+    }
+}
+
+/// Bounded event queue of a subscriber.
+///
+/// A new event replaces a pending one of the same kind for the same module. When the
+/// queue is full otherwise, the oldest event is dropped and counted so that the subscriber
+/// knows to resync from a listing.
+#[derive(Debug)]
+pub struct Subscription {
+    state: Mutex<QueueState>,
+    notify: Notify,
+}
+
+#[derive(Debug)]
+struct QueueState {
+    events: VecDeque<ModuleEvent>,
+    num_lost: usize,
+}
+
+/// Events taken from a subscription at once
+#[derive(Debug)]
+pub struct EventBatch {
+    pub events: Vec<ModuleEvent>,
+    /// Number of events dropped since the previous batch
+    pub num_lost: usize,
+}
+
+impl Subscription {
+    /// Waits for events and takes all the pending ones.
+    pub async fn next(&self) -> EventBatch {
+        loop {
+            {
+                let mut state = self.state.lock().unwrap();
+                if !state.events.is_empty() || state.num_lost > 0 {
+                    return EventBatch {
+                        events: state.events.drain(..).collect(),
+                        num_lost: std::mem::take(&mut state.num_lost),
+                    };
+                }
+            }
+            self.notify.notified().await;
+        }
+    }
+
+    fn push(&self, event: ModuleEvent) {
+        let mut state = self.state.lock().unwrap();
+        match state
+            .events
+            .iter()
+            .position(|entry| event.supersedes(entry))
+        {
+            Some(index) => {
+                // keep the order of the other events; the superseded one moves to the end
+                state.events.remove(index);
+            }
+            None if state.events.len() >= QUEUE_CAPACITY => {
+                state.events.pop_front();
+                state.num_lost += 1;
+            }
+            None => {}
+        }
+        state.events.push_back(event);
+        drop(state);
+        self.notify.notify_one();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn renamed(uid: u32, name: &str) -> ModuleEvent {
+        ModuleEvent::Renamed {
+            id: 1,
+            uid,
+            name: name.to_string(),
+        }
+    }
+
+    #[tokio::test]
+    async fn test_coalescing() {
+        let hub = EventHub::new();
+        let subscription = hub.subscribe();
+        hub.publish(ModuleEvent::Registered { id: 1, uid: 10 });
+        hub.publish(renamed(10, "lfo"));
+        hub.publish(renamed(11, "vca"));
+        hub.publish(renamed(10, "lfo 2"));
+
+        let batch = subscription.next().await;
+        assert_eq!(batch.num_lost, 0);
+        assert_eq!(
+            batch.events,
+            vec![
+                ModuleEvent::Registered { id: 1, uid: 10 },
+                renamed(11, "vca"),
+                renamed(10, "lfo 2"),
+            ]
+        );
+    }
+
+    #[tokio::test]
+    async fn test_overflow() {
+        let hub = EventHub::new();
+        let subscription = hub.subscribe();
+        for uid in 0..(QUEUE_CAPACITY as u32 + 3) {
+            hub.publish(ModuleEvent::Registered { id: 1, uid });
+        }
+        let batch = subscription.next().await;
+        assert_eq!(batch.num_lost, 3);
+        assert_eq!(batch.events.len(), QUEUE_CAPACITY);
+        assert_eq!(batch.events[0].uid(), 3);
+    }
+
+    #[test]
+    fn test_dropped_subscriber() {
+        let hub = EventHub::new();
+        let subscription = hub.subscribe();
+        drop(subscription);
+        hub.publish(ModuleEvent::Registered { id: 1, uid: 10 });
+        assert!(hub.subscribers.lock().unwrap().is_empty());
+    }
+}
@@ -0,0 +1,367 @@
+use std::{
+    collections::HashMap,
+    fs::{self, File, OpenOptions},
+    io::{self, BufRead, BufReader, Write},
+    iter,
+    path::{Path, PathBuf},
+    sync::mpsc,
+    thread,
+};
+
+use super::A3Module;
+use crate::analog3::schema::intern_type_name;
+
+const SNAPSHOT_FILE: &str = "modules.snapshot";
+const LOG_FILE: &str = "modules.log";
+
+/// The log is folded into the snapshot after this many records.
+pub(super) const COMPACTION_THRESHOLD: usize = 256;
+
+/// Crash-safe storage of the module registry.
+///
+/// Changes are appended to a log and synced in batches. The log is compacted
+/// into a snapshot file now and then. Both files are made of text records, one per line:
+///
+/// ```text
+/// M <uid> <id> <name> <module type> <module type id>   module entry
+/// D <uid>                                              removal
+/// ```
+/// Numbers are hex, strings are hex-encoded UTF-8, and `-` stands for a missing field.
+/// Every record carries the full state of an entry, so replaying the log over a snapshot
+/// that already includes it is harmless. A torn record at the end of the log is ignored.
+pub struct RegistryStore {
+    dir: PathBuf,
+    log: File,
+    num_records: usize,
+}
+
+enum Record {
+    Module(A3Module),
+    Removed(u32),
+}
+
+impl RegistryStore {
+    /// Opens the store in the directory and returns the modules recovered from it.
+    pub fn open(dir: &Path) -> io::Result<(Self, Vec<A3Module>)> {
+        fs::create_dir_all(dir)?;
+        let mut modules = HashMap::<u32, A3Module>::new();
+        for path in [dir.join(SNAPSHOT_FILE), dir.join(LOG_FILE)] {
+            for record in read_records(&path)? {
+                match record {
+                    Record::Module(module) => {
+                        modules.insert(module.uid, module);
+                    }
+                    Record::Removed(uid) => {
+                        modules.remove(&uid);
+                    }
+                }
+            }
+        }
+        let log = OpenOptions::new()
+            .create(true)
+            .append(true)
+            .open(dir.join(LOG_FILE))?;
+        let mut store = Self {
+            dir: dir.to_path_buf(),
+            log,
+            num_records: 0,
+        };
+        let modules: Vec<A3Module> = modules.into_values().collect();
+        store.compact(modules.iter())?;
+        return Ok((store, modules));
+    }
+
+    pub fn put(&mut self, module: &A3Module) -> io::Result<()> {
+        self.append(&encode_module(module))
+    }
+
+    pub fn remove(&mut self, uid: u32) -> io::Result<()> {
+        self.append(&format!("D {:08x}", uid))
+    }
+
+    /// Makes the records appended so far durable.
+    pub fn sync(&mut self) -> io::Result<()> {
+        self.log.sync_data()
+    }
+
+    pub fn needs_compaction(&self) -> bool {
+        self.num_records >= COMPACTION_THRESHOLD
+    }
+
+    /// Writes the modules into a new snapshot and starts over the log.
+    /// The snapshot replaces the old one by rename, so a crash leaves either of them intact.
+    pub fn compact<'a>(&mut self, modules: impl Iterator<Item = &'a A3Module>) -> io::Result<()> {
+        let snapshot_path = self.dir.join(SNAPSHOT_FILE);
+        let temp_path = self.dir.join(format!("{}.tmp", SNAPSHOT_FILE));
+        let mut temp = File::create(&temp_path)?;
+        for module in modules {
+            writeln!(temp, "{}", encode_module(module))?;
+        }
+        temp.sync_all()?;
+        fs::rename(&temp_path, &snapshot_path)?;
+        self.log.set_len(0)?;
+        self.log.sync_all()?;
+        self.num_records = 0;
+        return Ok(());
+    }
+
+    fn append(&mut self, record: &String) -> io::Result<()> {
+        writeln!(self.log, "{}", record)?;
+        self.num_records += 1;
+        return Ok(());
+    }
+}
+
+enum Change {
+    Put(A3Module),
+    Removed(u32),
+    #[cfg(test)]
+    Flush(mpsc::Sender<()>),
+}
+
+/// Writes the store on a thread of its own, so that the registry never waits for the disk.
+///
+/// Whatever changes pile up while a batch is being synced go into the next batch, which is
+/// synced once. A change is durable a little after it is queued; if the power goes in
+/// between, the module comes back with whatever the store had before.
+pub struct StoreWriter {
+    changes: Option<mpsc::Sender<Change>>,
+    thread: Option<thread::JoinHandle<()>>,
+}
+
+impl StoreWriter {
+    /// Starts writing to the store, which holds the modules.
+    pub fn start(store: RegistryStore, modules: &[A3Module]) -> Self {
+        let (changes_tx, changes_rx) = mpsc::channel();
+        let modules = modules
+            .iter()
+            .map(|module| (module.uid, module.clone()))
+            .collect();
+        let thread = thread::Builder::new()
+            .name("registry-store".to_string())
+            .spawn(move || write_changes(store, modules, changes_rx))
+            .expect("Failed to start the registry store writer");
+        return Self {
+            changes: Some(changes_tx),
+            thread: Some(thread),
+        };
+    }
+
+    pub fn put(&self, module: &A3Module) {
+        self.send(Change::Put(module.clone()));
+    }
+
+    pub fn remove(&self, uid: u32) {
+        self.send(Change::Removed(uid));
+    }
+
+    /// Waits until the changes queued so far are written.
+    #[cfg(test)]
+    pub fn flush(&self) {
+        let (done_tx, done_rx) = mpsc::channel();
+        self.send(Change::Flush(done_tx));
+        let _ = done_rx.recv();
+    }
+
+    fn send(&self, change: Change) {
+        if let Some(changes) = &self.changes {
+            if changes.send(change).is_err() {
+                log::error!("The module registry store writer is gone");
+            }
+        }
+    }
+}
+
+impl Drop for StoreWriter {
+    /// Writes out the queued changes before the store is closed.
+    fn drop(&mut self) {
+        self.changes = None;
+        if let Some(thread) = self.thread.take() {
+            let _ = thread.join();
+        }
+    }
+}
+
+/// Keeps a copy of the modules, so that compactions do not need the registry.
+fn write_changes(
+    mut store: RegistryStore,
+    mut modules: HashMap<u32, A3Module>,
+    changes: mpsc::Receiver<Change>,
+) {
+    while let Ok(first) = changes.recv() {
+        #[cfg(test)]
+        let mut flushed = Vec::new();
+        for change in iter::once(first).chain(changes.try_iter()) {
+            match change {
+                Change::Put(module) => {
+                    if let Err(e) = store.put(&module) {
+                        log::error!("Failed to persist module uid {:08x}: {}", module.uid, e);
+                    }
+                    modules.insert(module.uid, module);
+                }
+                Change::Removed(uid) => {
+                    if let Err(e) = store.remove(uid) {
+                        log::error!("Failed to persist removal of uid {:08x}: {}", uid, e);
+                    }
+                    modules.remove(&uid);
+                }
+                #[cfg(test)]
+                Change::Flush(done) => flushed.push(done),
+            }
+        }
+        if let Err(e) = store.sync() {
+            log::error!("Failed to sync the module registry: {}", e);
+        }
+        if store.needs_compaction() {
+            if let Err(e) = store.compact(modules.values()) {
+                log::error!("Failed to compact the module registry: {}", e);
+            }
+        }
+        #[cfg(test)]
+        for done in flushed {
+            let _ = done.send(());
+        }
+    }
+}
+
+fn read_records(path: &Path) -> io::Result<Vec<Record>> {
+    let file = match File::open(path) {
+        Ok(file) => file,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(Vec::new()),
+        Err(e) => return Err(e),
+    };
+    let mut records = Vec::new();
+    let mut reader = BufReader::new(file);
+    let mut line = String::new();
+    loop {
+        line.clear();
+        if reader.read_line(&mut line)? == 0 {
+            break;
+        }
+        let Some(record) = line.strip_suffix('\n').and_then(decode_record) else {
+            log::warn!("Ignoring a broken registry record in {:?}", path);
+            continue;
+        };
+        records.push(record);
+    }
+    return Ok(records);
+}
+
+fn encode_module(module: &A3Module) -> String {
+    let encode_text = |text: Option<&str>| match text {
+        Some(text) => hex::encode(text),
+        None => "-".to_string(),
+    };
+    let module_type_id = match module.module_type_id {
+        Some(type_id) => format!("{:04x}", type_id),
+        None => "-".to_string(),
+    };
+    format!(
+        "M {:08x} {:02x} {} {} {}",
+        module.uid,
+        module.id,
+        encode_text(module.name.as_deref()),
+        encode_text(module.module_type.as_deref()),
+        module_type_id
+    )
+}
+
+fn decode_record(line: &str) -> Option<Record> {
+    let fields: Vec<&str> = line.split(' ').collect();
+    let decode_text = |field: &str| -> Option<Option<String>> {
+        match field {
+            "-" => Some(None),
+            _ => Some(Some(String::from_utf8(hex::decode(field).ok()?).ok()?)),
+        }
+    };
+    match fields.as_slice() {
+        ["M", uid, id, name, module_type, module_type_id] => {
+            let module_type_id = match *module_type_id {
+                "-" => None,
+                type_id => Some(u16::from_str_radix(type_id, 16).ok()?),
+            };
+            Some(Record::Module(A3Module {
+                uid: u32::from_str_radix(uid, 16).ok()?,
+                id: u8::from_str_radix(id, 16).ok()?,
+                name: decode_text(name)?,
+                module_type: decode_text(module_type)?.map(|name| intern_type_name(&name)),
+                module_type_id,
+            }))
+        }
+        ["D", uid] => Some(Record::Removed(u32::from_str_radix(uid, 16).ok()?)),
+        _ => None,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn temp_dir(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("a3-store-{}-{}", name, std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        dir
+    }
+
+    fn module(uid: u32, id: u8, name: Option<&str>) -> A3Module {
+        A3Module {
+            uid,
+            id,
+            name: name.map(|name| name.to_string()),
+            module_type: Some("amps".into()),
+            module_type_id: Some(2),
+        }
+    }
+
+    fn sorted(mut modules: Vec<A3Module>) -> Vec<A3Module> {
+        modules.sort_by_key(|module| module.uid);
+        modules
+    }
+
+    #[test]
+    fn test_recover_from_log_and_snapshot() {
+        let dir = temp_dir("recover");
+        {
+            let (mut store, modules) = RegistryStore::open(&dir).unwrap();
+            assert!(modules.is_empty());
+            store.put(&module(0x1acebeef, 1, None)).unwrap();
+            store.put(&module(0xba5eba11, 2, Some("vca 1"))).unwrap();
+            store.put(&module(0x1acebeef, 1, Some("lfo"))).unwrap();
+            store.remove(0xba5eba11).unwrap();
+            store.put(&module(0xfeedface, 3, None)).unwrap();
+        }
+        // recovery compacts the log into the snapshot
+        let (_, modules) = RegistryStore::open(&dir).unwrap();
+        let modules = sorted(modules);
+        assert_eq!(modules.len(), 2);
+        assert_eq!(modules[0].uid, 0x1acebeef);
+        assert_eq!(modules[0].name.as_deref(), Some("lfo"));
+        assert_eq!(modules[0].module_type_id, Some(2));
+        assert_eq!(modules[1].id, 3);
+        assert_eq!(fs::metadata(dir.join(LOG_FILE)).unwrap().len(), 0);
+
+        let (_, modules) = RegistryStore::open(&dir).unwrap();
+        assert_eq!(modules.len(), 2);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_torn_record_is_ignored() {
+        let dir = temp_dir("torn");
+        {
+            let (mut store, _) = RegistryStore::open(&dir).unwrap();
+            store.put(&module(0x1acebeef, 1, Some("lfo"))).unwrap();
+        }
+        let mut log = OpenOptions::new()
+            .append(true)
+            .open(dir.join(LOG_FILE))
+            .unwrap();
+        log.write_all(b"M ba5eba11 02 6c").unwrap();
+        drop(log);
+
+        let (_, modules) = RegistryStore::open(&dir).unwrap();
+        assert_eq!(modules.len(), 1);
+        assert_eq!(modules[0].name.as_deref(), Some("lfo"));
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,39 @@
+//! Counts heap allocations made by the current thread, so that parallel tests do
+//! not disturb each other's counts.
+
+use std::{
+    alloc::{GlobalAlloc, Layout, System},
+    cell::Cell,
+};
+
+pub struct CountingAllocator;
+
+thread_local! {
+    static NUM_ALLOCATIONS: Cell<usize> = const { Cell::new(0) };
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        let _ = NUM_ALLOCATIONS.try_with(|count| count.set(count.get() + 1));
+        unsafe { System.alloc(layout) }
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        unsafe { System.dealloc(ptr, layout) }
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        let _ = NUM_ALLOCATIONS.try_with(|count| count.set(count.get() + 1));
+        unsafe { System.realloc(ptr, layout, new_size) }
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+pub fn count<T>(f: impl FnOnce() -> T) -> (T, usize) {
+    let before = NUM_ALLOCATIONS.with(|count| count.get());
+    let result = f();
+    let after = NUM_ALLOCATIONS.with(|count| count.get());
+    (result, after - before)
+}
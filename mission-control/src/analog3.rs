@@ -1,5 +1,6 @@
 pub mod config;
 pub mod schema;
+pub mod snapshot;
 
 use num_enum::{IntoPrimitive, TryFromPrimitive};
 
@@ -40,6 +41,14 @@ pub const A3_MC_REQUEST_NAME: u8 = 0x04;
 pub const A3_MC_REQUEST_CONFIG: u8 = 0x05;
 pub const A3_MC_CONTINUE_STREAM: u8 = 0x06;
 pub const A3_MC_MODIFY_CONFIG: u8 = 0x08;
+pub const A3_MC_STAGE_CONFIG: u8 = 0x09;
+pub const A3_MC_COMMIT_STAGED: u8 = 0x0A;
+pub const A3_MC_DISCARD_STAGED: u8 = 0x0B;
+pub const A3_MC_REQUEST_PROPERTIES: u8 = 0x0C;
+pub const A3_MC_SET_PROPERTY_REALTIME: u8 = 0x0D;
+
+/* Module ID that addresses all modules in mission control messages */
+pub const A3_MODULE_ID_BROADCAST: u8 = 0x00;
 
 /* Individual module opcodes */
 pub const A3_IM_REPLY_PING: u8 = 0x01;
@@ -58,6 +67,21 @@ pub enum StreamStatus {
 
 pub const A3_STREAM_PAYLOAD_SIZE: usize = 8;
 
+/// Property values of this length or longer have the length byte set to this value,
+/// followed by the actual length in two bytes, big endian.
+pub const A3_PROP_LENGTH_EXTENDED: u8 = 0xff;
+/// Longest property value the extended length can tell
+pub const A3_PROP_MAX_LENGTH: usize = u16::MAX as usize;
+
+/// Stream options mission control offers after the arguments of a config stream command.
+/// A peer that takes any of them replies Ready followed by the options it accepts.
+pub const A3_STREAM_OPT_PACKED: u8 = 0x01;
+
+/// On a stream with packed values, a length byte of this value tells that the value is
+/// packed. It is followed by the codec, the unpacked length, and the packed length, in
+/// the length format above. Lengths of this value or longer take the extended form then.
+pub const A3_PROP_LENGTH_PACKED: u8 = 0xfe;
+
 // Properties /////////////////////////////////////
 
 /* Common property types */
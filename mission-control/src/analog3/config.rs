@@ -1,14 +1,18 @@
-use std::collections::BTreeMap;
 use std::fmt;
+use std::sync::Arc;
 use std::{cmp::min, num::ParseIntError};
 
 use crate::error::{AppError, ErrorType};
 
 use super::{
-    A3_PROP_ID_MODULE_TYPE,
-    schema::{COMMON_MODULE_DEF, MODULES_SCHEMA, ModuleDef, ValueType},
+    A3_PROP_ID_MODULE_TYPE, A3_PROP_LENGTH_EXTENDED, A3_PROP_LENGTH_PACKED,
+    schema::{COMMON_MODULE_DEF, ModuleDef, Schema, ValueType, modules_schema},
 };
 
+mod packing;
+
+use packing::Codec;
+
 #[derive(Debug, Clone)]
 pub struct TypeError {}
 
@@ -87,7 +91,7 @@ impl Value {
 #[derive(Debug, Clone)]
 pub struct Property {
     pub id: u8,
-    pub length: u8,
+    pub length: u16,
     pub data: Vec<u8>,
 }
 
@@ -121,10 +125,10 @@ impl Property {
         }
     }
 
-    pub fn text(id: u8, value: &String) -> Self {
+    pub fn text(id: u8, value: &str) -> Self {
         Self {
             id,
-            length: value.len() as u8,
+            length: value.len() as u16,
             data: value.as_bytes().to_vec(),
         }
     }
@@ -132,7 +136,7 @@ impl Property {
     pub fn vector_u8(id: u8, value: &Vec<u8>) -> Self {
         Self {
             id,
-            length: value.len() as u8,
+            length: value.len() as u16,
             data: value.clone(),
         }
     }
@@ -141,7 +145,7 @@ impl Property {
         let data = value.into_iter().flat_map(|v| v.to_be_bytes()).collect();
         Self {
             id,
-            length: (value.len() * 2) as u8,
+            length: (value.len() * 2) as u16,
             data,
         }
     }
@@ -156,7 +160,7 @@ impl Property {
 
     pub fn from_string(
         id: u8,
-        src: &String,
+        src: &str,
         value_type: &ValueType,
     ) -> std::result::Result<Self, AppError> {
         match value_type {
@@ -217,10 +221,17 @@ impl Property {
         ))
     }
 
-    fn split(src: &String) -> Vec<String> {
+    fn split(src: &str) -> Vec<String> {
         src.split(",").map(|s| s.trim().to_string()).collect()
     }
 
+    pub fn view(&self) -> PropertyRef<'_> {
+        PropertyRef {
+            id: self.id,
+            data: &self.data,
+        }
+    }
+
     pub fn get_value_with_type(&self, value_type: &ValueType) -> Value {
         let value = match value_type {
             ValueType::U8 => Value::U8(self.data[0]),
@@ -232,10 +243,10 @@ impl Property {
                     + self.data[3] as u32,
             ),
             ValueType::Text => {
-                let value = match String::from_utf8(self.data.clone()) {
-                    Ok(v) => v,
-                    Err(e) => {
-                        log::warn!("Utf parsing error: {:?}", e);
+                let value = match self.view().as_text() {
+                    Ok(v) => v.to_string(),
+                    Err(_) => {
+                        log::warn!("Utf parsing error: {}", hex::encode(&self.data));
                         let mut v = String::new();
                         for byte in &self.data {
                             v.push_str(format!("\\x{:02x}", byte).as_str());
@@ -270,20 +281,20 @@ impl Property {
 }
 
 /// Module properties with schema
-pub struct Configuration<'a> {
-    module_def: &'a ModuleDef,
+pub struct Configuration {
+    module_def: Arc<ModuleDef>,
     properties: Vec<Property>,
 
     pub module_type: u16,
-    pub module_type_name: &'a String,
+    pub module_type_name: Arc<str>,
 }
 
-impl<'a> Configuration<'a> {
+impl Configuration {
     pub fn new(properties: Vec<Property>) -> Self {
-        Self::with_schema(properties, &MODULES_SCHEMA)
+        Self::with_schema(properties, &modules_schema())
     }
 
-    pub fn with_schema(properties: Vec<Property>, schema: &'a BTreeMap<u16, ModuleDef>) -> Self {
+    pub fn with_schema(properties: Vec<Property>, schema: &Schema) -> Self {
         let mut module_type = 0xffff;
         for property in &properties {
             if property.id == A3_PROP_ID_MODULE_TYPE {
@@ -296,16 +307,16 @@ impl<'a> Configuration<'a> {
             }
         }
         let module_def = match schema.get(&module_type) {
-            Some(def) => def,
-            None => &COMMON_MODULE_DEF,
+            Some(def) => def.clone(),
+            None => COMMON_MODULE_DEF.clone(),
         };
 
         Self {
+            module_type_name: module_def.module_type_name.clone(),
             module_def,
             properties,
 
             module_type: module_type,
-            module_type_name: &module_def.module_type_name,
         }
     }
 
@@ -319,51 +330,59 @@ impl<'a> Configuration<'a> {
     }
 
     pub fn prop_name(&self, index: usize) -> String {
-        let property = &self.properties[index];
-        match self.module_def.properties.get(&property.id) {
-            Some(prop_def) => prop_def.name.clone(),
-            None => "unknown".to_string(),
-        }
+        return property_name(&self.module_def, &self.properties[index]);
     }
 
     pub fn prop_value_as_string(&self, index: usize) -> String {
-        let property = &self.properties[index];
-        match self.module_def.properties.get(&property.id) {
-            Some(prop_def) => {
-                let value_type = &prop_def.value_type;
-                let value = property.get_value_with_type(value_type);
-
-                match &prop_def.enum_names {
-                    Some(enum_names) => match value_type {
-                        ValueType::U8 => {
-                            let enum_index = value.as_u8().unwrap() as usize;
-                            if enum_index < enum_names.len() {
-                                format!("{} ({})", enum_names[enum_index], enum_index)
+        return property_value_as_string(&self.module_def, &self.properties[index]);
+    }
+}
+
+/// Name of the property in the module definition
+pub fn property_name(module_def: &ModuleDef, property: &Property) -> String {
+    match module_def.get_property_by_id(property.id) {
+        Some(prop_def) => prop_def.name.clone(),
+        None => "unknown".to_string(),
+    }
+}
+
+/// Value of the property rendered by its type in the module definition; hex if unknown
+pub fn property_value_as_string(module_def: &ModuleDef, property: &Property) -> String {
+    match module_def.get_property_by_id(property.id) {
+        Some(prop_def) => {
+            let value_type = &prop_def.value_type;
+            let value = property.get_value_with_type(value_type);
+
+            match &prop_def.enum_names {
+                Some(enum_names) => match value_type {
+                    ValueType::U8 => {
+                        let enum_index = value.as_u8().unwrap() as usize;
+                        if enum_index < enum_names.len() {
+                            format!("{} ({})", enum_names[enum_index], enum_index)
+                        } else {
+                            "VALUE_OUT_OF_ENUM_RANGE".to_string()
+                        }
+                    }
+                    ValueType::VectorU8 => value
+                        .as_vec_u8()
+                        .unwrap()
+                        .iter()
+                        .map(|value| {
+                            let index = value.clone() as usize;
+                            if index < enum_names.len() {
+                                format!("{} ({})", enum_names[index].clone(), index)
                             } else {
                                 "VALUE_OUT_OF_ENUM_RANGE".to_string()
                             }
-                        }
-                        ValueType::VectorU8 => value
-                            .as_vec_u8()
-                            .unwrap()
-                            .iter()
-                            .map(|value| {
-                                let index = value.clone() as usize;
-                                if index < enum_names.len() {
-                                    format!("{} ({})", enum_names[index].clone(), index)
-                                } else {
-                                    "VALUE_OUT_OF_ENUM_RANGE".to_string()
-                                }
-                            })
-                            .collect::<Vec<_>>()
-                            .join(", "),
-                        _ => "INVALID_ENUM_TYPE".to_string(),
-                    },
-                    None => value_type.to_hex(&value),
-                }
+                        })
+                        .collect::<Vec<_>>()
+                        .join(", "),
+                    _ => "INVALID_ENUM_TYPE".to_string(),
+                },
+                None => value_type.to_hex(&value),
             }
-            None => hex::encode(&property.data),
         }
+        None => hex::encode(&property.data),
     }
 }
 
@@ -390,72 +409,206 @@ fn error<T>(message: &str) -> Result<T> {
     });
 }
 
+/// Longest field header, i.e., a packed value with extended lengths
+const MAX_HEADER_LENGTH: usize = 9;
+
+/// Writes a value length and returns the number of bytes taken. On packed streams, the
+/// length byte of the packed value marker needs the extended form, too.
+fn encode_length(length: usize, packing: bool, out: &mut [u8]) -> usize {
+    let first_extended = match packing {
+        true => A3_PROP_LENGTH_PACKED,
+        false => A3_PROP_LENGTH_EXTENDED,
+    };
+    if length < first_extended as usize {
+        out[0] = length as u8;
+        return 1;
+    }
+    out[0] = A3_PROP_LENGTH_EXTENDED;
+    out[1..3].copy_from_slice(&(length as u16).to_be_bytes());
+    return 3;
+}
+
+/// Writes the field header, i.e., the property ID and the value length, and returns its size.
+pub fn encode_field_header(id: u8, length: usize, out: &mut [u8; 4]) -> usize {
+    out[0] = id;
+    return 1 + encode_length(length, false, &mut out[1..]);
+}
+
+/// Writes the header of a packed field and returns its size.
+fn encode_packed_field_header(
+    id: u8,
+    codec: Codec,
+    raw_length: usize,
+    packed_length: usize,
+    out: &mut [u8; MAX_HEADER_LENGTH],
+) -> usize {
+    out[0] = id;
+    out[1] = A3_PROP_LENGTH_PACKED;
+    out[2] = codec.into();
+    let size = 3 + encode_length(raw_length, true, &mut out[3..]);
+    return size + encode_length(packed_length, true, &mut out[size..]);
+}
+
+/// Field header read from a stream
+#[derive(Debug, Clone, Copy)]
+struct FieldHeader {
+    id: u8,
+    /// Number of value bytes that follow on the stream
+    length: u16,
+    /// Codec and the unpacked length of a packed value
+    packing: Option<(Codec, u16)>,
+}
+
+/// Reads a value length at `pos`. Returns None if more bytes are needed, otherwise the
+/// length and the position next to it. The length is None for the packed value marker.
+fn read_length(bytes: &[u8], pos: usize, packing: bool) -> Option<(Option<u16>, usize)> {
+    let first = *bytes.get(pos)?;
+    if first == A3_PROP_LENGTH_EXTENDED {
+        let extended = bytes.get(pos + 1..pos + 3)?;
+        return Some((
+            Some(u16::from_be_bytes([extended[0], extended[1]])),
+            pos + 3,
+        ));
+    }
+    if first == A3_PROP_LENGTH_PACKED && packing {
+        return Some((None, pos + 1));
+    }
+    return Some((Some(first as u16), pos + 1));
+}
+
+/// Collects the bytes of a field header, which may span frames.
+#[derive(Debug, Clone)]
+struct HeaderReader {
+    bytes: [u8; MAX_HEADER_LENGTH],
+    length: usize,
+}
+
+impl HeaderReader {
+    fn new() -> Self {
+        Self {
+            bytes: [0; MAX_HEADER_LENGTH],
+            length: 0,
+        }
+    }
+
+    fn is_empty(&self) -> bool {
+        self.length == 0
+    }
+
+    /// Takes the next byte. Returns the header once it is complete.
+    fn feed(&mut self, byte: u8, packing: bool) -> Result<Option<FieldHeader>> {
+        self.bytes[self.length] = byte;
+        self.length += 1;
+        let bytes = &self.bytes[..self.length];
+        let id = bytes[0];
+        let Some((length, pos)) = read_length(bytes, 1, packing) else {
+            return Ok(None);
+        };
+        if let Some(length) = length {
+            return Ok(Some(FieldHeader {
+                id,
+                length,
+                packing: None,
+            }));
+        }
+        let Some(&codec) = bytes.get(pos) else {
+            return Ok(None);
+        };
+        let Ok(codec) = Codec::try_from(codec) else {
+            return error("Unknown codec of a packed value");
+        };
+        let Some((raw_length, pos)) = read_length(bytes, pos + 1, true) else {
+            return Ok(None);
+        };
+        let Some((length, _)) = read_length(bytes, pos, true) else {
+            return Ok(None);
+        };
+        let (Some(raw_length), Some(length)) = (raw_length, length) else {
+            return error("Broken header of a packed value");
+        };
+        return Ok(Some(FieldHeader {
+            id,
+            length,
+            packing: Some((codec, raw_length)),
+        }));
+    }
+}
+
 #[derive(Debug, Clone)]
 pub struct DataFieldParser {
-    id: u8,
-    length: u8,
+    packing: bool,
+    header_reader: HeaderReader,
+    header: Option<FieldHeader>,
     data: Option<Vec<u8>>,
-    id_read: bool,
-    length_read: bool,
-    data_pos: usize,
 }
 
 impl DataFieldParser {
     pub fn new() -> Self {
+        return Self::with_packing(false);
+    }
+
+    /// Makes a parser for a stream where packed values are negotiated.
+    pub fn with_packing(packing: bool) -> Self {
         Self {
-            id: 0,
-            length: 0,
+            packing,
+            header_reader: HeaderReader::new(),
+            header: None,
             data: Some(Vec::new()),
-            id_read: false,
-            length_read: false,
-            data_pos: 0,
         }
     }
 
     pub fn data(&mut self, data: &[u8], length: usize, offset: usize) -> Result<(bool, usize)> {
-        if self.length_read && self.data_pos == self.length as usize {
-            return error("DataFieldParser: Data overflow");
-        }
-        let Some(acc_data) = &mut self.data.as_mut() else {
+        let Some(acc_data) = self.data.as_mut() else {
             return error("DataFieldParser: Committed already. The build cannot be used twice.");
         };
         let mut index = offset;
-        if !self.id_read {
-            self.id = data[index];
-            index += 1;
-            self.id_read = true;
-        }
-        if index >= length {
-            return Ok((false, index));
-        }
-        if !self.length_read {
-            self.length = data[index];
+        let value_length = loop {
+            if let Some(header) = self.header {
+                break header.length as usize;
+            }
+            if index >= length {
+                return Ok((false, index));
+            }
+            self.header = self.header_reader.feed(data[index], self.packing)?;
             index += 1;
-            self.length_read = true;
-        }
-        let bytes_left = length - index;
-        if bytes_left <= 0 {
-            return Ok((false, index));
+            if let Some(header) = self.header {
+                // the value arrives in pieces; place them into the final buffer directly
+                acc_data.reserve_exact(header.length as usize);
+                if header.length == 0 {
+                    return Ok((true, index));
+                }
+            }
+        };
+        if acc_data.len() == value_length {
+            return error("DataFieldParser: Data overflow");
         }
-        let to_read = min(self.length as usize - self.data_pos, bytes_left);
+        let to_read = min(value_length - acc_data.len(), length - index);
         acc_data.extend_from_slice(&data[index..index + to_read]);
-        self.data_pos += to_read;
-        let is_ready = self.data_pos == self.length as usize;
-        return Ok((is_ready, index + to_read));
+        return Ok((acc_data.len() == value_length, index + to_read));
     }
 
     pub fn commit(&mut self) -> Result<Property> {
-        if self.data_pos < self.length as usize {
+        let (Some(header), Some(data)) = (self.header, self.data.as_ref()) else {
+            return error("DataFieldParser: The parser is not ready to build yet");
+        };
+        if data.len() < header.length as usize {
             return error("DataFieldParser: The parser is not ready to build yet");
         }
-        if let Some(data) = self.data.take() {
+        let data = self.data.take().unwrap();
+        let Some((codec, raw_length)) = header.packing else {
             return Ok(Property {
-                id: self.id,
-                length: self.length,
+                id: header.id,
+                length: header.length,
                 data,
             });
-        }
-        return error("Data field is not set");
+        };
+        let mut value = Vec::with_capacity(raw_length as usize);
+        packing::unpack(codec, &data, raw_length as usize, &mut value)?;
+        return Ok(Property {
+            id: header.id,
+            length: raw_length,
+            data: value,
+        });
     }
 }
 
@@ -464,6 +617,7 @@ pub struct ChunkParser {
     chunk: Option<Vec<Property>>,
     target_num_fields: usize,
     num_fields_read: bool,
+    packing: bool,
     field_parser: DataFieldParser,
 }
 
@@ -473,6 +627,7 @@ impl ChunkParser {
             chunk: Some(Vec::new()),
             target_num_fields: 0,
             num_fields_read: false,
+            packing: false,
             field_parser: DataFieldParser::new(),
         };
     }
@@ -484,6 +639,13 @@ impl ChunkParser {
         return parser;
     }
 
+    /// Accepts packed values. Call before feeding data when the stream has negotiated
+    /// packing.
+    pub fn enable_packing(&mut self) {
+        self.packing = true;
+        self.field_parser = DataFieldParser::with_packing(true);
+    }
+
     pub fn data(&mut self, data: &[u8], data_length: usize) -> Result<bool> {
         let Some(chunk) = self.chunk.as_mut() else {
             return error("ChunkParser: Committed already. The parser cannot be used twice.");
@@ -502,8 +664,8 @@ impl ChunkParser {
             let (field_done, next_index) = self.field_parser.data(data, data_length, index)?;
             index = next_index;
             if field_done {
-                chunk.push(self.field_parser.commit().unwrap());
-                self.field_parser = DataFieldParser::new();
+                chunk.push(self.field_parser.commit()?);
+                self.field_parser = DataFieldParser::with_packing(self.packing);
             }
         }
         return Ok(chunk.len() == self.target_num_fields);
@@ -520,27 +682,321 @@ impl ChunkParser {
     }
 }
 
+// Arena config parser ////////////////////////////////////////////////////////////
+
+/// Capacity reserved for property data up front; covers a full config of common modules
+const INITIAL_DATA_CAPACITY: usize = 512;
+
+/// Config parsed into a single buffer.
+///
+/// Property values are kept back to back in one byte buffer, and the fields index into it.
+/// Accessors hand out borrowed views, so reading a config takes a couple of allocations
+/// regardless of the number of properties.
+#[derive(Debug, Clone)]
+pub struct ParsedConfig {
+    data: Vec<u8>,
+    fields: Vec<FieldEntry>,
+}
+
+#[derive(Debug, Clone, Copy)]
+struct FieldEntry {
+    id: u8,
+    offset: usize,
+    length: u16,
+}
+
+impl ParsedConfig {
+    pub fn len(&self) -> usize {
+        self.fields.len()
+    }
+
+    pub fn get(&self, index: usize) -> PropertyRef<'_> {
+        let field = &self.fields[index];
+        PropertyRef {
+            id: field.id,
+            data: &self.data[field.offset..field.offset + field.length as usize],
+        }
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = PropertyRef<'_>> {
+        (0..self.fields.len()).map(|index| self.get(index))
+    }
+
+    pub fn find(&self, id: u8) -> Option<PropertyRef<'_>> {
+        self.iter().find(|property| property.id == id)
+    }
+
+    /// Makes owned properties, one allocation each, for the consumers that keep them.
+    pub fn to_properties(&self) -> Vec<Property> {
+        self.iter().map(|property| property.to_property()).collect()
+    }
+}
+
+/// Borrowed view of a property
+#[derive(Debug, Clone, Copy)]
+pub struct PropertyRef<'a> {
+    pub id: u8,
+    pub data: &'a [u8],
+}
+
+impl<'a> PropertyRef<'a> {
+    pub fn as_u8(&self) -> std::result::Result<u8, TypeError> {
+        match self.data {
+            [value] => Ok(*value),
+            _ => Err(TypeError {}),
+        }
+    }
+
+    pub fn as_u16(&self) -> std::result::Result<u16, TypeError> {
+        match self.data {
+            [b0, b1] => Ok(u16::from_be_bytes([*b0, *b1])),
+            _ => Err(TypeError {}),
+        }
+    }
+
+    pub fn as_u32(&self) -> std::result::Result<u32, TypeError> {
+        match self.data {
+            [b0, b1, b2, b3] => Ok(u32::from_be_bytes([*b0, *b1, *b2, *b3])),
+            _ => Err(TypeError {}),
+        }
+    }
+
+    pub fn as_bool(&self) -> std::result::Result<bool, TypeError> {
+        Ok(self.as_u8()? != 0)
+    }
+
+    pub fn as_text(&self) -> std::result::Result<&'a str, TypeError> {
+        std::str::from_utf8(self.data).map_err(|_| TypeError {})
+    }
+
+    /// Big-endian u16 elements; a trailing odd byte is ignored.
+    pub fn u16_elements(&self) -> impl Iterator<Item = u16> + 'a {
+        self.data
+            .chunks_exact(2)
+            .map(|b| u16::from_be_bytes([b[0], b[1]]))
+    }
+
+    pub fn to_property(&self) -> Property {
+        Property {
+            id: self.id,
+            length: self.data.len() as u16,
+            data: self.data.to_vec(),
+        }
+    }
+}
+
+enum FieldState {
+    Header(HeaderReader),
+    /// Header of the field and the number of value bytes to come
+    Value(FieldHeader, usize),
+}
+
+/// Streaming parser that builds a `ParsedConfig`. Takes the same chunk format as
+/// `ChunkParser`.
+pub struct ConfigParser {
+    config: Option<ParsedConfig>,
+    target_num_fields: Option<usize>,
+    state: FieldState,
+    packing: bool,
+    /// Packed value being received; unpacked into the data buffer once complete
+    packed: Vec<u8>,
+}
+
+impl ConfigParser {
+    pub fn new() -> Self {
+        Self {
+            config: Some(ParsedConfig {
+                data: Vec::with_capacity(INITIAL_DATA_CAPACITY),
+                fields: Vec::new(),
+            }),
+            target_num_fields: None,
+            state: FieldState::Header(HeaderReader::new()),
+            packing: false,
+            packed: Vec::new(),
+        }
+    }
+
+    pub fn for_single_field() -> Self {
+        let mut parser = Self::new();
+        parser.data(&[1], 1).unwrap();
+        return parser;
+    }
+
+    /// Accepts packed values. Call before feeding data when the stream has negotiated
+    /// packing.
+    pub fn enable_packing(&mut self) {
+        self.packing = true;
+    }
+
+    pub fn data(&mut self, data: &[u8], data_length: usize) -> Result<bool> {
+        if self.is_done() {
+            return error("ConfigParser: Data overflow.");
+        }
+        let Some(config) = self.config.as_mut() else {
+            return error("ConfigParser: Committed already. The parser cannot be used twice.");
+        };
+        let mut index = 0;
+        while index < data_length {
+            let Some(target_num_fields) = self.target_num_fields else {
+                let num_fields = data[index] as usize;
+                config.fields.reserve_exact(num_fields);
+                self.target_num_fields = Some(num_fields);
+                index += 1;
+                continue;
+            };
+            match &mut self.state {
+                FieldState::Header(reader) => {
+                    if reader.is_empty() && config.fields.len() == target_num_fields {
+                        break;
+                    }
+                    let header = reader.feed(data[index], self.packing)?;
+                    index += 1;
+                    let Some(header) = header else {
+                        continue;
+                    };
+                    if header.packing.is_none() {
+                        config.fields.push(FieldEntry {
+                            id: header.id,
+                            offset: config.data.len(),
+                            length: header.length,
+                        });
+                    }
+                    self.state = FieldState::Value(header, header.length as usize);
+                }
+                FieldState::Value(header, remaining) => {
+                    let to_read = min(*remaining, data_length - index);
+                    let dest = match header.packing {
+                        Some(_) => &mut self.packed,
+                        None => &mut config.data,
+                    };
+                    dest.extend_from_slice(&data[index..index + to_read]);
+                    index += to_read;
+                    *remaining -= to_read;
+                }
+            }
+            if let FieldState::Value(header, 0) = self.state {
+                if let Some((codec, raw_length)) = header.packing {
+                    let offset = config.data.len();
+                    packing::unpack(codec, &self.packed, raw_length as usize, &mut config.data)?;
+                    self.packed.clear();
+                    config.fields.push(FieldEntry {
+                        id: header.id,
+                        offset,
+                        length: raw_length,
+                    });
+                }
+                self.state = FieldState::Header(HeaderReader::new());
+            }
+        }
+        return Ok(self.is_done());
+    }
+
+    pub fn commit(&mut self) -> Result<ParsedConfig> {
+        if self.config.is_none() {
+            return error("ConfigParser: commit() method cannot be called twice.");
+        }
+        if !self.is_done() {
+            return error("ConfigParser: The parser is not ready for generating the config.");
+        }
+        return Ok(self.config.take().unwrap());
+    }
+
+    /// Number of fields received in full so far
+    pub fn num_completed(&self) -> usize {
+        let Some(config) = &self.config else {
+            return 0;
+        };
+        match &self.state {
+            // a plain field is indexed as soon as its header arrives
+            FieldState::Value(header, _) if header.packing.is_none() => config.fields.len() - 1,
+            _ => config.fields.len(),
+        }
+    }
+
+    /// Field received in full; the index must be less than `num_completed()`.
+    pub fn completed_field(&self, index: usize) -> PropertyRef<'_> {
+        return self.config.as_ref().unwrap().get(index);
+    }
+
+    fn is_done(&self) -> bool {
+        match (&self.config, self.target_num_fields, &self.state) {
+            (Some(config), Some(target), FieldState::Header(reader)) => {
+                reader.is_empty() && config.fields.len() == target
+            }
+            _ => false,
+        }
+    }
+}
+
 // Property encoder ///////////////////////////////////////////////////////////////
 
 pub struct PropertyEncoder<'a> {
     props: &'a Vec<Property>,
+    /// Packed values of the properties that pack shorter; empty unless packing is on
+    packed: Vec<Option<(Codec, Vec<u8>)>>,
+    packing: bool,
     num_props_sent: bool,
-    prop_id_sent: bool,
-    value_length_sent: bool,
+    /// Header of the current property, i.e., the ID and the length; it may span frames
+    header: [u8; MAX_HEADER_LENGTH],
+    header_length: usize,
+    pos_header: usize,
     pos_value: usize,
     pos_prop: usize,
 }
 
 impl<'a> PropertyEncoder<'a> {
     pub fn new(props: &'a Vec<Property>) -> Self {
-        Self {
+        return Self::make(props, false);
+    }
+
+    /// Makes an encoder for a stream where packed values are negotiated. Values are
+    /// packed where it makes the field shorter.
+    pub fn with_packing(props: &'a Vec<Property>) -> Self {
+        return Self::make(props, true);
+    }
+
+    fn make(props: &'a Vec<Property>, packing: bool) -> Self {
+        let mut packed = Vec::new();
+        if packing {
+            let mut header = [0u8; MAX_HEADER_LENGTH];
+            packed = props
+                .iter()
+                .map(|prop| {
+                    let (codec, value) = packing::pack(&prop.data)?;
+                    let packed_length = encode_packed_field_header(
+                        prop.id,
+                        codec,
+                        prop.data.len(),
+                        value.len(),
+                        &mut header,
+                    ) + value.len();
+                    let raw_length =
+                        1 + encode_length(prop.data.len(), true, &mut header) + prop.data.len();
+                    (packed_length < raw_length).then_some((codec, value))
+                })
+                .collect();
+        }
+        let mut encoder = Self {
             props,
+            packed,
+            packing,
             num_props_sent: false,
-            prop_id_sent: false,
-            value_length_sent: false,
+            header: [0; MAX_HEADER_LENGTH],
+            header_length: 0,
+            pos_header: 0,
             pos_value: 0,
             pos_prop: 0,
-        }
+        };
+        encoder.prepare_header();
+        return encoder;
+    }
+
+    /// Number of bytes the encoder emits in total
+    pub fn encoded_length(&self) -> usize {
+        let mut header = [0u8; MAX_HEADER_LENGTH];
+        1 + (0..self.props.len())
+            .map(|index| self.field_header(index, &mut header) + self.value(index).len())
+            .sum::<usize>()
     }
 
     /// Flushes next piece of property data into the specified byte array.
@@ -567,29 +1023,25 @@ impl<'a> PropertyEncoder<'a> {
         }
 
         while data_index < out_data_len {
-            let prop = &self.props[self.pos_prop];
-
-            if !self.prop_id_sent {
-                out_data[data_index] = prop.id;
-                data_index += 1;
-                self.prop_id_sent = true;
+            if self.pos_header < self.header_length {
+                let bytes_to_send = min(
+                    out_data_len - data_index,
+                    self.header_length - self.pos_header,
+                );
+                out_data[data_index..data_index + bytes_to_send].copy_from_slice(
+                    &self.header[self.pos_header..self.pos_header + bytes_to_send],
+                );
+                data_index += bytes_to_send;
+                self.pos_header += bytes_to_send;
                 if data_index >= out_data_len {
                     return data_index;
                 }
             }
 
-            if !self.value_length_sent {
-                out_data[data_index] = prop.data.len() as u8;
-                data_index += 1;
-                self.value_length_sent = true;
-                if data_index >= out_data_len {
-                    return data_index;
-                }
-            }
-
-            let bytes_to_send = min(out_data_len - data_index, prop.data.len() - self.pos_value);
+            let value = self.value(self.pos_prop);
+            let bytes_to_send = min(out_data_len - data_index, value.len() - self.pos_value);
             let dest = &mut out_data[data_index..data_index + bytes_to_send];
-            let src = &prop.data[self.pos_value..self.pos_value + bytes_to_send];
+            let src = &value[self.pos_value..self.pos_value + bytes_to_send];
             dest.copy_from_slice(src);
             data_index += bytes_to_send;
             if self.update_positions(bytes_to_send) {
@@ -610,17 +1062,43 @@ impl<'a> PropertyEncoder<'a> {
     ///
     /// - `bool` - True if the position reaches the end.
     fn update_positions(&mut self, delta: usize) -> bool {
-        let prop = &self.props[self.pos_prop];
         self.pos_value += delta;
-        if self.pos_value >= prop.data.len() {
+        if self.pos_value >= self.value(self.pos_prop).len() {
             self.pos_value = 0;
-            self.prop_id_sent = false;
-            self.value_length_sent = false;
             self.pos_prop += 1;
+            self.prepare_header();
         }
         return self.is_done();
     }
 
+    fn prepare_header(&mut self) {
+        let mut header = [0u8; MAX_HEADER_LENGTH];
+        self.pos_header = 0;
+        self.header_length = match self.pos_prop < self.props.len() {
+            true => self.field_header(self.pos_prop, &mut header),
+            false => 0,
+        };
+        self.header = header;
+    }
+
+    /// Writes the header of the property at the index and returns its size.
+    fn field_header(&self, index: usize, out: &mut [u8; MAX_HEADER_LENGTH]) -> usize {
+        let prop = &self.props[index];
+        if let Some(Some((codec, value))) = self.packed.get(index) {
+            return encode_packed_field_header(prop.id, *codec, prop.data.len(), value.len(), out);
+        }
+        out[0] = prop.id;
+        return 1 + encode_length(prop.data.len(), self.packing, &mut out[1..]);
+    }
+
+    /// Value bytes of the property at the index as they go on the stream
+    fn value(&self, index: usize) -> &[u8] {
+        match self.packed.get(index) {
+            Some(Some((_, value))) => value,
+            _ => &self.props[index].data,
+        }
+    }
+
     pub fn is_done(&self) -> bool {
         self.pos_prop == self.props.len()
     }
@@ -810,7 +1288,7 @@ mod tests {
                         let properties = parser.commit().unwrap();
                         let config = Configuration::with_schema(properties, &schema);
                         assert_eq!(config.module_type, 0x2345);
-                        assert_eq!(config.module_type_name.as_str(), "test-module");
+                        assert_eq!(&*config.module_type_name, "test-module");
                         assert_eq!(config.len(), 6);
                         assert_eq!(config.prop_name(0), "module_uid");
                         assert_eq!(config.prop_value_as_string(0), "1acebeef");
@@ -842,6 +1320,128 @@ mod tests {
         }
     }
 
+    #[test]
+    fn test_parse_config_into_arena() {
+        let data1 = b"\x03\x02\x02hi\x03\x05";
+        let data2 = b"hello\x01\x02\x23";
+        let data3 = b"\x45";
+        let mut parser = ConfigParser::new();
+        assert!(!parser.data(data1, 7).unwrap());
+        // the second field is still coming in
+        assert_eq!(parser.num_completed(), 1);
+        assert_eq!(parser.completed_field(0).as_text().unwrap(), "hi");
+        assert!(!parser.data(data2, 8).unwrap());
+        assert_eq!(parser.num_completed(), 2);
+        assert!(parser.data(data3, 1).unwrap());
+        assert_eq!(parser.num_completed(), 3);
+        assert!(parser.data(data3, 1).is_err());
+        let config = parser.commit().unwrap();
+        assert!(parser.commit().is_err());
+
+        assert_eq!(config.len(), 3);
+        assert_eq!(config.get(0).as_text().unwrap(), "hi");
+        assert_eq!(config.get(1).as_text().unwrap(), "hello");
+        assert_eq!(config.find(1).unwrap().as_u16().unwrap(), 0x2345);
+        assert!(config.find(1).unwrap().as_u8().is_err());
+        assert!(config.find(4).is_none());
+
+        // same result as the owned parser
+        let mut chunk_parser = ChunkParser::new();
+        chunk_parser.data(data1, 7).unwrap();
+        chunk_parser.data(data2, 8).unwrap();
+        chunk_parser.data(data3, 1).unwrap();
+        let properties = chunk_parser.commit().unwrap();
+        for (owned, borrowed) in properties.iter().zip(config.to_properties()) {
+            assert_eq!(owned.id, borrowed.id);
+            assert_eq!(owned.length, borrowed.length);
+            assert_eq!(owned.data, borrowed.data);
+        }
+    }
+
+    #[test]
+    fn test_parse_single_field_using_config_parser() {
+        let mut parser = ConfigParser::for_single_field();
+        assert!(parser.data(b"\x02\x00", 2).unwrap());
+        let config = parser.commit().unwrap();
+        assert_eq!(config.len(), 1);
+        assert_eq!(config.get(0).id, 2);
+        assert_eq!(config.get(0).as_text().unwrap(), "");
+    }
+
+    /// A config with `num_fields` text properties, split into CAN frames
+    fn make_config_frames(num_fields: usize) -> Vec<Vec<u8>> {
+        let props: Vec<Property> = (0..num_fields)
+            .map(|id| Property::text(id as u8, &format!("property {}", id)))
+            .collect();
+        let mut encoder = PropertyEncoder::new(&props);
+        let mut frames = Vec::new();
+        let mut data = [0u8; 8];
+        loop {
+            let size = encoder.flush(&mut data);
+            if size == 0 {
+                break;
+            }
+            frames.push(data[..size].to_vec());
+        }
+        frames
+    }
+
+    #[test]
+    fn test_config_parser_allocations() {
+        for num_fields in [4, 16, 40] {
+            let frames = make_config_frames(num_fields);
+            let (chunk, chunk_allocations) = crate::alloc_counter::count(|| {
+                let mut parser = ChunkParser::new();
+                for frame in &frames {
+                    parser.data(frame, frame.len()).unwrap();
+                }
+                parser.commit().unwrap()
+            });
+            let (config, arena_allocations) = crate::alloc_counter::count(|| {
+                let mut parser = ConfigParser::new();
+                for frame in &frames {
+                    parser.data(frame, frame.len()).unwrap();
+                }
+                let config = parser.commit().unwrap();
+                // reading the values does not allocate either
+                assert!(config.iter().all(|property| property.as_text().is_ok()));
+                config
+            });
+            assert_eq!(chunk.len(), num_fields);
+            assert_eq!(config.len(), num_fields);
+            assert!(chunk_allocations > num_fields);
+            // the field index and the data buffer; the buffer grows at most a few times
+            // for configs larger than the initial capacity
+            assert!(arena_allocations <= 4);
+        }
+    }
+
+    #[test]
+    #[ignore]
+    fn bench_config_parser_allocations() {
+        for num_fields in [4, 16, 40] {
+            let frames = make_config_frames(num_fields);
+            let (_, chunk_allocations) = crate::alloc_counter::count(|| {
+                let mut parser = ChunkParser::new();
+                for frame in &frames {
+                    parser.data(frame, frame.len()).unwrap();
+                }
+                parser.commit().unwrap()
+            });
+            let (_, arena_allocations) = crate::alloc_counter::count(|| {
+                let mut parser = ConfigParser::new();
+                for frame in &frames {
+                    parser.data(frame, frame.len()).unwrap();
+                }
+                parser.commit().unwrap()
+            });
+            println!(
+                "{} fields: ChunkParser {} allocations, ConfigParser {} allocations",
+                num_fields, chunk_allocations, arena_allocations
+            );
+        }
+    }
+
     #[test]
     fn test_encode_string() {
         let prop = Property::text(A3_PROP_ID_NAME, &"Analog3 mission control".to_string());
@@ -888,6 +1488,92 @@ mod tests {
 
         assert_eq!(encoder.flush(&mut data), 0);
     }
+
+    #[test]
+    fn test_extended_length() {
+        let table: Vec<u8> = (0..600).map(|i| i as u8).collect();
+        let props = vec![
+            Property::u8(1, 7),
+            Property::vector_u8(2, &table),
+            Property::vector_u8(3, &vec![0xee; 255]),
+            Property::vector_u8(4, &vec![0x11; 254]),
+        ];
+        let mut encoder = PropertyEncoder::new(&props);
+        let encoded_length = encoder.encoded_length();
+        let mut frames = Vec::new();
+        let mut data = [0u8; 8];
+        loop {
+            let size = encoder.flush(&mut data);
+            if size == 0 {
+                break;
+            }
+            frames.push(data[..size].to_vec());
+        }
+        let stream: Vec<u8> = frames.concat();
+        assert_eq!(stream.len(), encoded_length);
+        // the extended header of the table spans the first two frames
+        assert_eq!(&frames[0], b"\x04\x01\x01\x07\x02\xff\x02\x58");
+        assert_eq!(&stream[8 + 600..8 + 600 + 4], b"\x03\xff\x00\xff");
+        assert_eq!(
+            &stream[8 + 600 + 4 + 255..8 + 600 + 4 + 255 + 2],
+            b"\x04\xfe"
+        );
+
+        let mut chunk_parser = ChunkParser::new();
+        let mut config_parser = ConfigParser::new();
+        for frame in &frames {
+            chunk_parser.data(frame, frame.len()).unwrap();
+            config_parser.data(frame, frame.len()).unwrap();
+        }
+        let chunk = chunk_parser.commit().unwrap();
+        let config = config_parser.commit().unwrap();
+        assert_eq!(chunk.len(), 4);
+        assert_eq!(config.len(), 4);
+        for (index, prop) in props.iter().enumerate() {
+            assert_eq!(chunk[index].id, prop.id);
+            assert_eq!(chunk[index].length, prop.length);
+            assert_eq!(chunk[index].data, prop.data);
+            assert_eq!(config.get(index).id, prop.id);
+            assert_eq!(config.get(index).data, prop.data.as_slice());
+        }
+        // received straight into a buffer of the final size
+        assert_eq!(chunk[1].data.capacity(), 600);
+    }
+
+    #[test]
+    fn test_packed_stream() {
+        let noise: Vec<u8> = (0..254).map(|i| (i * 37 % 251) as u8).collect();
+        let props = vec![
+            Property::u8(3, 2),
+            Property::vector_u8(6, &vec![1; 16]),
+            Property::vector_u8(7, &noise),
+            Property::vector_u16(8, &vec![0x0800; 16]),
+        ];
+        let mut encoder = PropertyEncoder::with_packing(&props);
+        let length = encoder.encoded_length();
+        let mut stream = vec![0u8; length];
+        let mut pos = 0;
+        while !encoder.is_done() {
+            pos += encoder.flush(&mut stream[pos..(pos + 8).min(length)]);
+        }
+        assert_eq!(pos, stream.len());
+        // packed vector: id, marker, codec, unpacked length, packed length, PackBits
+        assert_eq!(&stream[4..11], b"\x06\xfe\x00\x10\x02\xf1\x01");
+        // 254 bytes do not pack and take the extended length on a packed stream
+        assert_eq!(&stream[11..15], b"\x07\xff\x00\xfe");
+
+        let mut parser = ConfigParser::new();
+        parser.enable_packing();
+        for frame in stream.chunks(8) {
+            parser.data(frame, frame.len()).unwrap();
+        }
+        let config = parser.commit().unwrap();
+        assert_eq!(config.len(), props.len());
+        for (index, prop) in props.iter().enumerate() {
+            assert_eq!(config.get(index).id, prop.id);
+            assert_eq!(config.get(index).data, prop.data.as_slice());
+        }
+    }
 }
 
 // primitive parsers ///////////////////////////////////////////
@@ -0,0 +1,207 @@
+//! Packing of property values on config streams.
+//!
+//! A packed value is a PackBits byte stream, optionally taken over a transformed vector of
+//! u16 values. Vector properties carry a value per voice or per channel, which are mostly
+//! the same or a ramp, and pack into a few bytes.
+
+use std::iter;
+
+use num_enum::{IntoPrimitive, TryFromPrimitive};
+
+use super::{Result, error};
+
+/// Values shorter than this are never packed
+const MIN_PACKED_LENGTH: usize = 4;
+
+/// Longest run or literal a PackBits control byte can tell
+const MAX_RUN_LENGTH: usize = 128;
+
+#[derive(Debug, Clone, Copy, PartialEq, IntoPrimitive, TryFromPrimitive)]
+#[repr(u8)]
+pub enum Codec {
+    /// PackBits over the value bytes
+    PackBits = 0,
+    /// u16 elements split into the high byte plane and the low byte plane, then PackBits
+    Planes16 = 1,
+    /// Differences of consecutive u16 elements, split into byte planes, then PackBits
+    Delta16 = 2,
+}
+
+/// Packs the value with the codec that makes it the shortest. Returns None if the value
+/// is too short to bother.
+pub fn pack(data: &[u8]) -> Option<(Codec, Vec<u8>)> {
+    if data.len() < MIN_PACKED_LENGTH {
+        return None;
+    }
+    let mut best = (Codec::PackBits, pack_bits(data));
+    if data.len() % 2 == 0 {
+        for codec in [Codec::Planes16, Codec::Delta16] {
+            let packed = pack_bits(&to_planes(data, codec == Codec::Delta16));
+            if packed.len() < best.1.len() {
+                best = (codec, packed);
+            }
+        }
+    }
+    return Some(best);
+}
+
+/// Unpacks the value and appends it to `out`. The value must come out exactly
+/// `raw_length` bytes long.
+pub fn unpack(codec: Codec, packed: &[u8], raw_length: usize, out: &mut Vec<u8>) -> Result<()> {
+    if codec == Codec::PackBits {
+        let start = out.len();
+        unpack_bits(packed, raw_length, out)?;
+        if out.len() - start != raw_length {
+            return error("Packed value is shorter than told");
+        }
+        return Ok(());
+    }
+    if raw_length % 2 != 0 {
+        return error("Odd length for a u16 vector");
+    }
+    let mut planes = Vec::with_capacity(raw_length);
+    unpack_bits(packed, raw_length, &mut planes)?;
+    if planes.len() != raw_length {
+        return error("Packed value is shorter than told");
+    }
+    let (high, low) = planes.split_at(raw_length / 2);
+    let mut previous = 0u16;
+    out.reserve(raw_length);
+    for (high, low) in high.iter().zip(low) {
+        let mut element = u16::from_be_bytes([*high, *low]);
+        if codec == Codec::Delta16 {
+            element = element.wrapping_add(previous);
+            previous = element;
+        }
+        out.extend_from_slice(&element.to_be_bytes());
+    }
+    return Ok(());
+}
+
+/// Splits big-endian u16 elements into the plane of the high bytes followed by the plane
+/// of the low bytes, taking the differences of the elements first if `delta` is set.
+fn to_planes(data: &[u8], delta: bool) -> Vec<u8> {
+    let num_elements = data.len() / 2;
+    let mut planes = vec![0u8; data.len()];
+    let mut previous = 0u16;
+    for (index, pair) in data.chunks_exact(2).enumerate() {
+        let mut element = u16::from_be_bytes([pair[0], pair[1]]);
+        if delta {
+            (element, previous) = (element.wrapping_sub(previous), element);
+        }
+        let [high, low] = element.to_be_bytes();
+        planes[index] = high;
+        planes[num_elements + index] = low;
+    }
+    return planes;
+}
+
+/// Length of the run of the same byte starting at `index`, up to `MAX_RUN_LENGTH`
+fn run_length(data: &[u8], index: usize) -> usize {
+    let byte = data[index];
+    return data[index..]
+        .iter()
+        .take(MAX_RUN_LENGTH)
+        .take_while(|value| **value == byte)
+        .count();
+}
+
+/// PackBits: a control byte n of 0..=127 is followed by n + 1 literal bytes, and 129..=255
+/// is followed by a byte that repeats 257 - n times.
+fn pack_bits(data: &[u8]) -> Vec<u8> {
+    let mut out = Vec::with_capacity(data.len() / 2 + 2);
+    let mut index = 0;
+    while index < data.len() {
+        let run = run_length(data, index);
+        if run >= 3 {
+            out.push((257 - run) as u8);
+            out.push(data[index]);
+            index += run;
+            continue;
+        }
+        // literals up to the next run that is worth a control byte
+        let start = index;
+        while index < data.len() && index - start < MAX_RUN_LENGTH && run_length(data, index) < 3 {
+            index += 1;
+        }
+        out.push((index - start - 1) as u8);
+        out.extend_from_slice(&data[start..index]);
+    }
+    return out;
+}
+
+fn unpack_bits(packed: &[u8], limit: usize, out: &mut Vec<u8>) -> Result<()> {
+    let start = out.len();
+    let mut index = 0;
+    while index < packed.len() {
+        let control = packed[index] as usize;
+        index += 1;
+        match control {
+            0..=127 => {
+                let Some(literal) = packed.get(index..index + control + 1) else {
+                    return error("Packed literal is truncated");
+                };
+                out.extend_from_slice(literal);
+                index += control + 1;
+            }
+            128 => {}
+            _ => {
+                let Some(byte) = packed.get(index) else {
+                    return error("Packed run is truncated");
+                };
+                out.extend(iter::repeat_n(*byte, 257 - control));
+                index += 1;
+            }
+        }
+        if out.len() - start > limit {
+            return error("Packed value is longer than told");
+        }
+    }
+    return Ok(());
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn roundtrip(data: &[u8]) -> (Codec, usize) {
+        let (codec, packed) = pack(data).unwrap();
+        let mut out = vec![0xaa];
+        unpack(codec, &packed, data.len(), &mut out).unwrap();
+        assert_eq!(&out[1..], data);
+        return (codec, packed.len());
+    }
+
+    #[test]
+    fn test_pack_bits() {
+        assert_eq!(pack_bits(&[1, 1, 1, 1, 2, 3, 3]), vec![0xfd, 1, 2, 2, 3, 3]);
+        assert_eq!(roundtrip(&[5; 16]), (Codec::PackBits, 2));
+        assert_eq!(roundtrip(&[0; 300]).1, 6);
+        let noise: Vec<u8> = (0..200).map(|i| (i * 37 % 251) as u8).collect();
+        assert!(roundtrip(&noise).1 <= noise.len() + 2);
+    }
+
+    #[test]
+    fn test_pack_u16_vectors() {
+        // same value for every voice
+        let same: Vec<u8> = [0x0123u16; 8]
+            .iter()
+            .flat_map(|v| v.to_be_bytes())
+            .collect();
+        assert_eq!(roundtrip(&same), (Codec::Planes16, 4));
+        // voice IDs counting up
+        let ramp: Vec<u8> = (0x100u16..0x110).flat_map(|v| v.to_be_bytes()).collect();
+        assert_eq!(roundtrip(&ramp), (Codec::Delta16, 6));
+    }
+
+    #[test]
+    fn test_unpack_errors() {
+        let mut out = Vec::new();
+        assert!(unpack(Codec::PackBits, &[0xfd, 1], 4, &mut out).is_ok());
+        assert!(unpack(Codec::PackBits, &[0xfd, 1], 3, &mut out).is_err());
+        assert!(unpack(Codec::PackBits, &[0xfd, 1], 5, &mut out).is_err());
+        assert!(unpack(Codec::PackBits, &[0x03, 1, 2], 4, &mut out).is_err());
+        assert!(unpack(Codec::PackBits, &[0xfd], 3, &mut out).is_err());
+        assert!(unpack(Codec::Planes16, &[0xfd, 1], 3, &mut out).is_err());
+    }
+}
@@ -1,14 +1,24 @@
-use std::collections::BTreeMap;
+use std::collections::{BTreeMap, HashMap};
 use std::fs;
-use std::path::Path;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
 
 use lazy_static::lazy_static;
 use serde;
 use serde::Deserialize;
+use tokio::task::JoinHandle;
 use walkdir::WalkDir;
 
 use super::config::Value;
 
+mod cache;
+mod registry;
+
+use registry::{OverlayLoader, SchemaRegistry};
+
+/// Module definitions by module type
+pub type Schema = BTreeMap<u16, Arc<ModuleDef>>;
+
 #[cfg(not(test))]
 use log::error;
 
@@ -96,57 +106,189 @@ struct ModuleDesc {
     pub properties: Vec<Option<PropertyDef>>,
 }
 
-/// Module definition used internally to handle config data
-#[derive(Debug, Clone)]
+/// Module definition compiled in from the schema directory by the build script
+#[derive(Debug)]
+pub struct StaticModuleDef {
+    pub module_type: u16,
+    pub module_type_name: &'static str,
+    /// Sorted by ID; includes the common properties the YAML file lists, which `ModuleDef`
+    /// replaces with `COMMON_MODULE_DEF`'s
+    pub properties: &'static [StaticPropertyDef],
+    pub name_table: NameTable,
+}
+
+#[derive(Debug)]
+pub struct StaticPropertyDef {
+    pub id: u8,
+    pub name: &'static str,
+    pub value_type: ValueType,
+    pub enum_names: Option<&'static [&'static str]>,
+    pub read_only: bool,
+}
+
+/// Perfect hash table of property names. The build script picks a seed that gives every
+/// name of the module its own slot, so a lookup is one hash and one comparison.
+#[derive(Debug)]
+pub struct NameTable {
+    pub seed: u32,
+    /// Indexes into the properties; 0xff for empty slots
+    pub slots: &'static [u8],
+}
+
+impl StaticModuleDef {
+    pub fn find_property(&self, name: &str) -> Option<&'static StaticPropertyDef> {
+        let slots = self.name_table.slots;
+        let slot = name_hash(name, self.name_table.seed) as usize & (slots.len() - 1);
+        let property = self.properties.get(slots[slot] as usize)?;
+        match property.name == name {
+            true => Some(property),
+            false => None,
+        }
+    }
+}
+
+/// FNV-1a seeded by the initial state, with a finalizer. The build script has the same function.
+fn name_hash(name: &str, seed: u32) -> u32 {
+    let mut hash = 0x811c9dc5 ^ seed;
+    for byte in name.bytes() {
+        hash ^= byte as u32;
+        hash = hash.wrapping_mul(0x01000193);
+    }
+    // FNV leaves the low bits depending on the low bits only; fold the high bits in
+    hash ^= hash >> 16;
+    hash = hash.wrapping_mul(0x7feb352d);
+    hash ^= hash >> 15;
+    return hash;
+}
+
+mod builtin {
+    use super::{NameTable, StaticModuleDef, StaticPropertyDef, ValueType};
+
+    include!(concat!(env!("OUT_DIR"), "/schema_tables.rs"));
+}
+
+pub use builtin::BUILTIN_MODULES;
+
+/// Module type of the definition that only knows the common properties
+const COMMON_MODULE_TYPE: u16 = 0xffff;
+
+/// Marks an undefined property ID in the ID index
+const NO_PROPERTY: u8 = 0xff;
+
+/// Module definition used internally to handle config data.
+///
+/// Definitions are immutable once built and shared by `Arc`, so handing one to a session
+/// or a background job does not copy the property definitions.
+#[derive(Debug)]
 pub struct ModuleDef {
     pub module_type: u16,
-    pub module_type_name: String,
-    pub properties: BTreeMap<u8, PropertyDef>,
+    /// Interned; module registry entries of the type share this string
+    pub module_type_name: Arc<str>,
+    /// Ordered by ID
+    pub properties: Vec<PropertyDef>,
+    /// Position in `properties` by property ID
+    id_index: [u8; 256],
+    name_index: NameIndex,
+}
+
+/// Property name lookup. Builtin definitions use the perfect hash table generated by the
+/// build script; definitions loaded at runtime get a hash map.
+#[derive(Debug)]
+enum NameIndex {
+    Builtin(&'static StaticModuleDef),
+    Map(HashMap<String, u8>),
 }
 
 impl ModuleDef {
-    fn from_desc(module_desc: ModuleDesc) -> Self {
-        let mut def = Self {
-            module_type: module_desc.module_type,
-            module_type_name: module_desc.module_type_name,
-            properties: BTreeMap::new(),
+    fn new(
+        module_type: u16,
+        module_type_name: Arc<str>,
+        mut properties: Vec<PropertyDef>,
+        builtin: Option<&'static StaticModuleDef>,
+    ) -> Self {
+        if module_type != COMMON_MODULE_TYPE {
+            // the common properties take precedence
+            properties
+                .retain(|property| COMMON_MODULE_DEF.get_property_by_id(property.id).is_none());
+            properties.extend(COMMON_MODULE_DEF.properties.iter().cloned());
+        }
+        properties.sort_by_key(|property| property.id);
+        properties.dedup_by_key(|property| property.id);
+        let mut id_index = [NO_PROPERTY; 256];
+        for (position, property) in properties.iter().enumerate() {
+            id_index[property.id as usize] = position as u8;
+        }
+        let name_index = match builtin {
+            Some(static_def) => NameIndex::Builtin(static_def),
+            None => NameIndex::Map(
+                properties
+                    .iter()
+                    .map(|property| (property.name.clone(), property.id))
+                    .collect(),
+            ),
         };
-
-        for mut property_or_none in module_desc.properties {
-            if let Some(property) = property_or_none.take() {
-                def.properties.insert(property.id, property);
-            }
+        Self {
+            module_type,
+            module_type_name,
+            properties,
+            id_index,
+            name_index,
         }
+    }
 
-        for (id, prop_def) in &COMMON_MODULE_DEF.properties {
-            def.properties.insert(*id, prop_def.clone());
-        }
+    fn from_static(static_def: &'static StaticModuleDef) -> Self {
+        let properties: Vec<PropertyDef> = static_def
+            .properties
+            .iter()
+            .map(|property| PropertyDef {
+                id: property.id,
+                name: property.name.to_string(),
+                value_type: property.value_type.clone(),
+                enum_names: property
+                    .enum_names
+                    .map(|names| names.iter().map(|name| name.to_string()).collect()),
+                read_only: property.read_only.then_some(true),
+            })
+            .collect();
+        Self::new(
+            static_def.module_type,
+            static_def.module_type_name.into(),
+            properties,
+            Some(static_def),
+        )
+    }
 
-        def
+    fn from_desc(module_desc: ModuleDesc) -> Self {
+        let properties: Vec<PropertyDef> = module_desc.properties.into_iter().flatten().collect();
+        Self::new(
+            module_desc.module_type,
+            module_desc.module_type_name.into(),
+            properties,
+            None,
+        )
     }
 
-    pub fn get_property_def_by_name(&self, name: &String) -> Option<&PropertyDef> {
-        match self.properties.iter().find(|entry| entry.1.name == *name) {
-            Some(entry) => Some(entry.1),
-            None => None,
-        }
+    pub fn get_property_def_by_name(&self, name: &str) -> Option<&PropertyDef> {
+        let id = match &self.name_index {
+            NameIndex::Builtin(static_def) => match static_def.find_property(name) {
+                Some(property) => property.id,
+                None => COMMON_MODULE_DEF.get_property_def_by_name(name)?.id,
+            },
+            NameIndex::Map(ids) => *ids.get(name)?,
+        };
+        self.get_property_by_id(id)
     }
 
     pub fn get_property_by_id(&self, id: u8) -> Option<&PropertyDef> {
-        self.properties.get(&id)
+        self.properties.get(self.id_index[id as usize] as usize)
     }
 }
 
 lazy_static! {
-    pub static ref COMMON_MODULE_DEF: ModuleDef = {
-        let mut def = ModuleDef {
-            module_type: 0xffff,
-            module_type_name: "unknown".to_string(),
-            properties: BTreeMap::new(),
-        };
-
-        def.properties.insert(
-            0,
+    pub static ref COMMON_MODULE_DEF: Arc<ModuleDef> = Arc::new(ModuleDef::new(
+        COMMON_MODULE_TYPE,
+        "unknown".into(),
+        vec![
             PropertyDef {
                 id: 0,
                 name: String::from("module_uid"),
@@ -154,9 +296,6 @@ lazy_static! {
                 enum_names: None,
                 read_only: Some(true),
             },
-        );
-        def.properties.insert(
-            1,
             PropertyDef {
                 id: 1,
                 name: String::from("module_type"),
@@ -164,9 +303,6 @@ lazy_static! {
                 enum_names: None,
                 read_only: Some(true),
             },
-        );
-        def.properties.insert(
-            2,
             PropertyDef {
                 id: 2,
                 name: String::from("name"),
@@ -174,15 +310,68 @@ lazy_static! {
                 enum_names: None,
                 read_only: None,
             },
-        );
+        ],
+        None,
+    ));
+    static ref SCHEMA_REGISTRY: SchemaRegistry = SchemaRegistry::new(builtin_schema());
+}
 
-        def
-    };
-    pub static ref MODULES_SCHEMA: BTreeMap<u16, ModuleDef> = load_schema("schema");
+/// Returns the schema in effect. Holds only the builtin definitions until overlays are
+/// loaded by `start_overlay()`.
+pub fn modules_schema() -> Arc<Schema> {
+    SCHEMA_REGISTRY.load()
+}
+
+/// Loads the schema files in the overlay directory and keeps watching it for changes.
+/// Parsed files are cached in `cache_file` so that a restart does not parse them again.
+pub fn start_overlay(dir: PathBuf, cache_file: Option<PathBuf>) -> JoinHandle<()> {
+    let mut loader = OverlayLoader::new(dir, cache_file);
+    if let Some(schema) = loader.reload_if_changed() {
+        SCHEMA_REGISTRY.publish(schema);
+    }
+    return registry::watch(&SCHEMA_REGISTRY, loader);
+}
+
+/// Module definitions compiled into the binary
+pub fn builtin_schema() -> Schema {
+    let mut schema: Schema = BUILTIN_MODULES
+        .iter()
+        .map(|static_def| {
+            let def = ModuleDef::from_static(static_def);
+            (static_def.module_type, Arc::new(def))
+        })
+        .collect();
+    schema.insert(COMMON_MODULE_DEF.module_type, COMMON_MODULE_DEF.clone());
+    return schema;
+}
+
+/// Adds schemas loaded at runtime. A definition replaces the builtin one of the same type.
+pub fn apply_overlay(schema: &mut Schema, overlay: Schema) {
+    for (module_type, def) in overlay {
+        if module_type == COMMON_MODULE_DEF.module_type {
+            continue;
+        }
+        if schema.contains_key(&module_type) {
+            log::info!("Schema overlay replaces module type {}", module_type);
+        }
+        schema.insert(module_type, def);
+    }
+}
+
+/// Returns the type name shared with the module definition of the same name, or a new one
+/// if no module definition matches.
+pub fn intern_type_name(name: &str) -> Arc<str> {
+    match modules_schema()
+        .values()
+        .find(|def| &*def.module_type_name == name)
+    {
+        Some(def) => def.module_type_name.clone(),
+        None => name.into(),
+    }
 }
 
 /// schema loader
-pub fn load_schema<P: AsRef<Path>>(directory: P) -> BTreeMap<u16, ModuleDef> {
+pub fn load_schema<P: AsRef<Path>>(directory: P) -> Schema {
     let mut schema = BTreeMap::new();
 
     for entry in WalkDir::new(directory) {
@@ -198,7 +387,8 @@ pub fn load_schema<P: AsRef<Path>>(directory: P) -> BTreeMap<u16, ModuleDef> {
                     match fs::read_to_string(path) {
                         Ok(content) => match serde_yaml::from_str::<ModuleDesc>(&content) {
                             Ok(desc) => {
-                                schema.insert(desc.module_type, ModuleDef::from_desc(desc));
+                                schema
+                                    .insert(desc.module_type, Arc::new(ModuleDef::from_desc(desc)));
                             }
                             Err(e) => error!("YAML parse error in {:?}: {}", path, e),
                         },
@@ -221,6 +411,70 @@ use std::eprintln as error;
 mod tests {
     use super::*;
 
+    #[test]
+    fn test_builtin_schema_matches_yaml() {
+        let builtin = builtin_schema();
+        let loaded = load_schema("schema");
+        assert_eq!(builtin.len(), loaded.len());
+        for (module_type, loaded_def) in &loaded {
+            let builtin_def = &builtin[module_type];
+            assert_eq!(builtin_def.module_type_name, loaded_def.module_type_name);
+            assert_eq!(builtin_def.properties.len(), loaded_def.properties.len());
+            for loaded_prop in &loaded_def.properties {
+                let id = loaded_prop.id;
+                let builtin_prop = builtin_def.get_property_by_id(id).unwrap();
+                assert_eq!(builtin_prop.name, loaded_prop.name);
+                assert_eq!(builtin_prop.value_type, loaded_prop.value_type);
+                assert_eq!(builtin_prop.enum_names, loaded_prop.enum_names);
+                assert_eq!(
+                    builtin_prop.read_only.unwrap_or(false),
+                    loaded_prop.read_only.unwrap_or(false)
+                );
+                // the perfect hash finds every name
+                let found = builtin_def.get_property_def_by_name(&loaded_prop.name);
+                assert_eq!(found.map(|prop| prop.id), Some(id));
+            }
+            assert!(
+                builtin_def
+                    .get_property_def_by_name(&"no_such_property".to_string())
+                    .is_none()
+            );
+        }
+    }
+
+    #[test]
+    fn test_property_indexes() {
+        let schema = load_schema("test-schema");
+        let def = &schema[&0x2345];
+        assert_eq!(def.get_property_by_id(7).unwrap().name, "retrigger");
+        assert!(def.get_property_by_id(11).is_none());
+        assert!(def.get_property_by_id(0xff).is_none());
+        let name = def.get_property_def_by_name(&"name".to_string()).unwrap();
+        assert_eq!(name.id, 2);
+        assert!(
+            def.get_property_def_by_name(&"nothing".to_string())
+                .is_none()
+        );
+        // properties are ordered by ID
+        assert!(
+            def.properties
+                .windows(2)
+                .all(|pair| pair[0].id < pair[1].id)
+        );
+    }
+
+    #[test]
+    fn test_schema_overlay() {
+        let mut schema = builtin_schema();
+        let num_builtin = schema.len();
+        apply_overlay(&mut schema, load_schema("test-schema"));
+        assert_eq!(schema.len(), num_builtin + 1);
+        let def = &schema[&0x2345];
+        assert_eq!(&*def.module_type_name, "test-module");
+        let prop = def.get_property_def_by_name(&"retrigger".to_string());
+        assert_eq!(prop.map(|prop| prop.id), Some(7));
+    }
+
     #[test]
     fn test_schema_loading() {
         let schema = load_schema("schema");
@@ -229,38 +483,38 @@ mod tests {
             panic!("the entry must be found");
         };
         assert_eq!(entry.module_type, 1);
-        assert_eq!(entry.module_type_name, "cv-depot".to_string());
+        assert_eq!(&*entry.module_type_name, "cv-depot");
         assert_eq!(entry.properties.len(), 14);
 
-        let Some(uid) = entry.properties.get(&0) else {
+        let Some(uid) = entry.get_property_by_id(0) else {
             panic!("UID entry not found");
         };
         assert_eq!(uid.id, 0);
         assert_eq!(uid.name, "module_uid");
         assert_eq!(uid.value_type, ValueType::U32);
 
-        let Some(module_type) = entry.properties.get(&1) else {
+        let Some(module_type) = entry.get_property_by_id(1) else {
             panic!("module_type entry not found");
         };
         assert_eq!(module_type.id, 1);
         assert_eq!(module_type.name, "module_type");
         assert_eq!(module_type.value_type, ValueType::U16);
 
-        let Some(module_type) = entry.properties.get(&1) else {
+        let Some(module_type) = entry.get_property_by_id(1) else {
             panic!("module_type entry not found");
         };
         assert_eq!(module_type.id, 1);
         assert_eq!(module_type.name, "module_type");
         assert_eq!(module_type.value_type, ValueType::U16);
 
-        let Some(module_name) = entry.properties.get(&2) else {
+        let Some(module_name) = entry.get_property_by_id(2) else {
             panic!("name entry not found");
         };
         assert_eq!(module_name.id, 2);
         assert_eq!(module_name.name, "name");
         assert_eq!(module_name.value_type, ValueType::Text);
 
-        let Some(num_voices) = entry.properties.get(&3) else {
+        let Some(num_voices) = entry.get_property_by_id(3) else {
             panic!("num_voices entry not found");
         };
         assert_eq!(num_voices.id, 3);
@@ -268,7 +522,7 @@ mod tests {
         assert_eq!(num_voices.value_type, ValueType::U8);
         assert!(num_voices.enum_names.is_none());
 
-        let Some(key_assign_mode) = entry.properties.get(&4) else {
+        let Some(key_assign_mode) = entry.get_property_by_id(4) else {
             panic!("key_assign_mode entry not found");
         };
         assert_eq!(key_assign_mode.id, 4);
@@ -0,0 +1,355 @@
+use std::{
+    collections::HashMap,
+    fs::{self, File},
+    io::{self, Write},
+    path::{Path, PathBuf},
+    time::UNIX_EPOCH,
+};
+
+use super::{ModuleDesc, PropertyDef, ValueType};
+
+const MAGIC: &[u8; 4] = b"A3SC";
+const VERSION: u8 = 1;
+
+/// Parsed schema files, kept across restarts.
+///
+/// An entry is reused while the file keeps its modification time and length. When either
+/// of them changes, the file is read and hashed, and the YAML is parsed only if the hash
+/// differs from the cached one, too.
+///
+/// The cache file is a binary dump of the entries:
+///
+/// ```text
+/// "A3SC" version(u8) num_entries(u32)
+/// entry: path(str) modified(u64) length(u64) hash(u64) module description
+/// ```
+/// Integers are big-endian and strings are a u16 length followed by UTF-8 bytes.
+/// A cache file that cannot be decoded is ignored as a whole.
+pub struct SchemaCache {
+    entries: HashMap<PathBuf, CacheEntry>,
+    /// Number of files parsed since the cache was made
+    pub num_parsed: usize,
+}
+
+struct CacheEntry {
+    modified: u64,
+    length: u64,
+    hash: u64,
+    desc: ModuleDesc,
+}
+
+impl SchemaCache {
+    pub fn new() -> Self {
+        Self {
+            entries: HashMap::new(),
+            num_parsed: 0,
+        }
+    }
+
+    /// Reads the cache file. Starts over with an empty cache if the file is missing or
+    /// broken.
+    pub fn read(path: &Path) -> Self {
+        let mut cache = Self::new();
+        match fs::read(path) {
+            Ok(data) => match decode(&data) {
+                Some(entries) => cache.entries = entries,
+                None => log::warn!("Ignoring a broken schema cache {:?}", path),
+            },
+            Err(e) if e.kind() == io::ErrorKind::NotFound => {}
+            Err(e) => log::warn!("Failed to read schema cache {:?}: {}", path, e),
+        }
+        return cache;
+    }
+
+    /// Writes the cache file. The file is replaced by rename so that a crash never leaves
+    /// a partial cache behind.
+    pub fn write(&self, path: &Path) -> io::Result<()> {
+        if let Some(dir) = path.parent() {
+            fs::create_dir_all(dir)?;
+        }
+        let temp_path = path.with_extension("tmp");
+        let mut temp = File::create(&temp_path)?;
+        temp.write_all(&encode(&self.entries))?;
+        temp.sync_all()?;
+        fs::rename(&temp_path, path)?;
+        return Ok(());
+    }
+
+    /// Returns the module description of the schema file, parsing it only if the cached
+    /// one is stale.
+    pub fn get(&mut self, path: &Path) -> Option<ModuleDesc> {
+        let metadata = match fs::metadata(path) {
+            Ok(metadata) => metadata,
+            Err(e) => {
+                log::error!("File read error in {:?}: {}", path, e);
+                return None;
+            }
+        };
+        let modified = metadata
+            .modified()
+            .ok()
+            .and_then(|time| time.duration_since(UNIX_EPOCH).ok())
+            .map_or(0, |duration| duration.as_nanos() as u64);
+        let length = metadata.len();
+        if let Some(entry) = self.entries.get(path) {
+            if entry.modified == modified && entry.length == length {
+                return Some(entry.desc.clone());
+            }
+        }
+
+        let content = match fs::read_to_string(path) {
+            Ok(content) => content,
+            Err(e) => {
+                log::error!("File read error in {:?}: {}", path, e);
+                return None;
+            }
+        };
+        let hash = content_hash(content.as_bytes());
+        if let Some(entry) = self.entries.get_mut(path) {
+            if entry.hash == hash {
+                entry.modified = modified;
+                entry.length = length;
+                return Some(entry.desc.clone());
+            }
+        }
+
+        self.num_parsed += 1;
+        let desc = match serde_yaml::from_str::<ModuleDesc>(&content) {
+            Ok(desc) => desc,
+            Err(e) => {
+                log::error!("YAML parse error in {:?}: {}", path, e);
+                self.entries.remove(path);
+                return None;
+            }
+        };
+        self.entries.insert(
+            path.to_path_buf(),
+            CacheEntry {
+                modified,
+                length,
+                hash,
+                desc: desc.clone(),
+            },
+        );
+        return Some(desc);
+    }
+
+    /// Drops the entries of the files that are gone.
+    pub fn retain(&mut self, paths: &[PathBuf]) {
+        self.entries.retain(|path, _| paths.contains(path));
+    }
+}
+
+/// FNV-1a, 64 bits. Stable across builds, unlike the std hasher.
+fn content_hash(data: &[u8]) -> u64 {
+    let mut hash: u64 = 0xcbf29ce484222325;
+    for byte in data {
+        hash ^= *byte as u64;
+        hash = hash.wrapping_mul(0x100000001b3);
+    }
+    return hash;
+}
+
+// Encoder ////////////////////////////////////////////////////////////////
+
+fn encode(entries: &HashMap<PathBuf, CacheEntry>) -> Vec<u8> {
+    let mut out = Vec::new();
+    out.extend_from_slice(MAGIC);
+    out.push(VERSION);
+    out.extend_from_slice(&(entries.len() as u32).to_be_bytes());
+    for (path, entry) in entries {
+        put_str(&mut out, &path.to_string_lossy());
+        out.extend_from_slice(&entry.modified.to_be_bytes());
+        out.extend_from_slice(&entry.length.to_be_bytes());
+        out.extend_from_slice(&entry.hash.to_be_bytes());
+        encode_desc(&mut out, &entry.desc);
+    }
+    return out;
+}
+
+fn encode_desc(out: &mut Vec<u8>, desc: &ModuleDesc) {
+    out.extend_from_slice(&desc.module_type.to_be_bytes());
+    put_str(out, &desc.module_type_name);
+    let properties: Vec<&PropertyDef> = desc.properties.iter().flatten().collect();
+    out.push(properties.len() as u8);
+    for property in properties {
+        out.push(property.id);
+        put_str(out, &property.name);
+        out.push(value_type_code(&property.value_type));
+        out.push(match property.read_only {
+            None => 0,
+            Some(false) => 1,
+            Some(true) => 2,
+        });
+        match &property.enum_names {
+            Some(names) => {
+                out.push(names.len() as u8 + 1);
+                for name in names {
+                    put_str(out, name);
+                }
+            }
+            None => out.push(0),
+        }
+    }
+}
+
+fn put_str(out: &mut Vec<u8>, text: &str) {
+    out.extend_from_slice(&(text.len() as u16).to_be_bytes());
+    out.extend_from_slice(text.as_bytes());
+}
+
+fn value_type_code(value_type: &ValueType) -> u8 {
+    match value_type {
+        ValueType::U8 => 0,
+        ValueType::U16 => 1,
+        ValueType::U32 => 2,
+        ValueType::Text => 3,
+        ValueType::Boolean => 4,
+        ValueType::VectorU8 => 5,
+        ValueType::VectorU16 => 6,
+    }
+}
+
+// Decoder ////////////////////////////////////////////////////////////////
+
+struct Reader<'a> {
+    data: &'a [u8],
+    position: usize,
+}
+
+impl<'a> Reader<'a> {
+    fn bytes(&mut self, length: usize) -> Option<&'a [u8]> {
+        let bytes = self.data.get(self.position..self.position + length)?;
+        self.position += length;
+        return Some(bytes);
+    }
+
+    fn u8(&mut self) -> Option<u8> {
+        Some(self.bytes(1)?[0])
+    }
+
+    fn u16(&mut self) -> Option<u16> {
+        Some(u16::from_be_bytes(self.bytes(2)?.try_into().ok()?))
+    }
+
+    fn u32(&mut self) -> Option<u32> {
+        Some(u32::from_be_bytes(self.bytes(4)?.try_into().ok()?))
+    }
+
+    fn u64(&mut self) -> Option<u64> {
+        Some(u64::from_be_bytes(self.bytes(8)?.try_into().ok()?))
+    }
+
+    fn str(&mut self) -> Option<String> {
+        let length = self.u16()? as usize;
+        String::from_utf8(self.bytes(length)?.to_vec()).ok()
+    }
+}
+
+fn decode(data: &[u8]) -> Option<HashMap<PathBuf, CacheEntry>> {
+    let mut reader = Reader { data, position: 0 };
+    if reader.bytes(MAGIC.len())? != MAGIC || reader.u8()? != VERSION {
+        return None;
+    }
+    let num_entries = reader.u32()?;
+    let mut entries = HashMap::new();
+    for _ in 0..num_entries {
+        let path = PathBuf::from(reader.str()?);
+        let entry = CacheEntry {
+            modified: reader.u64()?,
+            length: reader.u64()?,
+            hash: reader.u64()?,
+            desc: decode_desc(&mut reader)?,
+        };
+        entries.insert(path, entry);
+    }
+    if reader.position != data.len() {
+        return None;
+    }
+    return Some(entries);
+}
+
+fn decode_desc(reader: &mut Reader) -> Option<ModuleDesc> {
+    let module_type = reader.u16()?;
+    let module_type_name = reader.str()?;
+    let num_properties = reader.u8()?;
+    let mut properties = Vec::with_capacity(num_properties as usize);
+    for _ in 0..num_properties {
+        let id = reader.u8()?;
+        let name = reader.str()?;
+        let value_type = match reader.u8()? {
+            0 => ValueType::U8,
+            1 => ValueType::U16,
+            2 => ValueType::U32,
+            3 => ValueType::Text,
+            4 => ValueType::Boolean,
+            5 => ValueType::VectorU8,
+            6 => ValueType::VectorU16,
+            _ => return None,
+        };
+        let read_only = match reader.u8()? {
+            0 => None,
+            1 => Some(false),
+            2 => Some(true),
+            _ => return None,
+        };
+        let enum_names = match reader.u8()? {
+            0 => None,
+            num_names => {
+                let mut names = Vec::with_capacity(num_names as usize - 1);
+                for _ in 1..num_names {
+                    names.push(reader.str()?);
+                }
+                Some(names)
+            }
+        };
+        properties.push(Some(PropertyDef {
+            id,
+            name,
+            value_type,
+            enum_names,
+            read_only,
+        }));
+    }
+    return Some(ModuleDesc {
+        module_type,
+        module_type_name,
+        properties,
+    });
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_encode_decode() {
+        let mut cache = SchemaCache::new();
+        let path = PathBuf::from("test-schema/test-module.yaml");
+        let desc = cache.get(&path).unwrap();
+        assert_eq!(cache.num_parsed, 1);
+
+        let decoded = decode(&encode(&cache.entries)).unwrap();
+        let entry = &decoded[&path];
+        assert_eq!(entry.desc.module_type, desc.module_type);
+        assert_eq!(entry.desc.module_type_name, desc.module_type_name);
+        let properties: Vec<&PropertyDef> = entry.desc.properties.iter().flatten().collect();
+        let expected: Vec<&PropertyDef> = desc.properties.iter().flatten().collect();
+        assert_eq!(properties.len(), expected.len());
+        for (property, expected) in properties.iter().zip(expected) {
+            assert_eq!(property.id, expected.id);
+            assert_eq!(property.name, expected.name);
+            assert_eq!(property.value_type, expected.value_type);
+            assert_eq!(property.enum_names, expected.enum_names);
+            assert_eq!(property.read_only, expected.read_only);
+        }
+
+        // unchanged file is served from the cache
+        cache.get(&path).unwrap();
+        assert_eq!(cache.num_parsed, 1);
+
+        let mut data = encode(&cache.entries);
+        data.pop();
+        assert!(decode(&data).is_none());
+    }
+}
@@ -0,0 +1,203 @@
+use std::{
+    collections::BTreeMap,
+    fs,
+    path::PathBuf,
+    sync::{Arc, RwLock},
+    time::{Duration, SystemTime},
+};
+
+use tokio::task::JoinHandle;
+use walkdir::WalkDir;
+
+use super::{ModuleDef, Schema, apply_overlay, builtin_schema, cache::SchemaCache};
+
+/// How often the overlay directory is checked for changes
+const POLL_INTERVAL: Duration = Duration::from_secs(2);
+
+/// Module schema in effect.
+///
+/// Readers take the current schema as an `Arc` and keep using it for as long as they like;
+/// a reload publishes a new one without disturbing them.
+pub struct SchemaRegistry {
+    published: RwLock<Arc<Schema>>,
+}
+
+impl SchemaRegistry {
+    pub fn new(schema: Schema) -> Self {
+        Self {
+            published: RwLock::new(Arc::new(schema)),
+        }
+    }
+
+    pub fn load(&self) -> Arc<Schema> {
+        self.published.read().unwrap().clone()
+    }
+
+    pub fn publish(&self, schema: Schema) {
+        *self.published.write().unwrap() = Arc::new(schema);
+    }
+}
+
+/// Modification time and length of every schema file in the overlay directory
+type DirectoryState = BTreeMap<PathBuf, (Option<SystemTime>, u64)>;
+
+/// Builds the schema from the builtin definitions and the overlay directory.
+pub struct OverlayLoader {
+    dir: PathBuf,
+    cache: SchemaCache,
+    cache_file: Option<PathBuf>,
+    last_state: Option<DirectoryState>,
+}
+
+impl OverlayLoader {
+    pub fn new(dir: PathBuf, cache_file: Option<PathBuf>) -> Self {
+        let cache = match &cache_file {
+            Some(path) => SchemaCache::read(path),
+            None => SchemaCache::new(),
+        };
+        Self {
+            dir,
+            cache,
+            cache_file,
+            last_state: None,
+        }
+    }
+
+    /// Returns a new schema if the overlay directory has changed since the last call.
+    pub fn reload_if_changed(&mut self) -> Option<Schema> {
+        let state = self.scan();
+        if self.last_state.as_ref() == Some(&state) {
+            return None;
+        }
+        let paths: Vec<PathBuf> = state.keys().cloned().collect();
+        self.last_state = Some(state);
+
+        let mut overlay = BTreeMap::new();
+        for path in &paths {
+            if let Some(desc) = self.cache.get(path) {
+                overlay.insert(desc.module_type, Arc::new(ModuleDef::from_desc(desc)));
+            }
+        }
+        self.cache.retain(&paths);
+        if let Some(cache_file) = &self.cache_file {
+            if let Err(e) = self.cache.write(cache_file) {
+                log::warn!("Failed to write schema cache {:?}: {}", cache_file, e);
+            }
+        }
+
+        let mut schema = builtin_schema();
+        apply_overlay(&mut schema, overlay);
+        return Some(schema);
+    }
+
+    fn scan(&self) -> DirectoryState {
+        let mut state = DirectoryState::new();
+        for entry in WalkDir::new(&self.dir).into_iter().flatten() {
+            let path = entry.path();
+            let is_schema = path
+                .extension()
+                .is_some_and(|ext| ext == "yaml" || ext == "yml");
+            if !entry.file_type().is_file() || !is_schema {
+                continue;
+            }
+            if let Ok(metadata) = fs::metadata(path) {
+                state.insert(
+                    path.to_path_buf(),
+                    (metadata.modified().ok(), metadata.len()),
+                );
+            }
+        }
+        return state;
+    }
+}
+
+/// Keeps the registry in sync with the overlay directory. Changed files are parsed off the
+/// async runtime, and the new schema replaces the current one at once.
+pub fn watch(registry: &'static SchemaRegistry, mut loader: OverlayLoader) -> JoinHandle<()> {
+    tokio::spawn(async move {
+        let mut interval = tokio::time::interval(POLL_INTERVAL);
+        interval.tick().await;
+        loop {
+            interval.tick().await;
+            let (returned, schema) = tokio::task::spawn_blocking(move || {
+                let schema = loader.reload_if_changed();
+                (loader, schema)
+            })
+            .await
+            .unwrap();
+            loader = returned;
+            if let Some(schema) = schema {
+                log::info!("Schema reloaded: {} module types", schema.len());
+                registry.publish(schema);
+            }
+        }
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn temp_dir(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("a3-schema-{}-{}", name, std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(dir.join("overlay")).unwrap();
+        dir
+    }
+
+    #[test]
+    fn test_reload_and_cache() {
+        let dir = temp_dir("reload");
+        let overlay_dir = dir.join("overlay");
+        let cache_file = dir.join("schema.cache");
+        fs::copy(
+            "test-schema/test-module.yaml",
+            overlay_dir.join("test-module.yaml"),
+        )
+        .unwrap();
+
+        let mut loader = OverlayLoader::new(overlay_dir.clone(), Some(cache_file.clone()));
+        let schema = loader.reload_if_changed().unwrap();
+        assert_eq!(&*schema[&0x2345].module_type_name, "test-module");
+        assert_eq!(loader.cache.num_parsed, 1);
+        assert!(loader.reload_if_changed().is_none());
+
+        // a restart is served from the cache
+        let mut loader = OverlayLoader::new(overlay_dir.clone(), Some(cache_file.clone()));
+        let schema = loader.reload_if_changed().unwrap();
+        assert!(schema.contains_key(&0x2345));
+        assert_eq!(loader.cache.num_parsed, 0);
+
+        // a new module type and a removed one
+        fs::write(
+            overlay_dir.join("new.yaml"),
+            "module_type: 0x77\nmodule_type_name: new\nproperties:\n  - id: 3\n    name: level\n    value_type: u8\n",
+        )
+        .unwrap();
+        fs::remove_file(overlay_dir.join("test-module.yaml")).unwrap();
+        let schema = loader.reload_if_changed().unwrap();
+        assert!(!schema.contains_key(&0x2345));
+        let def = &schema[&0x77];
+        assert_eq!(
+            def.get_property_def_by_name(&"level".to_string())
+                .unwrap()
+                .id,
+            3
+        );
+        assert_eq!(loader.cache.num_parsed, 1);
+
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_publish() {
+        let registry = SchemaRegistry::new(builtin_schema());
+        let before = registry.load();
+        let mut schema = builtin_schema();
+        schema.remove(&2);
+        registry.publish(schema);
+        // readers keep the schema they have taken
+        assert!(before.contains_key(&2));
+        assert!(!registry.load().contains_key(&2));
+    }
+}
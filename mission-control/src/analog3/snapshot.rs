@@ -0,0 +1,253 @@
+use std::fmt;
+
+use super::{
+    A3_PROP_ID_MODULE_TYPE, A3_PROP_ID_MODULE_UID, A3_PROP_LENGTH_EXTENDED,
+    config::{Property, encode_field_header},
+};
+
+/// Binary rack snapshot format
+///
+/// ```text
+/// header  : "A3SN" version(u8) num_modules(u16)
+/// module  : uid(u32) module_type(u16) num_props(u8) property*
+/// property: id(u8) length data[length]
+/// ```
+/// The length is a byte, or 0xff followed by a u16 for values of 255 bytes or longer, same
+/// as the wire format. Version 1 files have single byte lengths and are still readable.
+/// All integers are big endian.
+const MAGIC: &[u8; 4] = b"A3SN";
+const VERSION: u8 = 2;
+
+#[derive(Debug, Clone)]
+pub struct ModuleSnapshot {
+    pub uid: u32,
+    pub module_type: u16,
+    pub properties: Vec<Property>,
+}
+
+impl ModuleSnapshot {
+    /// Makes a snapshot entry out of a config read from a module.
+    /// Returns None if the config lacks the UID or the module type.
+    pub fn from_properties(properties: Vec<Property>) -> Option<Self> {
+        let mut uid: Option<u32> = None;
+        let mut module_type: Option<u16> = None;
+        for property in &properties {
+            match (property.id, property.data.as_slice()) {
+                (A3_PROP_ID_MODULE_UID, &[b0, b1, b2, b3]) => {
+                    uid.replace(u32::from_be_bytes([b0, b1, b2, b3]));
+                }
+                (A3_PROP_ID_MODULE_TYPE, &[b0, b1]) => {
+                    module_type.replace(u16::from_be_bytes([b0, b1]));
+                }
+                _ => {}
+            }
+        }
+        Some(Self {
+            uid: uid?,
+            module_type: module_type?,
+            properties,
+        })
+    }
+}
+
+#[derive(Debug, Clone)]
+pub struct RackSnapshot {
+    pub modules: Vec<ModuleSnapshot>,
+}
+
+#[derive(Debug)]
+pub struct SnapshotFormatError {
+    pub message: String,
+}
+
+impl fmt::Display for SnapshotFormatError {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "{}", self.message)
+    }
+}
+
+impl std::error::Error for SnapshotFormatError {}
+
+type Result<T> = std::result::Result<T, SnapshotFormatError>;
+
+fn error<T>(message: &str) -> Result<T> {
+    return Err(SnapshotFormatError {
+        message: String::from(message),
+    });
+}
+
+impl RackSnapshot {
+    pub fn encode(&self) -> Vec<u8> {
+        let mut out = Vec::new();
+        out.extend_from_slice(MAGIC);
+        out.push(VERSION);
+        out.extend_from_slice(&(self.modules.len() as u16).to_be_bytes());
+        for module in &self.modules {
+            out.extend_from_slice(&module.uid.to_be_bytes());
+            out.extend_from_slice(&module.module_type.to_be_bytes());
+            out.push(module.properties.len() as u8);
+            for property in &module.properties {
+                let mut header = [0u8; 4];
+                let header_length =
+                    encode_field_header(property.id, property.data.len(), &mut header);
+                out.extend_from_slice(&header[..header_length]);
+                out.extend_from_slice(&property.data);
+            }
+        }
+        out
+    }
+
+    pub fn decode(src: &[u8]) -> Result<Self> {
+        let mut reader = Reader { src, pos: 0 };
+        if reader.take(4)? != MAGIC {
+            return error("Not a snapshot file");
+        }
+        let version = reader.u8()?;
+        if version != 1 && version != VERSION {
+            return error(format!("Unsupported snapshot version {}", version).as_str());
+        }
+        let num_modules = reader.u16()? as usize;
+        let mut modules = Vec::with_capacity(num_modules);
+        for _ in 0..num_modules {
+            let uid = reader.u32()?;
+            let module_type = reader.u16()?;
+            let num_props = reader.u8()? as usize;
+            let mut properties = Vec::with_capacity(num_props);
+            for _ in 0..num_props {
+                let id = reader.u8()?;
+                let length = match reader.u8()? {
+                    A3_PROP_LENGTH_EXTENDED if version >= 2 => reader.u16()?,
+                    length => length as u16,
+                };
+                let data = reader.take(length as usize)?.to_vec();
+                properties.push(Property { id, length, data });
+            }
+            modules.push(ModuleSnapshot {
+                uid,
+                module_type,
+                properties,
+            });
+        }
+        if reader.pos != src.len() {
+            return error("Trailing garbage after snapshot");
+        }
+        return Ok(Self { modules });
+    }
+}
+
+struct Reader<'a> {
+    src: &'a [u8],
+    pos: usize,
+}
+
+impl<'a> Reader<'a> {
+    fn take(&mut self, length: usize) -> Result<&'a [u8]> {
+        if self.pos + length > self.src.len() {
+            return error("Snapshot is truncated");
+        }
+        let out = &self.src[self.pos..self.pos + length];
+        self.pos += length;
+        Ok(out)
+    }
+
+    fn u8(&mut self) -> Result<u8> {
+        Ok(self.take(1)?[0])
+    }
+
+    fn u16(&mut self) -> Result<u16> {
+        let bytes = self.take(2)?;
+        Ok(u16::from_be_bytes([bytes[0], bytes[1]]))
+    }
+
+    fn u32(&mut self) -> Result<u32> {
+        let bytes = self.take(4)?;
+        Ok(u32::from_be_bytes([bytes[0], bytes[1], bytes[2], bytes[3]]))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::super::A3_PROP_ID_NAME;
+    use super::*;
+
+    fn module_config(uid: u32, module_type: u16, name: &str) -> Vec<Property> {
+        vec![
+            Property::u32(A3_PROP_ID_MODULE_UID, uid),
+            Property::u16(A3_PROP_ID_MODULE_TYPE, module_type),
+            Property::text(A3_PROP_ID_NAME, &name.to_string()),
+            Property::vector_u8(6, &vec![1, 1, 2, 2]),
+        ]
+    }
+
+    #[test]
+    fn test_snapshot_roundtrip() {
+        let snapshot = RackSnapshot {
+            modules: vec![
+                ModuleSnapshot::from_properties(module_config(0x1acebeef, 1, "depot")).unwrap(),
+                ModuleSnapshot::from_properties(module_config(0xba5eba11, 2, "amps")).unwrap(),
+            ],
+        };
+        let encoded = snapshot.encode();
+        assert_eq!(&encoded[0..7], b"A3SN\x02\x00\x02");
+
+        let decoded = RackSnapshot::decode(&encoded).unwrap();
+        assert_eq!(decoded.modules.len(), 2);
+        assert_eq!(decoded.modules[0].uid, 0x1acebeef);
+        assert_eq!(decoded.modules[0].module_type, 1);
+        assert_eq!(decoded.modules[1].uid, 0xba5eba11);
+        assert_eq!(decoded.modules[1].module_type, 2);
+        let props = &decoded.modules[1].properties;
+        assert_eq!(props.len(), 4);
+        assert_eq!(props[2].get_value_as_string().unwrap(), "amps");
+        assert_eq!(props[3].data, vec![1, 1, 2, 2]);
+    }
+
+    #[test]
+    fn test_snapshot_long_property() {
+        let mut config = module_config(0x1acebeef, 1, "depot");
+        config.push(Property::vector_u8(7, &vec![0x5a; 600]));
+        config.push(Property::vector_u8(8, &vec![0xff; 255]));
+        let snapshot = RackSnapshot {
+            modules: vec![ModuleSnapshot::from_properties(config).unwrap()],
+        };
+        let decoded = RackSnapshot::decode(&snapshot.encode()).unwrap();
+        let props = &decoded.modules[0].properties;
+        assert_eq!(props[4].length, 600);
+        assert_eq!(props[4].data, vec![0x5a; 600]);
+        assert_eq!(props[5].data, vec![0xff; 255]);
+    }
+
+    #[test]
+    fn test_snapshot_version_1() {
+        // a version 1 file has single byte lengths, even 255
+        let mut src = b"A3SN\x01\x00\x01\x1a\xce\xbe\xef\x00\x01\x01\x07\xff".to_vec();
+        src.extend_from_slice(&[0x33; 255]);
+        let decoded = RackSnapshot::decode(&src).unwrap();
+        assert_eq!(decoded.modules[0].uid, 0x1acebeef);
+        assert_eq!(decoded.modules[0].properties[0].data, vec![0x33; 255]);
+    }
+
+    #[test]
+    fn test_snapshot_entry_requires_identity() {
+        let props = vec![Property::text(A3_PROP_ID_NAME, &"orphan".to_string())];
+        assert!(ModuleSnapshot::from_properties(props).is_none());
+    }
+
+    #[test]
+    fn test_snapshot_decode_errors() {
+        assert!(RackSnapshot::decode(b"").is_err());
+        assert!(RackSnapshot::decode(b"XXXX\x01\x00\x00").is_err());
+        assert!(RackSnapshot::decode(b"A3SN\x03\x00\x00").is_err());
+
+        let snapshot = RackSnapshot {
+            modules: vec![
+                ModuleSnapshot::from_properties(module_config(0x1acebeef, 1, "depot")).unwrap(),
+            ],
+        };
+        let encoded = snapshot.encode();
+        assert!(RackSnapshot::decode(&encoded[..encoded.len() - 1]).is_err());
+        let mut extended = encoded.clone();
+        extended.push(0);
+        assert!(RackSnapshot::decode(&extended).is_err());
+    }
+}
@@ -1,7 +1,13 @@
 #![allow(non_upper_case_globals, non_camel_case_types, non_snake_case)]
 include!(concat!(env!("OUT_DIR"), "/bindings.rs"));
 
-use std::sync::{LazyLock, Mutex};
+use std::{
+    sync::{
+        LazyLock, Mutex,
+        atomic::{AtomicU64, Ordering},
+    },
+    time::{Duration, Instant},
+};
 use tokio::{
     sync::mpsc::{Receiver, Sender, channel},
     task::JoinHandle,
@@ -13,6 +19,8 @@ use crate::analog3::A3_ID_ADMIN_WIRES_BASE;
 pub struct CanMessage {
     pub message: *mut can_message_t,
     message_attached: bool,
+    /// The TX task drops the message instead of sending it after this
+    deadline: Option<Instant>,
 }
 
 impl CanMessage {
@@ -22,6 +30,7 @@ impl CanMessage {
             return Self {
                 message,
                 message_attached: false,
+                deadline: None,
             };
         }
     }
@@ -30,6 +39,7 @@ impl CanMessage {
         return Self {
             message: message,
             message_attached: true,
+            deadline: None,
         };
     }
 
@@ -52,6 +62,15 @@ impl CanMessage {
         }
     }
 
+    pub fn set_deadline(&mut self, deadline: Option<Instant>) {
+        self.deadline = deadline;
+    }
+
+    pub fn is_expired(&self) -> bool {
+        self.deadline
+            .is_some_and(|deadline| deadline <= Instant::now())
+    }
+
     pub fn set_ext_id(&mut self, ext_id: u32) {
         unsafe {
             (*self.message).id = ext_id;
@@ -163,6 +182,102 @@ impl Drop for CanMessage {
 unsafe impl Sync for CanMessage {}
 unsafe impl Send for CanMessage {}
 
+/// Payload capacity of the controller's message buffer
+pub const MAX_PAYLOAD_LENGTH: usize = 8;
+
+/// Payload lengths a CAN FD frame can carry beyond 8 bytes
+const FD_PAYLOAD_LENGTHS: [usize; 7] = [12, 16, 20, 24, 32, 48, 64];
+
+/// Returns the smallest CAN FD payload length that holds `length` bytes, or None if it
+/// does not fit in a frame. Lengths up to 8 map to themselves.
+pub fn fd_payload_length(length: usize) -> Option<usize> {
+    if length <= 8 {
+        return Some(length);
+    }
+    FD_PAYLOAD_LENGTHS
+        .into_iter()
+        .find(|&payload_length| payload_length >= length)
+}
+
+/// Standard-ID data frame prepared ahead of sending.
+///
+/// Plain memory, so a stream's worth of frames can be built in one pass into a vector and
+/// turned into controller messages only when they go out.
+#[derive(Debug, Clone, Copy)]
+pub struct TxFrame {
+    pub id: u16,
+    pub length: u8,
+    pub data: [u8; MAX_PAYLOAD_LENGTH],
+}
+
+impl TxFrame {
+    pub fn new(id: u16) -> Self {
+        Self {
+            id,
+            length: 0,
+            data: [0; MAX_PAYLOAD_LENGTH],
+        }
+    }
+
+    /// Sets the number of bytes written into `data`, padded up to a valid FD payload length.
+    pub fn set_payload_length(&mut self, length: usize) {
+        let payload_length = fd_payload_length(length)
+            .filter(|&payload_length| payload_length <= MAX_PAYLOAD_LENGTH)
+            .expect("payload exceeds the message buffer");
+        self.length = payload_length as u8;
+    }
+
+    pub fn payload(&self) -> &[u8] {
+        &self.data[..self.length as usize]
+    }
+}
+
+impl CanMessage {
+    /// Makes a controller message of the frame, setting all the fields at once.
+    pub fn from_frame(frame: &TxFrame) -> Self {
+        unsafe {
+            let message = can_create_message();
+            (*message).id = frame.id as u32;
+            (*message).is_extended = 0;
+            (*message).is_remote = 0;
+            (*message).data_length = frame.length;
+            (*message).data = frame.data;
+            return Self {
+                message,
+                message_attached: false,
+                deadline: None,
+            };
+        }
+    }
+}
+
+/// Rough on-wire time of a stream frame (8-byte FD payload, 2M arbitration / 4M data bitrate).
+/// Used only to estimate bus utilization from frame counts.
+pub const NOMINAL_FRAME_TIME: Duration = Duration::from_micros(40);
+
+static TX_FRAMES: AtomicU64 = AtomicU64::new(0);
+static RX_FRAMES: AtomicU64 = AtomicU64::new(0);
+static RX_DROPS: AtomicU64 = AtomicU64::new(0);
+
+/// Cumulative frame counters of the CAN controller.
+///
+/// RX counts only the frames that pass the acceptance filter, so utilization
+/// derived from these numbers is a lower bound of the actual bus load.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct BusStats {
+    pub tx_frames: u64,
+    pub rx_frames: u64,
+    pub rx_drops: u64,
+}
+
+pub fn bus_stats() -> BusStats {
+    BusStats {
+        tx_frames: TX_FRAMES.load(Ordering::Relaxed),
+        rx_frames: RX_FRAMES.load(Ordering::Relaxed),
+        rx_drops: RX_DROPS.load(Ordering::Relaxed),
+    }
+}
+
 struct FdHolder {
     rx_sender: Option<Sender<CanMessage>>,
 }
@@ -174,38 +289,65 @@ static EVENT_FD_HOLDER: LazyLock<Mutex<FdHolder>> =
 pub extern "C" fn notify_message(message: *mut can_message_t) {
     let holder = EVENT_FD_HOLDER.lock().unwrap();
     if let Some(rx_sender) = &holder.rx_sender {
-        if let Err(e) = rx_sender.try_send(CanMessage::from_raw_message(message)) {
-            log::error!("Failed to put a new RX message to channel: {e:?}");
+        match rx_sender.try_send(CanMessage::from_raw_message(message)) {
+            Ok(_) => {
+                RX_FRAMES.fetch_add(1, Ordering::Relaxed);
+            }
+            Err(e) => {
+                RX_DROPS.fetch_add(1, Ordering::Relaxed);
+                log::error!("Failed to put a new RX message to channel: {e:?}");
+            }
         }
     }
 }
 
-fn run_tx(mut tx_receiver: Receiver<CanMessage>) -> JoinHandle<()> {
+fn run_tx(
+    mut priority_tx_receiver: Receiver<CanMessage>,
+    mut tx_receiver: Receiver<CanMessage>,
+) -> JoinHandle<()> {
     return tokio::spawn(async move {
         loop {
-            if let Some(mut message) = tx_receiver.recv().await {
-                message.set_fd(true);
-                message.set_brs(true);
-                if log::log_enabled!(log::Level::Debug) {
-                    let mut data_elements = Vec::<String>::new();
-                    for i in 0..message.data_length() as usize {
-                        data_elements.push(format!("{:02x}", message.data()[i]));
-                    }
-                    log::debug!(
-                        "Message sending: id={:08x} data={}",
-                        message.id(),
-                        data_elements.join(" ")
-                    );
-                }
-                unsafe {
-                    can_send_message(message.message);
+            let mut message = tokio::select! {
+                biased;
+                Some(message) = priority_tx_receiver.recv() => message,
+                Some(message) = tx_receiver.recv() => message,
+                else => break,
+            };
+            if message.is_expired() {
+                log::debug!("Message expired in the queue: id={:08x}", message.id());
+                continue;
+            }
+            message.set_fd(true);
+            message.set_brs(true);
+            if log::log_enabled!(log::Level::Debug) {
+                let mut data_elements = Vec::<String>::new();
+                for i in 0..message.data_length() as usize {
+                    data_elements.push(format!("{:02x}", message.data()[i]));
                 }
+                log::debug!(
+                    "Message sending: id={:08x} data={}",
+                    message.id(),
+                    data_elements.join(" ")
+                );
+            }
+            unsafe {
+                can_send_message(message.message);
             }
+            TX_FRAMES.fetch_add(1, Ordering::Relaxed);
         }
     });
 }
 
-pub fn start() -> (Sender<CanMessage>, Receiver<CanMessage>, JoinHandle<()>) {
+/// Starts the CAN controller.
+///
+/// Returns the TX sender, the priority TX sender whose messages are sent ahead of the queued
+/// regular ones, the RX receiver and the TX task handle.
+pub fn start() -> (
+    Sender<CanMessage>,
+    Sender<CanMessage>,
+    Receiver<CanMessage>,
+    JoinHandle<()>,
+) {
     // Set up message rx
     let (rx_sender, rx_receiver) = channel(16);
     let mut holder = EVENT_FD_HOLDER.lock().unwrap();
@@ -254,8 +396,9 @@ pub fn start() -> (Sender<CanMessage>, Receiver<CanMessage>, JoinHandle<()>) {
 
     // set up message tx
     let (tx_sender, tx_receiver) = channel(16);
+    let (priority_tx_sender, priority_tx_receiver) = channel(4);
 
-    let handle = run_tx(tx_receiver);
+    let handle = run_tx(priority_tx_receiver, tx_receiver);
 
-    (tx_sender, rx_receiver, handle)
+    (tx_sender, priority_tx_sender, rx_receiver, handle)
 }
@@ -1,45 +1,105 @@
-use tokio::sync::oneshot;
+use std::{
+    fmt,
+    sync::Arc,
+    time::{Duration, Instant},
+};
+
+use tokio::sync::{mpsc, oneshot};
 
 use crate::{
-    a3_modules::A3Module,
-    analog3::{
-        config::{Property, Value},
-        schema::ModuleDef,
-    },
+    a3_modules::{A3Module, Subscription},
+    analog3::{config::Property, schema::ModuleDef},
     error::AppError,
+    mission_control::{
+        CommitSummary, FanOutOp, FanOutProgress, FanOutSummary, RealtimeStats, RttHistogram,
+    },
 };
 
 #[derive(Debug)]
 pub enum Command {
-    List {
-        resp: oneshot::Sender<Result<Vec<A3Module>, AppError>>,
+    /// Streams the modules in the registry
+    List { resp: ResponseStream<Arc<A3Module>> },
+    /// Subscribe to module registry events
+    Subscribe {
+        resp: oneshot::Sender<Result<Arc<Subscription>, AppError>>,
     },
     Ping {
         id: u8,
         enable_visual: bool,
-        resp: oneshot::Sender<Result<(), AppError>>,
+        resp: oneshot::Sender<Result<Duration, AppError>>,
+    },
+    GetPingStats {
+        id: Option<u8>,
+        resp: oneshot::Sender<Result<Vec<(u8, RttHistogram)>, AppError>>,
     },
     GetName {
         id: u8,
         resp: oneshot::Sender<Result<String, AppError>>,
     },
+    /// Streams the properties of the module as they arrive from the bus
     GetConfig {
         id: u8,
-        resp: oneshot::Sender<Result<Vec<Property>, AppError>>,
+        resp: ResponseStream<PropertyEntry>,
     },
     GetModule {
         id: u8,
-        resp: oneshot::Sender<Result<A3Module, AppError>>,
+        resp: oneshot::Sender<Result<Arc<A3Module>, AppError>>,
     },
     GetSchema {
         id: u8,
-        resp: oneshot::Sender<Result<ModuleDef, AppError>>,
+        resp: oneshot::Sender<Result<Arc<ModuleDef>, AppError>>,
     },
+    /// Responds with the number of properties written; unchanged ones are not sent
     SetConfig {
         id: u8,
         props: Vec<Property>,
+        resp: oneshot::Sender<Result<usize, AppError>>,
+    },
+    /// Stage properties on a module without applying them until the tag is committed
+    StageConfig {
+        id: u8,
+        tag: u8,
+        props: Vec<Property>,
+        resp: oneshot::Sender<Result<(), AppError>>,
+    },
+    /// Broadcast a commit of the staged properties of the tag
+    CommitStaged {
+        tag: u8,
+        resp: oneshot::Sender<Result<CommitSummary, AppError>>,
+    },
+    DiscardStaged {
+        tag: u8,
+        resp: oneshot::Sender<Result<(), AppError>>,
+    },
+    /// Rack-wide operation; per-module results are streamed to `progress`
+    FanOut {
+        op: FanOutOp,
+        progress: mpsc::Sender<FanOutProgress>,
+        resp: oneshot::Sender<Result<FanOutSummary, AppError>>,
+    },
+    /// Sends the value of the property to `updates` at first and whenever it changes,
+    /// polled at the interval, until `updates` is closed
+    Watch {
+        id: u8,
+        property_name: String,
+        interval: Duration,
+        updates: mpsc::Sender<Result<PropertyEntry, AppError>>,
         resp: oneshot::Sender<Result<(), AppError>>,
     },
+    /// Sends a scalar property by the realtime channel. Values of the same property that
+    /// arrive before the next flush are coalesced; responds with whether this one replaced
+    /// a value not yet sent.
+    SetRealtime {
+        id: u8,
+        property_name: String,
+        value: String,
+        /// Arrival at the session, from which the latency to the frame is measured
+        received_at: Instant,
+        resp: oneshot::Sender<Result<bool, AppError>>,
+    },
+    GetRealtimeStats {
+        resp: oneshot::Sender<Result<RealtimeStats, AppError>>,
+    },
     RequestUidCancel {
         uid: u32,
         resp: oneshot::Sender<Result<(), AppError>>,
@@ -59,11 +119,59 @@ pub enum Command {
     },
 }
 
+/// Scheduling class of a command
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum CommandClass {
+    /// Answered quickly; served ahead of the bulk commands
+    Interactive = 0,
+    /// Occupies the bus for a long time
+    Bulk = 1,
+}
+
+impl Command {
+    pub fn class(&self) -> CommandClass {
+        match self {
+            Command::FanOut { .. } => CommandClass::Bulk,
+            _ => CommandClass::Interactive,
+        }
+    }
+
+    /// Answers the command with the error instead of executing it.
+    pub async fn reject(self, error: AppError) {
+        let result = match self {
+            Command::List { resp } => return resp.fail(error).await,
+            Command::GetConfig { resp, .. } => return resp.fail(error).await,
+            Command::Subscribe { resp } => resp.send(Err(error)).is_ok(),
+            Command::Ping { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::GetPingStats { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::GetName { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::GetModule { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::GetSchema { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::SetConfig { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::StageConfig { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::CommitStaged { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::DiscardStaged { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::FanOut { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::Watch { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::SetRealtime { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::GetRealtimeStats { resp } => resp.send(Err(error)).is_ok(),
+            Command::RequestUidCancel { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::Hi { resp } => resp.send(Err(error)).is_ok(),
+            Command::PretendSignIn { resp, .. } => resp.send(Err(error)).is_ok(),
+            Command::PretendNotifyId { resp, .. } => resp.send(Err(error)).is_ok(),
+        };
+        if !result {
+            log::debug!("The session is gone before its command was rejected");
+        }
+    }
+}
+
+/// Command on its way to mission control, with the time by which its session wants the
+/// result if it cares
 #[derive(Debug)]
 pub struct Request {
-    pub session_id: u32,
-    pub operation: Command,
-    pub params: Vec<Value>,
+    pub command: Command,
+    pub deadline: Option<Instant>,
 }
 
 #[derive(Debug)]
@@ -75,3 +183,86 @@ pub struct Response {
 }
 
 pub type OperationResult = Result<Response, AppError>;
+
+/// Parts of a multi-part response that may wait in the channel before the session writes
+/// them out; the producer waits beyond this, so a slow client holds back a large result
+/// instead of having it buffered
+const STREAM_BUFFER_SIZE: usize = 8;
+
+/// Sending end of a multi-part response.
+///
+/// Every item goes to the session as a `Response` part with `more` set as soon as it is
+/// produced. The stream ends with a part with `more` cleared, or with an error. The
+/// session decides how the items are rendered when it opens the stream.
+pub struct ResponseStream<T> {
+    tx: mpsc::Sender<OperationResult>,
+    stream_id: u8,
+    render: Box<dyn FnMut(&T) -> Vec<u8> + Send>,
+}
+
+impl<T> ResponseStream<T> {
+    pub fn new(
+        stream_id: u8,
+        render: Box<dyn FnMut(&T) -> Vec<u8> + Send>,
+    ) -> (Self, mpsc::Receiver<OperationResult>) {
+        let (tx, rx) = mpsc::channel(STREAM_BUFFER_SIZE);
+        let stream = Self {
+            tx,
+            stream_id,
+            render,
+        };
+        return (stream, rx);
+    }
+
+    /// Sends an item. Returns false if the session has gone away.
+    pub async fn send(&mut self, item: &T) -> bool {
+        let response = Response {
+            reply: (self.render)(item),
+            more: true,
+            stream_id: self.stream_id,
+        };
+        return self.tx.send(Ok(response)).await.is_ok();
+    }
+
+    /// Ends the stream successfully.
+    pub async fn finish(self) {
+        let response = Response {
+            reply: Vec::new(),
+            more: false,
+            stream_id: self.stream_id,
+        };
+        let _ = self.tx.send(Ok(response)).await;
+    }
+
+    /// Ends the stream with an error. The parts sent so far stay valid.
+    pub async fn fail(self, error: AppError) {
+        let _ = self.tx.send(Err(error)).await;
+    }
+}
+
+impl<T> fmt::Debug for ResponseStream<T> {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "ResponseStream {{ stream_id: {} }}", self.stream_id)
+    }
+}
+
+/// Hands out the stream IDs of a session in turn, skipping zero
+#[derive(Debug, Default)]
+pub struct StreamIdAllocator {
+    last: u8,
+}
+
+impl StreamIdAllocator {
+    pub fn next(&mut self) -> u8 {
+        self.last = self.last.checked_add(1).unwrap_or(1);
+        return self.last;
+    }
+}
+
+/// A property of a config described by the schema of the module
+#[derive(Debug, Clone, PartialEq)]
+pub struct PropertyEntry {
+    pub id: u8,
+    pub name: String,
+    pub value: String,
+}
@@ -14,6 +14,10 @@ pub enum ErrorType {
     UserCommandStreamIdMissing,
     UserCommandInvalidRequest,
     Timeout,
+    /// The deadline the client gave has passed; says nothing about the module
+    DeadlineExceeded,
+    /// Shed before execution, or the peer stayed busy; the client may try again later
+    Busy,
     RuntimeError,
 }
 
@@ -46,6 +50,13 @@ impl AppError {
         }
     }
 
+    pub fn deadline_exceeded() -> Self {
+        Self {
+            error_type: ErrorType::DeadlineExceeded,
+            message: "deadline passed".to_string(),
+        }
+    }
+
     pub fn runtime(message: &str) -> Self {
         Self {
             error_type: ErrorType::RuntimeError,
@@ -7,7 +7,10 @@ pub mod error;
 pub mod mission_control;
 pub mod user_session;
 
-use std::io::Write;
+#[cfg(test)]
+mod alloc_counter;
+
+use std::{io::Write, path::PathBuf};
 
 use env_logger::Env;
 
@@ -35,33 +38,56 @@ async fn main() {
         .init();
     log::info!("Analog3 mission control started");
 
+    let state_dir = PathBuf::from(std::env::var("A3_STATE_DIR").unwrap_or("state".to_string()));
+
+    // Module schemas
+    let _schema_handle = std::env::var_os("A3_SCHEMA_DIR").map(|schema_dir| {
+        analog3::schema::start_overlay(
+            PathBuf::from(schema_dir),
+            Some(state_dir.join("schema.cache")),
+        )
+    });
+
     // A3 Modules
-    let (modules_tx, _modules_handle) = a3_modules::start();
+    let (modules_tx, registry, _modules_handle) = a3_modules::start(Some(&state_dir));
 
     // CAN controller
-    let (can_tx, mut can_rx, _can_tx_handle) = can_controller::start();
+    let (can_tx, can_priority_tx, mut can_rx, _can_tx_handle) = can_controller::start();
 
     // Mission control
-    let mut mission_control = MissionControl::new(can_tx.clone(), modules_tx);
-
-    // User sessions
-    let (mut command_rx, _command_handle) = match user_session::start().await {
-        Ok(ret) => ret,
+    let mut mission_control =
+        MissionControl::new(can_tx.clone(), can_priority_tx, modules_tx, registry);
+    let shm_path = std::env::var("A3_SHM_PATH").unwrap_or("/dev/shm/analog3".to_string());
+    let _shared_state_handle = match mission_control.share_state(&PathBuf::from(&shm_path)) {
+        Ok(handle) => Some(handle),
         Err(e) => {
-            log::error!("The process failed to start listening: {:?}", e);
-            std::process::exit(1);
+            log::warn!("Failed to share the module state at {}: {:?}", shm_path, e);
+            None
         }
     };
 
+    // User sessions
+    let socket_path =
+        std::env::var_os("A3_SOCKET").map_or_else(|| state_dir.join("machine.sock"), PathBuf::from);
+    let (mut command_rx, _command_handle) =
+        match user_session::start(Some(&socket_path), can_tx.clone()).await {
+            Ok(ret) => ret,
+            Err(e) => {
+                log::error!("The process failed to start listening: {:?}", e);
+                std::process::exit(1);
+            }
+        };
+
     a3_message::sign_in(can_tx.clone()).await;
+    mission_control.confirm_restored_modules();
 
     loop {
         tokio::select! {
         Some(can_message) = can_rx.recv() => {
             mission_control.handle_can_message(can_message);
         }
-        Some(user_command) = command_rx.recv() => {
-            mission_control.handle_command(user_command);
+        Some(request) = command_rx.recv() => {
+            mission_control.handle_command(request.command, request.deadline);
         }
         }
     }
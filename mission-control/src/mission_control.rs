@@ -1,41 +1,211 @@
+mod config_cache;
+mod deadline;
+mod fanout;
+mod latency;
+mod preset;
+mod realtime;
+mod shared_state;
 mod streams;
+mod watch;
+mod write_planner;
+
+use std::{
+    io,
+    path::Path,
+    sync::{Arc, Mutex},
+    time::Instant,
+};
 
 use crate::{
     a3_message,
-    a3_modules::{self, A3Module},
+    a3_modules::{self, A3Module, RegistryReader},
     analog3::{
         self as a3, A3_PROP_ID_MODULE_TYPE, A3_PROP_ID_NAME, StreamStatus,
-        config::{ChunkParser, Property, PropertyEncoder},
-        schema::{MODULES_SCHEMA, ModuleDef, ValueType},
+        config::{ConfigParser, Property, property_name, property_value_as_string},
+        schema::{COMMON_MODULE_DEF, ModuleDef, ValueType, modules_schema},
     },
     can_controller::CanMessage,
-    command::Command,
+    command::{Command, PropertyEntry, ResponseStream},
     error::{AppError, ErrorType},
 };
 
+use deadline::Deadline;
+pub use fanout::{FanOutOp, FanOutOutcome, FanOutProgress, FanOutSummary};
+pub use latency::{LatencySummary, RttHistogram};
+pub use preset::CommitSummary;
+pub use realtime::RealtimeStats;
+pub use watch::{
+    DEFAULT_INTERVAL as DEFAULT_WATCH_INTERVAL, UPDATE_QUEUE_SIZE as WATCH_QUEUE_SIZE,
+};
+
 use tokio::{
     sync::{mpsc::Sender, oneshot},
+    task::{JoinHandle, JoinSet},
     time::{Duration, sleep, timeout},
 };
 
 type Result<T> = std::result::Result<T, AppError>;
 
+/// How long a restored module has to answer the confirmation ping
+const CONFIRM_TIMEOUT: Duration = Duration::from_millis(200);
+
+/// How long a stream waits for each reply of the peer
+const STREAM_TIMEOUT: Duration = Duration::from_secs(10);
+
+/// Stream options offered on config reads and writes
+const CONFIG_STREAM_OPTIONS: u8 = a3::A3_STREAM_OPT_PACKED;
+
+/// Property IDs a property read can ask for; they fill the request frame
+const MAX_PROPERTIES_PER_READ: usize = 5;
+
 pub struct MissionControl {
     can_tx: Sender<CanMessage>,
+    can_priority_tx: Sender<CanMessage>,
     modules_tx: Sender<a3_modules::Operation>,
+    registry: RegistryReader,
     streams_tx: Sender<streams::Operation>,
+    rtt_stats: Arc<Mutex<latency::RttStats>>,
+    transfer_limiter: Arc<fanout::AdaptiveLimiter>,
+    config_cache: Arc<config_cache::ConfigCache>,
+    staged_writes: Arc<preset::StagedWrites>,
+    write_planner: Arc<write_planner::WritePlanner>,
+    watches: Arc<watch::PropertyWatches>,
+    realtime: Arc<realtime::RealtimeChannel>,
 }
 
 impl MissionControl {
-    pub fn new(can_tx: Sender<CanMessage>, modules_tx: Sender<a3_modules::Operation>) -> Self {
+    pub fn new(
+        can_tx: Sender<CanMessage>,
+        can_priority_tx: Sender<CanMessage>,
+        modules_tx: Sender<a3_modules::Operation>,
+        registry: RegistryReader,
+    ) -> Self {
         let (streams_tx, _) = streams::start();
+        let config_cache = Arc::new(config_cache::ConfigCache::new());
+        config_cache::start(config_cache.clone(), registry.clone());
+        let watches = Arc::new(watch::PropertyWatches::new());
+        watch::start(watches.clone(), {
+            let streams_tx = streams_tx.clone();
+            let can_tx = can_tx.clone();
+            let modules_tx = modules_tx.clone();
+            let config_cache = config_cache.clone();
+            move |id, property_ids| {
+                read_properties_on_new_wire(
+                    streams_tx.clone(),
+                    can_tx.clone(),
+                    modules_tx.clone(),
+                    config_cache.clone(),
+                    id,
+                    property_ids,
+                    Deadline::after(STREAM_TIMEOUT),
+                )
+            }
+        });
+        let realtime = Arc::new(realtime::RealtimeChannel::new());
+        realtime::start(
+            realtime.clone(),
+            can_priority_tx.clone(),
+            config_cache.clone(),
+        );
         Self {
             can_tx,
+            can_priority_tx,
             modules_tx,
+            registry,
             streams_tx,
+            rtt_stats: Arc::new(Mutex::new(latency::RttStats::new())),
+            transfer_limiter: Arc::new(fanout::AdaptiveLimiter::new()),
+            config_cache,
+            staged_writes: Arc::new(preset::StagedWrites::new()),
+            write_planner: Arc::new(write_planner::WritePlanner::new()),
+            watches,
+            realtime,
         }
     }
 
+    /// Publishes the module registry and the cached configs to a shared memory region
+    /// mapped from the file at `path`.
+    pub fn share_state(&self, path: &Path) -> io::Result<JoinHandle<()>> {
+        let shared = Arc::new(shared_state::SharedState::create(path)?);
+        self.config_cache.publish_to(shared.clone());
+        log::info!("Sharing the module state at {:?}", path);
+        return Ok(shared_state::start(shared, self.registry.clone()));
+    }
+
+    /// Confirms the modules restored from the persistent registry are still on the bus.
+    ///
+    /// The restored IDs are usable right away. This pings all of them at once in the
+    /// background and drops the ones that do not answer, which should be the modules that
+    /// were removed or replaced while mission control was down. Modules that lost their ID
+    /// meanwhile sign in again as usual and get their old ID back.
+    pub fn confirm_restored_modules(&self) {
+        let modules_tx = self.modules_tx.clone();
+        let streams_tx = self.streams_tx.clone();
+        let can_tx = self.can_tx.clone();
+        let modules = self.registry.load().list();
+        tokio::spawn(async move {
+            let started_at = Instant::now();
+            if modules.is_empty() {
+                return;
+            }
+            let mut tasks = JoinSet::new();
+            for module in &modules {
+                let streams_tx = streams_tx.clone();
+                let can_tx = can_tx.clone();
+                let (id, uid) = (module.id, module.uid);
+                tasks.spawn(async move {
+                    loop {
+                        let result = ping_core(
+                            streams_tx.clone(),
+                            can_tx.clone(),
+                            id,
+                            false,
+                            CONFIRM_TIMEOUT,
+                            Deadline::NONE,
+                        )
+                        .await;
+                        match result {
+                            Ok(_) => return (uid, true),
+                            Err(e) if matches!(e.error_type, ErrorType::Timeout) => {
+                                return (uid, false);
+                            }
+                            // a ping from a client is running; the module is not silent
+                            // for that, so try again once it is done
+                            Err(e) if matches!(e.error_type, ErrorType::A3StreamConflict) => {
+                                sleep(CONFIRM_TIMEOUT).await;
+                            }
+                            // not an answer either way; keep the module
+                            Err(e) => {
+                                log::warn!("Confirmation ping of {} failed: {}", id, e);
+                                return (uid, true);
+                            }
+                        }
+                    }
+                });
+            }
+            let mut num_dropped = 0;
+            while let Some(joined) = tasks.join_next().await {
+                let Ok((uid, confirmed)) = joined else {
+                    continue;
+                };
+                if !confirmed {
+                    log::info!("Restored module uid {:08x} did not answer; dropping", uid);
+                    modules_tx
+                        .send(a3_modules::Operation::Deregister { uid })
+                        .await
+                        .unwrap();
+                    num_dropped += 1;
+                }
+            }
+            log::info!(
+                "Confirmed {} restored modules, dropped {} in {}ms",
+                modules.len() - num_dropped,
+                num_dropped,
+                started_at.elapsed().as_millis()
+            );
+        });
+    }
+
     // incoming message handling /////////////////////////////////////////////////////////
 
     pub fn handle_can_message(&mut self, message: CanMessage) {
@@ -210,20 +380,51 @@ impl MissionControl {
 
     // Command handling ///////////////////////////////////////////////////////////////
 
-    pub fn handle_command(&mut self, command: Command) {
+    /// Executes the command. The operations on the bus are given up when the deadline
+    /// passes, if any.
+    pub fn handle_command(&mut self, command: Command, deadline: Option<Instant>) {
+        let deadline = Deadline::new(deadline);
         match command {
             Command::Hi { resp } => self.hi(resp),
             Command::List { resp } => self.list(resp),
+            Command::Subscribe { resp } => self.subscribe(resp),
             Command::GetModule { id, resp } => self.get_module(id, resp),
             Command::GetSchema { id, resp } => self.get_schema(id, resp),
             Command::Ping {
                 id,
                 enable_visual,
                 resp,
-            } => self.ping(id, enable_visual, resp),
-            Command::GetName { id, resp } => self.get_name(id, resp),
-            Command::GetConfig { id, resp } => self.get_config(id, resp),
+            } => self.ping(id, enable_visual, deadline, resp),
+            Command::GetPingStats { id, resp } => self.get_ping_stats(id, resp),
+            Command::GetName { id, resp } => self.get_name(id, deadline, resp),
+            Command::GetConfig { id, resp } => self.get_config(id, deadline, resp),
             Command::SetConfig { id, props, resp } => self.set_config(id, props, resp),
+            Command::StageConfig {
+                id,
+                tag,
+                props,
+                resp,
+            } => self.stage_config(id, tag, props, deadline, resp),
+            Command::CommitStaged { tag, resp } => self.commit_staged(tag, resp),
+            Command::DiscardStaged { tag, resp } => self.discard_staged(tag, resp),
+            Command::FanOut { op, progress, resp } => self.fan_out(op, progress, deadline, resp),
+            Command::Watch {
+                id,
+                property_name,
+                interval,
+                updates,
+                resp,
+            } => self.watch(id, &property_name, interval, updates, resp),
+            Command::SetRealtime {
+                id,
+                property_name,
+                value,
+                received_at,
+                resp,
+            } => self.set_realtime(id, &property_name, &value, received_at, resp),
+            Command::GetRealtimeStats { resp } => {
+                resp.send(Ok(self.realtime.stats())).unwrap();
+            }
             Command::RequestUidCancel { uid, resp } => self.request_uid_cancel(uid, resp),
             Command::PretendSignIn { uid, resp } => self.pretend_sign_in(uid, resp),
             Command::PretendNotifyId { uid, id, resp } => self.pretend_notify_id(uid, id, resp),
@@ -236,112 +437,135 @@ impl MissionControl {
         });
     }
 
-    fn list(&mut self, resp: oneshot::Sender<Result<Vec<A3Module>>>) {
-        let modules_tx = self.modules_tx.clone();
+    // The read-only commands are served from the registry view without going through
+    // the registry actor.
+
+    fn list(&mut self, mut resp: ResponseStream<Arc<A3Module>>) {
+        let modules = self.registry.load().list();
         tokio::spawn(async move {
-            let (tx, rx) = oneshot::channel();
-            modules_tx
-                .send(a3_modules::Operation::List { resp: tx })
-                .await
-                .unwrap();
-            match rx.await.unwrap() {
-                Ok(list) => {
-                    resp.send(Ok(list)).unwrap();
-                }
-                Err(e) => {
-                    log::error!("An error encountered while listing modules: {:?}", e);
+            for module in &modules {
+                if !resp.send(module).await {
+                    return;
                 }
             }
+            resp.finish().await;
         });
     }
 
-    fn get_module(&mut self, id: u8, resp: oneshot::Sender<Result<A3Module>>) {
-        let modules_tx = self.modules_tx.clone();
-        tokio::spawn(async move {
-            let (tx, rx) = oneshot::channel();
-            modules_tx
-                .send(a3_modules::Operation::GetById { id, resp: tx })
-                .await
-                .unwrap();
-            resp.send(rx.await.unwrap()).unwrap();
-        });
+    fn subscribe(&mut self, resp: oneshot::Sender<Result<Arc<a3_modules::Subscription>>>) {
+        if let Err(e) = resp.send(Ok(self.registry.subscribe())) {
+            log::error!("Error in sending back the subscription: {:?}", e);
+        }
     }
 
-    fn get_schema(&mut self, id: u8, resp: oneshot::Sender<Result<ModuleDef>>) {
-        let modules_tx = self.modules_tx.clone();
-        tokio::spawn(async move {
-            let (tx, rx) = oneshot::channel();
-            modules_tx
-                .send(a3_modules::Operation::GetById { id, resp: tx })
-                .await
-                .unwrap();
-            let result: Result<ModuleDef> = match rx.await.unwrap() {
-                Ok(module) => match module.module_type_id {
-                    Some(tid) => match MODULES_SCHEMA.get(&tid) {
-                        Some(value) => Ok(value.clone()),
-                        None => Err(AppError::new(
-                            ErrorType::A3SchemaError,
-                            "Schema unknown".to_string(),
-                        )),
-                    },
+    fn get_module(&mut self, id: u8, resp: oneshot::Sender<Result<Arc<A3Module>>>) {
+        if let Err(e) = resp.send(self.registry.load().get_by_id(id)) {
+            log::error!("Error in sending back the module: {:?}", e);
+        }
+    }
+
+    fn get_schema(&mut self, id: u8, resp: oneshot::Sender<Result<Arc<ModuleDef>>>) {
+        let result: Result<Arc<ModuleDef>> = match self.registry.load().get_by_id(id) {
+            Ok(module) => match module.module_type_id {
+                Some(tid) => match modules_schema().get(&tid) {
+                    Some(value) => Ok(value.clone()),
                     None => Err(AppError::new(
                         ErrorType::A3SchemaError,
-                        "Module type could not be resolved. Consider running get-config"
-                            .to_string(),
+                        "Schema unknown".to_string(),
                     )),
                 },
-                Err(e) => Err(e),
-            };
-            resp.send(result).unwrap();
-        });
+                None => Err(AppError::new(
+                    ErrorType::A3SchemaError,
+                    "Module type could not be resolved. Consider running get-config".to_string(),
+                )),
+            },
+            Err(e) => Err(e),
+        };
+        if let Err(e) = resp.send(result) {
+            log::error!("Error in sending back the schema: {:?}", e);
+        }
     }
 
-    fn ping(&mut self, id: u8, enable_visual: bool, resp: oneshot::Sender<Result<()>>) {
+    fn ping(
+        &mut self,
+        id: u8,
+        enable_visual: bool,
+        deadline: Deadline,
+        resp: oneshot::Sender<Result<Duration>>,
+    ) {
         let streams_tx = self.streams_tx.clone();
         let can_tx = self.can_tx.clone();
+        let rtt_stats = self.rtt_stats.clone();
+        let modules_tx = self.modules_tx.clone();
         tokio::spawn(async move {
-            let result = ping_core(streams_tx.clone(), can_tx, id, enable_visual).await;
+            let result = ping_core(
+                streams_tx,
+                can_tx,
+                id,
+                enable_visual,
+                STREAM_TIMEOUT,
+                deadline,
+            )
+            .await;
+            // a client deadline running out says nothing about the module
+            let alive = match &result {
+                Ok(rtt) => {
+                    rtt_stats.lock().unwrap().record(id, *rtt);
+                    Some(true)
+                }
+                Err(e) if matches!(e.error_type, ErrorType::Timeout) => {
+                    rtt_stats.lock().unwrap().record_timeout(id);
+                    Some(false)
+                }
+                Err(_) => None,
+            };
+            if let Some(alive) = alive {
+                modules_tx
+                    .send(a3_modules::Operation::ReportLiveness { id, alive })
+                    .await
+                    .unwrap();
+            }
             if let Err(e) = resp.send(result) {
                 log::error!("Error in sending back the ping result: {:?}", e);
             }
-
-            terminate_stream(streams_tx, id as u16 + a3::A3_ID_INDIVIDUAL_MODULE_BASE).await;
         });
     }
 
-    fn get_name(&mut self, id: u8, resp: oneshot::Sender<Result<String>>) {
-        let streams_tx = self.streams_tx.clone();
-        let can_tx = self.can_tx.clone();
-        tokio::spawn(async move {
-            match create_wire(streams_tx.clone()).await {
-                Ok((wire_addr, stream_resp_rx)) => {
-                    let result =
-                        get_name_core(streams_tx.clone(), can_tx, id, wire_addr, stream_resp_rx)
-                            .await;
-                    if let Err(e) = resp.send(result) {
-                        log::error!("Error in sending back the get-name result: {:?}", e);
-                    }
-                    terminate_stream(streams_tx, wire_addr).await;
-                }
-                Err(e) => resp.send(Err(e)).unwrap(),
-            }
-        });
+    fn get_ping_stats(
+        &mut self,
+        id: Option<u8>,
+        resp: oneshot::Sender<Result<Vec<(u8, RttHistogram)>>>,
+    ) {
+        let rtt_stats = self.rtt_stats.lock().unwrap();
+        let result = match id {
+            Some(id) => match rtt_stats.get(id) {
+                Some(histogram) => Ok(vec![(id, histogram.clone())]),
+                None => Err(AppError::new(
+                    ErrorType::A3ModuleNotFound,
+                    format!("No ping records for module ID: {}", id),
+                )),
+            },
+            None => Ok(rtt_stats
+                .iter()
+                .map(|(id, histogram)| (*id, histogram.clone()))
+                .collect()),
+        };
+        resp.send(result).unwrap();
     }
 
-    fn get_config(&mut self, id: u8, resp: oneshot::Sender<Result<Vec<Property>>>) {
-        let modules_tx = self.modules_tx.clone();
+    fn get_name(&mut self, id: u8, deadline: Deadline, resp: oneshot::Sender<Result<String>>) {
         let streams_tx = self.streams_tx.clone();
         let can_tx = self.can_tx.clone();
         tokio::spawn(async move {
             match create_wire(streams_tx.clone()).await {
                 Ok((wire_addr, stream_resp_rx)) => {
-                    let result = get_config_core(
+                    let result = get_name_core(
                         streams_tx.clone(),
                         can_tx,
-                        modules_tx,
                         id,
                         wire_addr,
                         stream_resp_rx,
+                        deadline,
                     )
                     .await;
                     if let Err(e) = resp.send(result) {
@@ -354,31 +578,226 @@ impl MissionControl {
         });
     }
 
-    fn set_config(&mut self, id: u8, props: Vec<Property>, resp: oneshot::Sender<Result<()>>) {
+    fn get_config(&mut self, id: u8, deadline: Deadline, mut resp: ResponseStream<PropertyEntry>) {
+        let modules_tx = self.modules_tx.clone();
+        let streams_tx = self.streams_tx.clone();
+        let can_tx = self.can_tx.clone();
+        let config_cache = self.config_cache.clone();
+        tokio::spawn(async move {
+            let result = get_config_on_new_wire(
+                streams_tx,
+                can_tx,
+                modules_tx,
+                config_cache,
+                id,
+                deadline,
+                Some(&mut resp),
+            )
+            .await;
+            match result {
+                Ok(_) => resp.finish().await,
+                Err(e) => resp.fail(e).await,
+            }
+        });
+    }
+
+    fn set_config(&mut self, id: u8, props: Vec<Property>, resp: oneshot::Sender<Result<usize>>) {
         let streams_tx = self.streams_tx.clone();
         let can_tx = self.can_tx.clone();
         let modules_tx = self.modules_tx.clone();
+        let registry = self.registry.clone();
+        let config_cache = self.config_cache.clone();
+        let write_planner = self.write_planner.clone();
         tokio::spawn(async move {
-            match create_wire(streams_tx.clone()).await {
-                Ok((wire_addr, stream_resp_rx)) => {
-                    let result = set_config_core(
-                        streams_tx.clone(),
-                        can_tx,
-                        modules_tx,
-                        id,
-                        props,
-                        wire_addr,
-                        stream_resp_rx,
-                    )
-                    .await;
-                    if let Err(e) = resp.send(result) {
-                        log::error!("Error in sending back the get-name result: {:?}", e);
-                    }
-                    terminate_stream(streams_tx, wire_addr).await;
+            let result = write_config(
+                streams_tx,
+                can_tx,
+                modules_tx,
+                registry,
+                config_cache,
+                write_planner,
+                id,
+                props,
+            )
+            .await;
+            if let Err(e) = resp.send(result) {
+                log::error!("Error in sending back the set-config result: {:?}", e);
+            }
+        });
+    }
+
+    fn stage_config(
+        &mut self,
+        id: u8,
+        tag: u8,
+        props: Vec<Property>,
+        deadline: Deadline,
+        resp: oneshot::Sender<Result<()>>,
+    ) {
+        let streams_tx = self.streams_tx.clone();
+        let can_tx = self.can_tx.clone();
+        let staged_writes = self.staged_writes.clone();
+        tokio::spawn(async move {
+            let result = stage_config_on_new_wire(
+                streams_tx,
+                can_tx,
+                staged_writes,
+                id,
+                tag,
+                props,
+                deadline,
+            )
+            .await;
+            if let Err(e) = resp.send(result) {
+                log::error!("Error in sending back the stage result: {:?}", e);
+            }
+        });
+    }
+
+    /// Applies the staged property sets on all modules at once by a single broadcast frame.
+    /// The broadcast gets no ack, so the cached configs of the staged modules are dropped
+    /// rather than updated; the next read of a module brings its config and name back.
+    fn commit_staged(&mut self, tag: u8, resp: oneshot::Sender<Result<CommitSummary>>) {
+        let received_at = Instant::now();
+        let can_priority_tx = self.can_priority_tx.clone();
+        let config_cache = self.config_cache.clone();
+        let staged = self.staged_writes.take(tag);
+        tokio::spawn(async move {
+            a3_message::commit_staged(can_priority_tx, tag).await;
+            let latency = received_at.elapsed();
+            log::info!(
+                "Committed staged tag {} on {} modules; latency={}us",
+                tag,
+                staged.len(),
+                latency.as_micros()
+            );
+            let num_modules = staged.len();
+            for (id, _) in staged {
+                config_cache.remove(id);
+            }
+            resp.send(Ok(CommitSummary {
+                tag,
+                num_modules,
+                latency,
+            }))
+            .unwrap();
+        });
+    }
+
+    fn discard_staged(&mut self, tag: u8, resp: oneshot::Sender<Result<()>>) {
+        let can_tx = self.can_tx.clone();
+        self.staged_writes.take(tag);
+        tokio::spawn(async move {
+            a3_message::discard_staged(can_tx, tag).await;
+            resp.send(Ok(())).unwrap();
+        });
+    }
+
+    fn fan_out(
+        &mut self,
+        op: FanOutOp,
+        progress: Sender<FanOutProgress>,
+        deadline: Deadline,
+        resp: oneshot::Sender<Result<FanOutSummary>>,
+    ) {
+        let modules_tx = self.modules_tx.clone();
+        let registry = self.registry.clone();
+        let streams_tx = self.streams_tx.clone();
+        let can_tx = self.can_tx.clone();
+        let limiter = self.transfer_limiter.clone();
+        let config_cache = self.config_cache.clone();
+        let staged_writes = self.staged_writes.clone();
+        let write_planner = self.write_planner.clone();
+        tokio::spawn(async move {
+            let result = fanout::run(
+                op,
+                modules_tx,
+                registry,
+                streams_tx,
+                can_tx,
+                config_cache,
+                staged_writes,
+                write_planner,
+                limiter,
+                progress,
+                deadline,
+            )
+            .await;
+            if let Err(e) = resp.send(result) {
+                log::error!("Error in sending back the fan-out result: {:?}", e);
+            }
+        });
+    }
+
+    fn watch(
+        &mut self,
+        id: u8,
+        property_name: &str,
+        interval: Duration,
+        updates: watch::UpdateSender,
+        resp: oneshot::Sender<Result<()>>,
+    ) {
+        let result = resolve_module_def(&self.registry, id).and_then(|module_def| {
+            let Some(property_def) = module_def.get_property_def_by_name(property_name) else {
+                return Err(AppError::new(
+                    ErrorType::UserCommandInvalidRequest,
+                    format!("No such property: {}", property_name),
+                ));
+            };
+            let property_id = property_def.id;
+            self.watches
+                .subscribe(id, module_def, property_id, interval, updates);
+            log::debug!(
+                "Watching {} of module {}; {} properties watched",
+                property_name,
+                id,
+                self.watches.num_watched()
+            );
+            return Ok(());
+        });
+        if let Err(e) = resp.send(result) {
+            log::error!("Error in sending back the watch result: {:?}", e);
+        }
+    }
+
+    /// Queues a scalar property on the realtime channel. Answers once queued; the module
+    /// does not acknowledge realtime values.
+    fn set_realtime(
+        &mut self,
+        id: u8,
+        property_name: &str,
+        value: &str,
+        received_at: Instant,
+        resp: oneshot::Sender<Result<bool>>,
+    ) {
+        let result = resolve_module_def(&self.registry, id).and_then(|module_def| {
+            let Some(property_def) = module_def.get_property_def_by_name(property_name) else {
+                return Err(AppError::new(
+                    ErrorType::UserCommandInvalidRequest,
+                    format!("No such property: {}", property_name),
+                ));
+            };
+            match property_def.value_type {
+                ValueType::U8 | ValueType::U16 | ValueType::U32 | ValueType::Boolean => {}
+                _ => {
+                    return Err(AppError::new(
+                        ErrorType::UserCommandInvalidRequest,
+                        format!("{} is not a scalar property", property_name),
+                    ));
                 }
-                Err(e) => resp.send(Err(e)).unwrap(),
             }
+            if property_def.read_only.unwrap_or(false) {
+                return Err(AppError::new(
+                    ErrorType::UserCommandInvalidRequest,
+                    format!("Property is read-only: {}", property_name),
+                ));
+            }
+            let property = Property::from_string(property_def.id, value, &property_def.value_type)?;
+            return Ok(self.realtime.update(id, property, received_at));
         });
+        if let Err(e) = resp.send(result) {
+            log::debug!("Realtime value queued for a gone session: {:?}", e);
+        }
     }
 
     fn request_uid_cancel(&mut self, uid: u32, resp: oneshot::Sender<Result<()>>) {
@@ -406,25 +825,247 @@ impl MissionControl {
     }
 }
 
+/// Pings the module and waits up to `reply_timeout` for the reply. The stream of the ping
+/// is terminated here if it was started; a ping that fails to start it because another one
+/// is running fails with `A3StreamConflict` and leaves the stream to its owner.
 async fn ping_core(
     streams_tx: Sender<streams::Operation>,
     can_tx: Sender<CanMessage>,
     id: u8,
     enable_visual: bool,
-) -> Result<()> {
+    reply_timeout: Duration,
+    deadline: Deadline,
+) -> Result<Duration> {
     let stream_id = id as u16 + a3::A3_ID_INDIVIDUAL_MODULE_BASE;
+    deadline.check()?;
 
     // start a stream
     let stream_resp_rx = start_stream(streams_tx.clone(), stream_id).await?;
 
     // ping
-    a3_message::ping(can_tx, id, enable_visual).await;
+    let sent_at = Instant::now();
+    a3_message::ping(can_tx, id, enable_visual, deadline.instant()).await;
 
     // wait for the response
-    return match timeout(Duration::from_secs(10), stream_resp_rx).await {
-        Ok(_) => Ok(()),
-        Err(_) => Err(AppError::timeout()),
-    };
+    let result = deadline.timeout(reply_timeout, stream_resp_rx).await;
+    terminate_stream(streams_tx, stream_id).await;
+    let _response = result?;
+    return Ok(sent_at.elapsed());
+}
+
+async fn get_config_on_new_wire(
+    streams_tx: Sender<streams::Operation>,
+    can_tx: Sender<CanMessage>,
+    modules_tx: Sender<a3_modules::Operation>,
+    config_cache: Arc<config_cache::ConfigCache>,
+    id: u8,
+    deadline: Deadline,
+    parts: Option<&mut ResponseStream<PropertyEntry>>,
+) -> Result<Vec<Property>> {
+    deadline.check()?;
+    let (wire_addr, stream_resp_rx) = create_wire(streams_tx.clone()).await?;
+    let result = get_config_core(
+        streams_tx.clone(),
+        can_tx,
+        modules_tx,
+        id,
+        wire_addr,
+        stream_resp_rx,
+        deadline,
+        parts,
+    )
+    .await;
+    terminate_stream(streams_tx, wire_addr).await;
+    if let Ok(properties) = &result {
+        config_cache.store(id, properties);
+    }
+    return result;
+}
+
+/// Reads the properties of the IDs off the module. A module that does not take property
+/// reads has its whole config read instead.
+async fn read_properties_on_new_wire(
+    streams_tx: Sender<streams::Operation>,
+    can_tx: Sender<CanMessage>,
+    modules_tx: Sender<a3_modules::Operation>,
+    config_cache: Arc<config_cache::ConfigCache>,
+    id: u8,
+    property_ids: Vec<u8>,
+    deadline: Deadline,
+) -> Result<Vec<Property>> {
+    let mut properties = Vec::with_capacity(property_ids.len());
+    for chunk in property_ids.chunks(MAX_PROPERTIES_PER_READ) {
+        deadline.check()?;
+        let (wire_addr, stream_resp_rx) = create_wire(streams_tx.clone()).await?;
+        let result = read_properties_core(
+            streams_tx.clone(),
+            can_tx.clone(),
+            id,
+            wire_addr,
+            stream_resp_rx,
+            chunk,
+            deadline,
+        )
+        .await;
+        terminate_stream(streams_tx.clone(), wire_addr).await;
+        match result {
+            Ok(read) => properties.extend(read),
+            Err(AppError {
+                error_type: ErrorType::A3OpCodeUnknown,
+                ..
+            }) => {
+                let config = get_config_on_new_wire(
+                    streams_tx,
+                    can_tx,
+                    modules_tx,
+                    config_cache,
+                    id,
+                    deadline,
+                    None,
+                )
+                .await?;
+                return Ok(config
+                    .into_iter()
+                    .filter(|property| property_ids.contains(&property.id))
+                    .collect());
+            }
+            Err(e) => return Err(e),
+        }
+    }
+    config_cache.merge(id, &properties);
+    return Ok(properties);
+}
+
+async fn set_config_on_new_wire(
+    streams_tx: Sender<streams::Operation>,
+    can_tx: Sender<CanMessage>,
+    modules_tx: Sender<a3_modules::Operation>,
+    config_cache: Arc<config_cache::ConfigCache>,
+    id: u8,
+    props: Vec<Property>,
+    deadline: Deadline,
+) -> Result<()> {
+    deadline.check()?;
+    let (wire_addr, stream_resp_rx) = create_wire(streams_tx.clone()).await?;
+    let result = set_config_core(
+        streams_tx.clone(),
+        can_tx,
+        modules_tx,
+        id,
+        &props,
+        wire_addr,
+        stream_resp_rx,
+        deadline,
+    )
+    .await;
+    terminate_stream(streams_tx, wire_addr).await;
+    if result.is_ok() {
+        config_cache.merge(id, &props);
+    }
+    return result;
+}
+
+/// Writes properties through the write planner. The properties are validated against the
+/// module definition, then merged with other writes queued for the module, and finally
+/// diffed against the last known config. Returns the number of properties written.
+async fn write_config(
+    streams_tx: Sender<streams::Operation>,
+    can_tx: Sender<CanMessage>,
+    modules_tx: Sender<a3_modules::Operation>,
+    registry: RegistryReader,
+    config_cache: Arc<config_cache::ConfigCache>,
+    write_planner: Arc<write_planner::WritePlanner>,
+    id: u8,
+    props: Vec<Property>,
+) -> Result<usize> {
+    let module_def = resolve_module_def(&registry, id)?;
+    write_planner::validate(&props, &module_def)?;
+    let (resp_tx, resp_rx) = oneshot::channel();
+    if write_planner.enqueue(id, &props, resp_tx) {
+        tokio::spawn(async move {
+            while let Some((props, waiters)) = write_planner.take(id) {
+                // a config cached for the module that had the ID before does not count
+                let current = match registry.load().get_by_id(id) {
+                    Ok(module) => config_cache.get_by_uid(module.uid),
+                    Err(e) => {
+                        for waiter in waiters {
+                            let _ = waiter.send(Err(e.clone()));
+                        }
+                        continue;
+                    }
+                };
+                let planned = write_planner::plan(current.as_deref(), &props, &module_def);
+                let result = if planned.is_empty() {
+                    log::debug!("No properties to write; id={:02x}", id);
+                    Ok(0)
+                } else {
+                    set_config_on_new_wire(
+                        streams_tx.clone(),
+                        can_tx.clone(),
+                        modules_tx.clone(),
+                        config_cache.clone(),
+                        id,
+                        planned.clone(),
+                        // the write is shared by all the waiters; it is not cut short
+                        // for one of them
+                        Deadline::NONE,
+                    )
+                    .await
+                    .map(|_| planned.len())
+                };
+                for waiter in waiters {
+                    let _ = waiter.send(result.clone());
+                }
+            }
+        });
+    }
+    return resp_rx.await.unwrap();
+}
+
+/// Returns the definition of the module. Only the common properties are known until the
+/// module type is resolved.
+fn resolve_module_def(registry: &RegistryReader, id: u8) -> Result<Arc<ModuleDef>> {
+    let module = registry.load().get_by_id(id)?;
+    match module.module_type_id {
+        Some(type_id) => match modules_schema().get(&type_id) {
+            Some(module_def) => Ok(module_def.clone()),
+            None => Err(AppError::new(
+                ErrorType::A3SchemaError,
+                format!("Schema unknown for module type {:04x}", type_id),
+            )),
+        },
+        None => Ok(COMMON_MODULE_DEF.clone()),
+    }
+}
+
+async fn stage_config_on_new_wire(
+    streams_tx: Sender<streams::Operation>,
+    can_tx: Sender<CanMessage>,
+    staged_writes: Arc<preset::StagedWrites>,
+    id: u8,
+    tag: u8,
+    props: Vec<Property>,
+    deadline: Deadline,
+) -> Result<()> {
+    deadline.check()?;
+    let (wire_addr, stream_resp_rx) = create_wire(streams_tx.clone()).await?;
+    let result = write_config_core(
+        streams_tx.clone(),
+        can_tx,
+        a3::A3_MC_STAGE_CONFIG,
+        &[tag],
+        id,
+        &props,
+        wire_addr,
+        stream_resp_rx,
+        deadline,
+    )
+    .await;
+    terminate_stream(streams_tx, wire_addr).await;
+    if result.is_ok() {
+        staged_writes.add(tag, id, &props);
+    }
+    return result;
 }
 
 async fn get_name_core(
@@ -433,6 +1074,7 @@ async fn get_name_core(
     id: u8,
     wire_id: u16,
     init_stream_resp_rx: oneshot::Receiver<CanMessage>,
+    deadline: Deadline,
 ) -> Result<String> {
     let mut stream_resp_rx = Some(init_stream_resp_rx);
 
@@ -441,33 +1083,36 @@ async fn get_name_core(
         &streams_tx,
         &can_tx,
         a3::A3_MC_REQUEST_NAME,
+        &[],
+        0,
         id,
         wire_id,
         &mut stream_resp_rx,
+        deadline,
     )
     .await?;
 
     // control the stream
-    let mut chunk_parser = ChunkParser::for_single_field();
+    let mut config_parser = ConfigParser::for_single_field();
     loop {
+        deadline.check()?;
         stream_resp_rx.replace(continue_stream(streams_tx.clone(), wire_id).await?);
-        a3_message::request_to_continue(can_tx.clone(), wire_id).await;
-        let Ok(result) = timeout(Duration::from_secs(10), stream_resp_rx.take().unwrap()).await
-        else {
-            return Err(AppError::timeout());
-        };
-        let message = result.unwrap();
+        a3_message::request_to_continue(can_tx.clone(), wire_id, deadline.instant()).await;
+        let message = deadline
+            .timeout(STREAM_TIMEOUT, stream_resp_rx.take().unwrap())
+            .await?
+            .unwrap();
         let data = &message.data();
         let size = message.data_length() as usize;
         if size < 1 {
             return Err(AppError::runtime("zero-length data received"));
         }
-        match chunk_parser.data(&data.as_slice(), size) {
+        match config_parser.data(&data.as_slice(), size) {
             Ok(is_done) => {
                 if is_done {
-                    let properties = chunk_parser.commit().unwrap();
-                    return match properties[0].get_value_as_string() {
-                        Ok(name) => Ok(name),
+                    let config = config_parser.commit().unwrap();
+                    return match config.get(0).as_text() {
+                        Ok(name) => Ok(name.to_string()),
                         Err(e) => {
                             log::warn!("Data reading error: {:?}", e);
                             Err(AppError::runtime("Detected corrupted data"))
@@ -490,54 +1135,92 @@ async fn get_config_core(
     id: u8,
     wire_id: u16,
     init_stream_resp_rx: oneshot::Receiver<CanMessage>,
+    deadline: Deadline,
+    mut parts: Option<&mut ResponseStream<PropertyEntry>>,
 ) -> Result<Vec<Property>> {
     let mut stream_resp_rx = Some(init_stream_resp_rx);
 
-    initiate_stream_command(
+    let options = initiate_stream_command(
         &streams_tx,
         &can_tx,
         a3::A3_MC_REQUEST_CONFIG,
+        &[],
+        CONFIG_STREAM_OPTIONS,
         id,
         wire_id,
         &mut stream_resp_rx,
+        deadline,
     )
     .await?;
 
     // control the stream
-    let mut chunk_parser = ChunkParser::new();
+    let mut config_parser = ConfigParser::new();
+    if options & a3::A3_STREAM_OPT_PACKED != 0 {
+        config_parser.enable_packing();
+    }
+    // fields are named by the common definition until the module type arrives
+    let mut module_def = COMMON_MODULE_DEF.clone();
+    let mut num_sent = 0;
     loop {
+        deadline.check()?;
         stream_resp_rx.replace(continue_stream(streams_tx.clone(), wire_id).await?);
-        a3_message::request_to_continue(can_tx.clone(), wire_id).await;
-        let Ok(result) = timeout(Duration::from_secs(10), stream_resp_rx.take().unwrap()).await
-        else {
-            return Err(AppError::timeout());
-        };
-        let message = result.unwrap();
+        a3_message::request_to_continue(can_tx.clone(), wire_id, deadline.instant()).await;
+        let message = deadline
+            .timeout(STREAM_TIMEOUT, stream_resp_rx.take().unwrap())
+            .await?
+            .unwrap();
         let data = &message.data();
         let size = message.data_length() as usize;
         if size < 1 {
             return Err(AppError::runtime("zero-length data received"));
         }
-        match chunk_parser.data(&data.as_slice(), size) {
+        match config_parser.data(&data.as_slice(), size) {
             Ok(is_done) => {
+                if let Some(parts) = parts.as_deref_mut() {
+                    while num_sent < config_parser.num_completed() {
+                        let field = config_parser.completed_field(num_sent);
+                        num_sent += 1;
+                        if field.id == A3_PROP_ID_MODULE_TYPE {
+                            if let Some(def) = field
+                                .as_u16()
+                                .ok()
+                                .and_then(|type_id| modules_schema().get(&type_id).cloned())
+                            {
+                                module_def = def;
+                            }
+                        }
+                        let property = field.to_property();
+                        let entry = PropertyEntry {
+                            id: property.id,
+                            name: property_name(&module_def, &property),
+                            value: property_value_as_string(&module_def, &property),
+                        };
+                        if !parts.send(&entry).await {
+                            return Err(AppError::runtime("Response receiver is gone"));
+                        }
+                    }
+                }
                 if is_done {
-                    let properties = chunk_parser.commit().unwrap();
+                    let config = config_parser.commit().unwrap();
                     // TODO: make following a subroutine.
                     let mut name: Option<String> = None;
-                    let mut module_type: Option<String> = None;
+                    let mut module_type: Option<Arc<str>> = None;
                     let mut module_type_id: Option<u16> = None;
-                    for property in &properties {
+                    for property in config.iter() {
                         match property.id {
-                            A3_PROP_ID_NAME => {
-                                name.replace(property.get_value_as_string().unwrap());
-                            }
+                            A3_PROP_ID_NAME => match property.as_text() {
+                                Ok(text) => {
+                                    name.replace(text.to_string());
+                                }
+                                Err(_) => log::warn!("Module {} reported a broken name", id),
+                            },
                             A3_PROP_ID_MODULE_TYPE => {
-                                let type_id: u16 = property
-                                    .get_value_with_type(&ValueType::U16)
-                                    .as_u16()
-                                    .unwrap();
+                                let Ok(type_id) = property.as_u16() else {
+                                    log::warn!("Module {} reported a broken module type", id);
+                                    continue;
+                                };
                                 module_type_id.replace(type_id);
-                                if let Some(module_def) = MODULES_SCHEMA.get(&type_id) {
+                                if let Some(module_def) = modules_schema().get(&type_id) {
                                     module_type.replace(module_def.module_type_name.clone());
                                 }
                             }
@@ -551,7 +1234,7 @@ async fn get_config_core(
                         module_type_id,
                     };
                     modules_tx.send(modules_op).await.unwrap();
-                    return Ok(properties);
+                    return Ok(config.to_properties());
                 }
             }
             Err(e) => {
@@ -562,23 +1245,94 @@ async fn get_config_core(
     }
 }
 
+/// Reads a few properties; the reply is shaped like a config read with only those in it.
+async fn read_properties_core(
+    streams_tx: Sender<streams::Operation>,
+    can_tx: Sender<CanMessage>,
+    id: u8,
+    wire_id: u16,
+    init_stream_resp_rx: oneshot::Receiver<CanMessage>,
+    property_ids: &[u8],
+    deadline: Deadline,
+) -> Result<Vec<Property>> {
+    let mut stream_resp_rx = Some(init_stream_resp_rx);
+    // the property IDs fill the frame, which leaves no room for options
+    initiate_stream_command(
+        &streams_tx,
+        &can_tx,
+        a3::A3_MC_REQUEST_PROPERTIES,
+        property_ids,
+        0,
+        id,
+        wire_id,
+        &mut stream_resp_rx,
+        deadline,
+    )
+    .await?;
+
+    let mut config_parser = ConfigParser::new();
+    loop {
+        deadline.check()?;
+        stream_resp_rx.replace(continue_stream(streams_tx.clone(), wire_id).await?);
+        a3_message::request_to_continue(can_tx.clone(), wire_id, deadline.instant()).await;
+        let message = deadline
+            .timeout(STREAM_TIMEOUT, stream_resp_rx.take().unwrap())
+            .await?
+            .unwrap();
+        let size = message.data_length() as usize;
+        if size < 1 {
+            return Err(AppError::runtime("zero-length data received"));
+        }
+        match config_parser.data(&message.data().as_slice(), size) {
+            Ok(true) => return Ok(config_parser.commit().unwrap().to_properties()),
+            Ok(false) => {}
+            Err(e) => {
+                let message = format!("ReadProperties: Data parsing failed: {:?}", e);
+                return Err(AppError::runtime(message.as_str()));
+            }
+        }
+    }
+}
+
 /// keep sending streaming command request until the remote node is ready
+///
+/// Non-zero `options` are offered to the peer after the arguments. Returns the options the
+/// peer has accepted; a peer that does not know them replies with the status only.
 async fn initiate_stream_command(
     streams_tx: &Sender<streams::Operation>,
     can_tx: &Sender<CanMessage>,
     opcode: u8,
+    args: &[u8],
+    options: u8,
     id: u8,
     wire_id: u16,
     stream_resp_rx: &mut Option<oneshot::Receiver<CanMessage>>,
-) -> Result<()> {
+    deadline: Deadline,
+) -> Result<u8> {
     let wire_num = (wire_id - a3::A3_ID_ADMIN_WIRES_BASE) as u8;
+    let mut request_args = args.to_vec();
+    if options != 0 {
+        request_args.push(options);
+    }
 
     const MAX_TRIALS: usize = 9;
     let mut num_trials = 0usize;
     let mut sleep_millis = 100u64;
     loop {
-        a3_message::request_command(can_tx.clone(), opcode, id, wire_num).await;
-        if let Ok(resp) = timeout(Duration::from_secs(10), stream_resp_rx.take().unwrap()).await {
+        deadline.check()?;
+        a3_message::request_command(
+            can_tx.clone(),
+            opcode,
+            id,
+            wire_num,
+            &request_args,
+            deadline.instant(),
+        )
+        .await;
+        if let Ok(resp) = deadline
+            .timeout(STREAM_TIMEOUT, stream_resp_rx.take().unwrap())
+            .await
+        {
             let message = resp.unwrap();
             if message.data_length() < 1 {
                 return Err(AppError::new(
@@ -594,11 +1348,20 @@ async fn initiate_stream_command(
             };
             match status {
                 StreamStatus::Ready => {
-                    break;
+                    if message.data_length() < 2 {
+                        return Ok(0);
+                    }
+                    return Ok(message.data()[1] & options);
                 }
                 StreamStatus::Busy => {
                     // continue
                 }
+                StreamStatus::NotSupported => {
+                    return Err(AppError::new(
+                        ErrorType::A3OpCodeUnknown,
+                        format!("opcode {:02x} not supported by module {}", opcode, id),
+                    ));
+                }
                 _ => {
                     return Err(AppError::new(
                         ErrorType::A3CommunicationError,
@@ -612,7 +1375,7 @@ async fn initiate_stream_command(
         num_trials += 1;
         if num_trials == MAX_TRIALS {
             return Err(AppError::new(
-                ErrorType::A3CommunicationError,
+                ErrorType::Busy,
                 "Remote peer is busy".to_string(),
             ));
         }
@@ -620,7 +1383,6 @@ async fn initiate_stream_command(
         sleep_millis *= 2;
         stream_resp_rx.replace(continue_stream(streams_tx.clone(), wire_id).await?);
     }
-    Ok(())
 }
 
 async fn set_config_core(
@@ -628,53 +1390,92 @@ async fn set_config_core(
     can_tx: Sender<CanMessage>,
     modules_tx: Sender<a3_modules::Operation>,
     id: u8,
-    props: Vec<Property>,
+    props: &Vec<Property>,
     wire_id: u16,
     init_stream_resp_rx: oneshot::Receiver<CanMessage>,
+    deadline: Deadline,
+) -> Result<()> {
+    write_config_core(
+        streams_tx,
+        can_tx,
+        a3::A3_MC_MODIFY_CONFIG,
+        &[],
+        id,
+        props,
+        wire_id,
+        init_stream_resp_rx,
+        deadline,
+    )
+    .await?;
+    update_module_name(&modules_tx, id, props).await;
+    return Ok(());
+}
+
+/// Streams properties to the module by a config writing command, i.e., modify or stage.
+async fn write_config_core(
+    streams_tx: Sender<streams::Operation>,
+    can_tx: Sender<CanMessage>,
+    opcode: u8,
+    args: &[u8],
+    id: u8,
+    props: &Vec<Property>,
+    wire_id: u16,
+    init_stream_resp_rx: oneshot::Receiver<CanMessage>,
+    deadline: Deadline,
 ) -> Result<()> {
     let mut stream_resp_rx = Some(init_stream_resp_rx);
 
-    // initiate modify config stream
-    initiate_stream_command(
+    // initiate the config writing stream
+    let options = initiate_stream_command(
         &streams_tx,
         &can_tx,
-        a3::A3_MC_MODIFY_CONFIG,
+        opcode,
+        args,
+        CONFIG_STREAM_OPTIONS,
         id,
         wire_id,
         &mut stream_resp_rx,
+        deadline,
     )
     .await?;
+    let packing = options & a3::A3_STREAM_OPT_PACKED != 0;
+    let frames = a3_message::encode_config_frames(wire_id, props, packing);
 
-    // control the stream
-    let mut encoder = PropertyEncoder::new(&props);
-    loop {
-        let mut out_message = CanMessage::new();
-        out_message.set_id(wire_id as u32);
-        out_message.set_extended(false);
-        out_message.set_remote(false);
-        let num_flushed_bytes = encoder.flush(out_message.mut_data());
-        out_message.set_data_length(num_flushed_bytes as u8);
-        if !encoder.is_done() {
+    // control the stream; the peer acknowledges each frame before the next one goes out
+    for (index, frame) in frames.iter().enumerate() {
+        let is_last = index + 1 == frames.len();
+        deadline.check()?;
+        if !is_last {
             stream_resp_rx.replace(continue_stream(streams_tx.clone(), wire_id).await?);
         }
-        can_tx.send(out_message).await.unwrap();
-        if encoder.is_done() {
+        let mut message = CanMessage::from_frame(frame);
+        message.set_deadline(deadline.instant());
+        can_tx.send(message).await.unwrap();
+        if is_last {
             break;
         }
-        let Ok(_result) = timeout(Duration::from_secs(10), stream_resp_rx.take().unwrap()).await
-        else {
-            return Err(AppError::timeout());
-        };
+        let _result = deadline
+            .timeout(STREAM_TIMEOUT, stream_resp_rx.take().unwrap())
+            .await?;
     }
+    return Ok(());
+}
+
+/// Reflects a written name property to the module registry.
+async fn update_module_name(
+    modules_tx: &Sender<a3_modules::Operation>,
+    id: u8,
+    props: &Vec<Property>,
+) {
     let mut name: Option<String> = None;
-    for prop in &props {
+    for prop in props {
         if prop.id == A3_PROP_ID_NAME {
             name.replace(prop.get_value_as_string().unwrap());
             break;
         }
     }
     if name.is_some() {
-        let module_type: Option<String> = None;
+        let module_type: Option<Arc<str>> = None;
         let module_type_id: Option<u16> = None;
         let modules_op = a3_modules::Operation::SetProperties {
             id,
@@ -684,7 +1485,6 @@ async fn set_config_core(
         };
         modules_tx.send(modules_op).await.unwrap();
     }
-    return Ok(());
 }
 
 async fn assign_remote_id(
@@ -813,3 +1613,141 @@ async fn terminate_stream(streams_tx: Sender<streams::Operation>, stream_id: u16
         .unwrap();
     term_resp_rx.await.unwrap().unwrap();
 }
+
+#[cfg(test)]
+mod tests {
+    use tokio::sync::mpsc;
+
+    use super::*;
+    use crate::analog3::A3_PROP_ID_MODULE_UID;
+
+    #[tokio::test]
+    async fn test_ping_past_deadline_leaves_liveness() {
+        let (can_tx, mut can_rx) = mpsc::channel(8);
+        let (can_priority_tx, _can_priority_rx) = mpsc::channel(8);
+        let (modules_tx, mut modules_rx) = mpsc::channel(8);
+        let registry = a3_modules::A3Modules::new().reader();
+        let mut mission_control =
+            MissionControl::new(can_tx, can_priority_tx, modules_tx, registry);
+
+        let (resp, resp_rx) = oneshot::channel();
+        let command = Command::Ping {
+            id: 3,
+            enable_visual: false,
+            resp,
+        };
+        mission_control.handle_command(command, Some(Instant::now()));
+        let error = resp_rx.await.unwrap().unwrap_err();
+        assert!(matches!(error.error_type, ErrorType::DeadlineExceeded));
+        // nothing went on the bus, and the module is not reported dead
+        assert!(can_rx.try_recv().is_err());
+        assert!(modules_rx.try_recv().is_err());
+        assert!(mission_control.rtt_stats.lock().unwrap().get(3).is_none());
+    }
+
+    #[tokio::test]
+    async fn test_write_after_id_reassignment() {
+        let (can_tx, mut can_rx) = mpsc::channel(8);
+        let (modules_tx, _modules_rx) = mpsc::channel(8);
+        let mut modules = a3_modules::A3Modules::new();
+        modules.register(0x1111, 3);
+        let registry = modules.reader();
+        let config_cache = Arc::new(config_cache::ConfigCache::new());
+        config_cache::start(config_cache.clone(), registry.clone());
+        let name = Property::text(A3_PROP_ID_NAME, "amp");
+        let config = vec![Property::u32(A3_PROP_ID_MODULE_UID, 0x1111), name.clone()];
+        config_cache.store(3, &config);
+
+        // another module takes the ID; its name may well differ from the cached one
+        modules.register(0x2222, 3);
+        let (streams_tx, _) = streams::start();
+        tokio::spawn(write_config(
+            streams_tx,
+            can_tx,
+            modules_tx,
+            registry,
+            config_cache.clone(),
+            Arc::new(write_planner::WritePlanner::new()),
+            3,
+            vec![name],
+        ));
+        let sent = tokio::time::timeout(Duration::from_secs(1), can_rx.recv()).await;
+        assert!(sent.unwrap().is_some());
+        while config_cache.get_by_uid(0x1111).is_some() {
+            sleep(Duration::from_millis(1)).await;
+        }
+    }
+
+    #[tokio::test]
+    async fn test_commit_drops_cached_configs() {
+        let (can_tx, _can_rx) = mpsc::channel(8);
+        let (can_priority_tx, mut can_priority_rx) = mpsc::channel(8);
+        let (modules_tx, _modules_rx) = mpsc::channel(8);
+        let registry = a3_modules::A3Modules::new().reader();
+        let mut mission_control =
+            MissionControl::new(can_tx, can_priority_tx, modules_tx, registry);
+        let config = vec![
+            Property::u32(A3_PROP_ID_MODULE_UID, 0x1111),
+            Property::text(A3_PROP_ID_NAME, "amp"),
+        ];
+        mission_control.config_cache.store(3, &config);
+        let name = vec![Property::text(A3_PROP_ID_NAME, "vca")];
+        mission_control.staged_writes.add(1, 3, &name);
+
+        let (resp, resp_rx) = oneshot::channel();
+        mission_control.commit_staged(1, resp);
+        assert_eq!(resp_rx.await.unwrap().unwrap().num_modules, 1);
+        assert!(can_priority_rx.try_recv().is_ok());
+        // whether the module took the staged name is not known
+        assert!(mission_control.config_cache.get_by_uid(0x1111).is_none());
+    }
+
+    #[tokio::test]
+    async fn test_fan_out_past_deadline() {
+        let (can_tx, mut can_rx) = mpsc::channel(8);
+        let (can_priority_tx, _can_priority_rx) = mpsc::channel(8);
+        let (modules_tx, _modules_rx) = mpsc::channel(8);
+        let mut modules = a3_modules::A3Modules::new();
+        modules.register(0x1111, 3);
+        modules.register(0x2222, 4);
+        let mut mission_control =
+            MissionControl::new(can_tx, can_priority_tx, modules_tx, modules.reader());
+
+        let (progress, mut progress_rx) = mpsc::channel(8);
+        let (resp, resp_rx) = oneshot::channel();
+        let command = Command::FanOut {
+            op: FanOutOp::GetConfig { module_type: None },
+            progress,
+            resp,
+        };
+        mission_control.handle_command(command, Some(Instant::now()));
+        let summary = resp_rx.await.unwrap().unwrap();
+        assert_eq!((summary.total, summary.failed), (2, 2));
+        while let Ok(progress) = progress_rx.try_recv() {
+            let error = progress.result.unwrap_err();
+            assert!(matches!(error.error_type, ErrorType::DeadlineExceeded));
+        }
+        assert!(can_rx.try_recv().is_err());
+    }
+
+    #[tokio::test]
+    async fn test_realtime_rejects_read_only() {
+        let (can_tx, _can_rx) = mpsc::channel(8);
+        let (can_priority_tx, mut can_priority_rx) = mpsc::channel(8);
+        let (modules_tx, _modules_rx) = mpsc::channel(8);
+        let mut modules = a3_modules::A3Modules::new();
+        modules.register(0x1234, 3);
+        let mut mission_control =
+            MissionControl::new(can_tx, can_priority_tx, modules_tx, modules.reader());
+
+        let (resp, resp_rx) = oneshot::channel();
+        mission_control.set_realtime(3, "module_uid", "5", Instant::now(), resp);
+        let error = resp_rx.await.unwrap().unwrap_err();
+        assert!(matches!(
+            error.error_type,
+            ErrorType::UserCommandInvalidRequest
+        ));
+        assert_eq!(mission_control.realtime.stats().received, 0);
+        assert!(can_priority_rx.try_recv().is_err());
+    }
+}
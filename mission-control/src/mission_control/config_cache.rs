@@ -0,0 +1,222 @@
+use std::{
+    collections::HashMap,
+    sync::{Arc, Mutex},
+};
+
+use tokio::task::JoinHandle;
+
+use super::{shared_state::SharedState, write_planner::merge_properties};
+use crate::{
+    a3_modules::{ModuleEvent, RegistryReader},
+    analog3::{A3_PROP_ID_MODULE_UID, config::Property, schema::ModuleDef},
+};
+
+/// Last known configs of the modules, keyed by UID. A config is dropped when its module
+/// registers or deregisters, as the module may have been power-cycled or replaced.
+pub struct ConfigCache {
+    state: Mutex<CacheState>,
+}
+
+struct CacheState {
+    configs_by_uid: HashMap<u32, Vec<Property>>,
+    uid_by_id: HashMap<u8, u32>,
+    /// Where the configs are published for local readers, if anywhere
+    shared: Option<Arc<SharedState>>,
+}
+
+impl ConfigCache {
+    pub fn new() -> Self {
+        Self {
+            state: Mutex::new(CacheState {
+                configs_by_uid: HashMap::new(),
+                uid_by_id: HashMap::new(),
+                shared: None,
+            }),
+        }
+    }
+
+    /// Publishes the configs to the shared memory region from now on.
+    pub fn publish_to(&self, shared: Arc<SharedState>) {
+        self.state.lock().unwrap().shared = Some(shared);
+    }
+
+    /// Stores a full config read from the module.
+    pub fn store(&self, id: u8, properties: &Vec<Property>) {
+        let Some(uid) = properties
+            .iter()
+            .find(|property| property.id == A3_PROP_ID_MODULE_UID)
+            .and_then(|property| <[u8; 4]>::try_from(property.data.as_slice()).ok())
+            .map(u32::from_be_bytes)
+        else {
+            return;
+        };
+        let mut state = self.state.lock().unwrap();
+        state.uid_by_id.insert(id, uid);
+        state.configs_by_uid.insert(uid, properties.clone());
+        if let Some(shared) = &state.shared {
+            shared.set_config(id, uid, properties);
+        }
+    }
+
+    /// Applies written properties to the cached config of the module, if any.
+    pub fn merge(&self, id: u8, properties: &Vec<Property>) {
+        let mut state = self.state.lock().unwrap();
+        let Some(uid) = state.uid_by_id.get(&id).copied() else {
+            return;
+        };
+        let Some(cached) = state.configs_by_uid.get_mut(&uid) else {
+            return;
+        };
+        merge_properties(cached, properties);
+        if let Some(shared) = &state.shared {
+            shared.set_config(id, uid, &state.configs_by_uid[&uid]);
+        }
+    }
+
+    /// Drops a property from the cached config of the module, so that the next write of it
+    /// is not planned away. For values sent without an ack, which may not have arrived.
+    pub fn invalidate(&self, id: u8, property_id: u8) {
+        let mut state = self.state.lock().unwrap();
+        let Some(uid) = state.uid_by_id.get(&id).copied() else {
+            return;
+        };
+        let Some(cached) = state.configs_by_uid.get_mut(&uid) else {
+            return;
+        };
+        cached.retain(|property| property.id != property_id);
+        if let Some(shared) = &state.shared {
+            shared.set_config(id, uid, &state.configs_by_uid[&uid]);
+        }
+    }
+
+    /// Drops the cached config of the module at the ID.
+    pub fn remove(&self, id: u8) {
+        let mut state = self.state.lock().unwrap();
+        if let Some(uid) = state.uid_by_id.remove(&id) {
+            state.configs_by_uid.remove(&uid);
+        }
+    }
+
+    /// Drops what is known of the module at the ID and of the UID.
+    pub fn forget(&self, id: u8, uid: u32) {
+        let mut state = self.state.lock().unwrap();
+        state.uid_by_id.remove(&id);
+        state.configs_by_uid.remove(&uid);
+    }
+
+    pub fn clear(&self) {
+        let mut state = self.state.lock().unwrap();
+        state.uid_by_id.clear();
+        state.configs_by_uid.clear();
+    }
+
+    pub fn get_by_uid(&self, uid: u32) -> Option<Vec<Property>> {
+        self.state.lock().unwrap().configs_by_uid.get(&uid).cloned()
+    }
+}
+
+/// Drops the cached configs of the modules that register or deregister.
+pub fn start(cache: Arc<ConfigCache>, registry: RegistryReader) -> JoinHandle<()> {
+    let subscription = registry.subscribe();
+    tokio::spawn(async move {
+        loop {
+            let batch = subscription.next().await;
+            if batch.num_lost > 0 {
+                cache.clear();
+                continue;
+            }
+            for event in batch.events {
+                match event {
+                    ModuleEvent::Registered { id, uid } | ModuleEvent::Deregistered { id, uid } => {
+                        cache.forget(id, uid)
+                    }
+                    _ => {}
+                }
+            }
+        }
+    })
+}
+
+/// Returns the writable properties in `desired` whose values differ from `current`.
+pub fn changed_properties(
+    current: &[Property],
+    desired: &[Property],
+    module_def: &ModuleDef,
+) -> Vec<Property> {
+    desired
+        .iter()
+        .filter(
+            |property| match module_def.get_property_by_id(property.id) {
+                Some(property_def) => !property_def.read_only.unwrap_or(false),
+                None => false,
+            },
+        )
+        .filter(|property| {
+            !current
+                .iter()
+                .any(|entry| entry.id == property.id && entry.data == property.data)
+        })
+        .cloned()
+        .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::analog3::{
+        A3_PROP_ID_MODULE_TYPE, A3_PROP_ID_NAME,
+        schema::{ModuleDef, modules_schema},
+    };
+    use std::sync::Arc;
+
+    fn amps_def() -> Arc<ModuleDef> {
+        modules_schema().get(&2).unwrap().clone()
+    }
+
+    #[test]
+    fn test_store_and_merge() {
+        let cache = ConfigCache::new();
+        let config = vec![
+            Property::u32(A3_PROP_ID_MODULE_UID, 0x1acebeef),
+            Property::text(A3_PROP_ID_NAME, &"amps".to_string()),
+        ];
+        cache.merge(3, &config);
+        assert!(cache.get_by_uid(0x1acebeef).is_none());
+
+        cache.store(3, &config);
+        cache.merge(
+            3,
+            &vec![Property::text(A3_PROP_ID_NAME, &"vca".to_string())],
+        );
+        cache.merge(3, &vec![Property::u8(3, 1)]);
+        let cached = cache.get_by_uid(0x1acebeef).unwrap();
+        assert_eq!(cached.len(), 3);
+        assert_eq!(cached[1].get_value_as_string().unwrap(), "vca");
+        assert_eq!(cached[2].data, vec![1]);
+
+        cache.invalidate(3, 3);
+        assert_eq!(cache.get_by_uid(0x1acebeef).unwrap().len(), 2);
+    }
+
+    #[test]
+    fn test_changed_properties() {
+        let current = vec![
+            Property::u32(A3_PROP_ID_MODULE_UID, 0x1acebeef),
+            Property::u16(A3_PROP_ID_MODULE_TYPE, 2),
+            Property::u8(3, 1),
+            Property::u16(6, 0x100),
+        ];
+        let desired = vec![
+            Property::u32(A3_PROP_ID_MODULE_UID, 0xba5eba11), // read only
+            Property::u16(A3_PROP_ID_MODULE_TYPE, 2),
+            Property::u8(3, 1),     // unchanged
+            Property::u8(4, 8),     // read only
+            Property::u16(6, 0x80), // changed
+            Property::u16(7, 0x10), // not cached yet
+        ];
+        let changed = changed_properties(&current, &desired, &amps_def());
+        assert_eq!(changed.len(), 2);
+        assert_eq!(changed[0].id, 6);
+        assert_eq!(changed[1].id, 7);
+    }
+}
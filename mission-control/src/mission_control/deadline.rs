@@ -0,0 +1,97 @@
+use std::{future::Future, time::Instant};
+
+use tokio::time::{Duration, timeout};
+
+use super::Result;
+use crate::error::AppError;
+
+/// Time by which the caller wants the result of an operation.
+///
+/// Waits on the bus end at the deadline even if their own timeout is longer, and work not
+/// yet sent is given up once the deadline has passed, so that the wire is released as soon
+/// as nobody is waiting for the result. Running out of the deadline fails with
+/// `DeadlineExceeded` rather than `Timeout`, so it is not taken for a silent module.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct Deadline(Option<Instant>);
+
+impl Deadline {
+    /// No deadline; only the timeouts of the individual waits apply
+    pub const NONE: Deadline = Deadline(None);
+
+    pub fn new(at: Option<Instant>) -> Self {
+        Self(at)
+    }
+
+    pub fn after(duration: Duration) -> Self {
+        Self(Some(Instant::now() + duration))
+    }
+
+    pub fn instant(&self) -> Option<Instant> {
+        self.0
+    }
+
+    /// Fails with `DeadlineExceeded` if the deadline has passed.
+    pub fn check(&self) -> Result<()> {
+        match self.0 {
+            Some(at) if at <= Instant::now() => Err(AppError::deadline_exceeded()),
+            _ => Ok(()),
+        }
+    }
+
+    /// Waits for the future for up to `limit`, or until the deadline if it comes earlier.
+    /// Fails with `Timeout` when `limit` runs out, and with `DeadlineExceeded` when the
+    /// deadline does.
+    pub async fn timeout<F: Future>(&self, limit: Duration, future: F) -> Result<F::Output> {
+        let (limit, cut_short) = match self.0 {
+            Some(at) => {
+                let left = at.saturating_duration_since(Instant::now());
+                (limit.min(left), left < limit)
+            }
+            None => (limit, false),
+        };
+        return match timeout(limit, future).await {
+            Ok(output) => Ok(output),
+            Err(_) if cut_short => Err(AppError::deadline_exceeded()),
+            Err(_) => Err(AppError::timeout()),
+        };
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::error::ErrorType;
+
+    #[tokio::test]
+    async fn test_deadline() {
+        assert!(Deadline::NONE.check().is_ok());
+        assert!(Deadline::after(Duration::from_secs(1)).check().is_ok());
+        assert!(Deadline::new(Some(Instant::now())).check().is_err());
+
+        let deadline = Deadline::after(Duration::from_millis(20));
+        let started_at = Instant::now();
+        let pending = std::future::pending::<()>();
+        let error = deadline
+            .timeout(Duration::from_secs(10), pending)
+            .await
+            .unwrap_err();
+        assert!(matches!(error.error_type, ErrorType::DeadlineExceeded));
+        assert!(started_at.elapsed() < Duration::from_secs(1));
+
+        // the own limit of the wait is a timeout even with a deadline
+        let deadline = Deadline::after(Duration::from_secs(10));
+        let pending = std::future::pending::<()>();
+        let error = deadline
+            .timeout(Duration::from_millis(10), pending)
+            .await
+            .unwrap_err();
+        assert!(matches!(error.error_type, ErrorType::Timeout));
+        assert_eq!(
+            Deadline::NONE
+                .timeout(Duration::from_secs(1), async { 7 })
+                .await
+                .unwrap(),
+            7
+        );
+    }
+}
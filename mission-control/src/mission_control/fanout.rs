@@ -0,0 +1,862 @@
+mod batch;
+
+use std::{
+    fs,
+    sync::{
+        Arc, Mutex,
+        atomic::{AtomicUsize, Ordering},
+    },
+    time::{Duration, Instant},
+};
+
+use tokio::{
+    sync::{Notify, mpsc::Sender},
+    task::JoinSet,
+};
+
+use super::{
+    config_cache::{ConfigCache, changed_properties},
+    deadline::Deadline,
+    get_config_on_new_wire,
+    preset::StagedWrites,
+    set_config_on_new_wire, stage_config_on_new_wire, streams, write_config,
+    write_planner::WritePlanner,
+};
+use crate::{
+    a3_modules::{self, A3Module, RegistryReader},
+    analog3::{
+        A3_PROP_ID_NAME,
+        config::Property,
+        schema::{ModuleDef, modules_schema},
+        snapshot::{ModuleSnapshot, RackSnapshot},
+    },
+    can_controller::{self, BusStats, CanMessage, NOMINAL_FRAME_TIME},
+    error::{AppError, ErrorType},
+};
+
+type Result<T> = std::result::Result<T, AppError>;
+
+/// Rack-wide operations
+#[derive(Debug)]
+pub enum FanOutOp {
+    /// Read configs of all modules, or of the modules of the specified type
+    GetConfig { module_type: Option<String> },
+    /// Set a property on every module of a type
+    SetProperty {
+        module_type: String,
+        property_name: String,
+        value: String,
+    },
+    /// Rename modules by a pattern. Placeholders {id}, {uid}, {type} and {n} are expanded.
+    Rename {
+        pattern: String,
+        module_type: Option<String>,
+    },
+    /// Read configs of all modules and save them into a snapshot file
+    Snapshot { path: String },
+    /// Push the properties in a snapshot file that differ from the current configs
+    Restore { path: String },
+    /// Stage the properties in a snapshot file that differ from the current configs.
+    /// Nothing takes effect until the tag is committed.
+    Stage { path: String, tag: u8 },
+    /// Run a batch script; see the batch module for the syntax
+    Batch { script: String },
+}
+
+#[derive(Debug)]
+pub enum FanOutOutcome {
+    Config(Vec<Property>),
+    Written,
+    Renamed(String),
+    Captured,
+    Restored(usize),
+    Staged(usize),
+    Unchanged,
+    Skipped(String),
+}
+
+/// Per-module progress report that is streamed back to the client
+#[derive(Debug)]
+pub struct FanOutProgress {
+    pub id: u8,
+    pub uid: u32,
+    /// Index of the batch step the result belongs to
+    pub step: Option<usize>,
+    pub done: usize,
+    pub total: usize,
+    pub result: Result<FanOutOutcome>,
+}
+
+#[derive(Debug)]
+pub struct FanOutSummary {
+    pub total: usize,
+    pub succeeded: usize,
+    pub failed: usize,
+    pub skipped: usize,
+    pub concurrency_limit: usize,
+    pub elapsed: Duration,
+}
+
+enum Job {
+    GetConfig,
+    SetConfig(Vec<Property>, FanOutOutcome),
+    Capture,
+    /// Pushes the snapshot entry; the properties are staged instead if the tag is given
+    Restore(ModuleSnapshot, Arc<ModuleDef>, Option<u8>),
+    Skip(String),
+}
+
+struct Target {
+    id: u8,
+    uid: u32,
+    step: Option<usize>,
+    job: Job,
+}
+
+pub async fn run(
+    op: FanOutOp,
+    modules_tx: Sender<a3_modules::Operation>,
+    registry: RegistryReader,
+    streams_tx: Sender<streams::Operation>,
+    can_tx: Sender<CanMessage>,
+    config_cache: Arc<ConfigCache>,
+    staged_writes: Arc<StagedWrites>,
+    write_planner: Arc<WritePlanner>,
+    limiter: Arc<AdaptiveLimiter>,
+    progress: Sender<FanOutProgress>,
+    deadline: Deadline,
+) -> Result<FanOutSummary> {
+    let started_at = Instant::now();
+    let modules = registry.load().list();
+
+    let snapshot = match &op {
+        FanOutOp::Restore { path } | FanOutOp::Stage { path, .. } => {
+            Some(load_snapshot(path).await?)
+        }
+        _ => None,
+    };
+    let targets = plan(&op, modules, snapshot)?;
+    let capture_uids: Vec<u32> = targets
+        .iter()
+        .filter(|target| matches!(target.job, Job::Capture))
+        .map(|target| target.uid)
+        .collect();
+    let total = targets.len();
+    let done = Arc::new(AtomicUsize::new(0));
+    let captured = Arc::new(Mutex::new(Vec::<ModuleSnapshot>::new()));
+    let mut summary = FanOutSummary {
+        total,
+        succeeded: 0,
+        failed: 0,
+        skipped: 0,
+        concurrency_limit: 0,
+        elapsed: Duration::ZERO,
+    };
+
+    // jobs on the same module run in their order, jobs on different modules in parallel
+    let mut lanes: Vec<Vec<Target>> = Vec::new();
+    for target in targets {
+        if let Job::Skip(reason) = target.job {
+            summary.skipped += 1;
+            let _ = progress
+                .send(FanOutProgress {
+                    id: target.id,
+                    uid: target.uid,
+                    step: target.step,
+                    done: done.fetch_add(1, Ordering::Relaxed) + 1,
+                    total,
+                    result: Ok(FanOutOutcome::Skipped(reason)),
+                })
+                .await;
+            continue;
+        }
+        match lanes.iter_mut().find(|lane| lane[0].id == target.id) {
+            Some(lane) => lane.push(target),
+            None => lanes.push(vec![target]),
+        }
+    }
+
+    let mut tasks = JoinSet::new();
+    for lane in lanes {
+        let limiter = limiter.clone();
+        let modules_tx = modules_tx.clone();
+        let registry = registry.clone();
+        let streams_tx = streams_tx.clone();
+        let can_tx = can_tx.clone();
+        let config_cache = config_cache.clone();
+        let staged_writes = staged_writes.clone();
+        let write_planner = write_planner.clone();
+        let progress = progress.clone();
+        let done = done.clone();
+        let captured = captured.clone();
+        tasks.spawn(async move {
+            let mut num_succeeded = 0;
+            for Target { id, uid, step, job } in lane {
+                let permit = limiter.clone().acquire().await;
+                let streams_tx = streams_tx.clone();
+                let can_tx = can_tx.clone();
+                let modules_tx = modules_tx.clone();
+                let config_cache = config_cache.clone();
+                let result = match job {
+                    // the jobs left once the deadline has passed are not started
+                    _ if deadline.check().is_err() => Err(AppError::deadline_exceeded()),
+                    Job::GetConfig => get_config_on_new_wire(
+                        streams_tx,
+                        can_tx,
+                        modules_tx,
+                        config_cache,
+                        id,
+                        deadline,
+                        None,
+                    )
+                    .await
+                    .map(FanOutOutcome::Config),
+                    Job::SetConfig(props, outcome) => write_config(
+                        streams_tx,
+                        can_tx,
+                        modules_tx,
+                        registry.clone(),
+                        config_cache,
+                        write_planner.clone(),
+                        id,
+                        props,
+                    )
+                    .await
+                    .map(|num_written| match num_written {
+                        0 => FanOutOutcome::Unchanged,
+                        _ => outcome,
+                    }),
+                    Job::Capture => {
+                        match get_config_on_new_wire(
+                            streams_tx,
+                            can_tx,
+                            modules_tx,
+                            config_cache,
+                            id,
+                            deadline,
+                            None,
+                        )
+                        .await
+                        {
+                            Ok(properties) => match ModuleSnapshot::from_properties(properties) {
+                                Some(entry) => {
+                                    captured.lock().unwrap().push(entry);
+                                    Ok(FanOutOutcome::Captured)
+                                }
+                                None => Err(AppError::new(
+                                    ErrorType::A3ProtocolError,
+                                    "UID or module type is missing in the config".to_string(),
+                                )),
+                            },
+                            Err(e) => Err(e),
+                        }
+                    }
+                    Job::Restore(snapshot, module_def, stage_tag) => {
+                        restore_module(
+                            streams_tx,
+                            can_tx,
+                            modules_tx,
+                            config_cache,
+                            staged_writes.clone(),
+                            id,
+                            snapshot,
+                            &module_def,
+                            stage_tag,
+                            deadline,
+                        )
+                        .await
+                    }
+                    Job::Skip(_) => unreachable!(),
+                };
+                permit.release(Outcome::of(&result));
+                if result.is_ok() {
+                    num_succeeded += 1;
+                }
+                let _ = progress
+                    .send(FanOutProgress {
+                        id,
+                        uid,
+                        step,
+                        done: done.fetch_add(1, Ordering::Relaxed) + 1,
+                        total,
+                        result,
+                    })
+                    .await;
+            }
+            num_succeeded
+        });
+    }
+
+    let num_jobs = total - summary.skipped;
+    while let Some(joined) = tasks.join_next().await {
+        match joined {
+            Ok(num_succeeded) => summary.succeeded += num_succeeded,
+            Err(e) => log::error!("Fan-out task failed: {:?}", e),
+        }
+    }
+    summary.failed = num_jobs - summary.succeeded;
+
+    if let FanOutOp::Snapshot { path } = &op {
+        let mut modules = std::mem::take(&mut *captured.lock().unwrap());
+        // a partial snapshot must not replace a complete one
+        check_captured(path, &capture_uids, &modules)?;
+        modules.sort_by_key(|module| module.uid);
+        save_snapshot(path, &RackSnapshot { modules }).await?;
+    }
+
+    summary.concurrency_limit = limiter.limit();
+    summary.elapsed = started_at.elapsed();
+    return Ok(summary);
+}
+
+/// `snapshot` is the file loaded for a restore or a stage.
+fn plan(
+    op: &FanOutOp,
+    modules: Vec<Arc<A3Module>>,
+    snapshot: Option<RackSnapshot>,
+) -> Result<Vec<Target>> {
+    if let FanOutOp::Batch { script } = op {
+        return batch::plan(script, &modules);
+    }
+    let mut targets = Vec::new();
+    let mut add = |id: u8, uid: u32, job: Job| {
+        targets.push(Target {
+            id,
+            uid,
+            step: None,
+            job,
+        })
+    };
+    match op {
+        FanOutOp::GetConfig { module_type } => {
+            for module in &modules {
+                if matches_type(module, module_type) {
+                    add(module.id, module.uid, Job::GetConfig);
+                }
+            }
+        }
+        FanOutOp::SetProperty {
+            module_type,
+            property_name,
+            value,
+        } => {
+            // Build the property before touching the bus so that invalid requests fail fast
+            let module_def = find_module_def(module_type)?;
+            let Some(property_def) = module_def.get_property_def_by_name(property_name) else {
+                return Err(AppError::new(
+                    ErrorType::UserCommandInvalidRequest,
+                    format!("No such property for {}: {}", module_type, property_name),
+                ));
+            };
+            let property = Property::from_string(property_def.id, value, &property_def.value_type)?;
+            for module in &modules {
+                match &module.module_type {
+                    Some(_) if matches_type(module, &Some(module_type.clone())) => {
+                        add(
+                            module.id,
+                            module.uid,
+                            Job::SetConfig(vec![property.clone()], FanOutOutcome::Written),
+                        );
+                    }
+                    Some(_) => {}
+                    None => add(module.id, module.uid, unresolved_type()),
+                }
+            }
+        }
+        FanOutOp::Rename {
+            pattern,
+            module_type,
+        } => {
+            let mut n = 0;
+            for module in &modules {
+                if module_type.is_some() && module.module_type.is_none() {
+                    add(module.id, module.uid, unresolved_type());
+                    continue;
+                }
+                if !matches_type(module, module_type) {
+                    continue;
+                }
+                n += 1;
+                let name = expand_name_pattern(pattern, module, n);
+                let property = Property::text(A3_PROP_ID_NAME, &name);
+                add(
+                    module.id,
+                    module.uid,
+                    Job::SetConfig(vec![property], FanOutOutcome::Renamed(name)),
+                );
+            }
+        }
+        FanOutOp::Snapshot { .. } => {
+            for module in &modules {
+                add(module.id, module.uid, Job::Capture);
+            }
+        }
+        FanOutOp::Restore { .. } | FanOutOp::Stage { .. } => {
+            let stage_tag = match op {
+                FanOutOp::Stage { tag, .. } => Some(*tag),
+                _ => None,
+            };
+            let snapshot = snapshot.unwrap();
+            let schema = modules_schema();
+            for entry in snapshot.modules {
+                let Some(module) = modules.iter().find(|module| module.uid == entry.uid) else {
+                    add(0, entry.uid, Job::Skip("module not present".to_string()));
+                    continue;
+                };
+                let job = match schema.get(&entry.module_type) {
+                    _ if module
+                        .module_type_id
+                        .is_some_and(|type_id| type_id != entry.module_type) =>
+                    {
+                        Job::Skip("module type mismatch".to_string())
+                    }
+                    Some(module_def) => Job::Restore(entry, module_def.clone(), stage_tag),
+                    None => Job::Skip(format!("unknown module type {:04x}", entry.module_type)),
+                };
+                add(module.id, module.uid, job);
+            }
+        }
+        FanOutOp::Batch { .. } => unreachable!(),
+    }
+    return Ok(targets);
+}
+
+async fn restore_module(
+    streams_tx: Sender<streams::Operation>,
+    can_tx: Sender<CanMessage>,
+    modules_tx: Sender<a3_modules::Operation>,
+    config_cache: Arc<ConfigCache>,
+    staged_writes: Arc<StagedWrites>,
+    id: u8,
+    snapshot: ModuleSnapshot,
+    module_def: &ModuleDef,
+    stage_tag: Option<u8>,
+    deadline: Deadline,
+) -> Result<FanOutOutcome> {
+    // the module may have been power-cycled or edited since it was last read, so the diff
+    // is taken against what it holds now rather than the cache
+    let current = get_config_on_new_wire(
+        streams_tx.clone(),
+        can_tx.clone(),
+        modules_tx.clone(),
+        config_cache.clone(),
+        id,
+        deadline,
+        None,
+    )
+    .await?;
+    match ModuleSnapshot::from_properties(current.clone()) {
+        Some(entry) if entry.uid == snapshot.uid && entry.module_type == snapshot.module_type => {}
+        _ => {
+            return Err(AppError::new(
+                ErrorType::A3InvalidValue,
+                "The module does not match the snapshot entry".to_string(),
+            ));
+        }
+    }
+    let changed = changed_properties(&current, &snapshot.properties, module_def);
+    if changed.is_empty() {
+        return Ok(FanOutOutcome::Unchanged);
+    }
+    let num_changed = changed.len();
+    if let Some(tag) = stage_tag {
+        stage_config_on_new_wire(
+            streams_tx,
+            can_tx,
+            staged_writes,
+            id,
+            tag,
+            changed,
+            deadline,
+        )
+        .await?;
+        return Ok(FanOutOutcome::Staged(num_changed));
+    }
+    set_config_on_new_wire(
+        streams_tx,
+        can_tx,
+        modules_tx,
+        config_cache,
+        id,
+        changed,
+        deadline,
+    )
+    .await?;
+    return Ok(FanOutOutcome::Restored(num_changed));
+}
+
+/// Fails naming the UIDs in `expected` that have no entry in `captured`.
+fn check_captured(path: &str, expected: &[u32], captured: &[ModuleSnapshot]) -> Result<()> {
+    let missing: Vec<String> = expected
+        .iter()
+        .filter(|uid| !captured.iter().any(|module| module.uid == **uid))
+        .map(|uid| format!("{:08x}", uid))
+        .collect();
+    if missing.is_empty() {
+        return Ok(());
+    }
+    return Err(AppError::runtime(&format!(
+        "Snapshot not saved to {}; no config from {}",
+        path,
+        missing.join(", ")
+    )));
+}
+
+/// Reads the file off the async runtime.
+async fn load_snapshot(path: &str) -> Result<RackSnapshot> {
+    let owned_path = path.to_string();
+    let data = tokio::task::spawn_blocking(move || fs::read(owned_path))
+        .await
+        .unwrap()
+        .map_err(|e| {
+            AppError::new(
+                ErrorType::UserCommandInvalidRequest,
+                format!("Failed to read {}: {}", path, e),
+            )
+        })?;
+    RackSnapshot::decode(&data).map_err(|e| {
+        AppError::new(
+            ErrorType::UserCommandInvalidRequest,
+            format!("Failed to parse {}: {}", path, e),
+        )
+    })
+}
+
+/// Writes the snapshot to a temporary file first so that a crash never leaves a partial file.
+/// The file is written off the async runtime.
+async fn save_snapshot(path: &str, snapshot: &RackSnapshot) -> Result<()> {
+    let data = snapshot.encode();
+    let owned_path = path.to_string();
+    tokio::task::spawn_blocking(move || {
+        let temp_path = format!("{}.tmp", owned_path);
+        fs::write(&temp_path, data).and_then(|_| fs::rename(&temp_path, &owned_path))
+    })
+    .await
+    .unwrap()
+    .map_err(|e| AppError::runtime(format!("Failed to write {}: {}", path, e).as_str()))
+}
+
+fn unresolved_type() -> Job {
+    Job::Skip("module type unresolved; run get-config-all first".to_string())
+}
+
+fn matches_type(module: &A3Module, module_type: &Option<String>) -> bool {
+    match module_type {
+        Some(wanted) => module
+            .module_type
+            .as_ref()
+            .is_some_and(|actual| actual.eq_ignore_ascii_case(wanted)),
+        None => true,
+    }
+}
+
+fn find_module_def(module_type: &str) -> Result<Arc<ModuleDef>> {
+    match modules_schema()
+        .values()
+        .find(|def| def.module_type_name.eq_ignore_ascii_case(module_type))
+    {
+        Some(def) => Ok(def.clone()),
+        None => Err(AppError::new(
+            ErrorType::A3SchemaError,
+            format!("Unknown module type: {}", module_type),
+        )),
+    }
+}
+
+/// Expands {id}, {uid}, {type} and {n} in a rename pattern.
+pub fn expand_name_pattern(pattern: &str, module: &A3Module, n: usize) -> String {
+    let module_type = module.module_type.as_deref().unwrap_or("unknown");
+    pattern
+        .replace("{id}", &format!("{:02x}", module.id))
+        .replace("{uid}", &format!("{:08x}", module.uid))
+        .replace("{type}", module_type)
+        .replace("{n}", &n.to_string())
+}
+
+// Concurrency control ////////////////////////////////////////////////////////
+
+/// Upper bound of concurrent transfers. Leaves admin wires for interactive commands.
+const MAX_CONCURRENCY: usize = 32;
+const INITIAL_CONCURRENCY: usize = 4;
+/// Bus utilization above which the limit stops growing and starts shrinking.
+const HIGH_UTILIZATION: f64 = 0.7;
+const BUS_SAMPLE_INTERVAL: Duration = Duration::from_millis(100);
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Outcome {
+    Success,
+    /// Timeouts or busy peers/wires; indicates the bus or the remote is overloaded
+    Congested,
+    /// Other failures that say nothing about the load
+    Neutral,
+}
+
+impl Outcome {
+    pub fn of<T>(result: &Result<T>) -> Self {
+        match result {
+            Ok(_) => Outcome::Success,
+            Err(e) => match e.error_type {
+                ErrorType::Timeout | ErrorType::A3StreamConflict | ErrorType::Busy => {
+                    Outcome::Congested
+                }
+                _ => Outcome::Neutral,
+            },
+        }
+    }
+}
+
+/// AIMD concurrency limit for transfers: grows by one after a full window of successes
+/// and halves on congestion, RX drops or high bus utilization.
+#[derive(Debug)]
+struct LimiterState {
+    limit: usize,
+    in_flight: usize,
+    successes: usize,
+    utilization: f64,
+    last_sample: BusStats,
+    last_sample_at: Instant,
+}
+
+impl LimiterState {
+    fn new(now: Instant, sample: BusStats) -> Self {
+        Self {
+            limit: INITIAL_CONCURRENCY,
+            in_flight: 0,
+            successes: 0,
+            utilization: 0.0,
+            last_sample: sample,
+            last_sample_at: now,
+        }
+    }
+
+    fn on_outcome(&mut self, outcome: Outcome) {
+        match outcome {
+            Outcome::Success => {
+                self.successes += 1;
+                if self.successes >= self.limit && self.utilization < HIGH_UTILIZATION {
+                    self.limit = (self.limit + 1).min(MAX_CONCURRENCY);
+                    self.successes = 0;
+                }
+            }
+            Outcome::Congested => self.decrease(),
+            Outcome::Neutral => {}
+        }
+    }
+
+    fn on_bus_sample(&mut self, now: Instant, sample: BusStats) {
+        let elapsed = now.duration_since(self.last_sample_at);
+        if elapsed < BUS_SAMPLE_INTERVAL {
+            return;
+        }
+        let frames = (sample.tx_frames - self.last_sample.tx_frames)
+            + (sample.rx_frames - self.last_sample.rx_frames);
+        let drops = sample.rx_drops - self.last_sample.rx_drops;
+        self.utilization =
+            (frames as f64 * NOMINAL_FRAME_TIME.as_secs_f64()) / elapsed.as_secs_f64();
+        self.last_sample = sample;
+        self.last_sample_at = now;
+        if drops > 0 {
+            log::warn!("RX drops detected; reducing transfer concurrency");
+            self.decrease();
+        } else if self.utilization >= HIGH_UTILIZATION {
+            self.limit = (self.limit - 1).max(1);
+            self.successes = 0;
+        }
+    }
+
+    fn decrease(&mut self) {
+        self.limit = (self.limit / 2).max(1);
+        self.successes = 0;
+    }
+}
+
+pub struct AdaptiveLimiter {
+    state: Mutex<LimiterState>,
+    released: Notify,
+}
+
+impl AdaptiveLimiter {
+    pub fn new() -> Self {
+        Self {
+            state: Mutex::new(LimiterState::new(
+                Instant::now(),
+                can_controller::bus_stats(),
+            )),
+            released: Notify::new(),
+        }
+    }
+
+    pub fn limit(&self) -> usize {
+        self.state.lock().unwrap().limit
+    }
+
+    /// Waits until a transfer slot is available.
+    pub async fn acquire(self: Arc<Self>) -> LimiterPermit {
+        loop {
+            {
+                let mut state = self.state.lock().unwrap();
+                state.on_bus_sample(Instant::now(), can_controller::bus_stats());
+                if state.in_flight < state.limit {
+                    state.in_flight += 1;
+                    break;
+                }
+            }
+            self.released.notified().await;
+        }
+        LimiterPermit {
+            limiter: self,
+            released: false,
+        }
+    }
+
+    fn release(&self, outcome: Outcome) {
+        {
+            let mut state = self.state.lock().unwrap();
+            state.in_flight -= 1;
+            state.on_outcome(outcome);
+        }
+        self.released.notify_one();
+    }
+}
+
+pub struct LimiterPermit {
+    limiter: Arc<AdaptiveLimiter>,
+    released: bool,
+}
+
+impl LimiterPermit {
+    pub fn release(mut self, outcome: Outcome) {
+        self.released = true;
+        self.limiter.release(outcome);
+    }
+}
+
+impl Drop for LimiterPermit {
+    fn drop(&mut self) {
+        if !self.released {
+            self.limiter.release(Outcome::Neutral);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn module(id: u8, module_type: Option<&str>) -> A3Module {
+        A3Module {
+            uid: 0x1ace0000 + id as u32,
+            id,
+            name: None,
+            module_type: module_type.map(|t| t.into()),
+            module_type_id: None,
+        }
+    }
+
+    #[test]
+    fn test_check_captured() {
+        let entry = |uid: u32| ModuleSnapshot {
+            uid,
+            module_type: 2,
+            properties: Vec::new(),
+        };
+        let captured = [entry(0x1ace0001), entry(0x1ace0003)];
+        assert!(check_captured("rack.a3s", &[0x1ace0001, 0x1ace0003], &captured).is_ok());
+        let error = check_captured("rack.a3s", &[0x1ace0001, 0x1ace0002, 0x1ace0003], &captured)
+            .unwrap_err();
+        assert_eq!(
+            error.message,
+            "Snapshot not saved to rack.a3s; no config from 1ace0002"
+        );
+    }
+
+    #[test]
+    fn test_expand_name_pattern() {
+        let amps = module(5, Some("Amps"));
+        assert_eq!(expand_name_pattern("{type}-{n}", &amps, 2), "Amps-2");
+        assert_eq!(expand_name_pattern("m{id}/{uid}", &amps, 1), "m05/1ace0005");
+        assert_eq!(
+            expand_name_pattern("{type}", &module(1, None), 1),
+            "unknown"
+        );
+    }
+
+    #[test]
+    fn test_outcome_of() {
+        let error = |error_type, message: &str| {
+            Err::<(), _>(AppError::new(error_type, message.to_string()))
+        };
+        assert_eq!(Outcome::of(&Ok(())), Outcome::Success);
+        assert_eq!(Outcome::of(&error(ErrorType::Busy, "")), Outcome::Congested);
+        assert_eq!(
+            Outcome::of(&error(ErrorType::Timeout, "")),
+            Outcome::Congested
+        );
+        // classified by the type alone, whatever the message says
+        assert_eq!(
+            Outcome::of(&error(
+                ErrorType::A3CommunicationError,
+                "Remote peer is busy"
+            )),
+            Outcome::Neutral
+        );
+    }
+
+    #[test]
+    fn test_limiter_aimd() {
+        let now = Instant::now();
+        let mut state = LimiterState::new(now, BusStats::default());
+        assert_eq!(state.limit, INITIAL_CONCURRENCY);
+        for _ in 0..INITIAL_CONCURRENCY {
+            state.on_outcome(Outcome::Success);
+        }
+        assert_eq!(state.limit, INITIAL_CONCURRENCY + 1);
+        state.on_outcome(Outcome::Congested);
+        assert_eq!(state.limit, (INITIAL_CONCURRENCY + 1) / 2);
+        state.on_outcome(Outcome::Neutral);
+        assert_eq!(state.limit, (INITIAL_CONCURRENCY + 1) / 2);
+        for _ in 0..10 {
+            state.on_outcome(Outcome::Congested);
+        }
+        assert_eq!(state.limit, 1);
+        for _ in 0..10_000 {
+            state.on_outcome(Outcome::Success);
+        }
+        assert_eq!(state.limit, MAX_CONCURRENCY);
+    }
+
+    #[test]
+    fn test_limiter_bus_feedback() {
+        let now = Instant::now();
+        let mut state = LimiterState::new(now, BusStats::default());
+        state.limit = 16;
+
+        // too early to take a sample
+        let busy = BusStats {
+            tx_frames: 5000,
+            rx_frames: 5000,
+            rx_drops: 0,
+        };
+        state.on_bus_sample(now + Duration::from_millis(10), busy);
+        assert_eq!(state.limit, 16);
+
+        // 10000 frames in 200ms saturates the bus
+        state.on_bus_sample(now + Duration::from_millis(200), busy);
+        assert!(state.utilization >= HIGH_UTILIZATION);
+        assert_eq!(state.limit, 15);
+        // no growth while the bus is busy
+        for _ in 0..100 {
+            state.on_outcome(Outcome::Success);
+        }
+        assert_eq!(state.limit, 15);
+
+        // drops halve the limit
+        let dropped = BusStats {
+            rx_drops: 1,
+            ..busy
+        };
+        state.on_bus_sample(now + Duration::from_millis(400), dropped);
+        assert_eq!(state.limit, 7);
+        assert!(state.utilization < HIGH_UTILIZATION);
+    }
+}
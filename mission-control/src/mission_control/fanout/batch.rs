@@ -0,0 +1,319 @@
+//! Batch scripts
+//!
+//! A script is a list of steps separated by newlines or semicolons. Each step applies a
+//! command to a set of modules:
+//!
+//! ```text
+//! set type=amps cv_depth 0x400; rename 1-4 'osc {n}'; get-config *
+//! ```
+//! The modules are given as an ID, a range of IDs such as `1-4` or `0x10-0x1f`, `*` for
+//! all of them, or `type=<module type>`. The commands are `get-config`, `set <prop-name>
+//! <value>` and `rename <pattern>`, with the placeholders of `rename-all` in the pattern.
+//!
+//! Steps are planned against the registry as a whole before anything is sent, so a
+//! malformed script or an invalid value fails the batch without touching the bus.
+
+use std::sync::Arc;
+
+use super::{FanOutOutcome, Job, Result, Target, expand_name_pattern, find_module_def};
+use crate::{
+    a3_modules::A3Module,
+    analog3::{
+        A3_PROP_ID_NAME,
+        config::{Property, parse_u8},
+    },
+    error::{AppError, ErrorType},
+};
+
+/// Steps a script may have
+const MAX_STEPS: usize = 256;
+
+#[derive(Debug, PartialEq)]
+enum Modules {
+    All,
+    Range(u8, u8),
+    Type(String),
+}
+
+#[derive(Debug, PartialEq)]
+enum Action {
+    GetConfig,
+    Set {
+        property_name: String,
+        value: String,
+    },
+    Rename {
+        pattern: String,
+    },
+}
+
+#[derive(Debug, PartialEq)]
+struct Step {
+    modules: Modules,
+    action: Action,
+}
+
+/// Plans the jobs of the script in the order of the steps.
+pub(super) fn plan(script: &str, modules: &[Arc<A3Module>]) -> Result<Vec<Target>> {
+    let mut targets = Vec::new();
+    for (index, step) in parse(script)?.iter().enumerate() {
+        let mut n = 0;
+        for module in modules {
+            let job = match &step.modules {
+                Modules::All => step.job(module, n + 1)?,
+                Modules::Range(first, last) if (*first..=*last).contains(&module.id) => {
+                    step.job(module, n + 1)?
+                }
+                Modules::Range(..) => continue,
+                Modules::Type(_) if module.module_type.is_none() => super::unresolved_type(),
+                Modules::Type(module_type)
+                    if super::matches_type(module, &Some(module_type.clone())) =>
+                {
+                    step.job(module, n + 1)?
+                }
+                Modules::Type(_) => continue,
+            };
+            if !matches!(job, Job::Skip(_)) {
+                n += 1;
+            }
+            targets.push(Target {
+                id: module.id,
+                uid: module.uid,
+                step: Some(index),
+                job,
+            });
+        }
+    }
+    return Ok(targets);
+}
+
+impl Step {
+    /// Job of the step on the module; `n` counts the modules of the step from 1.
+    fn job(&self, module: &A3Module, n: usize) -> Result<Job> {
+        match &self.action {
+            Action::GetConfig => return Ok(Job::GetConfig),
+            Action::Rename { pattern } => {
+                let name = expand_name_pattern(pattern, module, n);
+                let property = Property::text(A3_PROP_ID_NAME, &name);
+                return Ok(Job::SetConfig(vec![property], FanOutOutcome::Renamed(name)));
+            }
+            Action::Set {
+                property_name,
+                value,
+            } => {
+                let Some(module_type) = &module.module_type else {
+                    return Ok(super::unresolved_type());
+                };
+                let module_def = find_module_def(module_type)?;
+                let Some(property_def) = module_def.get_property_def_by_name(property_name) else {
+                    return Ok(Job::Skip(format!("no such property: {}", property_name)));
+                };
+                let property =
+                    Property::from_string(property_def.id, value, &property_def.value_type)?;
+                return Ok(Job::SetConfig(vec![property], FanOutOutcome::Written));
+            }
+        }
+    }
+}
+
+fn parse(script: &str) -> Result<Vec<Step>> {
+    let mut steps = Vec::new();
+    for (index, line) in script.split([';', '\n']).enumerate() {
+        let tokens = tokenize(line);
+        if tokens.is_empty() {
+            continue;
+        }
+        if steps.len() == MAX_STEPS {
+            return Err(invalid(format!("Too many steps; up to {}", MAX_STEPS)));
+        }
+        let step = parse_step(&tokens)
+            .map_err(|e| invalid(format!("Step {}: {}", index + 1, e.message)))?;
+        steps.push(step);
+    }
+    if steps.is_empty() {
+        return Err(invalid("Empty script".to_string()));
+    }
+    return Ok(steps);
+}
+
+fn parse_step(tokens: &[String]) -> Result<Step> {
+    let usage =
+        |command: &str, args: &str| invalid(format!("Usage {} <modules> {}", command, args));
+    let command = tokens[0].as_str();
+    let Some(modules) = tokens.get(1) else {
+        return Err(match command {
+            "get-config" => usage(command, ""),
+            "set" => usage(command, "<prop-name> <value>"),
+            "rename" => usage(command, "<pattern>"),
+            _ => invalid(format!("Unknown command {}", command)),
+        });
+    };
+    let modules = parse_modules(modules)?;
+    let action = match (command, &tokens[2..]) {
+        ("get-config", []) => Action::GetConfig,
+        ("get-config", _) => return Err(usage(command, "")),
+        ("set", [property_name, value]) => Action::Set {
+            property_name: property_name.clone(),
+            value: value.clone(),
+        },
+        ("set", _) => return Err(usage(command, "<prop-name> <value>")),
+        ("rename", [pattern]) => Action::Rename {
+            pattern: pattern.clone(),
+        },
+        ("rename", _) => return Err(usage(command, "<pattern>")),
+        _ => return Err(invalid(format!("Unknown command {}", command))),
+    };
+    return Ok(Step { modules, action });
+}
+
+fn parse_modules(token: &str) -> Result<Modules> {
+    if token == "*" {
+        return Ok(Modules::All);
+    }
+    if let Some(module_type) = token.strip_prefix("type=") {
+        return Ok(Modules::Type(module_type.to_string()));
+    }
+    let id =
+        |value: &str| parse_u8(value).map_err(|_| invalid(format!("Invalid modules {}", token)));
+    let (first, last) = match token.split_once('-') {
+        Some((first, last)) => (id(first)?, id(last)?),
+        None => (id(token)?, id(token)?),
+    };
+    if first > last {
+        return Err(invalid(format!("Invalid modules {}", token)));
+    }
+    return Ok(Modules::Range(first, last));
+}
+
+/// Splits at whitespace, keeping quoted sections together.
+fn tokenize(line: &str) -> Vec<String> {
+    let mut tokens = Vec::new();
+    let mut current: Option<String> = None;
+    let mut in_quotes: Option<char> = None;
+    for c in line.chars() {
+        match c {
+            '\'' | '"' if in_quotes == Some(c) => in_quotes = None,
+            '\'' | '"' if in_quotes.is_none() => {
+                in_quotes = Some(c);
+                current.get_or_insert_default();
+            }
+            c if c.is_whitespace() && in_quotes.is_none() => tokens.extend(current.take()),
+            c => current.get_or_insert_default().push(c),
+        }
+    }
+    tokens.extend(current);
+    return tokens;
+}
+
+fn invalid(message: String) -> AppError {
+    AppError::new(ErrorType::UserCommandInvalidRequest, message)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn module(id: u8, module_type: Option<&str>) -> Arc<A3Module> {
+        Arc::new(A3Module {
+            uid: 0x1ace0000 + id as u32,
+            id,
+            name: None,
+            module_type: module_type.map(|t| t.into()),
+            module_type_id: None,
+        })
+    }
+
+    #[test]
+    fn test_parse() {
+        let steps =
+            parse("set type=amps cv_depth 3;\n rename 0x2-4 'osc {n}'\n\nget-config *").unwrap();
+        assert_eq!(
+            steps,
+            vec![
+                Step {
+                    modules: Modules::Type("amps".to_string()),
+                    action: Action::Set {
+                        property_name: "cv_depth".to_string(),
+                        value: "3".to_string(),
+                    },
+                },
+                Step {
+                    modules: Modules::Range(2, 4),
+                    action: Action::Rename {
+                        pattern: "osc {n}".to_string(),
+                    },
+                },
+                Step {
+                    modules: Modules::All,
+                    action: Action::GetConfig,
+                },
+            ]
+        );
+        assert_eq!(tokenize("rename 1 ''"), vec!["rename", "1", ""]);
+
+        for script in [
+            "",
+            " ; ",
+            "ping 1",
+            "set 1 cv_depth",
+            "get-config 4-2",
+            "rename x y",
+        ] {
+            assert!(parse(script).is_err(), "{:?}", script);
+        }
+        let error = parse("get-config *; set 1").unwrap_err();
+        assert!(error.message.starts_with("Step 2:"));
+    }
+
+    #[test]
+    fn test_plan() {
+        let modules = vec![
+            module(1, Some("Amps")),
+            module(2, None),
+            module(3, Some("Dummy")),
+            module(4, Some("Amps")),
+        ];
+        let targets = plan(
+            "rename 2-4 m{n}; set type=amps cv_depth 0x10; set * cv_depth 1",
+            &modules,
+        )
+        .unwrap();
+        let summary: Vec<(Option<usize>, u8, String)> = targets
+            .iter()
+            .map(|target| {
+                let job = match &target.job {
+                    Job::SetConfig(_, FanOutOutcome::Renamed(name)) => format!("rename {}", name),
+                    Job::SetConfig(..) => "set".to_string(),
+                    Job::Skip(reason) => format!("skip {}", reason),
+                    _ => panic!("unexpected job"),
+                };
+                (target.step, target.id, job)
+            })
+            .collect();
+        let unresolved = format!(
+            "skip {}",
+            match super::super::unresolved_type() {
+                Job::Skip(reason) => reason,
+                _ => unreachable!(),
+            }
+        );
+        assert_eq!(
+            summary,
+            vec![
+                (Some(0), 2, "rename m1".to_string()),
+                (Some(0), 3, "rename m2".to_string()),
+                (Some(0), 4, "rename m3".to_string()),
+                (Some(1), 1, "set".to_string()),
+                (Some(1), 2, unresolved.clone()),
+                (Some(1), 4, "set".to_string()),
+                (Some(2), 1, "set".to_string()),
+                (Some(2), 2, unresolved),
+                (Some(2), 3, "skip no such property: cv_depth".to_string()),
+                (Some(2), 4, "set".to_string()),
+            ]
+        );
+
+        // values are checked before anything is sent
+        assert!(plan("set * cv_depth 0x10000", &modules).is_err());
+    }
+}
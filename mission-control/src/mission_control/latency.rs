@@ -0,0 +1,229 @@
+use std::{collections::BTreeMap, time::Duration};
+
+/// Number of sub-buckets per power of two. Four keeps the bucket error within 25%.
+const SUB_BUCKET_BITS: u32 = 2;
+const SUB_BUCKETS: usize = 1 << SUB_BUCKET_BITS;
+/// Covers RTTs up to 2^24 us (about 16 seconds), which is beyond any timeout we use.
+const MAX_EXPONENT: usize = 24;
+const NUM_BUCKETS: usize = (MAX_EXPONENT + 1) * SUB_BUCKETS;
+
+/// Round-trip time histogram with log-linear buckets in microseconds.
+#[derive(Debug, Clone)]
+pub struct RttHistogram {
+    buckets: Vec<u64>,
+    count: u64,
+    sum_micros: u64,
+    min_micros: u64,
+    max_micros: u64,
+    timeouts: u64,
+}
+
+impl RttHistogram {
+    pub fn new() -> Self {
+        Self {
+            buckets: vec![0; NUM_BUCKETS],
+            count: 0,
+            sum_micros: 0,
+            min_micros: u64::MAX,
+            max_micros: 0,
+            timeouts: 0,
+        }
+    }
+
+    pub fn record(&mut self, rtt: Duration) {
+        let micros = rtt.as_micros().min(u64::MAX as u128) as u64;
+        self.buckets[Self::bucket_index(micros)] += 1;
+        self.count += 1;
+        self.sum_micros = self.sum_micros.saturating_add(micros);
+        self.min_micros = self.min_micros.min(micros);
+        self.max_micros = self.max_micros.max(micros);
+    }
+
+    pub fn record_timeout(&mut self) {
+        self.timeouts += 1;
+    }
+
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    pub fn timeouts(&self) -> u64 {
+        self.timeouts
+    }
+
+    pub fn summary(&self) -> Option<LatencySummary> {
+        if self.count == 0 {
+            return None;
+        }
+        Some(LatencySummary {
+            count: self.count as usize,
+            min: Duration::from_micros(self.min_micros),
+            avg: Duration::from_micros(self.sum_micros / self.count),
+            p50: Duration::from_micros(self.percentile_micros(50.0)),
+            p99: Duration::from_micros(self.percentile_micros(99.0)),
+            max: Duration::from_micros(self.max_micros),
+        })
+    }
+
+    /// Returns the upper bound of the bucket holding the given percentile,
+    /// clamped to the observed min/max.
+    fn percentile_micros(&self, percentile: f64) -> u64 {
+        let rank = ((percentile / 100.0) * self.count as f64).ceil().max(1.0) as u64;
+        let mut seen = 0u64;
+        for (index, num) in self.buckets.iter().enumerate() {
+            seen += num;
+            if seen >= rank {
+                return Self::bucket_upper_bound(index).clamp(self.min_micros, self.max_micros);
+            }
+        }
+        self.max_micros
+    }
+
+    fn bucket_index(micros: u64) -> usize {
+        if micros < SUB_BUCKETS as u64 {
+            return micros as usize;
+        }
+        let exponent = 63 - micros.leading_zeros() as usize;
+        if exponent > MAX_EXPONENT {
+            return NUM_BUCKETS - 1;
+        }
+        let shift = exponent as u32 - SUB_BUCKET_BITS;
+        let sub = ((micros >> shift) as usize) & (SUB_BUCKETS - 1);
+        (exponent - SUB_BUCKET_BITS as usize + 1) * SUB_BUCKETS + sub
+    }
+
+    fn bucket_upper_bound(index: usize) -> u64 {
+        if index < SUB_BUCKETS {
+            return index as u64;
+        }
+        let exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS as usize - 1;
+        let sub = (index % SUB_BUCKETS) as u64;
+        let shift = exponent as u32 - SUB_BUCKET_BITS;
+        ((SUB_BUCKETS as u64 + sub + 1) << shift) - 1
+    }
+}
+
+/// Latency statistics over a series of round trips
+#[derive(Debug, Clone)]
+pub struct LatencySummary {
+    pub count: usize,
+    pub min: Duration,
+    pub avg: Duration,
+    pub p50: Duration,
+    pub p99: Duration,
+    pub max: Duration,
+}
+
+impl LatencySummary {
+    /// Computes exact statistics from raw samples.
+    pub fn from_samples(samples: &[Duration]) -> Option<Self> {
+        if samples.is_empty() {
+            return None;
+        }
+        let mut sorted = samples.to_vec();
+        sorted.sort();
+        let total: Duration = sorted.iter().sum();
+        let nth = |percentile: f64| {
+            let rank = ((percentile / 100.0) * sorted.len() as f64).ceil().max(1.0) as usize;
+            sorted[rank - 1]
+        };
+        Some(Self {
+            count: sorted.len(),
+            min: sorted[0],
+            avg: total / sorted.len() as u32,
+            p50: nth(50.0),
+            p99: nth(99.0),
+            max: sorted[sorted.len() - 1],
+        })
+    }
+}
+
+/// Per-module RTT histograms kept for the lifetime of the process.
+pub struct RttStats {
+    by_module: BTreeMap<u8, RttHistogram>,
+}
+
+impl RttStats {
+    pub fn new() -> Self {
+        Self {
+            by_module: BTreeMap::new(),
+        }
+    }
+
+    pub fn record(&mut self, id: u8, rtt: Duration) {
+        self.by_module
+            .entry(id)
+            .or_insert_with(RttHistogram::new)
+            .record(rtt);
+    }
+
+    pub fn record_timeout(&mut self, id: u8) {
+        self.by_module
+            .entry(id)
+            .or_insert_with(RttHistogram::new)
+            .record_timeout();
+    }
+
+    pub fn get(&self, id: u8) -> Option<&RttHistogram> {
+        self.by_module.get(&id)
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = (&u8, &RttHistogram)> {
+        self.by_module.iter()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_bucket_bounds() {
+        for micros in [
+            0u64, 1, 3, 4, 5, 7, 8, 100, 1023, 1024, 1500, 65535, 9_999_999,
+        ] {
+            let index = RttHistogram::bucket_index(micros);
+            assert!(RttHistogram::bucket_upper_bound(index) >= micros);
+            if index > 0 {
+                assert!(RttHistogram::bucket_upper_bound(index - 1) < micros);
+            }
+        }
+    }
+
+    #[test]
+    fn test_histogram_summary() {
+        let mut histogram = RttHistogram::new();
+        assert!(histogram.summary().is_none());
+        for micros in 1..=100u64 {
+            histogram.record(Duration::from_micros(micros * 10));
+        }
+        histogram.record_timeout();
+        let summary = histogram.summary().unwrap();
+        assert_eq!(summary.count, 100);
+        assert_eq!(histogram.timeouts(), 1);
+        assert_eq!(summary.min, Duration::from_micros(10));
+        assert_eq!(summary.max, Duration::from_micros(1000));
+        assert_eq!(summary.avg, Duration::from_micros(505));
+        // bucket resolution is within 25%
+        let p50 = summary.p50.as_micros() as f64;
+        assert!(p50 >= 500.0 && p50 <= 625.0, "p50={}", p50);
+        let p99 = summary.p99.as_micros() as f64;
+        assert!(p99 >= 990.0 && p99 <= 1000.0, "p99={}", p99);
+    }
+
+    #[test]
+    fn test_summary_from_samples() {
+        let samples: Vec<Duration> = [5u64, 1, 4, 2, 3]
+            .iter()
+            .map(|v| Duration::from_micros(*v))
+            .collect();
+        let summary = LatencySummary::from_samples(&samples).unwrap();
+        assert_eq!(summary.count, 5);
+        assert_eq!(summary.min, Duration::from_micros(1));
+        assert_eq!(summary.avg, Duration::from_micros(3));
+        assert_eq!(summary.p50, Duration::from_micros(3));
+        assert_eq!(summary.p99, Duration::from_micros(5));
+        assert_eq!(summary.max, Duration::from_micros(5));
+        assert!(LatencySummary::from_samples(&[]).is_none());
+    }
+}
@@ -0,0 +1,71 @@
+use std::{
+    collections::{BTreeMap, HashMap},
+    sync::Mutex,
+    time::Duration,
+};
+
+use super::write_planner::merge_properties;
+use crate::analog3::config::Property;
+
+/// Property sets staged on modules, waiting for a broadcast commit.
+///
+/// Modules hold the staged values without applying them. The entries here mirror what
+/// has been staged so that the config cache and the module registry can be updated when
+/// the tag is committed.
+pub struct StagedWrites {
+    by_tag: Mutex<HashMap<u8, BTreeMap<u8, Vec<Property>>>>,
+}
+
+impl StagedWrites {
+    pub fn new() -> Self {
+        Self {
+            by_tag: Mutex::new(HashMap::new()),
+        }
+    }
+
+    /// Records properties staged on a module. A later value for the same property wins.
+    pub fn add(&self, tag: u8, id: u8, props: &Vec<Property>) {
+        let mut by_tag = self.by_tag.lock().unwrap();
+        let staged = by_tag.entry(tag).or_default().entry(id).or_default();
+        merge_properties(staged, props);
+    }
+
+    /// Removes and returns the staged property sets of the tag, keyed by module ID.
+    pub fn take(&self, tag: u8) -> BTreeMap<u8, Vec<Property>> {
+        self.by_tag.lock().unwrap().remove(&tag).unwrap_or_default()
+    }
+}
+
+#[derive(Debug)]
+pub struct CommitSummary {
+    pub tag: u8,
+    /// Number of modules that mission control staged the tag on
+    pub num_modules: usize,
+    /// Time from receiving the command to queuing the commit frame
+    pub latency: Duration,
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_staged_writes() {
+        let staged = StagedWrites::new();
+        staged.add(1, 5, &vec![Property::u8(3, 1), Property::u16(6, 0x100)]);
+        staged.add(1, 5, &vec![Property::u8(3, 2)]);
+        staged.add(1, 7, &vec![Property::u8(3, 4)]);
+        staged.add(2, 5, &vec![Property::u8(3, 9)]);
+
+        let tag1 = staged.take(1);
+        assert_eq!(tag1.len(), 2);
+        let module5 = &tag1[&5];
+        assert_eq!(module5.len(), 2);
+        assert_eq!(module5[0].data, vec![2]);
+        assert_eq!(module5[1].data, vec![1, 0]);
+        assert_eq!(tag1[&7][0].data, vec![4]);
+
+        assert!(staged.take(1).is_empty());
+        assert_eq!(staged.take(2).len(), 1);
+    }
+}
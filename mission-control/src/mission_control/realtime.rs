@@ -0,0 +1,231 @@
+//! Realtime parameter channel
+//!
+//! Parameter sweeps from controllers and automation send many values per second to a few
+//! small properties. Each value goes out as a single frame on the priority lane, without a
+//! stream or an ack, and values that arrive faster than the frames are sent are coalesced
+//! so that only the latest one per property goes out:
+//!
+//! ```text
+//! data: opcode(0x0D) module_id property_id value(1-4 bytes)
+//! ```
+//! Frames are flushed at most once per `FLUSH_INTERVAL`. A value arriving after a quiet
+//! period goes out right away, so the latency from the client to the frame is a few
+//! milliseconds at most.
+
+use std::{
+    sync::{Arc, Mutex},
+    time::Instant,
+};
+
+use tokio::{
+    sync::{Notify, mpsc::Sender},
+    task::JoinHandle,
+    time::{Duration, sleep_until},
+};
+
+use super::{config_cache::ConfigCache, latency::RttHistogram};
+use crate::{a3_message, analog3::config::Property, can_controller::CanMessage};
+
+/// Shortest time between two flushes
+const FLUSH_INTERVAL: Duration = Duration::from_millis(2);
+
+/// Frames a flush may send; the rest wait for the next one
+const MAX_FRAMES_PER_FLUSH: usize = 16;
+
+/// Counters of the realtime channel since the start
+#[derive(Debug, Clone)]
+pub struct RealtimeStats {
+    pub received: u64,
+    /// Values replaced by a later one before they were sent
+    pub coalesced: u64,
+    pub sent: u64,
+    /// Time from the arrival of a value at its session to its frame on the priority lane
+    pub latency: RttHistogram,
+}
+
+pub struct RealtimeChannel {
+    state: Mutex<ChannelState>,
+    queued: Notify,
+}
+
+struct ChannelState {
+    /// In the order of arrival; a later value takes the place of the one it replaces
+    pending: Vec<PendingValue>,
+    stats: RealtimeStats,
+}
+
+struct PendingValue {
+    id: u8,
+    property: Property,
+    received_at: Instant,
+}
+
+impl RealtimeChannel {
+    pub fn new() -> Self {
+        Self {
+            state: Mutex::new(ChannelState {
+                pending: Vec::new(),
+                stats: RealtimeStats {
+                    received: 0,
+                    coalesced: 0,
+                    sent: 0,
+                    latency: RttHistogram::new(),
+                },
+            }),
+            queued: Notify::new(),
+        }
+    }
+
+    /// Queues the value for the next flush. Returns true if it replaced a value not yet
+    /// sent.
+    pub fn update(&self, id: u8, property: Property, received_at: Instant) -> bool {
+        let mut state = self.state.lock().unwrap();
+        state.stats.received += 1;
+        let replaced = match state
+            .pending
+            .iter_mut()
+            .find(|pending| pending.id == id && pending.property.id == property.id)
+        {
+            Some(pending) => {
+                pending.property = property;
+                pending.received_at = received_at;
+                true
+            }
+            None => {
+                state.pending.push(PendingValue {
+                    id,
+                    property,
+                    received_at,
+                });
+                false
+            }
+        };
+        if replaced {
+            state.stats.coalesced += 1;
+        }
+        drop(state);
+        self.queued.notify_one();
+        return replaced;
+    }
+
+    pub fn stats(&self) -> RealtimeStats {
+        return self.state.lock().unwrap().stats.clone();
+    }
+
+    /// Takes up to `max` values in the order of arrival.
+    fn take(&self, max: usize) -> Vec<PendingValue> {
+        let mut state = self.state.lock().unwrap();
+        let num_taken = state.pending.len().min(max);
+        return state.pending.drain(..num_taken).collect();
+    }
+
+    fn record_sent(&self, latencies: &[Duration]) {
+        let mut state = self.state.lock().unwrap();
+        state.stats.sent += latencies.len() as u64;
+        for latency in latencies {
+            state.stats.latency.record(*latency);
+        }
+    }
+}
+
+/// Starts flushing the channel to `can_priority_tx`. The frames get no ack, so the values
+/// sent are dropped from the config cache rather than merged into it; a later config write
+/// of the same property then goes out whatever it was.
+pub fn start(
+    channel: Arc<RealtimeChannel>,
+    can_priority_tx: Sender<CanMessage>,
+    config_cache: Arc<ConfigCache>,
+) -> JoinHandle<()> {
+    return tokio::spawn(async move {
+        let mut latencies = Vec::with_capacity(MAX_FRAMES_PER_FLUSH);
+        loop {
+            let batch = channel.take(MAX_FRAMES_PER_FLUSH);
+            if batch.is_empty() {
+                channel.queued.notified().await;
+                continue;
+            }
+            let flushed_at = Instant::now();
+            latencies.clear();
+            for value in &batch {
+                config_cache.invalidate(value.id, value.property.id);
+            }
+            for value in &batch {
+                a3_message::set_property_realtime(
+                    can_priority_tx.clone(),
+                    value.id,
+                    &value.property,
+                )
+                .await;
+                latencies.push(value.received_at.elapsed());
+            }
+            channel.record_sent(&latencies);
+            // values arriving meanwhile are coalesced until the next flush
+            sleep_until((flushed_at + FLUSH_INTERVAL).into()).await;
+        }
+    });
+}
+
+#[cfg(test)]
+mod tests {
+    use tokio::sync::mpsc;
+
+    use super::*;
+    use crate::analog3::A3_PROP_ID_MODULE_UID;
+
+    #[test]
+    fn test_coalescing() {
+        let channel = RealtimeChannel::new();
+        let now = Instant::now();
+        assert!(!channel.update(1, Property::u16(7, 100), now));
+        assert!(!channel.update(2, Property::u16(7, 100), now));
+        assert!(channel.update(1, Property::u16(7, 200), now));
+        assert!(!channel.update(1, Property::u8(8, 1), now));
+
+        let taken = channel.take(2);
+        assert_eq!(
+            taken
+                .iter()
+                .map(|value| (value.id, value.property.id, value.property.data.clone()))
+                .collect::<Vec<_>>(),
+            vec![(1, 7, vec![0, 200]), (2, 7, vec![0, 100])]
+        );
+        assert_eq!(channel.take(MAX_FRAMES_PER_FLUSH).len(), 1);
+        let stats = channel.stats();
+        assert_eq!((stats.received, stats.coalesced), (4, 1));
+    }
+
+    #[tokio::test]
+    async fn test_flush() {
+        let channel = Arc::new(RealtimeChannel::new());
+        let (can_tx, mut can_rx) = mpsc::channel(16);
+        let config_cache = Arc::new(ConfigCache::new());
+        let config = vec![
+            Property::u32(A3_PROP_ID_MODULE_UID, 0x1234),
+            Property::u16(0x10, 0x1234),
+        ];
+        config_cache.store(5, &config);
+        start(channel.clone(), can_tx, config_cache.clone());
+
+        channel.update(5, Property::u16(0x10, 0x1234), Instant::now());
+        let message = can_rx.recv().await.unwrap();
+        assert_eq!(message.data_length(), 5);
+        assert_eq!(&message.data()[..5], &[0x0D, 5, 0x10, 0x12, 0x34]);
+        // the frame may be lost, so the value is not taken as known
+        let cached = config_cache.get_by_uid(0x1234).unwrap();
+        assert!(cached.iter().all(|property| property.id != 0x10));
+
+        // a sweep faster than the flushes goes out as fewer frames, ending at its last value
+        for value in 0..=100u8 {
+            channel.update(5, Property::u8(0x11, value), Instant::now());
+        }
+        let mut last = None;
+        while last != Some(100) {
+            let message = can_rx.recv().await.unwrap();
+            last = Some(message.data()[3]);
+        }
+        let stats = channel.stats();
+        assert_eq!(stats.received, 102);
+        assert_eq!(stats.sent + stats.coalesced, stats.received);
+        assert!(stats.latency.summary().unwrap().max < Duration::from_secs(1));
+    }
+}
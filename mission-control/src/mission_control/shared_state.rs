@@ -0,0 +1,429 @@
+//! Read-only view of the module registry and the cached configs in shared memory.
+//!
+//! Local dashboards map the region and read the state without any syscalls. Every module
+//! ID has a slot of its own, guarded by a sequence lock: the writer makes the sequence odd,
+//! updates the slot and makes the sequence even again. A reader copies the slot between
+//! two reads of the sequence, and tries again if they differ or are odd.
+//!
+//! ```text
+//! header (64 bytes): "A3SM" version(u32) num_slots(u32) slot_size(u32)
+//! slot: sequence(u32) flags(u8) id(u8) module_type_id(u16) uid(u32)
+//!       name(32 bytes) module_type(32 bytes) config_length(u16) config
+//! ```
+//! Integers are little-endian. Names are UTF-8 padded with NULs, cut at 31 bytes. The
+//! config is a count byte followed by the header and the value of each property, as they
+//! are in a config stream; properties that do not fit in the slot are left out.
+
+use std::{
+    fs::OpenOptions,
+    io,
+    os::fd::AsRawFd,
+    path::Path,
+    ptr,
+    sync::{
+        Arc, Mutex,
+        atomic::{AtomicU32, Ordering, fence},
+    },
+};
+
+use tokio::task::JoinHandle;
+
+use crate::{
+    a3_modules::{A3Module, ModuleEvent, RegistryReader},
+    analog3::config::{Property, encode_field_header},
+};
+
+const MAGIC: &[u8; 4] = b"A3SM";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 64;
+const NUM_SLOTS: usize = 256;
+const SLOT_SIZE: usize = 2048;
+const REGION_SIZE: usize = HEADER_SIZE + NUM_SLOTS * SLOT_SIZE;
+
+const NAME_SIZE: usize = 32;
+const NAME_OFFSET: usize = 12;
+const MODULE_TYPE_OFFSET: usize = NAME_OFFSET + NAME_SIZE;
+const CONFIG_LENGTH_OFFSET: usize = MODULE_TYPE_OFFSET + NAME_SIZE;
+const CONFIG_OFFSET: usize = CONFIG_LENGTH_OFFSET + 2;
+const MAX_CONFIG_LENGTH: usize = SLOT_SIZE - CONFIG_OFFSET;
+
+/// The slot holds a module
+const FLAG_PRESENT: u8 = 0x01;
+/// The module answered its last round trip
+const FLAG_ALIVE: u8 = 0x02;
+/// The module type ID is known
+const FLAG_MODULE_TYPE: u8 = 0x04;
+/// The config has been read
+const FLAG_CONFIG: u8 = 0x08;
+/// Some properties did not fit in the slot
+const FLAG_TRUNCATED: u8 = 0x10;
+
+/// Mapping of the shared memory file
+struct Region {
+    base: *mut u8,
+}
+
+// The region is written only under the lock of `SharedState`.
+unsafe impl Send for Region {}
+unsafe impl Sync for Region {}
+
+impl Region {
+    fn create(path: &Path) -> io::Result<Self> {
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(true)
+            .open(path)?;
+        file.set_len(REGION_SIZE as u64)?;
+        let base = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                REGION_SIZE,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if base == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        return Ok(Self {
+            base: base as *mut u8,
+        });
+    }
+
+    fn slot(&self, id: u8) -> *mut u8 {
+        unsafe { self.base.add(HEADER_SIZE + id as usize * SLOT_SIZE) }
+    }
+}
+
+impl Drop for Region {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.base as *mut libc::c_void, REGION_SIZE);
+        }
+    }
+}
+
+/// What the writer knows about a slot; the slot is rendered from this on every change.
+#[derive(Clone, Default)]
+struct SlotState {
+    module: Option<Arc<A3Module>>,
+    alive: bool,
+    /// UID of the module the config was read from, and the config
+    config: Option<(u32, Vec<Property>)>,
+}
+
+/// Writer of the shared memory region
+pub struct SharedState {
+    region: Region,
+    slots: Mutex<Vec<SlotState>>,
+}
+
+impl SharedState {
+    /// Creates the region, replacing any previous contents of the file.
+    pub fn create(path: &Path) -> io::Result<Self> {
+        let region = Region::create(path)?;
+        let mut header = [0u8; 16];
+        header[0..4].copy_from_slice(MAGIC);
+        header[4..8].copy_from_slice(&VERSION.to_le_bytes());
+        header[8..12].copy_from_slice(&(NUM_SLOTS as u32).to_le_bytes());
+        header[12..16].copy_from_slice(&(SLOT_SIZE as u32).to_le_bytes());
+        unsafe { ptr::copy_nonoverlapping(header.as_ptr(), region.base, header.len()) };
+        return Ok(Self {
+            region,
+            slots: Mutex::new(vec![SlotState::default(); NUM_SLOTS]),
+        });
+    }
+
+    /// Puts the module in the slot of the ID, or clears the slot if None.
+    pub fn update_module(&self, id: u8, module: Option<Arc<A3Module>>) {
+        let mut slots = self.slots.lock().unwrap();
+        let slot = &mut slots[id as usize];
+        let same_module = match (&slot.module, &module) {
+            (Some(current), Some(new)) => current.uid == new.uid,
+            _ => false,
+        };
+        if !same_module {
+            slot.alive = module.is_some();
+        }
+        slot.module = module;
+        self.write_slot(id, slot);
+    }
+
+    pub fn set_alive(&self, id: u8, alive: bool) {
+        let mut slots = self.slots.lock().unwrap();
+        let slot = &mut slots[id as usize];
+        slot.alive = alive;
+        self.write_slot(id, slot);
+    }
+
+    pub fn set_config(&self, id: u8, uid: u32, properties: &[Property]) {
+        let mut slots = self.slots.lock().unwrap();
+        let slot = &mut slots[id as usize];
+        slot.config = Some((uid, properties.to_vec()));
+        self.write_slot(id, slot);
+    }
+
+    fn write_slot(&self, id: u8, state: &SlotState) {
+        let contents = render_slot(id, state);
+        let slot = self.region.slot(id);
+        let sequence = unsafe { &*(slot as *const AtomicU32) };
+        let value = sequence.load(Ordering::Relaxed);
+        sequence.store(value.wrapping_add(1), Ordering::Relaxed);
+        fence(Ordering::Release);
+        unsafe { ptr::copy_nonoverlapping(contents[4..].as_ptr(), slot.add(4), SLOT_SIZE - 4) };
+        sequence.store(value.wrapping_add(2), Ordering::Release);
+    }
+}
+
+fn render_slot(id: u8, state: &SlotState) -> Vec<u8> {
+    let mut out = vec![0u8; SLOT_SIZE];
+    let Some(module) = &state.module else {
+        return out;
+    };
+    let mut flags = FLAG_PRESENT;
+    if state.alive {
+        flags |= FLAG_ALIVE;
+    }
+    out[5] = id;
+    if let Some(module_type_id) = module.module_type_id {
+        flags |= FLAG_MODULE_TYPE;
+        out[6..8].copy_from_slice(&module_type_id.to_le_bytes());
+    }
+    out[8..12].copy_from_slice(&module.uid.to_le_bytes());
+    put_name(&mut out[NAME_OFFSET..], module.name.as_deref());
+    put_name(
+        &mut out[MODULE_TYPE_OFFSET..],
+        module.module_type.as_deref(),
+    );
+
+    // a config read before the ID went to another module is not shown
+    if let Some((uid, properties)) = &state.config {
+        if *uid == module.uid {
+            flags |= FLAG_CONFIG;
+            let config = &mut out[CONFIG_OFFSET..];
+            let mut length = 1;
+            let mut count = 0u8;
+            let mut header = [0u8; 4];
+            for property in properties {
+                let header_size =
+                    encode_field_header(property.id, property.data.len(), &mut header);
+                let end = length + header_size + property.data.len();
+                if end > MAX_CONFIG_LENGTH || count == u8::MAX {
+                    flags |= FLAG_TRUNCATED;
+                    break;
+                }
+                config[length..length + header_size].copy_from_slice(&header[..header_size]);
+                config[length + header_size..end].copy_from_slice(&property.data);
+                length = end;
+                count += 1;
+            }
+            config[0] = count;
+            out[CONFIG_LENGTH_OFFSET..CONFIG_OFFSET]
+                .copy_from_slice(&(length as u16).to_le_bytes());
+        }
+    }
+    out[4] = flags;
+    return out;
+}
+
+fn put_name(out: &mut [u8], name: Option<&str>) {
+    let Some(name) = name else {
+        return;
+    };
+    let mut length = name.len().min(NAME_SIZE - 1);
+    while !name.is_char_boundary(length) {
+        length -= 1;
+    }
+    out[..length].copy_from_slice(&name.as_bytes()[..length]);
+}
+
+/// Keeps the module slots in sync with the registry.
+pub fn start(shared: Arc<SharedState>, registry: RegistryReader) -> JoinHandle<()> {
+    let subscription = registry.subscribe();
+    sync_all(&shared, &registry);
+    tokio::spawn(async move {
+        loop {
+            let batch = subscription.next().await;
+            if batch.num_lost > 0 {
+                sync_all(&shared, &registry);
+                continue;
+            }
+            let view = registry.load();
+            for event in batch.events {
+                match event {
+                    ModuleEvent::LivenessChanged { id, alive, .. } => shared.set_alive(id, alive),
+                    ModuleEvent::Registered { id, .. }
+                    | ModuleEvent::Deregistered { id, .. }
+                    | ModuleEvent::Renamed { id, .. }
+                    | ModuleEvent::TypeResolved { id, .. } => {
+                        shared.update_module(id, view.get_by_id(id).ok())
+                    }
+                }
+            }
+        }
+    })
+}
+
+fn sync_all(shared: &SharedState, registry: &RegistryReader) {
+    let view = registry.load();
+    for id in 0..NUM_SLOTS {
+        shared.update_module(id as u8, view.get_by_id(id as u8).ok());
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{fs, path::PathBuf, thread};
+
+    use super::*;
+    use crate::analog3::{
+        A3_PROP_ID_MODULE_UID, A3_PROP_ID_NAME,
+        config::{ConfigParser, Property},
+    };
+
+    /// Maps the region as a dashboard would
+    struct Reader {
+        base: *const u8,
+    }
+
+    impl Reader {
+        fn open(path: &Path) -> Self {
+            let file = fs::File::open(path).unwrap();
+            let base = unsafe {
+                libc::mmap(
+                    ptr::null_mut(),
+                    REGION_SIZE,
+                    libc::PROT_READ,
+                    libc::MAP_SHARED,
+                    file.as_raw_fd(),
+                    0,
+                )
+            };
+            assert_ne!(base, libc::MAP_FAILED);
+            Self {
+                base: base as *const u8,
+            }
+        }
+
+        fn read_slot(&self, id: u8) -> Vec<u8> {
+            let slot = unsafe { self.base.add(HEADER_SIZE + id as usize * SLOT_SIZE) };
+            let sequence = unsafe { &*(slot as *const AtomicU32) };
+            let mut out = vec![0u8; SLOT_SIZE];
+            loop {
+                let before = sequence.load(Ordering::Acquire);
+                if before % 2 == 1 {
+                    std::hint::spin_loop();
+                    continue;
+                }
+                unsafe { ptr::copy_nonoverlapping(slot, out.as_mut_ptr(), SLOT_SIZE) };
+                fence(Ordering::Acquire);
+                if sequence.load(Ordering::Relaxed) == before {
+                    return out;
+                }
+            }
+        }
+    }
+
+    impl Drop for Reader {
+        fn drop(&mut self) {
+            unsafe { libc::munmap(self.base as *mut libc::c_void, REGION_SIZE) };
+        }
+    }
+
+    fn temp_path(name: &str) -> PathBuf {
+        std::env::temp_dir().join(format!("a3-shm-{}-{}", name, std::process::id()))
+    }
+
+    fn module(uid: u32, id: u8, name: &str) -> Arc<A3Module> {
+        Arc::new(A3Module {
+            uid,
+            id,
+            name: Some(name.to_string()),
+            module_type: Some("amps".into()),
+            module_type_id: Some(2),
+        })
+    }
+
+    #[test]
+    fn test_module_and_config() {
+        let path = temp_path("slots");
+        let shared = SharedState::create(&path).unwrap();
+        let reader = Reader::open(&path);
+        assert_eq!(unsafe { std::slice::from_raw_parts(reader.base, 4) }, MAGIC);
+
+        shared.update_module(3, Some(module(0x1acebeef, 3, "vca")));
+        let config = vec![
+            Property::u32(A3_PROP_ID_MODULE_UID, 0x1acebeef),
+            Property::text(A3_PROP_ID_NAME, &"vca".to_string()),
+            Property::vector_u8(5, &vec![7; 600]),
+        ];
+        shared.set_config(3, 0x1acebeef, &config);
+
+        let slot = reader.read_slot(3);
+        assert_eq!(
+            slot[4],
+            FLAG_PRESENT | FLAG_ALIVE | FLAG_MODULE_TYPE | FLAG_CONFIG
+        );
+        assert_eq!(slot[5], 3);
+        assert_eq!(u16::from_le_bytes([slot[6], slot[7]]), 2);
+        assert_eq!(
+            u32::from_le_bytes(slot[8..12].try_into().unwrap()),
+            0x1acebeef
+        );
+        assert_eq!(&slot[NAME_OFFSET..NAME_OFFSET + 4], b"vca\0");
+        assert_eq!(&slot[MODULE_TYPE_OFFSET..MODULE_TYPE_OFFSET + 5], b"amps\0");
+        let length =
+            u16::from_le_bytes([slot[CONFIG_LENGTH_OFFSET], slot[CONFIG_LENGTH_OFFSET + 1]]);
+        let config_bytes = &slot[CONFIG_OFFSET..CONFIG_OFFSET + length as usize];
+        let mut parser = ConfigParser::new();
+        assert!(parser.data(config_bytes, config_bytes.len()).unwrap());
+        let parsed = parser.commit().unwrap().to_properties();
+        assert_eq!(parsed.len(), config.len());
+        for (parsed, expected) in parsed.iter().zip(&config) {
+            assert_eq!((parsed.id, &parsed.data), (expected.id, &expected.data));
+        }
+
+        // another module takes the ID; the old config is not shown
+        shared.update_module(3, Some(module(0x2bad, 3, "lfo")));
+        shared.set_alive(3, false);
+        assert_eq!(reader.read_slot(3)[4], FLAG_PRESENT | FLAG_MODULE_TYPE);
+        shared.update_module(3, None);
+        assert_eq!(reader.read_slot(3)[4], 0);
+
+        drop(reader);
+        fs::remove_file(&path).unwrap();
+    }
+
+    #[test]
+    fn test_torn_reads_are_retried() {
+        let path = temp_path("seqlock");
+        let shared = Arc::new(SharedState::create(&path).unwrap());
+        let writer = {
+            let shared = shared.clone();
+            thread::spawn(move || {
+                for uid in 0..2000u32 {
+                    shared.update_module(1, Some(module(uid, 1, &format!("module {}", uid))));
+                }
+            })
+        };
+        let reader = Reader::open(&path);
+        while !writer.is_finished() {
+            let slot = reader.read_slot(1);
+            if slot[4] == 0 {
+                continue;
+            }
+            // the name always belongs to the UID next to it
+            let uid = u32::from_le_bytes(slot[8..12].try_into().unwrap());
+            let name = &slot[NAME_OFFSET..NAME_OFFSET + NAME_SIZE];
+            let name = std::str::from_utf8(&name[..name.iter().position(|b| *b == 0).unwrap()]);
+            assert_eq!(name.unwrap(), format!("module {}", uid));
+        }
+        writer.join().unwrap();
+        drop(reader);
+        fs::remove_file(&path).unwrap();
+    }
+}
@@ -0,0 +1,428 @@
+//! Property watches
+//!
+//! A watch follows the value of a single property of a module. The watched properties of a
+//! module are read together by one poll, however many watches there are on them, at the
+//! shortest interval any of the watches asked for. Polls of all modules are spaced out and
+//! only a few run at once, so the bus bandwidth the watches take is bounded no matter how
+//! many clients subscribe.
+//!
+//! Every subscriber gets the current value first and then a value only when it changes. A
+//! subscriber that does not keep up is sent the latest value once it has room again; values
+//! in between are skipped.
+
+use std::{
+    collections::HashMap,
+    future::Future,
+    sync::{Arc, Mutex},
+    time::Instant,
+};
+
+use tokio::{
+    sync::{Notify, mpsc},
+    task::JoinHandle,
+    time::{Duration, sleep, sleep_until},
+};
+
+use super::Result;
+use crate::{
+    analog3::{
+        config::{Property, property_name, property_value_as_string},
+        schema::ModuleDef,
+    },
+    command::PropertyEntry,
+    error::{AppError, ErrorType},
+};
+
+/// Shortest poll interval a watch may ask for
+pub const MIN_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Poll interval of a watch that does not ask for one
+pub const DEFAULT_INTERVAL: Duration = Duration::from_secs(1);
+
+/// Time between the starts of two polls, which bounds the polls of the whole rack
+const POLL_SPACING: Duration = Duration::from_millis(20);
+
+/// Polls running at once
+const MAX_POLLS_IN_FLIGHT: usize = 2;
+
+/// Polls of a module failing in a row before its watches end
+const MAX_FAILURES: u32 = 3;
+
+/// Updates a subscriber may have waiting
+pub const UPDATE_QUEUE_SIZE: usize = 16;
+
+pub type UpdateSender = mpsc::Sender<Result<PropertyEntry>>;
+
+pub struct PropertyWatches {
+    state: Mutex<WatchState>,
+    changed: Notify,
+}
+
+struct WatchState {
+    modules: HashMap<u8, ModuleWatch>,
+    num_in_flight: usize,
+}
+
+struct ModuleWatch {
+    module_def: Arc<ModuleDef>,
+    next_poll_at: Instant,
+    in_flight: bool,
+    num_failures: u32,
+    /// Values of the last poll
+    values: HashMap<u8, Property>,
+    subscribers: Vec<Subscriber>,
+}
+
+struct Subscriber {
+    property_id: u8,
+    interval: Duration,
+    /// Value the subscriber has last been sent
+    last_sent: Option<Vec<u8>>,
+    updates: UpdateSender,
+}
+
+/// Poll to run
+#[derive(Debug, PartialEq)]
+struct Poll {
+    id: u8,
+    property_ids: Vec<u8>,
+}
+
+impl PropertyWatches {
+    pub fn new() -> Self {
+        Self {
+            state: Mutex::new(WatchState {
+                modules: HashMap::new(),
+                num_in_flight: 0,
+            }),
+            changed: Notify::new(),
+        }
+    }
+
+    /// Starts a watch of the property. The interval is raised to `MIN_INTERVAL` if shorter.
+    /// The watch ends when `updates` is closed.
+    pub fn subscribe(
+        &self,
+        id: u8,
+        module_def: Arc<ModuleDef>,
+        property_id: u8,
+        interval: Duration,
+        updates: UpdateSender,
+    ) {
+        let mut state = self.state.lock().unwrap();
+        let module = state.modules.entry(id).or_insert_with(|| ModuleWatch {
+            module_def,
+            next_poll_at: Instant::now(),
+            in_flight: false,
+            num_failures: 0,
+            values: HashMap::new(),
+            subscribers: Vec::new(),
+        });
+        let interval = interval.max(MIN_INTERVAL);
+        // a shorter interval takes effect right away rather than after the current one
+        if module.interval().is_none_or(|current| interval < current) {
+            module.next_poll_at = module.next_poll_at.min(Instant::now() + interval);
+        }
+        let mut subscriber = Subscriber {
+            property_id,
+            interval,
+            last_sent: None,
+            updates,
+        };
+        // the property may be polled already
+        if let Some(value) = module.values.get(&property_id) {
+            subscriber.offer(&module.module_def, value);
+        }
+        module.subscribers.push(subscriber);
+        drop(state);
+        self.changed.notify_one();
+    }
+
+    /// Number of properties being polled
+    pub fn num_watched(&self) -> usize {
+        let state = self.state.lock().unwrap();
+        return state
+            .modules
+            .values()
+            .map(|module| module.property_ids().len())
+            .sum();
+    }
+
+    /// Takes the next poll that is due, or tells until when there is nothing to do. None
+    /// for the time means until something changes.
+    fn next_poll(&self, now: Instant) -> std::result::Result<Poll, Option<Instant>> {
+        let mut state = self.state.lock().unwrap();
+        state.modules.retain(|_, module| {
+            module.subscribers.retain(|s| !s.updates.is_closed());
+            return module.in_flight || !module.subscribers.is_empty();
+        });
+        if state.num_in_flight >= MAX_POLLS_IN_FLIGHT {
+            return Err(None);
+        }
+        let Some((&id, module)) = state
+            .modules
+            .iter_mut()
+            .filter(|(_, module)| !module.in_flight && !module.subscribers.is_empty())
+            .min_by_key(|(_, module)| module.next_poll_at)
+        else {
+            return Err(None);
+        };
+        if module.next_poll_at > now {
+            return Err(Some(module.next_poll_at));
+        }
+        module.in_flight = true;
+        module.next_poll_at = now + module.interval().unwrap();
+        let poll = Poll {
+            id,
+            property_ids: module.property_ids(),
+        };
+        state.num_in_flight += 1;
+        return Ok(poll);
+    }
+
+    /// Takes in the result of a poll of `property_ids` and sends the changed values to the
+    /// subscribers. Subscribers of properties the poll did not ask for wait for the next one.
+    fn complete(&self, id: u8, property_ids: &[u8], result: Result<Vec<Property>>) {
+        let mut state = self.state.lock().unwrap();
+        state.num_in_flight -= 1;
+        let Some(module) = state.modules.get_mut(&id) else {
+            return;
+        };
+        module.in_flight = false;
+        match result {
+            Ok(properties) => {
+                module.num_failures = 0;
+                for property in properties {
+                    module.values.insert(property.id, property);
+                }
+                let ModuleWatch {
+                    module_def,
+                    values,
+                    subscribers,
+                    ..
+                } = module;
+                subscribers.retain_mut(|subscriber| match values.get(&subscriber.property_id) {
+                    Some(value) => subscriber.offer(module_def, value),
+                    None if property_ids.contains(&subscriber.property_id) => {
+                        let message = format!("property {} not reported", subscriber.property_id);
+                        let error = AppError::new(ErrorType::A3InvalidValue, message);
+                        let _ = subscriber.updates.try_send(Err(error));
+                        false
+                    }
+                    None => true,
+                });
+            }
+            Err(e) => {
+                module.num_failures += 1;
+                log::warn!(
+                    "Watch poll of module {} failed ({} in a row): {}",
+                    id,
+                    module.num_failures,
+                    e
+                );
+                if module.num_failures >= MAX_FAILURES {
+                    for subscriber in &module.subscribers {
+                        let _ = subscriber.updates.try_send(Err(e.clone()));
+                    }
+                    state.modules.remove(&id);
+                }
+            }
+        }
+        drop(state);
+        self.changed.notify_one();
+    }
+}
+
+impl ModuleWatch {
+    fn interval(&self) -> Option<Duration> {
+        self.subscribers.iter().map(|s| s.interval).min()
+    }
+
+    fn property_ids(&self) -> Vec<u8> {
+        let mut ids: Vec<u8> = self.subscribers.iter().map(|s| s.property_id).collect();
+        ids.sort_unstable();
+        ids.dedup();
+        return ids;
+    }
+}
+
+impl Subscriber {
+    /// Sends the value unless it is what the subscriber has already. Returns false if the
+    /// subscriber is gone.
+    fn offer(&mut self, module_def: &ModuleDef, value: &Property) -> bool {
+        if self.last_sent.as_ref() == Some(&value.data) {
+            return true;
+        }
+        let entry = PropertyEntry {
+            id: value.id,
+            name: property_name(module_def, value),
+            value: property_value_as_string(module_def, value),
+        };
+        match self.updates.try_send(Ok(entry)) {
+            Ok(()) => {
+                self.last_sent = Some(value.data.clone());
+                return true;
+            }
+            // sent again with a later poll
+            Err(mpsc::error::TrySendError::Full(_)) => return true,
+            Err(mpsc::error::TrySendError::Closed(_)) => return false,
+        }
+    }
+}
+
+/// Starts polling for the watches. `read` reads the given properties of a module.
+pub fn start<F, Fut>(watches: Arc<PropertyWatches>, read: F) -> JoinHandle<()>
+where
+    F: Fn(u8, Vec<u8>) -> Fut + Send + 'static,
+    Fut: Future<Output = Result<Vec<Property>>> + Send + 'static,
+{
+    return tokio::spawn(async move {
+        loop {
+            match watches.next_poll(Instant::now()) {
+                Ok(poll) => {
+                    let watches = watches.clone();
+                    let reading = read(poll.id, poll.property_ids.clone());
+                    tokio::spawn(async move {
+                        let result = reading.await;
+                        watches.complete(poll.id, &poll.property_ids, result);
+                    });
+                    sleep(POLL_SPACING).await;
+                }
+                Err(Some(at)) => {
+                    tokio::select! {
+                        _ = sleep_until(at.into()) => {}
+                        _ = watches.changed.notified() => {}
+                    }
+                }
+                Err(None) => watches.changed.notified().await,
+            }
+        }
+    });
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::atomic::{AtomicUsize, Ordering};
+
+    use super::*;
+    use crate::analog3::{A3_PROP_ID_NAME, schema::COMMON_MODULE_DEF};
+
+    fn watch(
+        watches: &PropertyWatches,
+        id: u8,
+        interval: Duration,
+    ) -> mpsc::Receiver<Result<PropertyEntry>> {
+        let (updates, updates_rx) = mpsc::channel(UPDATE_QUEUE_SIZE);
+        watches.subscribe(
+            id,
+            COMMON_MODULE_DEF.clone(),
+            A3_PROP_ID_NAME,
+            interval,
+            updates,
+        );
+        return updates_rx;
+    }
+
+    #[test]
+    fn test_change_only_updates() {
+        let watches = PropertyWatches::new();
+        let mut updates_rx = watch(&watches, 3, Duration::from_millis(10));
+        let now = Instant::now();
+        let poll = watches.next_poll(now).unwrap();
+        assert_eq!(
+            poll,
+            Poll {
+                id: 3,
+                property_ids: vec![A3_PROP_ID_NAME]
+            }
+        );
+        assert_eq!(watches.next_poll(now), Err(None));
+
+        let name = |text: &str| Ok(vec![Property::text(A3_PROP_ID_NAME, text)]);
+        watches.complete(3, &poll.property_ids, name("osc-1"));
+        // the interval is raised to the minimum
+        assert_eq!(watches.next_poll(now), Err(Some(now + MIN_INTERVAL)));
+        assert_eq!(updates_rx.try_recv().unwrap().unwrap().value, "osc-1");
+        watches.next_poll(now + MIN_INTERVAL).unwrap();
+        watches.complete(3, &poll.property_ids, name("osc-1"));
+        assert!(updates_rx.try_recv().is_err());
+        watches.next_poll(now + MIN_INTERVAL * 2).unwrap();
+        watches.complete(3, &poll.property_ids, name("osc-2"));
+        assert_eq!(updates_rx.try_recv().unwrap().unwrap().value, "osc-2");
+
+        // failures end the watch after a few in a row
+        for n in 1..=MAX_FAILURES {
+            watches.next_poll(now + MIN_INTERVAL * (2 + n)).unwrap();
+            watches.complete(3, &poll.property_ids, Err(AppError::timeout()));
+        }
+        assert!(updates_rx.try_recv().unwrap().is_err());
+        assert_eq!(watches.num_watched(), 0);
+    }
+
+    #[test]
+    fn test_subscribe_during_poll() {
+        const UID: u8 = 0;
+        let watches = PropertyWatches::new();
+        let mut name_rx = watch(&watches, 3, MIN_INTERVAL);
+        let now = Instant::now();
+        let poll = watches.next_poll(now).unwrap();
+
+        // a property subscribed while the poll is out waits for the next one
+        let (updates, mut uid_rx) = mpsc::channel(UPDATE_QUEUE_SIZE);
+        watches.subscribe(3, COMMON_MODULE_DEF.clone(), UID, MIN_INTERVAL, updates);
+        let name = vec![Property::text(A3_PROP_ID_NAME, "osc-1")];
+        watches.complete(3, &poll.property_ids, Ok(name));
+        assert_eq!(name_rx.try_recv().unwrap().unwrap().value, "osc-1");
+        assert!(uid_rx.try_recv().is_err());
+        assert_eq!(watches.num_watched(), 2);
+
+        let poll = watches.next_poll(now + MIN_INTERVAL).unwrap();
+        assert_eq!(poll.property_ids, vec![UID, A3_PROP_ID_NAME]);
+        let uid = vec![Property::u32(UID, 0x1234)];
+        watches.complete(3, &poll.property_ids, Ok(uid));
+        assert!(uid_rx.try_recv().unwrap().is_ok());
+        assert!(name_rx.try_recv().is_err());
+
+        // a property the poll asked for and never got ends its watches
+        const TYPE: u8 = 1;
+        let (updates, mut type_rx) = mpsc::channel(UPDATE_QUEUE_SIZE);
+        watches.subscribe(3, COMMON_MODULE_DEF.clone(), TYPE, MIN_INTERVAL, updates);
+        let poll = watches.next_poll(now + MIN_INTERVAL * 2).unwrap();
+        watches.complete(3, &poll.property_ids, Ok(Vec::new()));
+        assert!(type_rx.try_recv().unwrap().is_err());
+        assert!(uid_rx.try_recv().is_err());
+        assert_eq!(watches.num_watched(), 2);
+    }
+
+    #[tokio::test]
+    async fn test_shared_polls() {
+        let watches = Arc::new(PropertyWatches::new());
+        let num_reads = Arc::new(AtomicUsize::new(0));
+        let counter = num_reads.clone();
+        start(watches.clone(), move |_id, property_ids| {
+            counter.fetch_add(1, Ordering::Relaxed);
+            async move {
+                assert_eq!(property_ids, vec![A3_PROP_ID_NAME]);
+                Ok(vec![Property::text(A3_PROP_ID_NAME, "amp")])
+            }
+        });
+        let mut first = watch(&watches, 7, MIN_INTERVAL);
+        assert_eq!(first.recv().await.unwrap().unwrap().value, "amp");
+        // a later subscriber gets the polled value without a poll of its own
+        let mut second = watch(&watches, 7, Duration::from_secs(5));
+        assert_eq!(second.recv().await.unwrap().unwrap().value, "amp");
+        assert_eq!(watches.num_watched(), 1);
+
+        sleep(MIN_INTERVAL * 3 + MIN_INTERVAL / 2).await;
+        // polled at the shortest interval, and unchanged values are not sent
+        let num_polls = num_reads.load(Ordering::Relaxed);
+        assert!((3..=5).contains(&num_polls), "{}", num_polls);
+        assert!(first.try_recv().is_err());
+        assert!(second.try_recv().is_err());
+
+        drop(first);
+        drop(second);
+        sleep(MIN_INTERVAL * 2).await;
+        assert_eq!(watches.num_watched(), 0);
+    }
+}
@@ -0,0 +1,221 @@
+use std::{collections::HashMap, sync::Mutex};
+
+use tokio::sync::oneshot;
+
+use super::config_cache::changed_properties;
+use crate::{
+    analog3::{
+        A3_PROP_MAX_LENGTH,
+        config::Property,
+        schema::{ModuleDef, ValueType},
+    },
+    error::{AppError, ErrorType},
+};
+
+type Result<T> = std::result::Result<T, AppError>;
+
+/// Receives the number of properties that were actually written to the module.
+pub type WriteWaiter = oneshot::Sender<Result<usize>>;
+
+/// Config writes queued per module.
+///
+/// Only one write stream runs against a module at a time. Requests that arrive meanwhile
+/// are merged into a single pending property set, which the running writer picks up when
+/// its stream is done. A burst of scripted writes to a module thus costs one extra
+/// transfer instead of one per request.
+pub struct WritePlanner {
+    queues: Mutex<HashMap<u8, ModuleQueue>>,
+}
+
+/// Presence of the queue means a writer is active for the module.
+struct ModuleQueue {
+    props: Vec<Property>,
+    waiters: Vec<WriteWaiter>,
+}
+
+impl WritePlanner {
+    pub fn new() -> Self {
+        Self {
+            queues: Mutex::new(HashMap::new()),
+        }
+    }
+
+    /// Queues a write. Returns true if no writer was active for the module, in which case
+    /// the caller is responsible for draining the queue by `take()`.
+    pub fn enqueue(&self, id: u8, props: &[Property], waiter: WriteWaiter) -> bool {
+        let mut queues = self.queues.lock().unwrap();
+        match queues.get_mut(&id) {
+            Some(queue) => {
+                merge_properties(&mut queue.props, props);
+                queue.waiters.push(waiter);
+                return false;
+            }
+            None => {
+                queues.insert(
+                    id,
+                    ModuleQueue {
+                        props: props.to_vec(),
+                        waiters: vec![waiter],
+                    },
+                );
+                return true;
+            }
+        }
+    }
+
+    /// Takes the merged pending writes of the module. Returns None and retires the writer
+    /// when nothing is pending.
+    pub fn take(&self, id: u8) -> Option<(Vec<Property>, Vec<WriteWaiter>)> {
+        let mut queues = self.queues.lock().unwrap();
+        let queue = queues.get_mut(&id)?;
+        if queue.waiters.is_empty() {
+            queues.remove(&id);
+            return None;
+        }
+        let props = std::mem::take(&mut queue.props);
+        let waiters = std::mem::take(&mut queue.waiters);
+        return Some((props, waiters));
+    }
+}
+
+/// Applies `props` onto `target`. A later value for the same property wins.
+pub fn merge_properties(target: &mut Vec<Property>, props: &[Property]) {
+    for prop in props {
+        match target.iter_mut().find(|entry| entry.id == prop.id) {
+            Some(entry) => *entry = prop.clone(),
+            None => target.push(prop.clone()),
+        }
+    }
+}
+
+/// Checks the properties against the module definition before they reach the bus.
+pub fn validate(props: &[Property], module_def: &ModuleDef) -> Result<()> {
+    for prop in props {
+        let Some(property_def) = module_def.get_property_by_id(prop.id) else {
+            return Err(AppError::new(
+                ErrorType::UserCommandInvalidRequest,
+                format!(
+                    "No such property for {}: {}",
+                    module_def.module_type_name, prop.id
+                ),
+            ));
+        };
+        if property_def.read_only.unwrap_or(false) {
+            return Err(AppError::new(
+                ErrorType::UserCommandInvalidRequest,
+                format!("Property is read-only: {}", property_def.name),
+            ));
+        }
+        let length = prop.data.len();
+        let valid_length = match property_def.value_type {
+            ValueType::U8 | ValueType::Boolean => length == 1,
+            ValueType::U16 => length == 2,
+            ValueType::U32 => length == 4,
+            ValueType::Text | ValueType::VectorU8 => length <= A3_PROP_MAX_LENGTH,
+            ValueType::VectorU16 => length % 2 == 0 && length <= A3_PROP_MAX_LENGTH,
+        };
+        if !valid_length || prop.length as usize != length {
+            return Err(AppError::new(
+                ErrorType::A3InvalidValue,
+                format!(
+                    "Invalid value length {} for {} ({:?})",
+                    length, property_def.name, property_def.value_type
+                ),
+            ));
+        }
+        if let Some(enum_names) = &property_def.enum_names {
+            if prop.data[0] as usize >= enum_names.len() {
+                return Err(AppError::new(
+                    ErrorType::A3InvalidValue,
+                    format!(
+                        "Value {} is out of range for {}",
+                        prop.data[0], property_def.name
+                    ),
+                ));
+            }
+        }
+    }
+    return Ok(());
+}
+
+/// Returns the properties that need to go on the bus, i.e., the validated ones that do not
+/// already hold the value according to the last known config.
+pub fn plan(
+    current: Option<&[Property]>,
+    props: &[Property],
+    module_def: &ModuleDef,
+) -> Vec<Property> {
+    changed_properties(current.unwrap_or(&[]), props, module_def)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::Arc;
+
+    use crate::analog3::{A3_PROP_ID_MODULE_UID, A3_PROP_ID_NAME, schema::modules_schema};
+
+    fn amps_def() -> Arc<ModuleDef> {
+        modules_schema().get(&2).unwrap().clone()
+    }
+
+    #[test]
+    fn test_queue_coalescing() {
+        let planner = WritePlanner::new();
+        let (tx1, _rx1) = oneshot::channel();
+        let (tx2, _rx2) = oneshot::channel();
+        let (tx3, _rx3) = oneshot::channel();
+        assert!(planner.enqueue(5, &[Property::u8(3, 1)], tx1));
+        let (props, waiters) = planner.take(5).unwrap();
+        assert_eq!(props.len(), 1);
+        assert_eq!(waiters.len(), 1);
+
+        // the writer is still active; these are merged into one write
+        assert!(!planner.enqueue(5, &[Property::u8(3, 2)], tx2));
+        assert!(!planner.enqueue(5, &[Property::u8(3, 4), Property::u16(6, 7)], tx3));
+        let (props, waiters) = planner.take(5).unwrap();
+        assert_eq!(props.len(), 2);
+        assert_eq!(props[0].data, vec![4]);
+        assert_eq!(waiters.len(), 2);
+
+        assert!(planner.take(5).is_none());
+        let (tx4, _rx4) = oneshot::channel();
+        assert!(planner.enqueue(5, &[Property::u8(3, 1)], tx4));
+    }
+
+    #[test]
+    fn test_validate() {
+        let def = amps_def();
+        assert!(validate(&[Property::u8(3, 1), Property::u16(6, 0x80)], &def).is_ok());
+        assert!(validate(&[Property::text(A3_PROP_ID_NAME, &"vca".to_string())], &def).is_ok());
+        // length mismatch
+        assert!(validate(&[Property::u16(3, 1)], &def).is_err());
+        // unknown property
+        assert!(validate(&[Property::u8(200, 1)], &def).is_err());
+        let error = validate(&[Property::u32(A3_PROP_ID_MODULE_UID, 5)], &def).unwrap_err();
+        assert!(matches!(
+            error.error_type,
+            ErrorType::UserCommandInvalidRequest
+        ));
+    }
+
+    #[test]
+    fn test_plan() {
+        let def = amps_def();
+        let current = vec![
+            Property::u32(A3_PROP_ID_MODULE_UID, 0x1acebeef),
+            Property::u8(3, 1),
+        ];
+        let props = vec![
+            Property::u32(A3_PROP_ID_MODULE_UID, 0xba5eba11),
+            Property::u8(3, 1),
+            Property::u16(6, 0x80),
+        ];
+        let planned = plan(Some(&current), &props, &def);
+        assert_eq!(planned.len(), 1);
+        assert_eq!(planned[0].id, 6);
+
+        // nothing is known about the module yet; only the read-only write is dropped
+        assert_eq!(plan(None, &props, &def).len(), 2);
+    }
+}
@@ -1,34 +1,89 @@
+mod machine;
+mod output;
+mod scheduler;
 mod spec;
+mod tokens;
 
-use std::cmp::max;
+use std::{
+    fs, io,
+    path::Path,
+    sync::Arc,
+    time::{Duration, Instant},
+};
 
 use tokio::{
-    io::{AsyncBufReadExt, AsyncWriteExt, BufReader},
-    net::{TcpListener, TcpStream},
-    sync::mpsc::{Receiver, Sender, channel},
+    io::{AsyncBufReadExt, BufReader},
+    net::{TcpListener, TcpStream, UnixListener},
+    sync::mpsc::{self, Receiver, Sender, channel},
     sync::oneshot,
     task::JoinHandle,
+    time::sleep,
 };
 
 use crate::{
+    a3_modules::{A3Module, ModuleEvent},
     analog3::{
         A3_PROP_ID_NAME,
-        config::{Configuration, Property, Value},
+        config::{Configuration, Property},
+    },
+    can_controller::CanMessage,
+    command::{
+        Command, OperationResult, PropertyEntry, Request, ResponseStream, StreamIdAllocator,
     },
-    command::Command,
     error::{AppError, ErrorType},
-    user_session::spec::Spec,
+    mission_control::{
+        DEFAULT_WATCH_INTERVAL, FanOutOp, FanOutOutcome, FanOutProgress, FanOutSummary,
+        LatencySummary, RealtimeStats, RttHistogram, WATCH_QUEUE_SIZE,
+    },
+    user_session::{
+        output::Output,
+        scheduler::{CommandSender, Scheduler},
+        spec::{Arg, Args, ArgsError, Options, Spec, parse_args, parse_args_and_options},
+        tokens::Tokens,
+    },
 };
 
-pub async fn start() -> std::io::Result<(Receiver<Command>, JoinHandle<()>)> {
+/// Tag used by the staging commands when none is given
+const DEFAULT_STAGE_TAG: u8 = 0;
+
+/// Width of the name column of a config listing. Rows are written as they arrive, so the
+/// column cannot be fitted to the longest name.
+const CONFIG_NAME_WIDTH: usize = 28;
+
+const GET_NAME_SPECS: [Spec; 1] = [Spec::u8("id", true)];
+const RENAME_SPECS: [Spec; 2] = [Spec::u8("id", true), Spec::str("name", true)];
+const SET_SPECS: [Spec; 3] = [
+    Spec::u8("id", true),
+    Spec::str("prop-name", true),
+    Spec::str("value", true),
+];
+const PING_SPECS: [Spec; 2] = [Spec::u8("id", true), Spec::bool("visual", false)];
+const PING_OPTION_SPECS: [Spec; 2] = [Spec::u32("count", false), Spec::u32("interval", false)];
+
+/// Starts the listeners. The machine protocol is served on the Unix domain socket at
+/// `socket_path`, too, if given. Commands are scheduled with the load of `bus_tx` in view.
+pub async fn start(
+    socket_path: Option<&Path>,
+    bus_tx: Sender<CanMessage>,
+) -> std::io::Result<(Receiver<Request>, JoinHandle<()>)> {
     let (command_tx, command_rx) = channel(8);
+    let (scheduler, _) = Scheduler::start(command_tx, bus_tx);
     let listener = TcpListener::bind("127.0.0.1:9999").await?;
+    let machine_listener = TcpListener::bind("127.0.0.1:9998").await?;
+    let unix_listener = match socket_path {
+        Some(path) => Some(bind_unix(path)?),
+        None => None,
+    };
     let handle = tokio::spawn(async move {
+        tokio::spawn(machine::serve(machine_listener, scheduler.clone()));
+        if let Some(unix_listener) = unix_listener {
+            tokio::spawn(machine::serve_unix(unix_listener, scheduler.clone()));
+        }
         log::info!("Listening on port 9999");
         loop {
             // The second item contains the IP and port of the new connection.
             match listener.accept().await {
-                Ok((stream, _)) => start_session(stream, command_tx.clone()),
+                Ok((stream, _)) => start_session(stream, scheduler.session()),
                 Err(e) => log::error!("User connection accept error: {:?}", e),
             }
         }
@@ -36,73 +91,100 @@ pub async fn start() -> std::io::Result<(Receiver<Command>, JoinHandle<()>)> {
     return Ok((command_rx, handle));
 }
 
-fn start_session(stream: TcpStream, command_tx: Sender<Command>) {
+/// Binds the socket, replacing the one left behind by a previous run.
+fn bind_unix(path: &Path) -> io::Result<UnixListener> {
+    if let Some(dir) = path.parent() {
+        fs::create_dir_all(dir)?;
+    }
+    match fs::remove_file(path) {
+        Err(e) if e.kind() != io::ErrorKind::NotFound => return Err(e),
+        _ => {}
+    }
+    return UnixListener::bind(path);
+}
+
+fn start_session(stream: TcpStream, command_tx: CommandSender) {
     tokio::spawn(async move {
         let mut session = Session::new(stream, command_tx);
         session.run().await.unwrap();
     });
 }
 
+const PROMPT: &[u8] = b"analog3> ";
+
 struct Session {
     stream: BufReader<TcpStream>,
-    command_tx: Sender<Command>,
+    command_tx: CommandSender,
+    stream_ids: StreamIdAllocator,
+    out: Output,
 }
 
 impl Session {
-    pub fn new(stream: TcpStream, command_tx: Sender<Command>) -> Self {
+    pub fn new(stream: TcpStream, command_tx: CommandSender) -> Self {
         Self {
             stream: BufReader::new(stream),
             command_tx,
+            stream_ids: StreamIdAllocator::default(),
+            out: Output::default(),
         }
     }
 
     pub async fn run(&mut self) -> std::io::Result<()> {
-        self.stream
-            .write_all(b"\r\n====================================\r\n welcome to analog3 mission control\r\n====================================\r\n\r\n")
-            .await?;
+        self.out
+            .push(b"\r\n====================================\r\n welcome to analog3 mission control\r\n====================================\r\n\r\n");
 
+        // reused for every line
+        let mut line = String::new();
+        let mut ranges = Vec::new();
         loop {
-            self.stream.write_all(b"analog3> ").await?;
-            let mut line = String::new();
+            self.out.flush(&mut self.stream, PROMPT).await?;
+            line.clear();
             match self.stream.read_line(&mut line).await? {
                 0 => {
                     log::debug!("Connection closed");
                     return Ok(());
                 }
                 _ => {
-                    let trimmed = line.trim().to_string();
-                    log::debug!("User command: {}", trimmed);
-                    let tokens: Vec<String> = Self::tokenize(&trimmed);
-                    if tokens.is_empty() {
+                    log::debug!("User command: {}", line.trim());
+                    let tokens = Tokens::parse(&mut line, &mut ranges);
+                    let Some(command) = tokens.get(0) else {
                         // do nothing
                         continue;
-                    }
-                    let command = tokens[0].trim();
+                    };
                     match command {
-                        "hello" => {
-                            self.stream.write_all(b"hi\r\n").await?;
-                        }
+                        "hello" => self.out.push(b"hi\r\n"),
                         "hi" => self.hi().await?,
                         "list" => self.list().await?,
+                        "subscribe" => self.subscribe().await?,
+                        "watch" => self.watch(command, &tokens).await?,
                         "ping" => self.ping(command, &tokens).await?,
-                        "get-name" => self.get_name(&command, &tokens).await?,
-                        "rename" => self.rename(&command, &tokens).await?,
-                        "get-config" => self.get_config(&command, &tokens).await?,
-                        "set" => self.set_property(&command, &tokens).await?,
-                        "cancel-uid" => self.cancel_uid(&command, &tokens).await?,
-                        "pretend-sign-in" => self.pretend_sign_in(&command, &tokens).await?,
-                        "pretend-notify-id" => self.pretend_notify_id(&command, &tokens).await?,
+                        "ping-stats" => self.ping_stats(command, &tokens).await?,
+                        "get-name" => self.get_name(command, &tokens).await?,
+                        "rename" => self.rename(command, &tokens).await?,
+                        "get-config" => self.get_config(command, &tokens).await?,
+                        "set" => self.set_property(command, &tokens).await?,
+                        "get-config-all" => self.get_config_all(command, &tokens).await?,
+                        "set-all" => self.set_all(command, &tokens).await?,
+                        "rename-all" => self.rename_all(command, &tokens).await?,
+                        "snapshot-save" => self.snapshot_save(command, &tokens).await?,
+                        "snapshot-restore" => self.snapshot_restore(command, &tokens).await?,
+                        "stage" => self.stage(command, &tokens).await?,
+                        "preset-stage" => self.preset_stage(command, &tokens).await?,
+                        "batch" => self.batch(command, &tokens).await?,
+                        "commit" => self.commit(command, &tokens).await?,
+                        "discard" => self.discard(command, &tokens).await?,
+                        "rt" => self.set_realtime(command, &tokens).await?,
+                        "rt-stats" => self.realtime_stats().await?,
+                        "cancel-uid" => self.cancel_uid(command, &tokens).await?,
+                        "pretend-sign-in" => self.pretend_sign_in(command, &tokens).await?,
+                        "pretend-notify-id" => self.pretend_notify_id(command, &tokens).await?,
                         "quit" => {
-                            self.stream.write_all(b"bye!\r\n").await?;
-                            return Ok(());
-                        }
-                        "" => {
-                            // do nothing
+                            self.out.push(b"bye!\r\n");
+                            return self.out.flush(&mut self.stream, b"").await;
                         }
                         _ => {
-                            self.stream
-                                .write_all(format!("{}: Unknown command\r\n", command).as_bytes())
-                                .await?;
+                            self.out
+                                .push_fmt(format_args!("{}: Unknown command\r\n", command));
                         }
                     }
                 }
@@ -113,258 +195,768 @@ impl Session {
     async fn hi(&mut self) -> std::io::Result<()> {
         let (resp_tx, resp_rx) = oneshot::channel();
         let command = Command::Hi { resp: resp_tx };
-        self.command_tx.send(command).await.unwrap();
-        return self.wait_and_handle_response(resp_rx, |r| r).await;
+        self.command_tx.send(command).await;
+        return self
+            .wait_and_handle_response(resp_rx, |greeting, out| out.push_str(&greeting))
+            .await;
     }
 
     async fn list(&mut self) -> std::io::Result<()> {
+        let (resp, parts) = ResponseStream::new(
+            self.stream_ids.next(),
+            Box::new(|m: &Arc<A3Module>| {
+                let module_type = match &m.module_type {
+                    Some(value) => format!(" type={}", value),
+                    None => "".to_string(),
+                };
+                let name = match &m.name {
+                    Some(value) => format!(" name={}", value),
+                    None => "".to_string(),
+                };
+                format!(
+                    "uid={:08x} id={:02x}{}{}\r\n",
+                    m.uid, m.id, module_type, name
+                )
+                .into_bytes()
+            }),
+        );
+        self.command_tx.send(Command::List { resp }).await;
+        self.write_response_stream(parts).await?;
+        return Ok(());
+    }
+
+    /// Streams registry events until the client sends a line.
+    async fn subscribe(&mut self) -> std::io::Result<()> {
         let (resp_tx, resp_rx) = oneshot::channel();
-        let command = Command::List { resp: resp_tx };
-        self.command_tx.send(command).await.unwrap();
-        return self
-            .wait_and_handle_response(resp_rx, |modules| {
-                let reply = modules
-                    .iter()
-                    .map(|m| {
-                        let module_type = match &m.module_type {
-                            Some(value) => format!(" type={}", value),
-                            None => "".to_string(),
-                        };
-                        let name = match &m.name {
-                            Some(value) => format!(" name={}", value),
-                            None => "".to_string(),
-                        };
-                        format!("uid={:08x} id={:02x}{}{}", m.uid, m.id, module_type, name)
-                    })
-                    .collect::<Vec<_>>()
-                    .join("\r\n");
-                return reply;
-            })
-            .await;
+        let command = Command::Subscribe { resp: resp_tx };
+        self.command_tx.send(command).await;
+        let subscription = match resp_rx.await.unwrap() {
+            Ok(subscription) => subscription,
+            Err(e) => {
+                self.out
+                    .push_fmt(format_args!("Error: {:?}: {}\r\n", e.error_type, e.message));
+                return Ok(());
+            }
+        };
+        self.out.push(b"subscribed; press enter to stop\r\n");
+        self.out.flush(&mut self.stream, b"").await?;
+        let mut line = String::new();
+        loop {
+            tokio::select! {
+                batch = subscription.next() => {
+                    if batch.num_lost > 0 {
+                        self.out.push_fmt(format_args!("event overflow lost={}\r\n", batch.num_lost));
+                    }
+                    for event in batch.events {
+                        Self::write_module_event(&mut self.out, &event);
+                        self.out.push(b"\r\n");
+                    }
+                    self.out.flush(&mut self.stream, b"").await?;
+                }
+                read = self.stream.read_line(&mut line) => {
+                    if read? > 0 {
+                        self.out.push(b"unsubscribed\r\n");
+                    }
+                    return Ok(());
+                }
+            }
+        }
     }
 
-    async fn ping(&mut self, command: &str, tokens: &Vec<String>) -> std::io::Result<()> {
-        let specs = vec![Spec::u8("id", true), Spec::bool("visual", false)];
-        let Some(params) = self.parse_params(command, tokens, &specs).await.unwrap() else {
+    /// Streams the value of a property as it changes until the client sends a line. The
+    /// interval is in milliseconds.
+    async fn watch(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [
+            Spec::u8("id", true),
+            Spec::str("prop-name", true),
+            Spec::u32("interval", false),
+        ];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
             return Ok(());
         };
-
-        let (resp_tx, resp_rx) = oneshot::channel();
         let id = params[0].as_u8().unwrap();
-        let enable_visual = if params.len() > 1 {
-            params[1].as_bool().unwrap()
-        } else {
-            false
+        let interval = match params.get(2) {
+            Some(param) => Duration::from_millis(param.as_u32().unwrap() as u64),
+            None => DEFAULT_WATCH_INTERVAL,
         };
-        let command = Command::Ping {
+        let (updates, mut updates_rx) = mpsc::channel(WATCH_QUEUE_SIZE);
+        let (resp_tx, resp_rx) = oneshot::channel();
+        let command = Command::Watch {
             id,
-            enable_visual,
+            property_name: params[1].as_text().unwrap().to_string(),
+            interval,
+            updates,
             resp: resp_tx,
         };
-        self.command_tx.send(command).await.unwrap();
-        self.stream
-            .write_all(format!("ping to id {:02x} ... ", id).as_bytes())
-            .await?;
+        self.command_tx.send(command).await;
+        if let Err(e) = resp_rx.await.unwrap() {
+            write_error(&mut self.out, &e);
+            return Ok(());
+        }
+        self.out.push(b"watching; press enter to stop\r\n");
+        self.out.flush(&mut self.stream, b"").await?;
+        let mut line = String::new();
+        loop {
+            tokio::select! {
+                update = updates_rx.recv() => {
+                    match update {
+                        Some(Ok(entry)) => self.out.push_fmt(format_args!(
+                            "id={:02x} {}={}\r\n",
+                            id, entry.name, entry.value
+                        )),
+                        Some(Err(e)) => {
+                            write_error(&mut self.out, &e);
+                            return Ok(());
+                        }
+                        None => return Ok(()),
+                    }
+                    self.out.flush(&mut self.stream, b"").await?;
+                }
+                read = self.stream.read_line(&mut line) => {
+                    if read? > 0 {
+                        self.out.push(b"unwatched\r\n");
+                    }
+                    return Ok(());
+                }
+            }
+        }
+    }
+
+    fn write_module_event(out: &mut Output, event: &ModuleEvent) {
+        match event {
+            ModuleEvent::Registered { id, uid } => out.push_fmt(format_args!(
+                "event registered id={:02x} uid={:08x}",
+                id, uid
+            )),
+            ModuleEvent::Deregistered { id, uid } => out.push_fmt(format_args!(
+                "event deregistered id={:02x} uid={:08x}",
+                id, uid
+            )),
+            ModuleEvent::Renamed { id, uid, name } => out.push_fmt(format_args!(
+                "event renamed id={:02x} uid={:08x} name={}",
+                id, uid, name
+            )),
+            ModuleEvent::TypeResolved {
+                id,
+                uid,
+                module_type,
+            } => out.push_fmt(format_args!(
+                "event type-resolved id={:02x} uid={:08x} type={}",
+                id, uid, module_type
+            )),
+            ModuleEvent::LivenessChanged { id, uid, alive } => out.push_fmt(format_args!(
+                "event liveness id={:02x} uid={:08x} alive={}",
+                id, uid, alive
+            )),
+        }
+    }
+
+    async fn ping(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let PingArgs {
+            id,
+            enable_visual,
+            count,
+            interval,
+        } = match parse_ping(tokens) {
+            Ok(args) => args,
+            Err(e) => return self.args_error(command, &PING_SPECS, e).await,
+        };
+
+        if count == 0 {
+            let (resp_tx, resp_rx) = oneshot::channel();
+            let command = Command::Ping {
+                id,
+                enable_visual,
+                resp: resp_tx,
+            };
+            self.command_tx.send(command).await;
+            self.out
+                .push_fmt(format_args!("ping to id {:02x} ... ", id));
+            // the reply may take until the timeout
+            self.out.flush(&mut self.stream, b"").await?;
+            return self
+                .wait_and_handle_response(resp_rx, Self::write_rtt)
+                .await;
+        }
+
+        self.out.push_fmt(format_args!(
+            "ping to id {:02x} count={} ...\r\n",
+            id, count
+        ));
+        let mut samples = Vec::<Duration>::new();
+        for seq in 1..=count {
+            self.out.flush(&mut self.stream, b"").await?;
+            let (resp_tx, resp_rx) = oneshot::channel();
+            let command = Command::Ping {
+                id,
+                enable_visual,
+                resp: resp_tx,
+            };
+            self.command_tx.send(command).await;
+            match resp_rx.await.unwrap() {
+                Ok(rtt) => {
+                    samples.push(rtt);
+                    self.out
+                        .push_fmt(format_args!("seq={} rtt={}us\r\n", seq, rtt.as_micros()));
+                }
+                Err(e) => match e.error_type {
+                    ErrorType::Timeout => {
+                        self.out.push_fmt(format_args!("seq={} timeout\r\n", seq))
+                    }
+                    _ => self.out.push_fmt(format_args!(
+                        "seq={} Error: {:?}: {}\r\n",
+                        seq, e.error_type, e.message
+                    )),
+                },
+            };
+            if seq < count {
+                self.out.flush(&mut self.stream, b"").await?;
+                sleep(interval).await;
+            }
+        }
+        self.out.push_fmt(format_args!(
+            "--- {} sent, {} received",
+            count,
+            samples.len()
+        ));
+        if let Some(stats) = LatencySummary::from_samples(&samples) {
+            self.out.push(b", min/avg/p50/p99/max = ");
+            Self::write_latency_summary(&mut self.out, &stats);
+        }
+        self.out.push(b"\r\n");
+        return Ok(());
+    }
+
+    async fn ping_stats(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [Spec::u8("id", false)];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
+            return Ok(());
+        };
+
+        let (resp_tx, resp_rx) = oneshot::channel();
+        let id = params.first().map(|param| param.as_u8().unwrap());
+        let command = Command::GetPingStats { id, resp: resp_tx };
+        self.command_tx.send(command).await;
         return self
-            .wait_and_handle_response(resp_rx, |_| "ok".to_string())
+            .wait_and_handle_response(resp_rx, |histograms, out| {
+                for (index, (id, histogram)) in histograms.iter().enumerate() {
+                    if index > 0 {
+                        out.push(b"\r\n");
+                    }
+                    Self::write_histogram(out, *id, histogram);
+                }
+            })
             .await;
     }
 
-    async fn get_name(&mut self, command: &str, tokens: &Vec<String>) -> std::io::Result<()> {
-        let specs = vec![Spec::u8("id", true)];
-        let Some(params) = self.parse_params(command, tokens, &specs).await.unwrap() else {
-            return Ok(());
+    fn write_histogram(out: &mut Output, id: u8, histogram: &RttHistogram) {
+        out.push_fmt(format_args!(
+            "id={:02x} received={} timeouts={}",
+            id,
+            histogram.count(),
+            histogram.timeouts()
+        ));
+        if let Some(stats) = histogram.summary() {
+            out.push(b" min/avg/p50/p99/max = ");
+            Self::write_latency_summary(out, &stats);
+        }
+    }
+
+    fn write_latency_summary(out: &mut Output, stats: &LatencySummary) {
+        out.push_fmt(format_args!(
+            "{}/{}/{}/{}/{} us",
+            stats.min.as_micros(),
+            stats.avg.as_micros(),
+            stats.p50.as_micros(),
+            stats.p99.as_micros(),
+            stats.max.as_micros()
+        ));
+    }
+
+    async fn get_name(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let id = match parse_get_name(tokens) {
+            Ok(id) => id,
+            Err(e) => return self.args_error(command, &GET_NAME_SPECS, e).await,
         };
 
         let (resp_tx, resp_rx) = oneshot::channel();
-        let id = params[0].as_u8().unwrap();
         let command = Command::GetName { id, resp: resp_tx };
-        self.command_tx.send(command).await.unwrap();
+        self.command_tx.send(command).await;
 
-        return self.wait_and_handle_response(resp_rx, |name| name).await;
+        return self
+            .wait_and_handle_response(resp_rx, |name, out| out.push_str(&name))
+            .await;
     }
 
-    async fn rename(&mut self, command: &str, tokens: &Vec<String>) -> std::io::Result<()> {
-        let specs = vec![Spec::u8("id", true), Spec::str("name", true)];
-        let Some(params) = self.parse_params(command, tokens, &specs).await.unwrap() else {
-            return Ok(());
+    async fn rename(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let (id, new_name) = match parse_rename(tokens) {
+            Ok(args) => args,
+            Err(e) => return self.args_error(command, &RENAME_SPECS, e).await,
         };
 
         let (resp_tx, resp_rx) = oneshot::channel();
-        let id = params[0].as_u8().unwrap();
-        let new_name = params[1].as_text().unwrap();
-        let property = Property::text(A3_PROP_ID_NAME, &new_name);
+        let property = Property::text(A3_PROP_ID_NAME, new_name);
         let command = Command::SetConfig {
             id,
             props: vec![property],
             resp: resp_tx,
         };
-        self.command_tx.send(command).await.unwrap();
+        self.command_tx.send(command).await;
 
         return self
-            .wait_and_handle_response(resp_rx, |_| "ok".to_string())
+            .wait_and_handle_response(resp_rx, Self::write_num_written)
             .await;
     }
 
-    async fn get_config(&mut self, command: &str, tokens: &Vec<String>) -> std::io::Result<()> {
-        let specs = vec![Spec::u8("id", true)];
-        let Some(params) = self.parse_params(command, tokens, &specs).await.unwrap() else {
+    async fn get_config(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [Spec::u8("id", true)];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
             return Ok(());
         };
 
-        let (resp_tx, resp_rx) = oneshot::channel();
         let id = params[0].as_u8().unwrap();
-        let command = Command::GetConfig { id, resp: resp_tx };
-        self.command_tx.send(command).await.unwrap();
+        let (resp, parts) = ResponseStream::new(
+            self.stream_ids.next(),
+            Box::new(|entry: &PropertyEntry| {
+                let left = format!("({:3}) {}", entry.id, entry.name);
+                format!(
+                    "  {:<width$} : {}\r\n",
+                    left,
+                    entry.value,
+                    width = CONFIG_NAME_WIDTH
+                )
+                .into_bytes()
+            }),
+        );
+        self.command_tx.send(Command::GetConfig { id, resp }).await;
 
-        return self
-            .wait_and_handle_response(resp_rx, |properties| {
-                let config = Configuration::new(properties);
-                // show only the common fields for now
-                let mut key_values = Vec::<(String, String)>::new();
-                let mut longest = 0;
-
-                for i in 0..config.len() {
-                    let id = config.prop_id(i);
-                    let name = config.prop_name(i);
-                    let value = config.prop_value_as_string(i);
-                    let left = format!("({:3}) {}", id, name);
-                    longest = max(left.len(), longest);
-                    key_values.push((left, value));
-                }
+        self.out.push(b"\r\n");
+        if self.write_response_stream(parts).await? {
+            self.out.push(b"\r\n");
+        }
+        return Ok(());
+    }
 
-                let mut lines = Vec::<String>::new();
-                lines.push("".to_string());
-                for (name, value) in key_values {
-                    let mut line: String = format!("  {}", name);
-                    for _ in name.len()..longest {
-                        line.push(' ');
-                    }
-                    line.push_str(" : ");
-                    line.push_str(value.as_str());
-                    lines.push(line);
-                }
-                lines.push("".to_string());
-                return lines.join("\r\n");
-            })
-            .await;
+    async fn get_config_all(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [Spec::str("type", false)];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
+            return Ok(());
+        };
+        let module_type = params
+            .first()
+            .map(|param| param.as_text().unwrap().to_string());
+        return self.fan_out(FanOutOp::GetConfig { module_type }).await;
     }
 
-    async fn set_property(&mut self, command: &str, tokens: &Vec<String>) -> std::io::Result<()> {
-        let specs = vec![
-            Spec::u8("id", true),
+    async fn set_all(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [
+            Spec::str("type", true),
             Spec::str("prop-name", true),
             Spec::str("value", true),
         ];
-        let Some(params) = self.parse_params(command, tokens, &specs).await.unwrap() else {
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
             return Ok(());
         };
+        return self
+            .fan_out(FanOutOp::SetProperty {
+                module_type: params[0].as_text().unwrap().to_string(),
+                property_name: params[1].as_text().unwrap().to_string(),
+                value: params[2].as_text().unwrap().to_string(),
+            })
+            .await;
+    }
 
-        let id = params[0].as_u8().unwrap();
-        let property_name = params[1].as_text().unwrap();
-        let property_value = params[2].as_text().unwrap();
+    async fn rename_all(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [Spec::str("pattern", true), Spec::str("type", false)];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
+            return Ok(());
+        };
+        return self
+            .fan_out(FanOutOp::Rename {
+                pattern: params[0].as_text().unwrap().to_string(),
+                module_type: params
+                    .get(1)
+                    .map(|param| param.as_text().unwrap().to_string()),
+            })
+            .await;
+    }
+
+    async fn snapshot_save(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [Spec::str("file", true)];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
+            return Ok(());
+        };
+        let path = params[0].as_text().unwrap().to_string();
+        return self.fan_out(FanOutOp::Snapshot { path }).await;
+    }
+
+    async fn snapshot_restore(
+        &mut self,
+        command: &str,
+        tokens: &Tokens<'_>,
+    ) -> std::io::Result<()> {
+        let specs = [Spec::str("file", true)];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
+            return Ok(());
+        };
+        let path = params[0].as_text().unwrap().to_string();
+        return self.fan_out(FanOutOp::Restore { path }).await;
+    }
+
+    async fn preset_stage(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [Spec::str("file", true)];
+        let option_specs = [Spec::u8("tag", false)];
+        let Some((params, options)) = self
+            .parse_params_and_options(command, tokens, &specs, &option_specs)
+            .await?
+        else {
+            return Ok(());
+        };
+        let path = params[0].as_text().unwrap().to_string();
+        let tag = Self::tag_or_default(options[0].as_ref());
+        return self.fan_out(FanOutOp::Stage { path, tag }).await;
+    }
+
+    /// Runs a batch script given as the rest of the line, e.g.,
+    /// `batch set 1-4 cv_depth 0; get-config 1-4`.
+    async fn batch(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        if tokens.len() < 2 {
+            return self.usage(command, &[Spec::str("script", true)]).await;
+        }
+        let script = tokens.rest().to_string();
+        return self.fan_out(FanOutOp::Batch { script }).await;
+    }
+
+    /// Runs a rack-wide operation and streams per-module progress to the client.
+    async fn fan_out(&mut self, op: FanOutOp) -> std::io::Result<()> {
+        let (progress_tx, mut progress_rx) = mpsc::channel(16);
+        let (resp_tx, resp_rx) = oneshot::channel();
+        let command = Command::FanOut {
+            op,
+            progress: progress_tx,
+            resp: resp_tx,
+        };
+        self.command_tx.send(command).await;
+        while let Some(progress) = progress_rx.recv().await {
+            Self::write_fan_out_progress(&mut self.out, progress);
+            // write out what has piled up in one go
+            while let Ok(progress) = progress_rx.try_recv() {
+                Self::write_fan_out_progress(&mut self.out, progress);
+            }
+            self.out.flush(&mut self.stream, b"").await?;
+        }
+        return self
+            .wait_and_handle_response(resp_rx, |summary, out| {
+                Self::write_fan_out_summary(out, &summary)
+            })
+            .await;
+    }
+
+    fn write_fan_out_progress(out: &mut Output, progress: FanOutProgress) {
+        out.push_fmt(format_args!("[{}/{}]", progress.done, progress.total));
+        if let Some(index) = progress.step {
+            out.push_fmt(format_args!(" step={}", index + 1));
+        }
+        out.push_fmt(format_args!(
+            " id={:02x} uid={:08x} ",
+            progress.id, progress.uid
+        ));
+        match progress.result {
+            Ok(FanOutOutcome::Config(properties)) => Self::write_config(out, properties),
+            Ok(FanOutOutcome::Written) => out.push(b"ok"),
+            Ok(FanOutOutcome::Renamed(name)) => out.push_fmt(format_args!("renamed to {}", name)),
+            Ok(FanOutOutcome::Captured) => out.push(b"captured"),
+            Ok(FanOutOutcome::Restored(num_props)) => {
+                out.push_fmt(format_args!("restored {} properties", num_props))
+            }
+            Ok(FanOutOutcome::Staged(num_props)) => {
+                out.push_fmt(format_args!("staged {} properties", num_props))
+            }
+            Ok(FanOutOutcome::Unchanged) => out.push(b"unchanged"),
+            Ok(FanOutOutcome::Skipped(reason)) => out.push_fmt(format_args!("skipped: {}", reason)),
+            Err(e) => match e.error_type {
+                ErrorType::Timeout => out.push(b"timeout"),
+                _ => out.push_fmt(format_args!("Error: {:?}: {}", e.error_type, e.message)),
+            },
+        }
+        out.push(b"\r\n");
+    }
+
+    fn write_fan_out_summary(out: &mut Output, summary: &FanOutSummary) {
+        out.push_fmt(format_args!(
+            "done: {} modules, {} succeeded, {} failed, {} skipped in {}ms (concurrency {})",
+            summary.total,
+            summary.succeeded,
+            summary.failed,
+            summary.skipped,
+            summary.elapsed.as_millis(),
+            summary.concurrency_limit
+        ));
+    }
+
+    /// Writes the properties one per line, with the values lined up.
+    fn write_config(out: &mut Output, properties: Vec<Property>) {
+        let config = Configuration::new(properties);
+        let longest = (0..config.len())
+            .map(|i| config.prop_name(i).len())
+            .max()
+            .unwrap_or(0);
+        out.push(b"\r\n");
+        for i in 0..config.len() {
+            out.push_fmt(format_args!(
+                "  ({:3}) {:<width$} : {}\r\n",
+                config.prop_id(i),
+                config.prop_name(i),
+                config.prop_value_as_string(i),
+                width = longest
+            ));
+        }
+    }
+
+    async fn set_property(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let (id, property_name, property_value) = match parse_set(tokens) {
+            Ok(args) => args,
+            Err(e) => return self.args_error(command, &SET_SPECS, e).await,
+        };
 
         let (resp_tx, resp_rx) = oneshot::channel();
 
         if let Err(e) = self
-            .set_property_core(id, &property_name, &property_value, resp_tx)
+            .set_property_core(id, property_name, property_value, resp_tx)
             .await
         {
             log::warn!("Operation failed: {:?}", e);
-            self.stream
-                .write_all(format!("Error: {:?}: {}\r\n", e.error_type, e.message).as_bytes())
-                .await?;
+            self.out
+                .push_fmt(format_args!("Error: {:?}: {}\r\n", e.error_type, e.message));
             return Ok(());
         }
 
         return self
-            .wait_and_handle_response(resp_rx, |_| "ok".to_string())
+            .wait_and_handle_response(resp_rx, Self::write_num_written)
             .await;
     }
 
+    fn write_rtt(rtt: Duration, out: &mut Output) {
+        out.push_fmt(format_args!("ok rtt={}us", rtt.as_micros()));
+    }
+
+    fn write_num_written(num_written: usize, out: &mut Output) {
+        match num_written {
+            0 => out.push(b"unchanged"),
+            _ => out.push(b"ok"),
+        }
+    }
+
     async fn set_property_core(
         &mut self,
         id: u8,
-        property_name: &String,
-        property_value: &String,
-        resp_tx: oneshot::Sender<Result<(), AppError>>,
+        property_name: &str,
+        property_value: &str,
+        resp_tx: oneshot::Sender<Result<usize, AppError>>,
     ) -> Result<(), AppError> {
-        // Retrieve the schema of the module
-        let (schema_resp_tx, schema_resp_rx) = oneshot::channel();
-        let command = Command::GetSchema {
+        let property = self
+            .build_property(id, property_name, property_value)
+            .await?;
+
+        // Send a setconfig request
+        let command = Command::SetConfig {
             id,
-            resp: schema_resp_tx,
+            props: vec![property],
+            resp: resp_tx,
         };
-        self.command_tx.send(command).await.unwrap();
-        let schema = schema_resp_rx.await.unwrap()?;
+        self.command_tx.send(command).await;
+        return Ok(());
+    }
 
-        // Build the property
-        let Some(property_def) = schema.get_property_def_by_name(&property_name) else {
-            return Err(AppError::new(
-                ErrorType::UserCommandInvalidRequest,
-                format!("No such property: {}", property_name),
-            ));
+    async fn build_property(
+        &mut self,
+        id: u8,
+        property_name: &str,
+        property_value: &str,
+    ) -> Result<Property, AppError> {
+        return build_property(&self.command_tx, id, property_name, property_value).await;
+    }
+
+    async fn stage(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [
+            Spec::u8("id", true),
+            Spec::str("prop-name", true),
+            Spec::str("value", true),
+        ];
+        let option_specs = [Spec::u8("tag", false)];
+        let Some((params, options)) = self
+            .parse_params_and_options(command, tokens, &specs, &option_specs)
+            .await?
+        else {
+            return Ok(());
         };
-        let property =
-            Property::from_string(property_def.id, &property_value, &property_def.value_type)?;
 
-        // Send a setconfig request
-        let command2 = Command::SetConfig {
+        let id = params[0].as_u8().unwrap();
+        let property_name = params[1].as_text().unwrap();
+        let property_value = params[2].as_text().unwrap();
+        let tag = Self::tag_or_default(options[0].as_ref());
+
+        let property = match self.build_property(id, property_name, property_value).await {
+            Ok(property) => property,
+            Err(e) => {
+                log::warn!("Operation failed: {:?}", e);
+                self.out
+                    .push_fmt(format_args!("Error: {:?}: {}\r\n", e.error_type, e.message));
+                return Ok(());
+            }
+        };
+
+        let (resp_tx, resp_rx) = oneshot::channel();
+        let command = Command::StageConfig {
             id,
+            tag,
             props: vec![property],
             resp: resp_tx,
         };
-        self.command_tx.send(command2).await.unwrap();
-        return Ok(());
+        self.command_tx.send(command).await;
+        return self
+            .wait_and_handle_response(resp_rx, |_, out| {
+                out.push_fmt(format_args!("staged on tag {}", tag))
+            })
+            .await;
+    }
+
+    async fn commit(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [Spec::u8("tag", false)];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
+            return Ok(());
+        };
+
+        let (resp_tx, resp_rx) = oneshot::channel();
+        let tag = Self::tag_or_default(params.first());
+        let command = Command::CommitStaged { tag, resp: resp_tx };
+        self.command_tx.send(command).await;
+        return self
+            .wait_and_handle_response(resp_rx, |summary, out| {
+                out.push_fmt(format_args!(
+                    "committed tag {} to {} modules in {}us",
+                    summary.tag,
+                    summary.num_modules,
+                    summary.latency.as_micros()
+                ))
+            })
+            .await;
+    }
+
+    async fn discard(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [Spec::u8("tag", false)];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
+            return Ok(());
+        };
+
+        let (resp_tx, resp_rx) = oneshot::channel();
+        let tag = Self::tag_or_default(params.first());
+        let command = Command::DiscardStaged { tag, resp: resp_tx };
+        self.command_tx.send(command).await;
+        return self
+            .wait_and_handle_response(resp_rx, |_, out| {
+                out.push_fmt(format_args!("discarded tag {}", tag))
+            })
+            .await;
     }
 
-    async fn cancel_uid(&mut self, command: &str, tokens: &Vec<String>) -> std::io::Result<()> {
-        let specs = vec![Spec::u32("uid", true)];
-        let Some(params) = self.parse_params(command, tokens, &specs).await.unwrap() else {
+    /// Sends a scalar property by the realtime channel, coalesced with the values of the
+    /// property not yet sent.
+    async fn set_realtime(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let received_at = Instant::now();
+        let specs = [
+            Spec::u8("id", true),
+            Spec::str("prop-name", true),
+            Spec::str("value", true),
+        ];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
+            return Ok(());
+        };
+
+        let (resp_tx, resp_rx) = oneshot::channel();
+        let command = Command::SetRealtime {
+            id: params[0].as_u8().unwrap(),
+            property_name: params[1].as_text().unwrap().to_string(),
+            value: params[2].as_text().unwrap().to_string(),
+            received_at,
+            resp: resp_tx,
+        };
+        self.command_tx.send(command).await;
+        return self
+            .wait_and_handle_response(resp_rx, |coalesced, out| {
+                out.push(if coalesced { b"ok coalesced" } else { b"ok" })
+            })
+            .await;
+    }
+
+    async fn realtime_stats(&mut self) -> std::io::Result<()> {
+        let (resp_tx, resp_rx) = oneshot::channel();
+        let command = Command::GetRealtimeStats { resp: resp_tx };
+        self.command_tx.send(command).await;
+        return self
+            .wait_and_handle_response(resp_rx, Self::write_realtime_stats)
+            .await;
+    }
+
+    fn write_realtime_stats(stats: RealtimeStats, out: &mut Output) {
+        out.push_fmt(format_args!(
+            "received={} coalesced={} sent={}",
+            stats.received, stats.coalesced, stats.sent
+        ));
+        if let Some(latency) = stats.latency.summary() {
+            out.push(b" latency min/avg/p50/p99/max = ");
+            Self::write_latency_summary(out, &latency);
+        }
+    }
+
+    fn tag_or_default(value: Option<&Arg>) -> u8 {
+        match value {
+            Some(value) => value.as_u8().unwrap(),
+            None => DEFAULT_STAGE_TAG,
+        }
+    }
+
+    async fn cancel_uid(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [Spec::u32("uid", true)];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
             return Ok(());
         };
 
         let (resp_tx, resp_rx) = oneshot::channel();
         let uid = params[0].as_u32().unwrap();
         let command = Command::RequestUidCancel { uid, resp: resp_tx };
-        self.command_tx.send(command).await.unwrap();
-        self.stream
-            .write_all(format!("request UID cancellation: {:08x} ... ", uid).as_bytes())
-            .await?;
+        self.command_tx.send(command).await;
+        self.out
+            .push_fmt(format_args!("request UID cancellation: {:08x} ... ", uid));
         return self
-            .wait_and_handle_response(resp_rx, |_| "sent".to_string())
+            .wait_and_handle_response(resp_rx, |_, out| out.push(b"sent"))
             .await;
     }
 
-    async fn pretend_sign_in(
-        &mut self,
-        command: &str,
-        tokens: &Vec<String>,
-    ) -> std::io::Result<()> {
-        let specs = vec![Spec::u32("uid", true)];
-        let Some(params) = self.parse_params(command, tokens, &specs).await.unwrap() else {
+    async fn pretend_sign_in(&mut self, command: &str, tokens: &Tokens<'_>) -> std::io::Result<()> {
+        let specs = [Spec::u32("uid", true)];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
             return Ok(());
         };
 
         let (resp_tx, resp_rx) = oneshot::channel();
         let uid = params[0].as_u32().unwrap();
         let command = Command::PretendSignIn { uid, resp: resp_tx };
-        self.command_tx.send(command).await.unwrap();
-        self.stream
-            .write_all(format!("pseudo sign-in with UID {:08x} ... ", uid).as_bytes())
-            .await?;
+        self.command_tx.send(command).await;
+        self.out
+            .push_fmt(format_args!("pseudo sign-in with UID {:08x} ... ", uid));
         return self
-            .wait_and_handle_response(resp_rx, |_| "sent".to_string())
+            .wait_and_handle_response(resp_rx, |_, out| out.push(b"sent"))
             .await;
     }
 
     async fn pretend_notify_id(
         &mut self,
         command: &str,
-        tokens: &Vec<String>,
+        tokens: &Tokens<'_>,
     ) -> std::io::Result<()> {
-        let specs = vec![Spec::u32("uid", true), Spec::u8("id", true)];
-        let Some(params) = self.parse_params(command, tokens, &specs).await.unwrap() else {
+        let specs = [Spec::u32("uid", true), Spec::u8("id", true)];
+        let Some(params) = self.parse_params(command, tokens, &specs).await? else {
             return Ok(());
         };
 
@@ -376,128 +968,434 @@ impl Session {
             id,
             resp: resp_tx,
         };
-        self.command_tx.send(command).await.unwrap();
-        self.stream
-            .write_all(
-                format!("pseudo notify-id with UID {:08x} ID {:02x} ... ", uid, id).as_bytes(),
-            )
-            .await?;
+        self.command_tx.send(command).await;
+        self.out.push_fmt(format_args!(
+            "pseudo notify-id with UID {:08x} ID {:02x} ... ",
+            uid, id
+        ));
         return self
-            .wait_and_handle_response(resp_rx, |_| "sent".to_string())
+            .wait_and_handle_response(resp_rx, |_, out| out.push(b"sent"))
             .await;
     }
 
     // Utilities ////////////////////////////////////////////////////////////////
 
-    fn tokenize(input: &str) -> Vec<String> {
-        let mut tokens = Vec::new();
-        let mut current = String::new();
-        let mut chars = input.chars().peekable();
-        let mut in_quotes: Option<char> = None;
-
-        while let Some(c) = chars.next() {
-            match c {
-                // entering or exiting quotes
-                '\'' | '"' => {
-                    if in_quotes == Some(c) {
-                        // closing matching quote
-                        in_quotes = None;
-                    } else if in_quotes.is_none() {
-                        // starting new quoted section
-                        in_quotes = Some(c);
-                    } else {
-                        // different quote inside quotes -> treat as normal char
-                        current.push(c);
-                    }
-                }
-
-                // whitespace: token delimiter only when NOT in quotes
-                c if c.is_whitespace() && in_quotes.is_none() => {
-                    if !current.is_empty() {
-                        tokens.push(current.clone());
-                        current.clear();
-                    }
-                }
-
-                // normal character
-                _ => current.push(c),
+    async fn parse_params<'a>(
+        &mut self,
+        command: &str,
+        tokens: &Tokens<'a>,
+        specs: &[Spec],
+    ) -> std::io::Result<Option<Args<'a>>> {
+        return match parse_args(tokens.iter(), specs) {
+            Ok(params) => Ok(Some(params)),
+            Err(e) => {
+                self.args_error(command, specs, e).await?;
+                Ok(None)
             }
-        }
-
-        // push final token if exists
-        if !current.is_empty() {
-            tokens.push(current);
-        }
-
-        tokens
+        };
     }
 
-    async fn parse_params(
+    /// Parses positional parameters followed by optional `name=value` options.
+    /// The returned options are ordered as the option specs, `None` for the ones not given.
+    async fn parse_params_and_options<'a>(
         &mut self,
         command: &str,
-        tokens: &Vec<String>,
-        specs: &Vec<Spec>,
-    ) -> std::io::Result<Option<Vec<Value>>> {
-        let mut params = Vec::new();
-        for (i, spec) in specs.iter().enumerate() {
-            if tokens.len() <= i + 1 {
-                if spec.required {
-                    self.usage(command, specs).await?;
-                    return Ok(None);
-                }
-                break;
-            }
-            if let Ok(param) = (spec.parse)(&tokens[i + 1]) {
-                params.push(param);
-            } else {
-                self.stream
-                    .write_all(format!("Invalid {}\r\n", spec.name).as_bytes())
-                    .await?;
-                return Ok(None);
+        tokens: &Tokens<'a>,
+        specs: &[Spec],
+        option_specs: &[Spec],
+    ) -> std::io::Result<Option<(Args<'a>, Options<'a>)>> {
+        return match parse_args_and_options(tokens.iter(), specs, option_specs) {
+            Ok(parsed) => Ok(Some(parsed)),
+            Err(e) => {
+                self.args_error(command, specs, e).await?;
+                Ok(None)
             }
+        };
+    }
+
+    async fn args_error(
+        &mut self,
+        command: &str,
+        specs: &[Spec],
+        error: ArgsError<'_>,
+    ) -> std::io::Result<()> {
+        match error {
+            ArgsError::Missing => return self.usage(command, specs).await,
+            ArgsError::Invalid(name) => self.out.push_fmt(format_args!("Invalid {}\r\n", name)),
+            ArgsError::UnknownOption(name) => self
+                .out
+                .push_fmt(format_args!("Unknown option {}\r\n", name)),
         }
-        return Ok(Some(params));
+        return Ok(());
     }
 
-    async fn usage(&mut self, command: &str, specs: &Vec<Spec>) -> std::io::Result<()> {
-        let mut out = String::new();
-        out += format!("Usage {}", command).as_str();
+    async fn usage(&mut self, command: &str, specs: &[Spec]) -> std::io::Result<()> {
+        self.out.push_fmt(format_args!("Usage {}", command));
         for spec in specs {
             if spec.required {
-                out += format!(" <{}>", spec.name).as_str();
+                self.out.push_fmt(format_args!(" <{}>", spec.name));
             } else {
-                out += format!(" [{}]", spec.name).as_str();
+                self.out.push_fmt(format_args!(" [{}]", spec.name));
             }
         }
-        out += "\r\n";
-        self.stream.write_all(out.as_bytes()).await?;
+        self.out.push(b"\r\n");
         return Ok(());
     }
 
     async fn wait_and_handle_response<T, F>(
         &mut self,
         resp_rx: oneshot::Receiver<Result<T, AppError>>,
-        stringify: F,
+        render: F,
     ) -> std::io::Result<()>
     where
-        F: Fn(T) -> String,
+        F: FnOnce(T, &mut Output),
     {
         match resp_rx.await.unwrap() {
             Ok(response) => {
-                let reply = stringify(response);
-                self.stream
-                    .write_all(format!("{}\r\n", reply).as_bytes())
-                    .await?;
+                render(response, &mut self.out);
+                self.out.push(b"\r\n");
             }
             Err(e) => {
                 log::warn!("Operation failed: {:?}", e);
-                let error_message = match e.error_type {
-                    ErrorType::Timeout => "timeout\r\n".to_string(),
-                    _ => format!("Error: {:?}: {}\r\n", e.error_type, e.message),
-                };
-                self.stream.write_all(error_message.as_bytes()).await?;
+                write_error(&mut self.out, &e);
             }
         }
         return Ok(());
     }
+
+    /// Writes the parts of a multi-part response as they arrive. Returns false if the
+    /// response has ended with an error.
+    async fn write_response_stream(
+        &mut self,
+        mut parts: mpsc::Receiver<OperationResult>,
+    ) -> std::io::Result<bool> {
+        while let Some(part) = parts.recv().await {
+            match part {
+                Ok(response) => {
+                    self.out.push(&response.reply);
+                    if !response.more {
+                        return Ok(true);
+                    }
+                    // write out the parts that have piled up in one go
+                    if parts.is_empty() {
+                        self.out.flush(&mut self.stream, b"").await?;
+                    }
+                }
+                Err(e) => {
+                    log::warn!("Operation failed: {:?}", e);
+                    write_error(&mut self.out, &e);
+                    return Ok(false);
+                }
+            }
+        }
+        log::error!("Response stream closed without an end");
+        return Ok(false);
+    }
+}
+
+fn write_error(out: &mut Output, e: &AppError) {
+    match e.error_type {
+        ErrorType::Timeout => out.push(b"timeout\r\n"),
+        _ => out.push_fmt(format_args!("Error: {:?}: {}\r\n", e.error_type, e.message)),
+    }
+}
+
+// Parameters of the most common commands, parsed apart from the session so that the
+// parsing can be measured on its own
+
+fn parse_get_name<'a>(tokens: &Tokens<'a>) -> Result<u8, ArgsError<'a>> {
+    let params = parse_args(tokens.iter(), &GET_NAME_SPECS)?;
+    return Ok(params[0].as_u8().unwrap());
+}
+
+/// Returns the id and the new name.
+fn parse_rename<'a>(tokens: &Tokens<'a>) -> Result<(u8, &'a str), ArgsError<'a>> {
+    let params = parse_args(tokens.iter(), &RENAME_SPECS)?;
+    return Ok((params[0].as_u8().unwrap(), params[1].as_text().unwrap()));
+}
+
+/// Returns the id, the property name and the value in text.
+fn parse_set<'a>(tokens: &Tokens<'a>) -> Result<(u8, &'a str, &'a str), ArgsError<'a>> {
+    let params = parse_args(tokens.iter(), &SET_SPECS)?;
+    return Ok((
+        params[0].as_u8().unwrap(),
+        params[1].as_text().unwrap(),
+        params[2].as_text().unwrap(),
+    ));
+}
+
+#[derive(Debug, PartialEq)]
+struct PingArgs {
+    id: u8,
+    enable_visual: bool,
+    /// 0 for a single ping
+    count: u32,
+    interval: Duration,
+}
+
+fn parse_ping<'a>(tokens: &Tokens<'a>) -> Result<PingArgs, ArgsError<'a>> {
+    let (params, options) = parse_args_and_options(tokens.iter(), &PING_SPECS, &PING_OPTION_SPECS)?;
+    return Ok(PingArgs {
+        id: params[0].as_u8().unwrap(),
+        enable_visual: match params.get(1) {
+            Some(visual) => visual.as_bool().unwrap(),
+            None => false,
+        },
+        count: match &options[0] {
+            Some(value) => value.as_u32().unwrap(),
+            None => 0,
+        },
+        interval: match &options[1] {
+            Some(value) => Duration::from_millis(value.as_u32().unwrap() as u64),
+            None => Duration::from_millis(1000),
+        },
+    });
+}
+
+/// Builds a property to write from its name and value in text, looking up the schema of
+/// the module.
+async fn build_property(
+    command_tx: &CommandSender,
+    id: u8,
+    property_name: &str,
+    property_value: &str,
+) -> Result<Property, AppError> {
+    // Retrieve the schema of the module
+    let (schema_resp_tx, schema_resp_rx) = oneshot::channel();
+    let command = Command::GetSchema {
+        id,
+        resp: schema_resp_tx,
+    };
+    command_tx.send(command).await;
+    let schema = schema_resp_rx.await.unwrap()?;
+
+    // Build the property
+    let Some(property_def) = schema.get_property_def_by_name(property_name) else {
+        return Err(AppError::new(
+            ErrorType::UserCommandInvalidRequest,
+            format!("No such property: {}", property_name),
+        ));
+    };
+    if property_def.read_only.unwrap_or(false) {
+        return Err(AppError::new(
+            ErrorType::UserCommandInvalidRequest,
+            format!("Property is read-only: {}", property_name),
+        ));
+    }
+    return Property::from_string(property_def.id, property_value, &property_def.value_type);
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Instant;
+
+    use super::*;
+    use crate::alloc_counter;
+
+    const COMMON_COMMANDS: [&str; 4] = [
+        "get-name 0x1a\r\n",
+        "set 3 cv_depth 0x400\r\n",
+        "ping 3 true count=4 interval=10\r\n",
+        "rename 3 'osc 1'\r\n",
+    ];
+
+    /// What a session does with a common command apart from the round trip to mission
+    /// control: tokenize the line, parse the parameters and render a reply.
+    fn handle(line: &mut String, ranges: &mut Vec<std::ops::Range<usize>>, out: &mut Output) {
+        let tokens = Tokens::parse(line, ranges);
+        match tokens.get(0).unwrap() {
+            "get-name" => {
+                std::hint::black_box(parse_get_name(&tokens).unwrap());
+            }
+            "set" => {
+                std::hint::black_box(parse_set(&tokens).unwrap());
+                Session::write_num_written(1, out);
+            }
+            "rename" => {
+                std::hint::black_box(parse_rename(&tokens).unwrap());
+                Session::write_num_written(1, out);
+            }
+            "ping" => {
+                let args = parse_ping(&tokens).unwrap();
+                Session::write_rtt(Duration::from_micros(args.count as u64), out);
+            }
+            _ => panic!("unexpected command"),
+        }
+        out.push(b"\r\n");
+    }
+
+    fn tokens<'a>(
+        line: &'a mut String,
+        ranges: &'a mut Vec<std::ops::Range<usize>>,
+        text: &str,
+    ) -> Tokens<'a> {
+        line.clear();
+        line.push_str(text);
+        return Tokens::parse(line, ranges);
+    }
+
+    #[test]
+    fn test_parse_common_commands() {
+        let (mut line, mut ranges) = (String::new(), Vec::new());
+        assert_eq!(
+            parse_get_name(&tokens(&mut line, &mut ranges, "get-name 0x1a")),
+            Ok(26)
+        );
+        assert_eq!(
+            parse_get_name(&tokens(&mut line, &mut ranges, "get-name")),
+            Err(ArgsError::Missing)
+        );
+        assert_eq!(
+            parse_rename(&tokens(&mut line, &mut ranges, "rename 3 'osc 1'")),
+            Ok((3, "osc 1"))
+        );
+        assert_eq!(
+            parse_set(&tokens(&mut line, &mut ranges, "set 3 cv_depth 0x400")),
+            Ok((3, "cv_depth", "0x400"))
+        );
+        assert_eq!(
+            parse_set(&tokens(&mut line, &mut ranges, "set x cv_depth 1")),
+            Err(ArgsError::Invalid("id"))
+        );
+        assert_eq!(
+            parse_ping(&tokens(
+                &mut line,
+                &mut ranges,
+                "ping 3 true count=4 interval=10"
+            )),
+            Ok(PingArgs {
+                id: 3,
+                enable_visual: true,
+                count: 4,
+                interval: Duration::from_millis(10),
+            })
+        );
+        assert_eq!(
+            parse_ping(&tokens(&mut line, &mut ranges, "ping 3")),
+            Ok(PingArgs {
+                id: 3,
+                enable_visual: false,
+                count: 0,
+                interval: Duration::from_millis(1000),
+            })
+        );
+        assert_eq!(
+            parse_ping(&tokens(&mut line, &mut ranges, "ping 3 seq=1")),
+            Err(ArgsError::UnknownOption("seq"))
+        );
+    }
+
+    #[test]
+    fn test_common_commands_do_not_allocate() {
+        let mut line = String::new();
+        let mut ranges = Vec::new();
+        let mut out = Output::default();
+        for pass in 0..2 {
+            // the buffers grow on the first pass only
+            let ((), num_allocations) = alloc_counter::count(|| {
+                for command in COMMON_COMMANDS {
+                    line.clear();
+                    line.push_str(command);
+                    handle(&mut line, &mut ranges, &mut out);
+                }
+            });
+            if pass == 1 {
+                assert_eq!(num_allocations, 0);
+            }
+            out.clear();
+        }
+
+        handle(
+            &mut "ping 3 true count=4".to_string(),
+            &mut ranges,
+            &mut out,
+        );
+        handle(&mut "rename 3 'osc 1'".to_string(), &mut ranges, &mut out);
+        assert_eq!(
+            String::from_utf8_lossy(out.as_bytes()),
+            "ok rtt=4us\r\nok\r\n"
+        );
+    }
+
+    #[tokio::test]
+    async fn test_batch_script_as_typed() {
+        use tokio::io::AsyncWriteExt;
+
+        let (command_tx, mut command_rx) = channel(8);
+        let (bus_tx, _) = channel(16);
+        let (scheduler, _) = Scheduler::start(command_tx, bus_tx);
+        let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+        let address = listener.local_addr().unwrap();
+        tokio::spawn(async move {
+            let (stream, _) = listener.accept().await.unwrap();
+            start_session(stream, scheduler.session());
+        });
+
+        let mut stream = TcpStream::connect(address).await.unwrap();
+        stream
+            .write_all(b"batch set type=amps cv_depth 0x400; rename 1-4 'amp {n}'\r\n")
+            .await
+            .unwrap();
+        let Some(Request {
+            command:
+                Command::FanOut {
+                    op: FanOutOp::Batch { script },
+                    resp,
+                    ..
+                },
+            ..
+        }) = command_rx.recv().await
+        else {
+            panic!("expected a batch");
+        };
+        assert_eq!(script, "set type=amps cv_depth 0x400; rename 1-4 'amp {n}'");
+        let summary = FanOutSummary {
+            total: 4,
+            succeeded: 4,
+            failed: 0,
+            skipped: 0,
+            concurrency_limit: 4,
+            elapsed: Duration::from_millis(3),
+        };
+        resp.send(Ok(summary)).unwrap();
+
+        stream.write_all(b"quit\r\n").await.unwrap();
+        let mut reply = String::new();
+        let mut reader = BufReader::new(stream);
+        while reader.read_line(&mut reply).await.unwrap() > 0 {}
+        assert!(reply.contains("done: 4 modules, 4 succeeded"), "{}", reply);
+    }
+
+    #[test]
+    #[ignore]
+    fn bench_command_handling() {
+        const NUM_ROUNDS: usize = 100_000;
+        let mut line = String::new();
+        let mut ranges = Vec::new();
+        let mut out = Output::default();
+        for command in COMMON_COMMANDS {
+            line.clear();
+            line.push_str(command);
+            handle(&mut line, &mut ranges, &mut out);
+        }
+        out.clear();
+        let started_at = Instant::now();
+        let ((), num_allocations) = alloc_counter::count(|| {
+            for _ in 0..NUM_ROUNDS {
+                for command in COMMON_COMMANDS {
+                    line.clear();
+                    line.push_str(command);
+                    handle(&mut line, &mut ranges, &mut out);
+                }
+                out.clear();
+            }
+        });
+        let num_commands = NUM_ROUNDS * COMMON_COMMANDS.len();
+        println!(
+            "commands={} {:?}/command allocations={}",
+            num_commands,
+            started_at.elapsed() / num_commands as u32,
+            num_allocations
+        );
+    }
 }
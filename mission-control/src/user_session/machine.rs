@@ -0,0 +1,851 @@
+//! Machine protocol
+//!
+//! Clients send one JSON request per line and get one JSON reply per line. The protocol is
+//! served on TCP and on a Unix domain socket for the clients on the same host:
+//!
+//! ```text
+//! {"id": 7, "op": "get-name", "args": {"id": 3}}
+//! {"id": 7, "ok": true, "result": "osc-1"}
+//! {"id": 8, "ok": false, "error": {"type": "Timeout", "message": ""}}
+//! ```
+//! The request ID is any JSON value chosen by the client and is echoed back as is. Requests
+//! are executed concurrently, so replies come back in the order they complete, not in the
+//! order they were sent.
+//!
+//! Requests with large results, `list`, `get-config` and the rack-wide ops, stream them in
+//! parts as they are produced. Each part is a line of its own, and the final reply ends the
+//! request:
+//!
+//! ```text
+//! {"id": 7, "more": true, "part": {"id": 0, "name": "uid", "value": "1acebeef"}}
+//! {"id": 7, "more": true, "part": {"id": 1, "name": "module_type", "value": "0003"}}
+//! {"id": 7, "ok": true, "result": {"count": 2}}
+//! ```
+//!
+//! `watch` streams the value of a property as a part whenever it changes. It runs until the
+//! connection closes, or until `count` values have been sent if given.
+//!
+//! A request may carry `"deadline_ms"`, the milliseconds from its arrival after which the
+//! client no longer wants the result. The request then fails with a `DeadlineExceeded`
+//! error and the frames it has not yet put on the bus are dropped.
+
+use std::{
+    sync::{Arc, Mutex},
+    time::{Duration, Instant},
+};
+
+use serde::{Deserialize, Serialize};
+use serde_json::{Value as Json, json};
+use tokio::{
+    io::{self, AsyncBufReadExt, AsyncRead, AsyncWrite, AsyncWriteExt, BufReader},
+    net::{TcpListener, UnixListener},
+    sync::{
+        OwnedSemaphorePermit, Semaphore,
+        mpsc::{self, Sender},
+        oneshot, watch,
+    },
+};
+
+use super::{
+    DEFAULT_STAGE_TAG, build_property,
+    scheduler::{CommandSender, Scheduler},
+};
+use crate::{
+    a3_modules::A3Module,
+    analog3::{
+        A3_PROP_ID_NAME,
+        config::{Configuration, Property, parse_u8, parse_u32},
+    },
+    command::{Command, OperationResult, PropertyEntry, ResponseStream, StreamIdAllocator},
+    error::{AppError, ErrorType},
+    mission_control::{
+        DEFAULT_WATCH_INTERVAL, FanOutOp, FanOutOutcome, FanOutProgress, LatencySummary,
+        WATCH_QUEUE_SIZE,
+    },
+};
+
+/// Requests a connection may have in flight; further requests are not read until one of
+/// them completes. Watches count only until they are set up.
+const MAX_IN_FLIGHT: usize = 64;
+
+type Result<T> = std::result::Result<T, AppError>;
+
+#[derive(Deserialize)]
+struct MachineRequest {
+    id: Json,
+    op: String,
+    #[serde(default)]
+    args: Json,
+    #[serde(default)]
+    deadline_ms: Option<u64>,
+}
+
+pub async fn serve(listener: TcpListener, scheduler: Scheduler) {
+    if let Ok(address) = listener.local_addr() {
+        log::info!("Machine protocol listening on {}", address);
+    }
+    loop {
+        match listener.accept().await {
+            Ok((stream, _)) => {
+                tokio::spawn(run_connection(stream, scheduler.session()));
+            }
+            Err(e) => log::error!("Machine connection accept error: {:?}", e),
+        }
+    }
+}
+
+pub async fn serve_unix(listener: UnixListener, scheduler: Scheduler) {
+    if let Ok(address) = listener.local_addr() {
+        log::info!("Machine protocol listening on {:?}", address);
+    }
+    loop {
+        match listener.accept().await {
+            Ok((stream, _)) => {
+                tokio::spawn(run_connection(stream, scheduler.session()));
+            }
+            Err(e) => log::error!("Machine connection accept error: {:?}", e),
+        }
+    }
+}
+
+async fn run_connection<S>(stream: S, command_tx: CommandSender)
+where
+    S: AsyncRead + AsyncWrite + Send + 'static,
+{
+    let (reader, mut writer) = io::split(stream);
+
+    // replies of the requests in flight funnel into a single writer
+    let (reply_tx, mut reply_rx) = mpsc::channel::<Vec<u8>>(MAX_IN_FLIGHT);
+    let writer_handle = tokio::spawn(async move {
+        while let Some(line) = reply_rx.recv().await {
+            if let Err(e) = writer.write_all(&line).await {
+                log::debug!("Machine connection write error: {:?}", e);
+                return;
+            }
+        }
+    });
+
+    // dropped when the client goes, which ends the requests that would otherwise wait on
+    // the bus for it
+    let (closed_tx, closed_rx) = watch::channel(());
+    let in_flight = Arc::new(Semaphore::new(MAX_IN_FLIGHT));
+    let mut stream_ids = StreamIdAllocator::default();
+    let mut lines = BufReader::new(reader).lines();
+    loop {
+        let line = match lines.next_line().await {
+            Ok(Some(line)) => line,
+            Ok(None) => break,
+            Err(e) => {
+                log::debug!("Machine connection read error: {:?}", e);
+                break;
+            }
+        };
+        if line.trim().is_empty() {
+            continue;
+        }
+        let request = match serde_json::from_str::<MachineRequest>(&line) {
+            Ok(request) => request,
+            Err(e) => {
+                let error = AppError::new(
+                    ErrorType::UserCommandInvalidRequest,
+                    format!("Malformed request: {}", e),
+                );
+                let _ = reply_tx.send(reply_line(&Json::Null, Err(error))).await;
+                continue;
+            }
+        };
+        let deadline = request
+            .deadline_ms
+            .map(|ms| Instant::now() + Duration::from_millis(ms));
+        let permit = in_flight.clone().acquire_owned().await.unwrap();
+        let command_tx = command_tx.with_deadline(deadline);
+        let parts = Parts {
+            request_id: request.id,
+            stream_id: stream_ids.next(),
+            reply_tx: reply_tx.clone(),
+            closed: closed_rx.clone(),
+            permit: Mutex::new(Some(permit)),
+        };
+        tokio::spawn(async move {
+            let result = execute(&command_tx, &request.op, &request.args, &parts).await;
+            let _ = parts
+                .reply_tx
+                .send(reply_line(&parts.request_id, result))
+                .await;
+        });
+    }
+
+    // let the requests in flight finish and their replies go out
+    drop(closed_tx);
+    drop(reply_tx);
+    let _ = writer_handle.await;
+    log::debug!("Machine connection closed");
+}
+
+fn reply_line(id: &Json, result: Result<Json>) -> Vec<u8> {
+    let reply = match result {
+        Ok(result) => json!({"id": id, "ok": true, "result": result}),
+        Err(e) => json!({"id": id, "ok": false, "error": error_json(&e)}),
+    };
+    return format!("{}\n", reply).into_bytes();
+}
+
+/// Where the parts of a request go
+struct Parts {
+    request_id: Json,
+    stream_id: u8,
+    reply_tx: Sender<Vec<u8>>,
+    /// Changes never; closes when the client has gone
+    closed: watch::Receiver<()>,
+    /// Slot of the request among `MAX_IN_FLIGHT`, held until the request completes
+    permit: Mutex<Option<OwnedSemaphorePermit>>,
+}
+
+impl Parts {
+    /// Gives up the slot of the request, for one that lives as long as the client wants.
+    fn release_slot(&self) {
+        self.permit.lock().unwrap().take();
+    }
+
+    /// Completes when the client has gone.
+    async fn closed(&self) {
+        let mut closed = self.closed.clone();
+        while closed.changed().await.is_ok() {}
+    }
+
+    fn line(request_id: &Json, part: impl Serialize) -> Vec<u8> {
+        let line = json!({"id": request_id, "more": true, "part": part});
+        return format!("{}\n", line).into_bytes();
+    }
+
+    /// Writes out a part right away. Returns false if the connection is gone.
+    async fn send(&self, part: impl Serialize) -> bool {
+        let line = Self::line(&self.request_id, part);
+        return self.reply_tx.send(line).await.is_ok();
+    }
+
+    /// Opens a response stream whose items are rendered into part lines
+    fn stream<T: 'static>(
+        &self,
+        to_json: fn(&T) -> Json,
+    ) -> (ResponseStream<T>, mpsc::Receiver<OperationResult>) {
+        let request_id = self.request_id.clone();
+        return ResponseStream::new(
+            self.stream_id,
+            Box::new(move |item| Self::line(&request_id, to_json(item))),
+        );
+    }
+
+    /// Passes the parts of a response stream through to the connection until it ends.
+    /// Returns the number of parts.
+    async fn forward(&self, mut stream: mpsc::Receiver<OperationResult>) -> Result<Json> {
+        let mut count = 0;
+        while let Some(part) = stream.recv().await {
+            let response = part?;
+            if !response.more {
+                return Ok(json!({"count": count}));
+            }
+            count += 1;
+            if self.reply_tx.send(response.reply).await.is_err() {
+                return Err(AppError::runtime("Connection is gone"));
+            }
+        }
+        return Err(AppError::runtime("Response stream closed without an end"));
+    }
+}
+
+fn error_json(e: &AppError) -> Json {
+    json!({"type": format!("{:?}", e.error_type), "message": e.message})
+}
+
+/// Sends a command to mission control and waits for its response.
+async fn call<T>(
+    command_tx: &CommandSender,
+    make_command: impl FnOnce(oneshot::Sender<Result<T>>) -> Command,
+) -> Result<T> {
+    let (resp_tx, resp_rx) = oneshot::channel();
+    command_tx.send(make_command(resp_tx)).await;
+    return resp_rx.await.unwrap();
+}
+
+async fn execute(command_tx: &CommandSender, op: &str, args: &Json, parts: &Parts) -> Result<Json> {
+    match op {
+        "hi" => {
+            let greeting = call(command_tx, |resp| Command::Hi { resp }).await?;
+            return Ok(json!(greeting));
+        }
+        "list" => {
+            let (resp, stream) = parts.stream(module_json);
+            command_tx.send(Command::List { resp }).await;
+            return parts.forward(stream).await;
+        }
+        "ping" => {
+            let id = arg_u8(args, "id")?;
+            let enable_visual = args["visual"].as_bool().unwrap_or(false);
+            let rtt = call(command_tx, |resp| Command::Ping {
+                id,
+                enable_visual,
+                resp,
+            })
+            .await?;
+            return Ok(json!({"rtt_us": rtt.as_micros() as u64}));
+        }
+        "ping-stats" => {
+            let id = optional(args, "id", arg_u8)?;
+            let histograms = call(command_tx, |resp| Command::GetPingStats { id, resp }).await?;
+            let stats: Vec<Json> = histograms
+                .iter()
+                .map(|(id, histogram)| {
+                    json!({
+                        "id": id,
+                        "received": histogram.count(),
+                        "timeouts": histogram.timeouts(),
+                        "latency": histogram.summary().map(|stats| latency_json(&stats)),
+                    })
+                })
+                .collect();
+            return Ok(Json::Array(stats));
+        }
+        "get-name" => {
+            let id = arg_u8(args, "id")?;
+            let name = call(command_tx, |resp| Command::GetName { id, resp }).await?;
+            return Ok(json!(name));
+        }
+        "get-config" => {
+            let id = arg_u8(args, "id")?;
+            let (resp, stream) = parts.stream(|entry: &PropertyEntry| {
+                json!({"id": entry.id, "name": entry.name, "value": entry.value})
+            });
+            command_tx.send(Command::GetConfig { id, resp }).await;
+            return parts.forward(stream).await;
+        }
+        "set" => {
+            let id = arg_u8(args, "id")?;
+            let property = build_property(
+                command_tx,
+                id,
+                &arg_str(args, "prop")?,
+                &arg_str(args, "value")?,
+            )
+            .await?;
+            return set_config(command_tx, id, property).await;
+        }
+        "rename" => {
+            let id = arg_u8(args, "id")?;
+            let property = Property::text(A3_PROP_ID_NAME, &arg_str(args, "name")?);
+            return set_config(command_tx, id, property).await;
+        }
+        "stage" => {
+            let id = arg_u8(args, "id")?;
+            let tag = optional(args, "tag", arg_u8)?.unwrap_or(DEFAULT_STAGE_TAG);
+            let property = build_property(
+                command_tx,
+                id,
+                &arg_str(args, "prop")?,
+                &arg_str(args, "value")?,
+            )
+            .await?;
+            call(command_tx, |resp| Command::StageConfig {
+                id,
+                tag,
+                props: vec![property],
+                resp,
+            })
+            .await?;
+            return Ok(json!({"tag": tag}));
+        }
+        "commit" => {
+            let tag = optional(args, "tag", arg_u8)?.unwrap_or(DEFAULT_STAGE_TAG);
+            let summary = call(command_tx, |resp| Command::CommitStaged { tag, resp }).await?;
+            return Ok(json!({
+                "tag": summary.tag,
+                "modules": summary.num_modules,
+                "latency_us": summary.latency.as_micros() as u64,
+            }));
+        }
+        "discard" => {
+            let tag = optional(args, "tag", arg_u8)?.unwrap_or(DEFAULT_STAGE_TAG);
+            call(command_tx, |resp| Command::DiscardStaged { tag, resp }).await?;
+            return Ok(json!({"tag": tag}));
+        }
+        "rt" => {
+            let received_at = Instant::now();
+            let id = arg_u8(args, "id")?;
+            let property_name = arg_str(args, "prop")?;
+            let value = arg_str(args, "value")?;
+            let coalesced = call(command_tx, |resp| Command::SetRealtime {
+                id,
+                property_name,
+                value,
+                received_at,
+                resp,
+            })
+            .await?;
+            return Ok(json!({"coalesced": coalesced}));
+        }
+        "rt-stats" => {
+            let stats = call(command_tx, |resp| Command::GetRealtimeStats { resp }).await?;
+            return Ok(json!({
+                "received": stats.received,
+                "coalesced": stats.coalesced,
+                "sent": stats.sent,
+                "latency": stats.latency.summary().map(|stats| latency_json(&stats)),
+            }));
+        }
+        "cancel-uid" => {
+            let uid = arg_u32(args, "uid")?;
+            call(command_tx, |resp| Command::RequestUidCancel { uid, resp }).await?;
+            return Ok(Json::Null);
+        }
+        "get-config-all" => {
+            let module_type = optional(args, "type", arg_str)?;
+            return fan_out(command_tx, parts, FanOutOp::GetConfig { module_type }).await;
+        }
+        "set-all" => {
+            let op = FanOutOp::SetProperty {
+                module_type: arg_str(args, "type")?,
+                property_name: arg_str(args, "prop")?,
+                value: arg_str(args, "value")?,
+            };
+            return fan_out(command_tx, parts, op).await;
+        }
+        "rename-all" => {
+            let op = FanOutOp::Rename {
+                pattern: arg_str(args, "pattern")?,
+                module_type: optional(args, "type", arg_str)?,
+            };
+            return fan_out(command_tx, parts, op).await;
+        }
+        "snapshot-save" => {
+            let path = arg_str(args, "file")?;
+            return fan_out(command_tx, parts, FanOutOp::Snapshot { path }).await;
+        }
+        "snapshot-restore" => {
+            let path = arg_str(args, "file")?;
+            return fan_out(command_tx, parts, FanOutOp::Restore { path }).await;
+        }
+        "preset-stage" => {
+            let path = arg_str(args, "file")?;
+            let tag = optional(args, "tag", arg_u8)?.unwrap_or(DEFAULT_STAGE_TAG);
+            return fan_out(command_tx, parts, FanOutOp::Stage { path, tag }).await;
+        }
+        "batch" => {
+            let script = arg_str(args, "script")?;
+            return fan_out(command_tx, parts, FanOutOp::Batch { script }).await;
+        }
+        "watch" => {
+            let id = arg_u8(args, "id")?;
+            let interval = optional(args, "interval_ms", arg_u32)?
+                .map(|ms| Duration::from_millis(ms as u64))
+                .unwrap_or(DEFAULT_WATCH_INTERVAL);
+            let count = optional(args, "count", arg_u32)?;
+            let (updates, mut updates_rx) = mpsc::channel(WATCH_QUEUE_SIZE);
+            let property_name = arg_str(args, "prop")?;
+            call(command_tx, |resp| Command::Watch {
+                id,
+                property_name,
+                interval,
+                updates,
+                resp,
+            })
+            .await?;
+            parts.release_slot();
+            let mut num_sent = 0;
+            while count.is_none_or(|count| num_sent < count) {
+                // an unchanging value sends nothing, so the client is watched for, too
+                let update = tokio::select! {
+                    update = updates_rx.recv() => update,
+                    _ = parts.closed() => return Err(AppError::runtime("Connection is gone")),
+                };
+                let Some(update) = update else {
+                    break;
+                };
+                let entry = update?;
+                let part = json!({"id": entry.id, "name": entry.name, "value": entry.value});
+                if !parts.send(part).await {
+                    return Err(AppError::runtime("Connection is gone"));
+                }
+                num_sent += 1;
+            }
+            return Ok(json!({"count": num_sent}));
+        }
+        _ => {
+            return Err(AppError::new(
+                ErrorType::UserCommandUnknown,
+                format!("Unknown op: {}", op),
+            ));
+        }
+    }
+}
+
+async fn set_config(command_tx: &CommandSender, id: u8, property: Property) -> Result<Json> {
+    let num_written = call(command_tx, |resp| Command::SetConfig {
+        id,
+        props: vec![property],
+        resp,
+    })
+    .await?;
+    return Ok(json!({"written": num_written}));
+}
+
+/// Runs a rack-wide operation. The result of each module goes out as a part as soon as it
+/// is known, and the reply is the summary.
+async fn fan_out(command_tx: &CommandSender, parts: &Parts, op: FanOutOp) -> Result<Json> {
+    let (progress_tx, mut progress_rx) = mpsc::channel(16);
+    let (resp_tx, resp_rx) = oneshot::channel();
+    let command = Command::FanOut {
+        op,
+        progress: progress_tx,
+        resp: resp_tx,
+    };
+    command_tx.send(command).await;
+    while let Some(progress) = progress_rx.recv().await {
+        // keep draining after the connection is gone so the fan-out is not held back
+        parts.send(progress_json(progress)).await;
+    }
+    let summary = resp_rx.await.unwrap()?;
+    return Ok(json!({
+        "total": summary.total,
+        "succeeded": summary.succeeded,
+        "failed": summary.failed,
+        "skipped": summary.skipped,
+        "elapsed_ms": summary.elapsed.as_millis() as u64,
+        "concurrency": summary.concurrency_limit,
+    }));
+}
+
+fn progress_json(progress: FanOutProgress) -> Json {
+    let mut entry = json!({"id": progress.id, "uid": progress.uid});
+    if let Some(index) = progress.step {
+        entry["step"] = json!(index + 1);
+    }
+    match progress.result {
+        Ok(outcome) => {
+            entry["ok"] = json!(true);
+            entry["result"] = outcome_json(outcome);
+        }
+        Err(e) => {
+            entry["ok"] = json!(false);
+            entry["error"] = error_json(&e);
+        }
+    }
+    return entry;
+}
+
+fn module_json(m: &Arc<A3Module>) -> Json {
+    json!({
+        "uid": m.uid,
+        "id": m.id,
+        "type": m.module_type.as_deref(),
+        "name": m.name,
+    })
+}
+
+fn outcome_json(outcome: FanOutOutcome) -> Json {
+    match outcome {
+        FanOutOutcome::Config(properties) => config_json(properties),
+        FanOutOutcome::Written => json!("written"),
+        FanOutOutcome::Renamed(name) => json!({"renamed": name}),
+        FanOutOutcome::Captured => json!("captured"),
+        FanOutOutcome::Restored(num_props) => json!({"restored": num_props}),
+        FanOutOutcome::Staged(num_props) => json!({"staged": num_props}),
+        FanOutOutcome::Unchanged => json!("unchanged"),
+        FanOutOutcome::Skipped(reason) => json!({"skipped": reason}),
+    }
+}
+
+fn config_json(properties: Vec<Property>) -> Json {
+    let config = Configuration::new(properties);
+    let properties: Vec<Json> = (0..config.len())
+        .map(|i| {
+            json!({
+                "id": config.prop_id(i),
+                "name": config.prop_name(i),
+                "value": config.prop_value_as_string(i),
+            })
+        })
+        .collect();
+    return Json::Array(properties);
+}
+
+fn latency_json(stats: &LatencySummary) -> Json {
+    json!({
+        "min_us": stats.min.as_micros() as u64,
+        "avg_us": stats.avg.as_micros() as u64,
+        "p50_us": stats.p50.as_micros() as u64,
+        "p99_us": stats.p99.as_micros() as u64,
+        "max_us": stats.max.as_micros() as u64,
+    })
+}
+
+// Arguments ////////////////////////////////////////////////////////////////
+
+fn invalid_arg(name: &str) -> AppError {
+    AppError::new(
+        ErrorType::UserCommandInvalidRequest,
+        format!("Missing or invalid argument: {}", name),
+    )
+}
+
+/// Reads an optional argument; absent and null are the same.
+fn optional<T>(args: &Json, name: &str, read: fn(&Json, &str) -> Result<T>) -> Result<Option<T>> {
+    match args.get(name) {
+        None | Some(Json::Null) => Ok(None),
+        Some(_) => read(args, name).map(Some),
+    }
+}
+
+fn arg_str(args: &Json, name: &str) -> Result<String> {
+    match &args[name] {
+        Json::String(value) => Ok(value.clone()),
+        Json::Number(value) => Ok(value.to_string()),
+        Json::Bool(value) => Ok(value.to_string()),
+        _ => Err(invalid_arg(name)),
+    }
+}
+
+/// Integers are taken as JSON numbers, or as strings in the telnet syntax such as "0x1a".
+fn arg_u8(args: &Json, name: &str) -> Result<u8> {
+    match &args[name] {
+        Json::Number(value) => value.as_u64().and_then(|value| u8::try_from(value).ok()),
+        Json::String(value) => parse_u8(value).ok(),
+        _ => None,
+    }
+    .ok_or_else(|| invalid_arg(name))
+}
+
+fn arg_u32(args: &Json, name: &str) -> Result<u32> {
+    match &args[name] {
+        Json::Number(value) => value.as_u64().and_then(|value| u32::try_from(value).ok()),
+        Json::String(value) => parse_u32(value).ok(),
+        _ => None,
+    }
+    .ok_or_else(|| invalid_arg(name))
+}
+
+#[cfg(test)]
+mod tests {
+    use tokio::{
+        io::AsyncBufReadExt,
+        net::{TcpStream, UnixStream},
+        sync::mpsc::Receiver,
+        time::sleep,
+    };
+
+    use super::*;
+    use crate::command::Request;
+
+    /// Answers `hi` slowly, `get-name` right away, lists three modules slowly, and times
+    /// out `get-config`
+    async fn fake_mission_control(mut command_rx: Receiver<Request>) {
+        while let Some(Request { command, .. }) = command_rx.recv().await {
+            match command {
+                Command::Hi { resp } => {
+                    tokio::spawn(async move {
+                        sleep(Duration::from_millis(100)).await;
+                        resp.send(Ok("hello".to_string())).unwrap();
+                    });
+                }
+                Command::GetName { id, resp } => {
+                    resp.send(Ok(format!("module {}", id))).unwrap();
+                }
+                Command::List { mut resp } => {
+                    tokio::spawn(async move {
+                        for id in 1..=3 {
+                            let module = Arc::new(A3Module {
+                                uid: 0x100 + id as u32,
+                                id,
+                                name: None,
+                                module_type: None,
+                                module_type_id: None,
+                            });
+                            resp.send(&module).await;
+                            sleep(Duration::from_millis(20)).await;
+                        }
+                        resp.finish().await;
+                    });
+                }
+                Command::GetConfig { resp, .. } => {
+                    resp.fail(AppError::timeout()).await;
+                }
+                _ => panic!("unexpected command"),
+            }
+        }
+    }
+
+    fn start_fake_mission_control() -> Scheduler {
+        let (command_tx, command_rx) = mpsc::channel(8);
+        tokio::spawn(fake_mission_control(command_rx));
+        let (bus_tx, _) = mpsc::channel(16);
+        return Scheduler::start(command_tx, bus_tx).0;
+    }
+
+    #[tokio::test]
+    async fn test_out_of_order_replies() {
+        let scheduler = start_fake_mission_control();
+        let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+        let address = listener.local_addr().unwrap();
+        tokio::spawn(serve(listener, scheduler));
+
+        let stream = TcpStream::connect(address).await.unwrap();
+        let (reader, mut writer) = stream.into_split();
+        writer
+            .write_all(
+                b"{\"id\": 1, \"op\": \"hi\"}\n\
+                  {\"id\": \"two\", \"op\": \"get-name\", \"args\": {\"id\": \"0x1a\"}}\n\
+                  {\"id\": 3, \"op\": \"get-name\", \"args\": {}}\n\
+                  {\"id\": 4, \"op\": \"warp\"}\n\
+                  {\"id\": 5, \"op\": \"get-name\", \"args\": {\"id\": 1}, \"deadline_ms\": 0}\n\
+                  not json\n",
+            )
+            .await
+            .unwrap();
+        writer.shutdown().await.unwrap();
+
+        let mut replies = Vec::new();
+        let mut lines = BufReader::new(reader).lines();
+        while let Some(line) = lines.next_line().await.unwrap() {
+            replies.push(serde_json::from_str::<Json>(&line).unwrap());
+        }
+        assert_eq!(replies.len(), 6);
+        // the slow request completes last even though it was sent first
+        assert_eq!(replies[5], json!({"id": 1, "ok": true, "result": "hello"}));
+        let reply_of = |id: Json| replies.iter().find(|reply| reply["id"] == id).unwrap();
+        assert_eq!(reply_of(json!("two"))["result"], json!("module 26"));
+        assert_eq!(
+            reply_of(json!(3))["error"]["type"],
+            json!("UserCommandInvalidRequest")
+        );
+        assert_eq!(
+            reply_of(json!(4))["error"]["type"],
+            json!("UserCommandUnknown")
+        );
+        assert_eq!(
+            reply_of(json!(5))["error"]["type"],
+            json!("DeadlineExceeded")
+        );
+        assert_eq!(reply_of(Json::Null)["ok"], json!(false));
+    }
+
+    #[tokio::test]
+    async fn test_streamed_parts() {
+        let scheduler = start_fake_mission_control();
+        let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+        let address = listener.local_addr().unwrap();
+        tokio::spawn(serve(listener, scheduler));
+
+        let stream = TcpStream::connect(address).await.unwrap();
+        let (reader, mut writer) = stream.into_split();
+        writer
+            .write_all(b"{\"id\": 1, \"op\": \"list\"}\n")
+            .await
+            .unwrap();
+        let mut lines = BufReader::new(reader).lines();
+        let mut next = async || -> Json {
+            let line = lines.next_line().await.unwrap().unwrap();
+            serde_json::from_str(&line).unwrap()
+        };
+
+        // the first module arrives before the listing is complete
+        let first = next().await;
+        assert_eq!(first["id"], json!(1));
+        assert_eq!(first["more"], json!(true));
+        assert_eq!(first["part"]["uid"], json!(0x101));
+        writer
+            .write_all(b"{\"id\": 2, \"op\": \"get-name\", \"args\": {\"id\": 5}}\n")
+            .await
+            .unwrap();
+        // another request is answered between the parts
+        assert_eq!(next().await["result"], json!("module 5"));
+        assert_eq!(next().await["part"]["id"], json!(2));
+        assert_eq!(next().await["part"]["id"], json!(3));
+        assert_eq!(
+            next().await,
+            json!({"id": 1, "ok": true, "result": {"count": 3}})
+        );
+
+        writer
+            .write_all(b"{\"id\": 3, \"op\": \"get-config\", \"args\": {\"id\": 5}}\n")
+            .await
+            .unwrap();
+        assert_eq!(next().await["error"]["type"], json!("Timeout"));
+    }
+
+    #[tokio::test]
+    async fn test_watch_ends_with_connection() {
+        let (command_tx, mut command_rx) = mpsc::channel(8);
+        let (bus_tx, _) = mpsc::channel(16);
+        let scheduler = Scheduler::start(command_tx, bus_tx).0;
+        let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+        let address = listener.local_addr().unwrap();
+        tokio::spawn(serve(listener, scheduler));
+
+        let stream = TcpStream::connect(address).await.unwrap();
+        let (reader, mut writer) = stream.into_split();
+        writer
+            .write_all(
+                b"{\"id\": 1, \"op\": \"watch\", \"args\": {\"id\": 3, \"prop\": \"name\"}}\n",
+            )
+            .await
+            .unwrap();
+        let Some(Request {
+            command: Command::Watch { updates, resp, .. },
+            ..
+        }) = command_rx.recv().await
+        else {
+            panic!("expected a watch");
+        };
+        resp.send(Ok(())).unwrap();
+        let entry = PropertyEntry {
+            id: 2,
+            name: "name".to_string(),
+            value: "amp".to_string(),
+        };
+        updates.send(Ok(entry)).await.unwrap();
+        let mut lines = BufReader::new(reader).lines();
+        let part: Json = serde_json::from_str(&lines.next_line().await.unwrap().unwrap()).unwrap();
+        assert_eq!(part["part"]["value"], json!("amp"));
+
+        // the watch does not hold up other requests
+        writer
+            .write_all(b"{\"id\": 2, \"op\": \"get-name\", \"args\": {\"id\": 5}}\n")
+            .await
+            .unwrap();
+        let Some(Request {
+            command: Command::GetName { resp, .. },
+            ..
+        }) = command_rx.recv().await
+        else {
+            panic!("expected get-name");
+        };
+        resp.send(Ok("module 5".to_string())).unwrap();
+        let reply: Json = serde_json::from_str(&lines.next_line().await.unwrap().unwrap()).unwrap();
+        assert_eq!(reply["result"], json!("module 5"));
+
+        // the value does not change, yet the watch ends once the client has gone
+        drop(writer);
+        drop(lines);
+        tokio::time::timeout(Duration::from_secs(1), updates.closed())
+            .await
+            .unwrap();
+    }
+
+    #[tokio::test]
+    async fn test_unix_socket() {
+        let scheduler = start_fake_mission_control();
+        let path = std::env::temp_dir().join(format!("a3-machine-{}.sock", std::process::id()));
+        let _ = std::fs::remove_file(&path);
+        let listener = UnixListener::bind(&path).unwrap();
+        tokio::spawn(serve_unix(listener, scheduler));
+
+        let mut stream = UnixStream::connect(&path).await.unwrap();
+        stream
+            .write_all(b"{\"id\": 1, \"op\": \"get-name\", \"args\": {\"id\": 9}}\n")
+            .await
+            .unwrap();
+        let mut lines = BufReader::new(stream).lines();
+        let reply: Json = serde_json::from_str(&lines.next_line().await.unwrap().unwrap()).unwrap();
+        assert_eq!(reply, json!({"id": 1, "ok": true, "result": "module 9"}));
+        std::fs::remove_file(&path).unwrap();
+    }
+}
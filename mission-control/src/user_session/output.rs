@@ -0,0 +1,92 @@
+use std::{
+    fmt,
+    io::{self, IoSlice, Write},
+};
+
+use tokio::io::{AsyncWrite, AsyncWriteExt};
+
+/// Output of a session, collected while a command runs and written out in one go.
+///
+/// The buffer is kept for the life of the session, so rendering a reply does not allocate
+/// once it has grown to the size of the usual replies.
+#[derive(Default)]
+pub struct Output {
+    buf: Vec<u8>,
+}
+
+impl Output {
+    pub fn push(&mut self, bytes: &[u8]) {
+        self.buf.extend_from_slice(bytes);
+    }
+
+    pub fn push_str(&mut self, text: &str) {
+        self.buf.extend_from_slice(text.as_bytes());
+    }
+
+    /// Appends formatted text; use with `format_args!`.
+    pub fn push_fmt(&mut self, args: fmt::Arguments) {
+        // writing to a Vec never fails
+        let _ = self.buf.write_fmt(args);
+    }
+
+    #[cfg(test)]
+    pub fn is_empty(&self) -> bool {
+        self.buf.is_empty()
+    }
+
+    #[cfg(test)]
+    pub fn as_bytes(&self) -> &[u8] {
+        &self.buf
+    }
+
+    #[cfg(test)]
+    pub fn clear(&mut self) {
+        self.buf.clear();
+    }
+
+    /// Writes out the buffer followed by `trailer`, such as the prompt, with vectored
+    /// writes, and empties the buffer.
+    pub async fn flush<W: AsyncWrite + Unpin>(
+        &mut self,
+        writer: &mut W,
+        trailer: &[u8],
+    ) -> io::Result<()> {
+        let mut slices = [IoSlice::new(&self.buf), IoSlice::new(trailer)];
+        let mut remaining = &mut slices[..];
+        IoSlice::advance_slices(&mut remaining, 0);
+        while !remaining.is_empty() {
+            let written = writer.write_vectored(remaining).await?;
+            if written == 0 {
+                return Err(io::ErrorKind::WriteZero.into());
+            }
+            IoSlice::advance_slices(&mut remaining, written);
+        }
+        self.buf.clear();
+        return Ok(());
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use tokio::io::AsyncReadExt;
+
+    use super::*;
+
+    #[tokio::test]
+    async fn test_flush() {
+        // a small pipe forces partial writes
+        let (mut writer, mut reader) = tokio::io::duplex(7);
+        let reading = tokio::spawn(async move {
+            let mut received = Vec::new();
+            reader.read_to_end(&mut received).await.unwrap();
+            received
+        });
+        let mut output = Output::default();
+        output.push_fmt(format_args!("ok rtt={}us\r\n", 1234));
+        output.flush(&mut writer, b"analog3> ").await.unwrap();
+        assert!(output.is_empty());
+        output.flush(&mut writer, b"bye\r\n").await.unwrap();
+        drop(writer);
+        assert_eq!(reading.await.unwrap(), b"ok rtt=1234us\r\nanalog3> bye\r\n");
+    }
+}
@@ -0,0 +1,365 @@
+//! Scheduling of the user commands.
+//!
+//! Every session queues its commands here instead of sending them to mission control
+//! directly. Commands are taken out only as fast as mission control accepts them, in
+//! weighted round robin between the classes and in round robin between the sessions
+//! within a class, so a session firing a bulk job cannot starve the others.
+//!
+//! Load is shed at the door: a command is answered with a `Busy` error right away when the
+//! queues are full, and a bulk command is when the CAN TX queue is, too. A command whose
+//! deadline passes while it waits is answered with a `DeadlineExceeded` error instead of
+//! being handed over.
+
+use std::{
+    collections::{HashMap, VecDeque},
+    sync::{
+        Arc, Mutex,
+        atomic::{AtomicU32, Ordering},
+    },
+    time::Instant,
+};
+
+use tokio::{
+    sync::{Notify, mpsc::Sender},
+    task::JoinHandle,
+};
+
+use crate::{
+    can_controller::CanMessage,
+    command::{Command, CommandClass, Request},
+    error::{AppError, ErrorType},
+};
+
+/// Commands a session may have waiting
+const MAX_QUEUED_PER_SESSION: usize = 16;
+
+/// Commands all the sessions may have waiting
+const MAX_QUEUED: usize = 256;
+
+/// Commands taken from a class in a row while the other one has some waiting
+const WEIGHTS: [usize; 2] = [4, 1];
+
+/// Hands the commands of the sessions over to mission control.
+#[derive(Clone)]
+pub struct Scheduler {
+    shared: Arc<Shared>,
+}
+
+struct Shared {
+    state: Mutex<QueueState>,
+    queued: Notify,
+    bus_tx: Sender<CanMessage>,
+    next_session_id: AtomicU32,
+}
+
+struct QueueState {
+    classes: [ClassQueue; 2],
+    /// Class being served and the number of commands taken from it in this turn
+    turn: usize,
+    num_served: usize,
+    num_queued: usize,
+    num_queued_by_session: HashMap<u32, usize>,
+}
+
+/// Commands of a class; the sessions with commands waiting take turns.
+#[derive(Default)]
+struct ClassQueue {
+    queues: HashMap<u32, VecDeque<Request>>,
+    ring: VecDeque<u32>,
+}
+
+impl ClassQueue {
+    fn push(&mut self, session_id: u32, request: Request) {
+        let queue = self.queues.entry(session_id).or_default();
+        if queue.is_empty() {
+            self.ring.push_back(session_id);
+        }
+        queue.push_back(request);
+    }
+
+    fn pop(&mut self) -> Option<(u32, Request)> {
+        let session_id = self.ring.pop_front()?;
+        let queue = self.queues.get_mut(&session_id).unwrap();
+        let request = queue.pop_front().unwrap();
+        if queue.is_empty() {
+            self.queues.remove(&session_id);
+        } else {
+            self.ring.push_back(session_id);
+        }
+        return Some((session_id, request));
+    }
+}
+
+impl QueueState {
+    fn pop(&mut self) -> Option<Request> {
+        // the class in turn, the other one, then the first one again with a new turn
+        for _ in 0..3 {
+            if self.num_served < WEIGHTS[self.turn] {
+                if let Some((session_id, request)) = self.classes[self.turn].pop() {
+                    self.num_served += 1;
+                    self.num_queued -= 1;
+                    let count = self.num_queued_by_session.get_mut(&session_id).unwrap();
+                    *count -= 1;
+                    if *count == 0 {
+                        self.num_queued_by_session.remove(&session_id);
+                    }
+                    return Some(request);
+                }
+            }
+            self.turn = (self.turn + 1) % WEIGHTS.len();
+            self.num_served = 0;
+        }
+        return None;
+    }
+}
+
+impl Scheduler {
+    /// Starts handing the queued commands over to `output`. `bus_tx` is watched for the
+    /// bus load.
+    pub fn start(output: Sender<Request>, bus_tx: Sender<CanMessage>) -> (Self, JoinHandle<()>) {
+        let shared = Arc::new(Shared {
+            state: Mutex::new(QueueState {
+                classes: Default::default(),
+                turn: 0,
+                num_served: 0,
+                num_queued: 0,
+                num_queued_by_session: HashMap::new(),
+            }),
+            queued: Notify::new(),
+            bus_tx,
+            next_session_id: AtomicU32::new(1),
+        });
+        let handle = tokio::spawn(dispatch(shared.clone(), output));
+        return (Self { shared }, handle);
+    }
+
+    /// Opens a queue for a new session.
+    pub fn session(&self) -> CommandSender {
+        CommandSender {
+            session_id: self.shared.next_session_id.fetch_add(1, Ordering::Relaxed),
+            deadline: None,
+            shared: self.shared.clone(),
+        }
+    }
+}
+
+async fn dispatch(shared: Arc<Shared>, output: Sender<Request>) {
+    loop {
+        // pick the command only when mission control can take it, so that the choice
+        // sees every command that has arrived meanwhile
+        let Ok(permit) = output.reserve().await else {
+            return;
+        };
+        let request = loop {
+            let popped = shared.state.lock().unwrap().pop();
+            match popped {
+                Some(request) if is_expired(&request) => {
+                    log::debug!("Command dropped after its deadline");
+                    request.command.reject(AppError::deadline_exceeded()).await;
+                }
+                Some(request) => break request,
+                None => shared.queued.notified().await,
+            }
+        };
+        permit.send(request);
+    }
+}
+
+fn is_expired(request: &Request) -> bool {
+    return request
+        .deadline
+        .is_some_and(|deadline| deadline <= Instant::now());
+}
+
+/// Queue of a session
+#[derive(Clone)]
+pub struct CommandSender {
+    session_id: u32,
+    deadline: Option<Instant>,
+    shared: Arc<Shared>,
+}
+
+impl CommandSender {
+    /// Sender into the same queue whose commands carry the deadline.
+    pub fn with_deadline(&self, deadline: Option<Instant>) -> CommandSender {
+        CommandSender {
+            session_id: self.session_id,
+            deadline,
+            shared: self.shared.clone(),
+        }
+    }
+
+    /// Queues the command. A command that is not admitted is answered with a `Busy` error
+    /// through its own response channel, as if mission control had failed it.
+    pub async fn send(&self, command: Command) {
+        let Err((command, reason)) = self.admit(command) else {
+            self.shared.queued.notify_one();
+            return;
+        };
+        log::warn!("Command of session {} shed: {}", self.session_id, reason);
+        command
+            .reject(AppError::new(ErrorType::Busy, reason.to_string()))
+            .await;
+    }
+
+    fn admit(&self, command: Command) -> Result<(), (Command, &'static str)> {
+        let class = command.class();
+        let mut state = self.shared.state.lock().unwrap();
+        let num_queued = state
+            .num_queued_by_session
+            .get(&self.session_id)
+            .copied()
+            .unwrap_or(0);
+        if num_queued >= MAX_QUEUED_PER_SESSION {
+            return Err((command, "too many commands queued by the session"));
+        }
+        if state.num_queued >= MAX_QUEUED {
+            return Err((command, "too many commands queued"));
+        }
+        if class == CommandClass::Bulk && self.shared.bus_tx.capacity() == 0 {
+            return Err((command, "the bus is saturated"));
+        }
+        let request = Request {
+            command,
+            deadline: self.deadline,
+        };
+        state.classes[class as usize].push(self.session_id, request);
+        state.num_queued += 1;
+        *state
+            .num_queued_by_session
+            .entry(self.session_id)
+            .or_default() += 1;
+        return Ok(());
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use tokio::sync::{mpsc, oneshot};
+
+    use super::*;
+    use crate::mission_control::FanOutOp;
+
+    fn get_name(id: u8) -> (Command, oneshot::Receiver<Result<String, AppError>>) {
+        let (resp, resp_rx) = oneshot::channel();
+        return (Command::GetName { id, resp }, resp_rx);
+    }
+
+    fn fan_out(tag: u8) -> Command {
+        let (progress, _) = mpsc::channel(1);
+        let (resp, _) = oneshot::channel();
+        let op = FanOutOp::GetConfig {
+            module_type: Some(tag.to_string()),
+        };
+        return Command::FanOut { op, progress, resp };
+    }
+
+    fn tag_of(command: &Command) -> String {
+        match command {
+            Command::GetName { id, .. } => id.to_string(),
+            Command::FanOut {
+                op: FanOutOp::GetConfig { module_type },
+                ..
+            } => format!("bulk {}", module_type.as_ref().unwrap()),
+            _ => panic!("unexpected command"),
+        }
+    }
+
+    #[tokio::test]
+    async fn test_weighted_fair_order() {
+        let (output, mut output_rx) = mpsc::channel(1);
+        let (bus_tx, _bus_rx) = mpsc::channel(16);
+        let (scheduler, _) = Scheduler::start(output, bus_tx);
+        let (a, b, c) = (
+            scheduler.session(),
+            scheduler.session(),
+            scheduler.session(),
+        );
+        // nothing is dispatched until the test yields
+        for id in 0..6 {
+            a.send(get_name(id).0).await;
+        }
+        for id in 100..102 {
+            b.send(get_name(id).0).await;
+        }
+        c.send(fan_out(1)).await;
+        c.send(fan_out(2)).await;
+
+        let mut order = Vec::new();
+        for _ in 0..10 {
+            order.push(tag_of(&output_rx.recv().await.unwrap().command));
+        }
+        assert_eq!(
+            order,
+            vec![
+                "0", "100", "1", "101", "bulk 1", "2", "3", "4", "5", "bulk 2"
+            ]
+        );
+    }
+
+    #[tokio::test]
+    async fn test_shedding() {
+        let (output, _output_rx) = mpsc::channel(1);
+        let (bus_tx, _bus_rx) = mpsc::channel(1);
+        let (scheduler, _) = Scheduler::start(output, bus_tx.clone());
+        let session = scheduler.session();
+        for id in 0..MAX_QUEUED_PER_SESSION {
+            session.send(get_name(id as u8).0).await;
+        }
+        let (command, resp_rx) = get_name(0xff);
+        session.send(command).await;
+        assert!(matches!(
+            resp_rx.await.unwrap(),
+            Err(AppError {
+                error_type: ErrorType::Busy,
+                ..
+            })
+        ));
+
+        // other sessions still get in, but not with bulk commands on a saturated bus
+        let other = scheduler.session();
+        let (command, mut resp_rx) = get_name(1);
+        other.send(command).await;
+        assert!(resp_rx.try_recv().is_err());
+        bus_tx.send(CanMessage::new()).await.unwrap();
+        let (resp, resp_rx) = oneshot::channel();
+        let (progress, _) = mpsc::channel(1);
+        let op = FanOutOp::GetConfig { module_type: None };
+        other.send(Command::FanOut { op, progress, resp }).await;
+        assert!(matches!(
+            resp_rx.await.unwrap(),
+            Err(AppError {
+                error_type: ErrorType::Busy,
+                ..
+            })
+        ));
+    }
+
+    #[tokio::test]
+    async fn test_expired_commands() {
+        let (output, mut output_rx) = mpsc::channel(1);
+        let (bus_tx, _bus_rx) = mpsc::channel(16);
+        let (scheduler, _) = Scheduler::start(output, bus_tx);
+        let session = scheduler.session();
+        let (command, resp_rx) = get_name(1);
+        session
+            .with_deadline(Some(Instant::now()))
+            .send(command)
+            .await;
+        let deadline = Instant::now() + std::time::Duration::from_secs(10);
+        session
+            .with_deadline(Some(deadline))
+            .send(get_name(2).0)
+            .await;
+        assert!(matches!(
+            resp_rx.await.unwrap(),
+            Err(AppError {
+                error_type: ErrorType::DeadlineExceeded,
+                ..
+            })
+        ));
+        let request = output_rx.recv().await.unwrap();
+        assert_eq!(tag_of(&request.command), "2");
+        assert_eq!(request.deadline, Some(deadline));
+    }
+}
@@ -1,64 +1,118 @@
-use crate::analog3::config::{Value, parse_u8, parse_u16, parse_u32};
+use std::ops::Deref;
+
+use crate::analog3::config::{TypeError, parse_u8, parse_u16, parse_u32};
+
+/// Most parameters or options a command takes
+pub const MAX_ARGS: usize = 4;
 
 #[derive(Debug)]
 pub struct ParseParamError {}
 
+/// Parameter of a command; text borrows the token it came from.
+#[derive(Debug, Clone, Copy)]
+pub enum Arg<'a> {
+    U8(u8),
+    #[allow(dead_code)]
+    U16(u16),
+    U32(u32),
+    Text(&'a str),
+    Boolean(bool),
+}
+
+impl<'a> Arg<'a> {
+    pub fn as_u8(&self) -> Result<u8, TypeError> {
+        let Arg::U8(value) = self else {
+            return Err(TypeError {});
+        };
+        return Ok(*value);
+    }
+
+    #[allow(dead_code)]
+    pub fn as_u16(&self) -> Result<u16, TypeError> {
+        let Arg::U16(value) = self else {
+            return Err(TypeError {});
+        };
+        return Ok(*value);
+    }
+
+    pub fn as_u32(&self) -> Result<u32, TypeError> {
+        let Arg::U32(value) = self else {
+            return Err(TypeError {});
+        };
+        return Ok(*value);
+    }
+
+    pub fn as_bool(&self) -> Result<bool, TypeError> {
+        let Arg::Boolean(value) = self else {
+            return Err(TypeError {});
+        };
+        return Ok(*value);
+    }
+
+    pub fn as_text(&self) -> Result<&'a str, TypeError> {
+        let Arg::Text(value) = self else {
+            return Err(TypeError {});
+        };
+        return Ok(value);
+    }
+}
+
 pub struct Spec {
-    pub name: String,
+    pub name: &'static str,
     pub required: bool,
-    pub parse: fn(&String) -> Result<Value, ParseParamError>,
+    pub parse: for<'a> fn(&'a str) -> Result<Arg<'a>, ParseParamError>,
 }
 
 impl Spec {
-    pub fn u8(name: &str, required: bool) -> Self {
+    pub const fn u8(name: &'static str, required: bool) -> Self {
         Self {
-            name: name.to_string(),
-            required: required,
+            name,
+            required,
             parse: |src| match parse_u8(src) {
-                Ok(value) => Ok(Value::U8(value)),
+                Ok(value) => Ok(Arg::U8(value)),
                 Err(_) => Err(ParseParamError {}),
             },
         }
     }
 
     #[allow(dead_code)]
-    pub fn u16(name: &str, required: bool) -> Self {
+    pub const fn u16(name: &'static str, required: bool) -> Self {
         Self {
-            name: name.to_string(),
-            required: required,
+            name,
+            required,
             parse: |src| match parse_u16(src) {
-                Ok(value) => Ok(Value::U16(value)),
+                Ok(value) => Ok(Arg::U16(value)),
                 Err(_) => Err(ParseParamError {}),
             },
         }
     }
 
-    pub fn u32(name: &str, required: bool) -> Self {
+    pub const fn u32(name: &'static str, required: bool) -> Self {
         Self {
-            name: name.to_string(),
-            required: required,
+            name,
+            required,
             parse: |src| match parse_u32(src) {
-                Ok(value) => Ok(Value::U32(value)),
+                Ok(value) => Ok(Arg::U32(value)),
                 Err(_) => Err(ParseParamError {}),
             },
         }
     }
 
-    pub fn str(name: &str, required: bool) -> Self {
+    pub const fn str(name: &'static str, required: bool) -> Self {
         Self {
-            name: name.to_string(),
-            required: required,
-            parse: |src| Ok(Value::Text(src.trim().to_string())),
+            name,
+            required,
+            parse: |src| Ok(Arg::Text(src.trim())),
         }
     }
 
-    pub fn bool(name: &str, required: bool) -> Self {
+    pub const fn bool(name: &'static str, required: bool) -> Self {
         Self {
-            name: name.to_string(),
-            required: required,
+            name,
+            required,
             parse: |src| {
                 return match src.trim().parse() {
-                    Ok(value) => Ok(Value::Boolean(value)),
+                    Ok(value) => Ok(Arg::Boolean(value)),
                     Err(_) => Err(ParseParamError {}),
                 };
             },
@@ -66,6 +120,88 @@ impl Spec {
     }
 }
 
+/// Parsed positional parameters, in the order of their specs
+pub struct Args<'a> {
+    items: [Arg<'a>; MAX_ARGS],
+    len: usize,
+}
+
+impl<'a> Deref for Args<'a> {
+    type Target = [Arg<'a>];
+
+    fn deref(&self) -> &Self::Target {
+        &self.items[..self.len]
+    }
+}
+
+/// Options in the order of their specs, `None` for the ones not given
+pub type Options<'a> = [Option<Arg<'a>>; MAX_ARGS];
+
+#[derive(Debug, PartialEq)]
+pub enum ArgsError<'a> {
+    /// A required parameter is missing
+    Missing,
+    /// The parameter or option of the name does not parse
+    Invalid(&'a str),
+    UnknownOption(&'a str),
+}
+
+/// Parses the parameters of a command line. The first token is the command and is skipped;
+/// tokens after the last spec are ignored.
+pub fn parse_args<'a>(
+    tokens: impl IntoIterator<Item = &'a str>,
+    specs: &[Spec],
+) -> Result<Args<'a>, ArgsError<'a>> {
+    assert!(specs.len() <= MAX_ARGS);
+    let mut args = Args {
+        items: [Arg::Boolean(false); MAX_ARGS],
+        len: 0,
+    };
+    let mut tokens = tokens.into_iter().skip(1);
+    for spec in specs {
+        let Some(token) = tokens.next() else {
+            if spec.required {
+                return Err(ArgsError::Missing);
+            }
+            break;
+        };
+        let Ok(arg) = (spec.parse)(token) else {
+            return Err(ArgsError::Invalid(spec.name));
+        };
+        args.items[args.len] = arg;
+        args.len += 1;
+    }
+    return Ok(args);
+}
+
+/// Parses positional parameters followed by optional `name=value` options.
+pub fn parse_args_and_options<'a>(
+    tokens: impl IntoIterator<Item = &'a str> + Clone,
+    specs: &[Spec],
+    option_specs: &[Spec],
+) -> Result<(Args<'a>, Options<'a>), ArgsError<'a>> {
+    assert!(option_specs.len() <= MAX_ARGS);
+    let mut options: Options<'a> = [None; MAX_ARGS];
+    let is_option = |(index, token): &(usize, &'a str)| *index > 0 && token.contains('=');
+    for (_, token) in tokens.clone().into_iter().enumerate().filter(is_option) {
+        let (name, value) = token.split_once('=').unwrap();
+        let Some(index) = option_specs.iter().position(|spec| spec.name == name) else {
+            return Err(ArgsError::UnknownOption(name));
+        };
+        match (option_specs[index].parse)(value) {
+            Ok(arg) => options[index] = Some(arg),
+            Err(_) => return Err(ArgsError::Invalid(name)),
+        }
+    }
+    let positional = tokens
+        .into_iter()
+        .enumerate()
+        .filter(|entry| !is_option(entry))
+        .map(|(_, token)| token);
+    let args = parse_args(positional, specs)?;
+    return Ok((args, options));
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -74,7 +210,7 @@ mod tests {
     fn test_u8() {
         let spec = Spec::u8("velocity", true);
         assert_eq!(spec.name, "velocity");
-        let Ok(out) = (spec.parse)(&"123".to_string()) else {
+        let Ok(out) = (spec.parse)("123") else {
             panic!();
         };
         assert_eq!(out.as_u8().unwrap(), 123u8);
@@ -85,32 +221,32 @@ mod tests {
         assert!(out.as_text().is_err());
         assert!(out.as_bool().is_err());
 
-        let Ok(out2) = (spec.parse)(&"0x71".to_string()) else {
+        let Ok(out2) = (spec.parse)("0x71") else {
             panic!();
         };
         assert_eq!(out2.as_u8().unwrap(), 0x71u8);
 
-        let Ok(out3) = (spec.parse)(&" 213 ".to_string()) else {
+        let Ok(out3) = (spec.parse)(" 213 ") else {
             panic!();
         };
         assert_eq!(out3.as_u8().unwrap(), 213);
 
-        let Ok(out4) = (spec.parse)(&" 0xca ".to_string()) else {
+        let Ok(out4) = (spec.parse)(" 0xca ") else {
             panic!();
         };
         assert_eq!(out4.as_u8().unwrap(), 0xcau8);
 
         // parse errors
-        assert!((spec.parse)(&"no".to_string()).is_err());
-        assert!((spec.parse)(&"321".to_string()).is_err());
-        assert!((spec.parse)(&"0xbad".to_string()).is_err());
+        assert!((spec.parse)("no").is_err());
+        assert!((spec.parse)("321").is_err());
+        assert!((spec.parse)("0xbad").is_err());
     }
 
     #[test]
     fn test_u16() {
         let spec = Spec::u16("sixteen", true);
         assert_eq!(spec.name, "sixteen");
-        let Ok(out) = (spec.parse)(&"65432".to_string()) else {
+        let Ok(out) = (spec.parse)("65432") else {
             panic!();
         };
         assert_eq!(out.as_u16().unwrap(), 65432u16);
@@ -121,32 +257,32 @@ mod tests {
         assert!(out.as_text().is_err());
         assert!(out.as_bool().is_err());
 
-        let Ok(out2) = (spec.parse)(&"0xcafe".to_string()) else {
+        let Ok(out2) = (spec.parse)("0xcafe") else {
             panic!();
         };
         assert_eq!(out2.as_u16().unwrap(), 0xcafeu16);
 
-        let Ok(out3) = (spec.parse)(&" 13245 ".to_string()) else {
+        let Ok(out3) = (spec.parse)(" 13245 ") else {
             panic!();
         };
         assert_eq!(out3.as_u16().unwrap(), 13245u16);
 
-        let Ok(out4) = (spec.parse)(&" 0xbad ".to_string()) else {
+        let Ok(out4) = (spec.parse)(" 0xbad ") else {
             panic!();
         };
         assert_eq!(out4.as_u16().unwrap(), 0xbadu16);
 
         // parse errors
-        assert!((spec.parse)(&"bad".to_string()).is_err());
-        assert!((spec.parse)(&"76543".to_string()).is_err());
-        assert!((spec.parse)(&"0xbaddata".to_string()).is_err());
+        assert!((spec.parse)("bad").is_err());
+        assert!((spec.parse)("76543").is_err());
+        assert!((spec.parse)("0xbaddata").is_err());
     }
 
     #[test]
     fn test_u32() {
         let spec = Spec::u32("thirty-two", true);
         assert_eq!(spec.name, "thirty-two");
-        let Ok(out) = (spec.parse)(&"12345678".to_string()) else {
+        let Ok(out) = (spec.parse)("12345678") else {
             panic!();
         };
         assert_eq!(out.as_u32().unwrap(), 12345678u32);
@@ -157,32 +293,32 @@ mod tests {
         assert!(out.as_text().is_err());
         assert!(out.as_bool().is_err());
 
-        let Ok(out2) = (spec.parse)(&"0xba5eba11".to_string()) else {
+        let Ok(out2) = (spec.parse)("0xba5eba11") else {
             panic!();
         };
         assert_eq!(out2.as_u32().unwrap(), 0xba5eba11u32);
 
-        let Ok(out3) = (spec.parse)(&" 87654321 ".to_string()) else {
+        let Ok(out3) = (spec.parse)(" 87654321 ") else {
             panic!();
         };
         assert_eq!(out3.as_u32().unwrap(), 87654321u32);
 
-        let Ok(out4) = (spec.parse)(&" 0xdeadbeef ".to_string()) else {
+        let Ok(out4) = (spec.parse)(" 0xdeadbeef ") else {
             panic!();
         };
         assert_eq!(out4.as_u32().unwrap(), 0xdeadbeefu32);
 
         // parse errors
-        assert!((spec.parse)(&"bad".to_string()).is_err());
-        assert!((spec.parse)(&"99999999999999999".to_string()).is_err());
-        assert!((spec.parse)(&"0xbadbadbeef".to_string()).is_err());
+        assert!((spec.parse)("bad").is_err());
+        assert!((spec.parse)("99999999999999999").is_err());
+        assert!((spec.parse)("0xbadbadbeef").is_err());
     }
 
     #[test]
     fn test_str() {
         let spec = Spec::str("nickname", true);
         assert_eq!(spec.name, "nickname");
-        let Ok(out) = (spec.parse)(&"hello".to_string()) else {
+        let Ok(out) = (spec.parse)("hello") else {
             panic!();
         };
         assert_eq!(out.as_text().unwrap(), "hello");
@@ -193,17 +329,51 @@ mod tests {
         assert!(out.as_u32().is_err());
         assert!(out.as_bool().is_err());
 
-        let Ok(out2) = (spec.parse)(&" world ".to_string()) else {
+        let Ok(out2) = (spec.parse)(" world ") else {
             panic!();
         };
         assert_eq!(out2.as_text().unwrap(), "world");
     }
 
+    #[test]
+    fn test_parse_args() {
+        let specs = [Spec::u8("id", true), Spec::str("name", false)];
+        let options = [Spec::u32("count", false), Spec::bool("visual", false)];
+        let line = ["ping", "0x1a", "count=3", "osc", "extra"];
+
+        let args = parse_args(line, &specs).unwrap();
+        assert_eq!(args.len(), 2);
+        assert_eq!(args[1].as_text().unwrap(), "count=3");
+
+        let (args, options) = parse_args_and_options(line, &specs, &options).unwrap();
+        assert_eq!(args[0].as_u8().unwrap(), 0x1a);
+        assert_eq!(args[1].as_text().unwrap(), "osc");
+        assert_eq!(options[0].unwrap().as_u32().unwrap(), 3);
+        assert!(options[1].is_none());
+
+        assert_eq!(parse_args(["ping"], &specs).err(), Some(ArgsError::Missing));
+        assert_eq!(parse_args(["ping", "1"], &specs).unwrap().len(), 1);
+        assert_eq!(
+            parse_args(["ping", "256"], &specs).err(),
+            Some(ArgsError::Invalid("id"))
+        );
+        let specs = [Spec::u8("id", true)];
+        let options = [Spec::u32("count", false)];
+        assert_eq!(
+            parse_args_and_options(["ping", "1", "size=2"], &specs, &options).err(),
+            Some(ArgsError::UnknownOption("size"))
+        );
+        assert_eq!(
+            parse_args_and_options(["ping", "1", "count=x"], &specs, &options).err(),
+            Some(ArgsError::Invalid("count"))
+        );
+    }
+
     #[test]
     fn test_bool() {
         let spec = Spec::bool("yes_or_no", true);
         assert_eq!(spec.name, "yes_or_no");
-        let Ok(out) = (spec.parse)(&"true".to_string()) else {
+        let Ok(out) = (spec.parse)("true") else {
             panic!();
         };
         assert!(out.as_bool().unwrap());
@@ -214,14 +384,14 @@ mod tests {
         assert!(out.as_u32().is_err());
         assert!(out.as_text().is_err());
 
-        let Ok(out2) = (spec.parse)(&"false".to_string()) else {
+        let Ok(out2) = (spec.parse)("false") else {
             panic!();
         };
         assert!(!out2.as_bool().unwrap());
 
         // parse errors
-        assert!((spec.parse)(&"bad".to_string()).is_err());
-        assert!((spec.parse)(&"no".to_string()).is_err());
-        assert!((spec.parse)(&"TRUE".to_string()).is_err()); // must be lower case
+        assert!((spec.parse)("bad").is_err());
+        assert!((spec.parse)("no").is_err());
+        assert!((spec.parse)("TRUE").is_err()); // must be lower case
     }
 }
@@ -0,0 +1,131 @@
+use std::ops::Range;
+
+/// Tokens of a command line, borrowed from the line buffer of the session.
+///
+/// The line is split at whitespace, keeping quoted sections together. The quotes are taken
+/// out of the buffer in place, and the line as typed is kept behind it for `rest()`, so
+/// neither the tokens nor the buffer are reallocated once the session has warmed up.
+pub struct Tokens<'a> {
+    line: &'a str,
+    ranges: &'a [Range<usize>],
+    /// Where the line as typed continues from the second token
+    rest: Range<usize>,
+}
+
+impl<'a> Tokens<'a> {
+    /// Tokenizes the line. `ranges` is scratch space kept by the caller between lines.
+    pub fn parse(line: &'a mut String, ranges: &'a mut Vec<Range<usize>>) -> Self {
+        ranges.clear();
+        let mut bytes = std::mem::take(line).into_bytes();
+        let raw_length = bytes.len();
+        bytes.extend_from_within(..);
+        let mut length = 0;
+        let mut start: Option<usize> = None;
+        let mut rest_start = raw_length;
+        let mut in_quotes: Option<u8> = None;
+        for index in 0..raw_length {
+            let byte = bytes[raw_length + index];
+            if start.is_none() && ranges.len() == 1 && !byte.is_ascii_whitespace() {
+                rest_start = index;
+            }
+            match byte {
+                // entering or exiting quotes; a different quote inside quotes is a normal char
+                b'\'' | b'"' if in_quotes == Some(byte) => in_quotes = None,
+                b'\'' | b'"' if in_quotes.is_none() => {
+                    in_quotes = Some(byte);
+                    start.get_or_insert(length);
+                }
+                // whitespace: token delimiter only when NOT in quotes
+                _ if byte.is_ascii_whitespace() && in_quotes.is_none() => {
+                    if let Some(start) = start.take() {
+                        ranges.push(start..length);
+                    }
+                    bytes[length] = byte;
+                    length += 1;
+                }
+                _ => {
+                    start.get_or_insert(length);
+                    bytes[length] = byte;
+                    length += 1;
+                }
+            }
+        }
+        if let Some(start) = start {
+            ranges.push(start..length);
+        }
+        // the line as typed follows right after the one without quotes
+        bytes.drain(length..raw_length);
+        // only ASCII bytes are taken out, which leaves the text valid
+        *line = String::from_utf8(bytes).unwrap();
+        let rest_end = length + line[length..].trim_end().len();
+        return Self {
+            line: line.as_str(),
+            ranges: ranges.as_slice(),
+            rest: (length + rest_start).min(rest_end)..rest_end,
+        };
+    }
+
+    pub fn len(&self) -> usize {
+        self.ranges.len()
+    }
+
+    pub fn get(&self, index: usize) -> Option<&'a str> {
+        let line = self.line;
+        self.ranges.get(index).map(|range| &line[range.clone()])
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = &'a str> + Clone + '_ {
+        let line = self.line;
+        self.ranges.iter().map(move |range| &line[range.clone()])
+    }
+
+    /// Text from the second token to the last, exactly as typed, quotes included
+    pub fn rest(&self) -> &'a str {
+        &self.line[self.rest.clone()]
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn tokenize(line: &str) -> Vec<String> {
+        let mut line = line.to_string();
+        let mut ranges = Vec::new();
+        let tokens = Tokens::parse(&mut line, &mut ranges);
+        return tokens.iter().map(|token| token.to_string()).collect();
+    }
+
+    #[test]
+    fn test_tokenize() {
+        assert_eq!(
+            tokenize("  set 3  cv_depth 0x10\r\n"),
+            ["set", "3", "cv_depth", "0x10"]
+        );
+        assert_eq!(
+            tokenize("rename 1 'osc \"A\"'"),
+            ["rename", "1", "osc \"A\""]
+        );
+        assert_eq!(
+            tokenize("rename 1 na\"me 1\"s é"),
+            ["rename", "1", "name 1s", "é"]
+        );
+        assert_eq!(tokenize("rename 1 ''"), ["rename", "1", ""]);
+        assert!(tokenize(" \t").is_empty());
+
+        let mut line = "batch set 1 a 'b c'; get-config 1".to_string();
+        let mut ranges = Vec::new();
+        let tokens = Tokens::parse(&mut line, &mut ranges);
+        assert_eq!(tokens.len(), 7);
+        assert_eq!(tokens.get(6), Some("1"));
+        assert_eq!(tokens.get(7), None);
+        assert_eq!(tokens.rest(), "set 1 a 'b c'; get-config 1");
+
+        let mut line = "batch rename 1-4 'amp {n}' \r\n".to_string();
+        let tokens = Tokens::parse(&mut line, &mut ranges);
+        assert_eq!(tokens.get(3), Some("amp {n}"));
+        assert_eq!(tokens.rest(), "rename 1-4 'amp {n}'");
+        let mut line = "batch  \r\n".to_string();
+        assert_eq!(Tokens::parse(&mut line, &mut ranges).rest(), "");
+    }
+}